@@ -136,6 +136,23 @@ namespace KeypointExtraction
         [DllImport("FLANNDLL.dll", CallingConvention = CallingConvention.Cdecl)]
         public static extern string CreateBagOfWords(float[] keypoint_data, int num_keypoints);
 
+        /// <summary>
+        /// Fills histogram with (word, count) pairs sorted by word, returns the number of
+        /// distinct words or a negative number for error.
+        /// </summary>
+        [DllImport("FLANNDLL.dll", CallingConvention = CallingConvention.Cdecl)]
+        public static extern int CreateBagOfWordsHistogram(float[] keypoint_data, int num_keypoints, int[] histogram, int capacity);
+
+        /// <summary>
+        /// Ranks the images of the native inverted file for the keypoints of a query image.
+        /// Fills images (and scores) by decreasing score, returns their number or a negative number for error.
+        /// </summary>
+        [DllImport("FLANNDLL.dll", CallingConvention = CallingConvention.Cdecl)]
+        public static extern int QueryImages(float[] keypoint_data, int num_keypoints, int k, int[] images, float[] scores);
+
+        [DllImport("FLANNDLL.dll", CharSet = CharSet.Ansi, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int GetImageName(int image, StringBuilder name, int capacity);
+
         public static string GetBagOfWords(Stream inputStream, Guid queryId, string saveQueryPath)
         {
 
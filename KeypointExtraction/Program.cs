@@ -36,6 +36,11 @@ namespace KeypointExtraction
             public float build_weight;
             public float memory_weight;
             public float sample_fraction;
+            public int kmeans_assign;
+            public int cores;
+            public int lists;
+            public int subquantizers;
+            public int rerank;
         }
 
         [StructLayout(LayoutKind.Sequential)]
@@ -10,6 +10,26 @@ class CompositeTree : public NNIndex
 	KDTree* kdtree;
 
     Dataset<float>& dataset;		
+
+	/**
+	 * Search context holding the contexts of the two trees, and the points
+	 * already found by the first one.
+	 */
+	struct CompositeContext : public SearchContext {
+		SearchContext* kmeans;
+		SearchContext* kdtree;
+		VisitedSet visited;
+
+		CompositeContext(int size) : visited(size)
+		{
+		}
+
+		~CompositeContext()
+		{
+			delete kmeans;
+			delete kdtree;
+		}
+	};
 	
 
 public:
@@ -58,10 +78,36 @@ public:
 	}
 	
 	
-	void findNeighbors(ResultSet& result, float* vec, Params searchParams)
+	void saveIndex(FILE* stream)
+	{
+		kmeans->saveIndex(stream);
+		kdtree->saveIndex(stream);
+	}
+
+	void loadIndex(FILE* stream)
+	{
+		kmeans->loadIndex(stream);
+		kdtree->loadIndex(stream);
+	}
+	
+	
+	SearchContext* createSearchContext() const
+	{
+		CompositeContext* context = new CompositeContext(dataset.rows);
+		context->kmeans = kmeans->createSearchContext();
+		context->kdtree = kdtree->createSearchContext();
+		return context;
+	}
+	
+	void findNeighbors(ResultSet& result, float* vec, const SearchParams& searchParams, SearchContext& context) const
 	{
-		kmeans->findNeighbors(result,vec,searchParams);
-		kdtree->findNeighbors(result,vec,searchParams);
+		CompositeContext& c = static_cast<CompositeContext&>(context);
+		// both trees hold all the points
+		c.visited.clear();
+		result.setVisited(&c.visited);
+		kmeans->findNeighbors(result,vec,searchParams,*c.kmeans);
+		kdtree->findNeighbors(result,vec,searchParams,*c.kdtree);
+		result.setVisited(NULL);
 	}
 
 
@@ -0,0 +1,709 @@
+/************************************************************************
+ * Inverted file with product quantization (IVF-PQ)
+ *
+ * This module finds the approximate nearest-neighbors of vectors from
+ * compressed copies of the dataset (Jegou, Douze and Schmid, Product
+ * Quantization for Nearest Neighbor Search). A coarse quantizer splits
+ * the dataset in lists, and the residual of each vector to the center
+ * of its list is encoded with one byte per subvector.
+ *
+ * Version: 1.0
+ *
+ * License: LGPL
+ *
+ *************************************************************************/
+
+#ifndef IVFPQINDEX_H
+#define IVFPQINDEX_H
+
+#include <algorithm>
+#include <vector>
+#include <utility>
+#include <limits>
+#include "../constants.h"
+#include "../util/common.h"
+#include "../util/Dataset.h"
+#include "../util/ResultSet.h"
+#include "../util/Random.h"
+#include "../util/ThreadPool.h"
+#include "../util/Serialization.h"
+#include "../util/Logger.h"
+#include "../algorithms/NNIndex.h"
+#include "../algorithms/KMeansTree.h"
+
+using namespace std;
+
+
+/**
+ * Inverted file index over product-quantized residuals.
+ *
+ * The coarse centers are a cut of a hierarchical k-means tree built on a
+ * sample of the dataset. Each vector goes in the list of its closest
+ * coarse center, and its residual is split in subquantizers subvectors,
+ * each one replaced by the closest of 256 centers learned on that
+ * subspace, so a vector takes subquantizers bytes (16 bytes instead of
+ * 512 for 128 floats and 16 subquantizers).
+ *
+ * A search visits the lists closest to the query until it has scanned
+ * checks codes and found enough candidates for the neighbors, with a table
+ * of the distances from the query residual to the subspace centers, so 
+ * the distance to a code is subquantizers table lookups (asymmetric 
+ * distance). The best rerank candidates (at least as many as neighbors)
+ * are then ranked by their exact distance to the original vectors. With rerank 0
+ * the results have the estimated distances and the dataset is only read
+ * by buildIndex.
+ */
+class IVFPQIndex : public NNIndex
+{
+    /**
+     * Number of centers of each subquantizer, the codes are one byte.
+     */
+    static const int SUBSPACE_CENTERS = 256;
+
+    /**
+     * Number of vectors per list in the sample the coarse tree is built on.
+     */
+    static const int COARSE_SAMPLE_PER_LIST = 64;
+
+    /**
+     * Largest number of residuals the subquantizers are trained on.
+     */
+    static const int TRAINING_ROWS = 16384;
+
+    /**
+     * Number of k-means iterations of the subquantizers, unless the
+     * max-iterations parameter asks for less.
+     */
+    static const int TRAINING_ITERATIONS = 25;
+
+    /**
+     * Number of residuals assigned at once in the training iterations.
+     */
+    static const int TRAINING_BLOCK = 64;
+
+    /**
+     * Number of vectors encoded by one task.
+     */
+    static const int ENCODE_CHUNK = 4096;
+
+	/**
+	 * The dataset used by this index
+	 */
+    Dataset<float>& dataset;
+
+    int size_;
+    int veclen_;
+
+    /**
+     * Number of lists (coarse centers).
+     */
+    int lists;
+
+    /**
+     * Number of subvectors of a residual, and their length.
+     */
+    int subquantizers;
+    int subveclen;
+
+    /**
+     * Number of candidates ranked with their exact distances, 0 to return
+     * the estimated distances.
+     */
+    int rerank;
+
+    /**
+     * Parameters of the coarse k-means tree.
+     */
+    Params tree_params;
+    int max_iter;
+    int cores;
+
+    /**
+     * The coarse centers, lists x veclen.
+     */
+    vector<float> centers;
+
+    /**
+     * The centers of each subquantizer: subquantizers blocks of
+     * SUBSPACE_CENTERS x subveclen floats.
+     */
+    vector<float> codebooks;
+
+    /**
+     * The vectors of list l are at positions list_offsets[l] to
+     * list_offsets[l+1]-1 of ids (their rows in the dataset) and codes
+     * (subquantizers bytes each).
+     */
+    vector<int> list_offsets;
+    vector<int> ids;
+    vector<unsigned char> codes;
+
+
+	/**
+	 * Search state of the index.
+	 */
+	class IVFPQContext : public SearchContext
+	{
+	public:
+		/**
+		 * Distances from the query to the coarse centers, and the lists
+		 * in the order they are visited.
+		 */
+		vector<float> list_dists;
+		vector<int> order;
+		/**
+		 * Residual of the query and its distance table, subquantizers x
+		 * SUBSPACE_CENTERS.
+		 */
+		vector<float> residual;
+		vector<float> table;
+		/**
+		 * Max-heap of the (estimated distance, row) candidates kept for
+		 * the re-ranking.
+		 */
+		vector<pair<float,int> > candidates;
+
+		IVFPQContext(int lists, int veclen, int subquantizers) :
+			list_dists(lists), order(lists), residual(veclen), table((size_t)subquantizers*SUBSPACE_CENTERS)
+		{
+		}
+	};
+
+
+    /**
+     * Orders the lists by the distance of their centers to the query.
+     */
+    struct ListOrder
+    {
+        const float* dists;
+
+        bool operator()(int a, int b) const
+        {
+            return dists[a]<dists[b] || (dists[a]==dists[b] && a<b);
+        }
+    };
+
+
+    /**
+     * Trains the centers of one subquantizer with k-means.
+     */
+    class TrainTask : public Task
+    {
+        const vector<float>& residuals;
+        int rows;
+        int veclen;
+        int offset;
+        int length;
+        int iterations;
+        const vector<int>& seeds;
+        float* codebook;
+
+    public:
+        TrainTask(const vector<float>& residuals_, int rows_, int veclen_, int offset_, int length_, int iterations_,
+                const vector<int>& seeds_, float* codebook_) :
+            residuals(residuals_), rows(rows_), veclen(veclen_), offset(offset_), length(length_), iterations(iterations_),
+            seeds(seeds_), codebook(codebook_)
+        {
+        }
+
+        void run()
+        {
+            // the subvectors of the subspace, contiguous
+            vector<float> points((size_t)rows*length);
+            for (int i=0;i<rows;++i) {
+                copy(&residuals[(size_t)i*veclen+offset], &residuals[(size_t)i*veclen+offset]+length, &points[(size_t)i*length]);
+            }
+            for (int k=0;k<SUBSPACE_CENTERS;++k) {
+                copy(&points[(size_t)seeds[k]*length], &points[(size_t)seeds[k]*length]+length, codebook+(size_t)k*length);
+            }
+
+            vector<int> assignment(rows, -1);
+            vector<float> norms(SUBSPACE_CENTERS);
+            vector<float> dots((size_t)TRAINING_BLOCK*SUBSPACE_CENTERS);
+            vector<double> sums((size_t)SUBSPACE_CENTERS*length);
+            vector<int> counts(SUBSPACE_CENTERS);
+            for (int iteration=0;iteration<iterations;++iteration) {
+                // the closest center minimizes ||c||^2 - 2x.c, the products are computed by blocks
+                for (int k=0;k<SUBSPACE_CENTERS;++k) {
+                    const float* center = codebook+(size_t)k*length;
+                    float norm = 0;
+                    for (int j=0;j<length;++j) {
+                        norm += center[j]*center[j];
+                    }
+                    norms[k] = norm;
+                }
+                bool changed = false;
+                for (int i=0;i<rows;i+=TRAINING_BLOCK) {
+                    int block = min((int)TRAINING_BLOCK, rows-i);
+                    dot_block_float(&points[(size_t)i*length], block, codebook, SUBSPACE_CENTERS, length, &dots[0], SUBSPACE_CENTERS);
+                    for (int b=0;b<block;++b) {
+                        const float* row = &dots[(size_t)b*SUBSPACE_CENTERS];
+                        int best = 0;
+                        float best_dist = norms[0]-2*row[0];
+                        for (int k=1;k<SUBSPACE_CENTERS;++k) {
+                            float dist = norms[k]-2*row[k];
+                            if (dist<best_dist) {
+                                best_dist = dist;
+                                best = k;
+                            }
+                        }
+                        if (best!=assignment[i+b]) {
+                            assignment[i+b] = best;
+                            changed = true;
+                        }
+                    }
+                }
+                if (!changed) {
+                    break;
+                }
+
+                fill(sums.begin(), sums.end(), 0.0);
+                fill(counts.begin(), counts.end(), 0);
+                for (int i=0;i<rows;++i) {
+                    const float* point = &points[(size_t)i*length];
+                    double* sum = &sums[(size_t)assignment[i]*length];
+                    for (int j=0;j<length;++j) {
+                        sum[j] += point[j];
+                    }
+                    counts[assignment[i]]++;
+                }
+                for (int k=0;k<SUBSPACE_CENTERS;++k) {
+                    // the empty clusters keep their center
+                    if (counts[k]>0) {
+                        for (int j=0;j<length;++j) {
+                            codebook[(size_t)k*length+j] = (float)(sums[(size_t)k*length+j]/counts[k]);
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+
+    /**
+     * Assigns a range of vectors to their lists and encodes their residuals.
+     */
+    class EncodeTask : public Task
+    {
+        const IVFPQIndex& index;
+        int* list;
+        unsigned char* encoded;
+        int start;
+        int end;
+
+    public:
+        EncodeTask(const IVFPQIndex& index_, int* list_, unsigned char* encoded_, int start_, int end_) :
+            index(index_), list(list_), encoded(encoded_), start(start_), end(end_)
+        {
+        }
+
+        void run()
+        {
+            vector<float> dists(max(index.lists, (int)SUBSPACE_CENTERS));
+            vector<float> residual(index.veclen_);
+            for (int i=start;i<end;++i) {
+                const float* vec = index.dataset[i];
+                list[i] = closest(vec, &index.centers[0], index.lists, index.veclen_, &dists[0]);
+                index.encode(vec, list[i], &residual[0], &dists[0], encoded+(size_t)i*index.subquantizers);
+            }
+        }
+    };
+
+
+public:
+
+
+    const char* name() const
+    {
+        return "ivfpq";
+    }
+
+	/**
+	 * Index constructor
+	 *
+	 * Params:
+	 * 		inputData = dataset with the input features
+	 * 		params = number of lists ("lists"), of subquantizers
+	 *			("subquantizers", dividing the length of the vectors) and of
+	 *			re-ranked candidates ("rerank"), and the parameters of the
+	 *			coarse k-means tree
+	 */
+    IVFPQIndex(Dataset<float>& inputData, Params params) : dataset(inputData), tree_params(params)
+    {
+        size_ = dataset.rows;
+        veclen_ = dataset.cols;
+
+        lists = 1024;
+        if (params.find("lists") != params.end()) {
+            lists = (int)params["lists"];
+        }
+        if (lists<1) {
+            throw FLANNException("The number of lists must be at least 1");
+        }
+        subquantizers = 16;
+        if (params.find("subquantizers") != params.end()) {
+            subquantizers = (int)params["subquantizers"];
+        }
+        if (subquantizers<1 || veclen_%subquantizers!=0) {
+            throw FLANNException("The number of subquantizers must divide the length of the vectors");
+        }
+        subveclen = veclen_/subquantizers;
+        rerank = 64;
+        if (params.find("rerank") != params.end()) {
+            rerank = max((int)params["rerank"], 0);
+        }
+
+        max_iter = TRAINING_ITERATIONS;
+        if (params.find("max-iterations") != params.end()) {
+            int iterations = (int)params["max-iterations"];
+            if (iterations>0 && iterations<max_iter) {
+                max_iter = iterations;
+            }
+        }
+        cores = 1;
+        if (params.find("cores") != params.end()) {
+            cores = (int)params["cores"];
+        }
+        // the C callers that fill the parameters field by field can leave
+        // the cores uninitialized, no more threads than the hardware ones
+        if (cores<=0 || cores>ThreadPool::hardwareThreads()) {
+            cores = ThreadPool::hardwareThreads();
+        }
+    }
+
+
+    int size() const
+    {
+        return size_;
+    }
+
+    int veclen() const
+    {
+        return veclen_;
+    }
+
+
+	/**
+	 * Memory used by the index: the codes, the ids and the centers, not
+	 * the dataset.
+	 */
+	int usedMemory() const
+	{
+		return (int)(codes.size() + (ids.size()+list_offsets.size())*sizeof(int) + (centers.size()+codebooks.size())*sizeof(float));
+	}
+
+
+	/**
+	 * Builds the index
+	 */
+	void buildIndex()
+	{
+		if (size_<1) {
+			throw FLANNException("Cannot build an index without vectors");
+		}
+		buildCoarseQuantizer();
+
+		ThreadPool threads(cores);
+
+		// the subquantizers are trained on the residuals of a sample
+		int rows = min(size_, (int)TRAINING_ROWS);
+		vector<float> residuals((size_t)rows*veclen_);
+		{
+			UniqueRandom r(size_);
+			vector<float> dists(lists);
+			for (int i=0;i<rows;++i) {
+				const float* vec = dataset[r.next()];
+				int list = closest(vec, &centers[0], lists, veclen_, &dists[0]);
+				for (int j=0;j<veclen_;++j) {
+					residuals[(size_t)i*veclen_+j] = vec[j]-centers[(size_t)list*veclen_+j];
+				}
+			}
+		}
+
+		// the seeds are drawn here so that the centers don't depend on the number of threads
+		vector<vector<int> > seeds(subquantizers);
+		for (int m=0;m<subquantizers;++m) {
+			seeds[m].resize(SUBSPACE_CENTERS);
+			UniqueRandom r(rows);
+			for (int k=0;k<SUBSPACE_CENTERS;++k) {
+				seeds[m][k] = k<rows ? r.next() : rand_int(rows);
+			}
+		}
+		codebooks.assign((size_t)subquantizers*SUBSPACE_CENTERS*subveclen, 0);
+		TaskGroup training;
+		for (int m=0;m<subquantizers;++m) {
+			threads.spawn(new TrainTask(residuals, rows, veclen_, m*subveclen, subveclen, max_iter, seeds[m],
+						&codebooks[(size_t)m*SUBSPACE_CENTERS*subveclen]), training);
+		}
+		threads.wait(training);
+
+		vector<int> assignment(size_);
+		vector<unsigned char> encoded((size_t)size_*subquantizers);
+		TaskGroup encoding;
+		for (int start=0;start<size_;start+=ENCODE_CHUNK) {
+			threads.spawn(new EncodeTask(*this, &assignment[0], &encoded[0], start, min(start+ENCODE_CHUNK, size_)), encoding);
+		}
+		threads.wait(encoding);
+
+		// the codes of each list are stored together, in the order of the dataset
+		list_offsets.assign(lists+1, 0);
+		for (int i=0;i<size_;++i) {
+			list_offsets[assignment[i]+1]++;
+		}
+		for (int l=0;l<lists;++l) {
+			list_offsets[l+1] += list_offsets[l];
+		}
+		vector<int> next(list_offsets.begin(), list_offsets.end()-1);
+		ids.resize(size_);
+		codes.resize((size_t)size_*subquantizers);
+		for (int i=0;i<size_;++i) {
+			int position = next[assignment[i]]++;
+			ids[position] = i;
+			copy(&encoded[(size_t)i*subquantizers], &encoded[(size_t)i*subquantizers]+subquantizers, &codes[(size_t)position*subquantizers]);
+		}
+		logger.info("IVF-PQ index of %d lists, %d bytes per vector\n", lists, subquantizers);
+	}
+
+
+	/**
+	 * Saves the parameters, the centers, the codebooks and the lists.
+	 */
+	void saveIndex(FILE* stream)
+	{
+		save_value(stream, lists);
+		save_value(stream, subquantizers);
+		save_value(stream, rerank);
+		save_value(stream, size_);
+		save_value(stream, centers[0], centers.size());
+		save_value(stream, codebooks[0], codebooks.size());
+		save_value(stream, list_offsets[0], list_offsets.size());
+		save_value(stream, ids[0], ids.size());
+		save_value(stream, codes[0], codes.size());
+	}
+
+
+	/**
+	 * Loads the index saved by saveIndex, instead of building it.
+	 */
+	void loadIndex(FILE* stream)
+	{
+		if (!ids.empty()) {
+			throw FLANNException("The index is already built");
+		}
+		int size;
+		load_value(stream, lists);
+		load_value(stream, subquantizers);
+		load_value(stream, rerank);
+		load_value(stream, size);
+		if (size!=size_) {
+			throw FLANNException("The index file does not match the dataset");
+		}
+		if (lists<1 || lists>size_ || subquantizers<1 || veclen_%subquantizers!=0 || rerank<0) {
+			throw FLANNException("Invalid IVF-PQ index in the index file");
+		}
+		subveclen = veclen_/subquantizers;
+
+		centers.resize((size_t)lists*veclen_);
+		load_value(stream, centers[0], centers.size());
+		codebooks.resize((size_t)subquantizers*SUBSPACE_CENTERS*subveclen);
+		load_value(stream, codebooks[0], codebooks.size());
+		list_offsets.resize(lists+1);
+		load_value(stream, list_offsets[0], list_offsets.size());
+		ids.resize(size_);
+		load_value(stream, ids[0], ids.size());
+		codes.resize((size_t)size_*subquantizers);
+		load_value(stream, codes[0], codes.size());
+
+		// the search trusts the offsets and the ids
+		bool valid = list_offsets[0]==0 && list_offsets[lists]==size_;
+		for (int l=0;l<lists && valid;++l) {
+			valid = list_offsets[l]<=list_offsets[l+1];
+		}
+		for (int i=0;i<size_ && valid;++i) {
+			valid = ids[i]>=0 && ids[i]<size_;
+		}
+		if (!valid) {
+			ids.clear();
+			throw FLANNException("Invalid IVF-PQ index in the index file");
+		}
+	}
+
+
+    /**
+     * Find set of nearest neighbors to vec. Their indices are stored inside
+     * the result object.
+     *
+     * Params:
+     *     result = the result object in which the indices of the nearest-neighbors are stored
+     *     vec = the vector for which to search the nearest neighbors
+     *     searchParams = parameters that influence the search algorithm (checks: number of
+     *         codes scanned, <0 to scan all the lists)
+     *     context = search context created by createSearchContext
+     */
+    void findNeighbors(ResultSet& result, float* vec, const SearchParams& searchParams, SearchContext& context) const
+    {
+        IVFPQContext& c = static_cast<IVFPQContext&>(context);
+        int maxChecks = searchParams.checks;
+
+        squared_dist_many_float(vec, &centers[0], lists, veclen_, &c.list_dists[0]);
+        for (int l=0;l<lists;++l) {
+            c.order[l] = l;
+        }
+        ListOrder byDistance = { &c.list_dists[0] };
+        sort(c.order.begin(), c.order.end(), byDistance);
+
+        // at least as many candidates as neighbors, and the lists are scanned
+        // past maxChecks until there are enough to fill the result
+        int neighbors = result.getCapacity();
+        int keep = max(rerank, neighbors);
+        c.candidates.clear();
+        int checks = 0;
+        for (int i=0;i<lists && (maxChecks<0 || checks<maxChecks ||
+                    (rerank>0 ? (int)c.candidates.size()<neighbors : !result.full()));++i) {
+            int list = c.order[i];
+            int start = list_offsets[list];
+            int end = list_offsets[list+1];
+            if (start==end) {
+                continue;
+            }
+            computeTable(vec, list, c);
+            const float* table = &c.table[0];
+            const unsigned char* code = &codes[(size_t)start*subquantizers];
+            for (int j=start;j<end;++j, code+=subquantizers) {
+                float dist = 0;
+                for (int m=0;m<subquantizers;++m) {
+                    dist += table[m*SUBSPACE_CENTERS+code[m]];
+                }
+                if (rerank>0) {
+                    addCandidate(c.candidates, keep, dist, ids[j]);
+                }
+                else if (dist<=result.worstDist()) {
+                    result.addPointDist(ids[j], dist);
+                }
+            }
+            checks += end-start;
+        }
+
+        for (size_t i=0;i<c.candidates.size();++i) {
+            int id = c.candidates[i].second;
+            result.addPoint(dataset[id], id);
+        }
+    }
+
+
+    SearchContext* createSearchContext() const
+    {
+        return new IVFPQContext(lists, veclen_, subquantizers);
+    }
+
+
+    Params estimateSearchParams(float precision, Dataset<float>* testset = NULL)
+    {
+        Params params;
+
+        return params;
+    }
+
+
+private:
+
+    /**
+     * Index of the closest of count vectors.
+     *
+     * Params:
+     *     dists = room for count distances
+     */
+    static int closest(const float* vec, const float* vecs, int count, int length, float* dists)
+    {
+        squared_dist_many_float(vec, vecs, count, length, dists);
+        int best = 0;
+        for (int k=1;k<count;++k) {
+            if (dists[k]<dists[best]) {
+                best = k;
+            }
+        }
+        return best;
+    }
+
+
+    /**
+     * Builds a k-means tree on a sample of the dataset and takes the
+     * centers of a cut of lists clusters as the coarse centers.
+     */
+    void buildCoarseQuantizer()
+    {
+        int rows = min(size_, lists*COARSE_SAMPLE_PER_LIST);
+        Dataset<float> sample(rows, veclen_);
+        UniqueRandom r(size_);
+        for (int i=0;i<rows;++i) {
+            const float* vec = dataset[r.next()];
+            copy(vec, vec+veclen_, sample[i]);
+        }
+
+        KMeansTree tree(sample, tree_params);
+        tree.buildIndex();
+        centers.resize((size_t)lists*veclen_);
+        lists = tree.getClusterCenters(lists, &centers[0]);
+        centers.resize((size_t)lists*veclen_);
+    }
+
+
+    /**
+     * Encodes the residual of a vector to the center of its list.
+     *
+     * Params:
+     *     residual = room for veclen values
+     *     dists = room for SUBSPACE_CENTERS distances
+     *     code = output, subquantizers bytes
+     */
+    void encode(const float* vec, int list, float* residual, float* dists, unsigned char* code) const
+    {
+        const float* center = &centers[(size_t)list*veclen_];
+        for (int j=0;j<veclen_;++j) {
+            residual[j] = vec[j]-center[j];
+        }
+        for (int m=0;m<subquantizers;++m) {
+            const float* codebook = &codebooks[(size_t)m*SUBSPACE_CENTERS*subveclen];
+            code[m] = (unsigned char)closest(residual+m*subveclen, codebook, SUBSPACE_CENTERS, subveclen, dists);
+        }
+    }
+
+
+    /**
+     * Computes the distances from the subvectors of the residual of the
+     * query to the centers of the subquantizers, for the codes of a list.
+     */
+    void computeTable(const float* vec, int list, IVFPQContext& c) const
+    {
+        const float* center = &centers[(size_t)list*veclen_];
+        for (int j=0;j<veclen_;++j) {
+            c.residual[j] = vec[j]-center[j];
+        }
+        for (int m=0;m<subquantizers;++m) {
+            squared_dist_many_float(&c.residual[m*subveclen], &codebooks[(size_t)m*SUBSPACE_CENTERS*subveclen],
+                        SUBSPACE_CENTERS, subveclen, &c.table[m*SUBSPACE_CENTERS]);
+        }
+    }
+
+
+    /**
+     * Keeps the keep candidates with the smallest estimated distances.
+     */
+    void addCandidate(vector<pair<float,int> >& candidates, int keep, float dist, int id) const
+    {
+        if ((int)candidates.size()<keep) {
+            candidates.push_back(make_pair(dist, id));
+            push_heap(candidates.begin(), candidates.end());
+        }
+        else if (make_pair(dist, id)<candidates.front()) {
+            pop_heap(candidates.begin(), candidates.end());
+            candidates.back() = make_pair(dist, id);
+            push_heap(candidates.begin(), candidates.end());
+        }
+    }
+
+};
+
+register_index("ivfpq",IVFPQIndex)
+
+#endif //IVFPQINDEX_H
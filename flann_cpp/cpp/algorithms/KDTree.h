@@ -19,12 +19,16 @@
 #include <algorithm>
 #include <map>
 #include <cassert>
+#include <limits>
+#include <vector>
 #include "../util/Heap.h"
 #include "../util/common.h"
 #include "../util/Allocator.h"
 #include "../util/Dataset.h"
 #include "../util/ResultSet.h"
 #include "../util/Random.h"
+#include "../util/ThreadPool.h"
+#include "../util/Serialization.h"
 #include "../algorithms/NNIndex.h"
 
 using namespace std;
@@ -46,6 +50,14 @@ const int SAMPLE_MEAN = 100;
     */
 const int RAND_DIM=5;
 
+/**
+ * Number of top levels of each tree laid out breadth-first. They are the
+ * first steps of every descent and stay in the cache; the subtrees below
+ * them are laid out depth-first, so that a descent moves forward in the
+ * node array.
+ */
+const int BREADTH_FIRST_LEVELS = 10;
+
 
 /**
  * Randomized kd-tree index
@@ -65,15 +77,10 @@ public:
 	int numTrees;       	
 
 	/**
-	 *  Array of indices to vectors in the dataset.  When doing lookup, 
-	 *  this is used instead to mark checkID.
-	 */
-	int* vind;
-	
-	/**
-	 * An unique ID for each lookup.
+	 * Number of threads used for building the trees (<=0 for one per
+	 * hardware thread).
 	 */
-	int checkID;
+	int cores;
 
 	/**
 	 * The dataset used by this index
@@ -82,16 +89,12 @@ public:
 
     int size_;
     int veclen_;
-    
-
-    float* mean;
-    float* var;
 	
 	
 	/*--------------------- Internal Data Structures --------------------------*/
 	
 	/**
-	 * A node of the binary k-d tree.
+	 * A node of the binary k-d tree while it is built.
 	 * 
 	 *  This is   All nodes that have vec[divfeat] < divval are placed in the
 	 *   child1 subtree, else child2., A leaf node is indicated if both children are NULL.
@@ -114,26 +117,109 @@ public:
 	};
 	typedef TreeSt* Tree;
 
-    /**
-     * Array of k-d trees used to find neighbors.
-     */
-    Tree* trees;
-    typedef BranchStruct<Tree> BranchSt;
+	/**
+	 * A node of the k-d trees as they are searched. The internal nodes of
+	 * all the trees are stored in one array and refer to their children
+	 * by position in it; a leaf takes no node, it is referred to by
+	 * -1-(index of its vector).
+	 */
+	struct Node {
+		int divfeat;
+		float divval;
+		int child1;
+		int child2;
+	};
+
+	/**
+	 * The internal nodes of the trees.
+	 */
+	vector<Node> nodes;
+
+	/**
+	 * The root of each tree, referred to as a child.
+	 */
+	vector<int> roots;
+
+    typedef BranchStruct<int> BranchSt;
     typedef BranchSt* Branch;
-    /**
-     * Priority queue storing intermediate branches in the best-bin-first search
-     */
-    Heap<BranchSt>* heap;
+
+	/**
+	 * Search state of the k-d trees.
+	 */
+	class KDTreeContext : public SearchContext
+	{
+		int size;
+
+	public:
+		/**
+		 * Priority queue storing intermediate branches in the best-bin-first search
+		 */
+		Heap<BranchSt> heap;
+
+		/**
+		 *  Array with one entry per vector in the dataset. When doing lookup, 
+		 *  this is used to mark checkID.
+		 */
+		int* vind;
+
+		/**
+		 * An unique ID for each lookup.
+		 */
+		int checkID;
+
+		KDTreeContext(int size_) : size(size_), heap(size_), checkID(0)
+		{
+			vind = new int[size];
+			memset(vind,0,size*sizeof(int));
+		}
+
+		~KDTreeContext()
+		{
+			delete[] vind;
+		}
+
+		/**
+		 * Sets a different unique ID for a new search.
+		 */
+		void newSearch()
+		{
+			if (checkID==numeric_limits<int>::max()) {
+				memset(vind,0,size*sizeof(int));
+				checkID = 0;
+			}
+			checkID++;
+		}
+	};
 	
 	
 	/**
-	 * Pooled memory allocator.
-	 * 
-	 * Using a pooled memory allocator is more efficient
-	 * than allocating memory directly when there is a large
-	 * number small of memory allocations.
+	 * A tree node as stored in an index file: the children are given by
+	 * their position in the node array of the tree (-1 for the leaves).
 	 */
-	PooledAllocator pool;
+	struct NodeRecord {
+		int divfeat;
+		float divval;
+		int child1;
+		int child2;
+
+		bool leaf() const
+		{
+			return child1<0 || child2<0;
+		}
+	};
+
+	/**
+	 * State used while building one tree: the permutation of the vectors
+	 * being subdivided, the scratch buffers for the mean and variance and
+	 * the pooled allocator of the nodes (one per tree so that the trees
+	 * can be built concurrently).
+	 */
+	struct TreeBuilder {
+		int* ind;
+		float* mean;
+		float* var;
+		PooledAllocator* pool;
+	};
 
     const char* name() const
     {
@@ -155,30 +241,10 @@ public:
 		// get the parameters
 		numTrees = (int)params["trees"];
 		printf("Num trees: %d\n",numTrees);
-		trees = new Tree[numTrees];
-		heap = new Heap<BranchSt>(size_);
-		checkID = -1000;
-			
-		// Create a permutable array of indices to the input vectors.
-		vind = new int[size_];
-		for (int i = 0; i < size_; i++) {
-			vind[i] = i;
-		}
-
-        mean = new float[veclen_];
-        var = new float[veclen_];
-	}
-	
-	/**
-	 * Standard destructor
-	 */
-	~KDTree()
-	{
-		delete[] vind;
-        delete[] trees;
-		delete heap;
-        delete[] mean;
-        delete[] var;
+		cores = 1;
+		if (params.find("cores") != params.end()) {
+			cores = (int)params["cores"];
+		}
 	}
 	
 	
@@ -187,22 +253,29 @@ public:
 	 */
 	void buildIndex() 
 	{
+		/* Each tree has its own random state, seeded here so that the
+			forest only depends on the caller's seed, not on the threads. */
+		unsigned int* seeds = new unsigned int[numTrees];
+		for (int i = 0; i < numTrees; i++) {
+			seeds[i] = (unsigned int)rand_double(4294967296.0);
+		}
+
 		/* Construct the randomized trees. */
+		vector<vector<NodeRecord> > records(numTrees);
+		ThreadPool threads(min(cores>0 ? cores : ThreadPool::hardwareThreads(), max(numTrees,1)));
+		TaskGroup tasks;
 		for (int i = 0; i < numTrees; i++) {
-			//printf("i[%d]\n",i);
-			/* Randomize the order of vectors to allow for unbiased sampling. */
-			for (int j = size_; j > 0; --j) {
-				int rnd = 0;
-// 				int rand = cast(int) (drand48() * size);  
-				rnd = rand_int(j);
-				assert(rnd >=0 && rnd < size_);
-				swap(vind[j-1], vind[rnd]);
-			}
-			//printf("Randomized vectors\n");
+			threads.spawn(new TreeTask(*this, records[i], seeds[i]), tasks);
+		}
+		threads.wait(tasks);
 
-			trees[i] = NULL;
-			divideTree(&trees[i], 0, size_ - 1);
+		delete[] seeds;
 
+		nodes.clear();
+		nodes.reserve((size_t)numTrees*max(size_-1,0));
+		roots.clear();
+		for (int i = 0; i < numTrees; i++) {
+			roots.push_back(layoutTree(records[i]));
 		}
 	}
 	
@@ -230,10 +303,80 @@ public:
 	 */
 	int usedMemory() const
 	{
-		return  pool.usedMemory+pool.wastedMemory+dataset.rows*sizeof(int);   // pool memory and vind array memory
+		return (int)(nodes.size()*sizeof(Node) + roots.size()*sizeof(int));
 	}
 	
 
+	/**
+	 * Saves the trees, each one as an array of nodes in depth-first order.
+	 */
+	void saveIndex(FILE* stream)
+	{
+		save_value(stream, numTrees);
+		vector<NodeRecord> records;
+		for (int i = 0; i < numTrees; ++i) {
+			getTree(i, records);
+			int count = (int)records.size();
+			save_value(stream, count);
+			save_value(stream, records[0], count);
+		}
+	}
+
+
+	/**
+	 * Loads the trees saved by saveIndex. Each node array is read at once
+	 * and laid out as the built trees.
+	 */
+	void loadIndex(FILE* stream)
+	{
+		int count;
+		load_value(stream, count);
+		if (count<1) {
+			throw FLANNException("Invalid number of trees in the index file");
+		}
+		numTrees = count;
+		nodes.clear();
+		roots.clear();
+
+		vector<NodeRecord> records;
+		for (int t = 0; t < numTrees; ++t) {
+			load_value(stream, count);
+			if (count<1) {
+				throw FLANNException("Invalid tree in the index file");
+			}
+			records.resize(count);
+			load_value(stream, records[0], count);
+
+			for (int i = 0; i < count; ++i) {
+				const NodeRecord& r = records[i];
+				if (r.leaf()) {
+					if (r.divfeat<0 || r.divfeat>=size_) {
+						throw FLANNException("The index file does not match the dataset");
+					}
+				}
+				else if (r.child1>=count || r.child2>=count || r.divfeat<0 || r.divfeat>=veclen_) {
+					throw FLANNException("Invalid tree in the index file");
+				}
+			}
+			roots.push_back(layoutTree(records));
+		}
+	}
+
+
+	/**
+	 * Gets a tree as an array of nodes in depth-first order, as saved in
+	 * the index files.
+	 *
+	 * Params: t = index of the tree
+	 * 			records = output, the nodes, the root first
+	 */
+	void getTree(int t, vector<NodeRecord>& records) const
+	{
+		records.clear();
+		recordTree(records, roots[t]);
+	}
+
+
     /** 
      * Find set of nearest neighbors to vec. Their indices are stored inside
      * the result object. 
@@ -241,23 +384,40 @@ public:
      * Params:
      *     result = the result object in which the indices of the nearest-neighbors are stored 
      *     vec = the vector for which to search the nearest neighbors
-     *     maxCheck = the maximum number of restarts (in a best-bin-first manner)
+     *     searchParams = parameters that influence the search algorithm (checks)
+     *     context = search context created by createSearchContext
      */
-    void findNeighbors(ResultSet& result, float* vec, Params searchParams)
+    void findNeighbors(ResultSet& result, float* vec, const SearchParams& searchParams, SearchContext& context) const
     {
-        int maxChecks;
-        if (searchParams.find("checks") == searchParams.end()) {
-            maxChecks = -1;
-        }
-        else {            
-            maxChecks = (int)searchParams["checks"];
+        KDTreeContext& c = static_cast<KDTreeContext&>(context);
+
+        if (searchParams.checks<0) {
+            getExactNeighbors(c, result, vec);
+        } else {
+            getNeighbors(c, result, vec, searchParams.checks);
         }
-        
-        if (maxChecks<0) {
-            getExactNeighbors(result, vec);
+    }
+
+
+    bool findNearest(float* vec, const SearchParams& searchParams, SearchContext& context, int& index, float& dist) const
+    {
+        KDTreeContext& c = static_cast<KDTreeContext&>(context);
+        SingleResultSet result(vec, veclen_);
+
+        if (searchParams.checks<0) {
+            getExactNeighbors(c, result, vec);
         } else {
-            getNeighbors(result, vec, maxChecks);
+            getNeighbors(c, result, vec, searchParams.checks);
         }
+        index = result.getNeighbor();
+        dist = result.getDistance();
+        return true;
+    }
+
+
+    SearchContext* createSearchContext() const
+    {
+        return new KDTreeContext(size_);
     }
 
 
@@ -270,21 +430,215 @@ public:
 
 
 private:	
+
+	/**
+	 * Task building one of the trees.
+	 */
+	class TreeTask : public Task
+	{
+		KDTree& index;
+		vector<NodeRecord>& records;
+		unsigned int seed;
+
+	public:
+		TreeTask(KDTree& index_, vector<NodeRecord>& records_, unsigned int seed_) : index(index_), records(records_), seed(seed_)
+		{
+		}
+
+		void run()
+		{
+			index.buildTree(records, seed);
+		}
+	};
+
+
+	/**
+	 * Builds one randomized tree.
+	 * 
+	 * Params: records = output, the nodes of the tree in depth-first order
+	 * 			seed = seed of the random state used for the tree
+	 */
+	void buildTree(vector<NodeRecord>& records, unsigned int seed)
+	{
+		seed_random(seed);
+
+		/* Using a pooled memory allocator is more efficient than allocating
+			memory directly when there is a large number small of memory 
+			allocations. */
+		PooledAllocator pool;
+		TreeBuilder b;
+		b.ind = new int[size_];
+		b.mean = new float[veclen_];
+		b.var = new float[veclen_];
+		b.pool = &pool;
+
+		/* Randomize the order of vectors to allow for unbiased sampling. */
+		for (int j = 0; j < size_; ++j) {
+			b.ind[j] = j;
+		}
+		for (int j = size_; j > 0; --j) {
+			int rnd = rand_int(j);
+			assert(rnd >=0 && rnd < size_);
+			swap(b.ind[j-1], b.ind[rnd]);
+		}
+
+		Tree root = NULL;
+		divideTree(b, &root, 0, size_ - 1);
+		records.clear();
+		flattenTree(records, root);
+
+		delete[] b.ind;
+		delete[] b.mean;
+		delete[] b.var;
+	}
+
 	
 	/**
-	 * Create a tree node that subdivides the list of vecs from vind[first]
-	 * to vind[last].  The routine is called recursively on each sublist.
+	 * Appends a subtree to a node array in depth-first order.
+	 * 
+	 * Returns: the position of the subtree root in the array
+	 */
+	int flattenTree(vector<NodeRecord>& nodes, Tree node)
+	{
+		int pos = (int)nodes.size();
+		NodeRecord r;
+		r.divfeat = node->divfeat;
+		r.divval = node->divval;
+		r.child1 = r.child2 = -1;
+		nodes.push_back(r);
+
+		if (node->child1 != NULL  ||  node->child2 != NULL) {
+			int child1 = flattenTree(nodes, node->child1);
+			int child2 = flattenTree(nodes, node->child2);
+			nodes[pos].child1 = child1;
+			nodes[pos].child2 = child2;
+		}
+		return pos;
+	}
+
+
+	/**
+	 * Appends the nodes of a tree, given by its nodes in depth-first order,
+	 * to the node array searched: the BREADTH_FIRST_LEVELS top levels
+	 * breadth-first, then each subtree below them depth-first.
+	 *
+	 * Returns: the root of the tree, referred to as a child
+	 */
+	int layoutTree(const vector<NodeRecord>& records)
+	{
+		int count = (int)records.size();
+		if (records[0].leaf()) {
+			return -1-records[0].divfeat;
+		}
+
+		/* Order of the internal nodes, each one reached once. */
+		vector<int> order;
+		vector<char> reached(count, 0);
+		vector<int> level(1, 0), next;
+		reached[0] = 1;
+		for (int depth = 0; depth < BREADTH_FIRST_LEVELS && !level.empty(); ++depth) {
+			next.clear();
+			for (size_t i = 0; i < level.size(); ++i) {
+				const NodeRecord& r = records[level[i]];
+				order.push_back(level[i]);
+				int children[2] = { r.child1, r.child2 };
+				for (int k = 0; k < 2; ++k) {
+					if (reached[children[k]]) {
+						throw FLANNException("Invalid tree in the index file");
+					}
+					reached[children[k]] = 1;
+					if (!records[children[k]].leaf()) {
+						next.push_back(children[k]);
+					}
+				}
+			}
+			level.swap(next);
+		}
+		vector<int> stack(level.rbegin(), level.rend());
+		while (!stack.empty()) {
+			int pos = stack.back();
+			stack.pop_back();
+			const NodeRecord& r = records[pos];
+			order.push_back(pos);
+			int children[2] = { r.child2, r.child1 };
+			for (int k = 0; k < 2; ++k) {
+				if (reached[children[k]]) {
+					throw FLANNException("Invalid tree in the index file");
+				}
+				reached[children[k]] = 1;
+				if (!records[children[k]].leaf()) {
+					stack.push_back(children[k]);
+				}
+			}
+		}
+
+		int base = (int)nodes.size();
+		vector<int> position(count);
+		for (size_t i = 0; i < order.size(); ++i) {
+			position[order[i]] = base + (int)i;
+		}
+		for (int i = 0; i < count; ++i) {
+			if (records[i].leaf()) {
+				position[i] = -1-records[i].divfeat;
+			}
+		}
+		for (size_t i = 0; i < order.size(); ++i) {
+			const NodeRecord& r = records[order[i]];
+			Node node;
+			node.divfeat = r.divfeat;
+			node.divval = r.divval;
+			node.child1 = position[r.child1];
+			node.child2 = position[r.child2];
+			nodes.push_back(node);
+		}
+		return base;
+	}
+
+
+	/**
+	 * Appends a subtree of the node array to an array of records in 
+	 * depth-first order, the inverse of layoutTree.
+	 *
+	 * Returns: the position of the subtree root in the records
+	 */
+	int recordTree(vector<NodeRecord>& records, int child) const
+	{
+		int pos = (int)records.size();
+		NodeRecord r;
+		r.child1 = r.child2 = -1;
+		if (child<0) {
+			r.divfeat = -1-child;
+			r.divval = 0;
+			records.push_back(r);
+			return pos;
+		}
+		const Node& node = nodes[child];
+		r.divfeat = node.divfeat;
+		r.divval = node.divval;
+		records.push_back(r);
+		int child1 = recordTree(records, node.child1);
+		int child2 = recordTree(records, node.child2);
+		records[pos].child1 = child1;
+		records[pos].child2 = child2;
+		return pos;
+	}
+
+
+	/**
+	 * Create a tree node that subdivides the list of vecs from b.ind[first]
+	 * to b.ind[last].  The routine is called recursively on each sublist.
 	 * Place a pointer to this new tree node in the location pTree.
 	 * 
-	 * Params: pTree = the new node to create
+	 * Params: b = state of the tree being built
+	 * 			pTree = the new node to create
 	 * 			first = index of the first vector
 	 * 			last = index of the last vector
 	 */
-	void divideTree(Tree* pTree, int first, int last)
+	void divideTree(TreeBuilder& b, Tree* pTree, int first, int last)
 	{
 		Tree node;
 		//printf("dividing tree\n");
-		node = pool.allocate<TreeSt>(); // allocate memory
+		node = b.pool->allocate<TreeSt>(); // allocate memory
 		*pTree = node;
 	
 		/* If only one exemplar remains, then make this a leaf node. */
@@ -292,11 +646,11 @@ private:
 			//printf("first is last \n");
 			node->child1 = node->child2 = NULL;    /* Mark as leaf node. */
 			//printf("leaf node marked \n");
-			node->divfeat = vind[first];    /* Store index of this vec. */
+			node->divfeat = b.ind[first];    /* Store index of this vec. */
 		} else {
-			chooseDivision(node, first, last);
+			chooseDivision(b, node, first, last);
 			//printf("division chosen \n");
-			subdivide(node, first, last);
+			subdivide(b, node, first, last);
 			//printf("sub divided \n");
 		}
 		//printf("finished dividing tree\n");
@@ -310,8 +664,10 @@ private:
 	 * Make a random choice among those with the highest variance, and use
 	 * its variance as the threshold value.
 	 */
-	void chooseDivision(Tree node, int first, int last)
+	void chooseDivision(TreeBuilder& b, Tree node, int first, int last)
 	{	
+        float* mean = b.mean;
+        float* var = b.var;
         memset(mean,0,veclen_*sizeof(float));		
         memset(var,0,veclen_*sizeof(float));     
 		//printf("memset complete\n");
@@ -323,7 +679,7 @@ private:
 
 		for (int j = first; j <= end; ++j) {
 			//printf("vind[j]: %d",vind[j]);
-			float* v = dataset[vind[j]];
+			float* v = dataset[b.ind[j]];
 			//printf("madness\n");
             for (int k=0; k<veclen_; ++k) {
 				//printf("going through veclan_[%d]:%d\n",k,veclen_);
@@ -339,7 +695,7 @@ private:
 		//printf("dividing by count\n");
 		/* Compute variances (no need to divide by count). */
 		for (int j = first; j <= end; ++j) {
-			float* v = dataset[vind[j]];
+			float* v = dataset[b.ind[j]];
             for (int k=0; k<veclen_; ++k) {
                 float dist = v[k] - mean[k];
                 var[k] += dist * dist;
@@ -392,19 +748,19 @@ private:
 	 *  Subdivide the list of exemplars using the feature and division
 	 *  value given in this node.  Call divideTree recursively on each list.
 	*/
-	void subdivide(Tree node, int first, int last)
+	void subdivide(TreeBuilder& b, Tree node, int first, int last)
 	{	
 		/* Move vector indices for left subtree to front of list. */
 		int i = first;
 		int j = last;
 		while (i <= j) {
-			int ind = vind[i];
+			int ind = b.ind[i];
 			float val = dataset[ind][node->divfeat];
 			if (val < node->divval) {
 				++i;
 			} else {
-				/* Move to end of list by swapping vind i and j. */
-				swap(vind[i], vind[j]);
+				/* Move to end of list by swapping ind i and j. */
+				swap(b.ind[i], b.ind[j]);
 				--j;
 			}
 		}
@@ -416,8 +772,8 @@ private:
             i = (first+last+1)/2;
 		}
 		
-		divideTree(& node->child1, first, i - 1);
-		divideTree(& node->child2, i, last);
+		divideTree(b, & node->child1, first, i - 1);
+		divideTree(b, & node->child2, i, last);
 	}
 	
 	
@@ -426,15 +782,16 @@ private:
 	 * Performs an exact nearest neighbor search. The exact search performs a full
 	 * traversal of the tree.  
 	 */
-	void getExactNeighbors(ResultSet& result, float* vec)
+	template <typename Result>
+	void getExactNeighbors(KDTreeContext& c, Result& result, float* vec) const
 	{
-		checkID -= 1;  /* Set a different unique ID for each search. */
+		c.newSearch();  /* Set a different unique ID for each search. */
 	
 		if (numTrees > 1) {
             fprintf(stderr,"Doesn't make any sense to use more than one tree for exact search");
 		}
 		if (numTrees>0) {
-			searchLevelExact(result, vec, trees[0], 0.0);		
+			searchLevelExact(c, result, vec, roots[0], 0.0);		
 		}		
 		assert(result.full());
 	}
@@ -444,23 +801,24 @@ private:
 	 * because the tree traversal is abandoned after a given number of descends in
 	 * the tree. 
 	 */
-	void getNeighbors(ResultSet& result, float* vec, int maxCheck)
+	template <typename Result>
+	void getNeighbors(KDTreeContext& c, Result& result, float* vec, int maxCheck) const
 	{
 		int i;
 		BranchSt branch;
 		
 		int checkCount = 0;
-		heap->clear();
-		checkID -= 1;  /* Set a different unique ID for each search. */
+		c.heap.clear();
+		c.newSearch();  /* Set a different unique ID for each search. */
 	
 		/* Search once through each tree down to root. */
 		for (i = 0; i < numTrees; ++i) {
-			searchLevel(result, vec, trees[i], 0.0, checkCount, maxCheck);
+			searchLevel(c, result, vec, roots[i], 0.0, checkCount, maxCheck);
 		}
 	
 		/* Keep searching other branches from heap until finished. */
-		while ( heap->popMin(branch) && (checkCount < maxCheck || !result.full() )) {
-			searchLevel(result, vec, branch.node,branch.mindistsq, checkCount, maxCheck);
+		while ( c.heap.popMin(branch) && (checkCount < maxCheck || !result.full() )) {
+			searchLevel(c, result, vec, branch.node,branch.mindistsq, checkCount, maxCheck);
 		}
 		
 		assert(result.full());
@@ -472,84 +830,75 @@ private:
 	 *  higher levels, all exemplars below this level must have a distance of
 	 *  at least "mindistsq". 
 	*/
-	void searchLevel(ResultSet& result, float* vec, Tree node, float mindistsq, int& checkCount, int maxCheck)
+	template <typename Result>
+	void searchLevel(KDTreeContext& c, Result& result, float* vec, int node, float mindistsq, int& checkCount, int maxCheck) const
 	{
-		float val, diff;
-		Tree bestChild, otherChild;
-	
-		/* If this is a leaf node, then do check and return. */
-		if (node->child1 == NULL  &&  node->child2 == NULL) {
-		
-			/* Do not check same node more than once when searching multiple trees.
-				Once a vector is checked, we set its location in vind to the
-				current checkID.
+		/* Descend to a leaf. */
+		while (node >= 0) {
+			const Node& n = nodes[node];
+
+			/* Which child branch should be taken first? */
+			float diff = vec[n.divfeat] - n.divval;
+			int bestChild = (diff < 0) ? n.child1 : n.child2;
+			int otherChild = (diff < 0) ? n.child2 : n.child1;
+
+			/* Create a branch record for the branch not taken.  Add distance
+				of this feature boundary (we don't attempt to correct for any
+				use of this feature in a parent node, which is unlikely to
+				happen and would have only a small effect).  Don't bother
+				adding more branches to heap after halfway point, as cost of
+				adding exceeds their value.
 			*/
-			if (vind[node->divfeat] == checkID || checkCount>=maxCheck) {
-				if (result.full()) return;
+			if (2 * checkCount < maxCheck  ||  !result.full()) {
+				c.heap.insert( BranchSt::make_branch(otherChild, mindistsq + diff * diff) );
 			}
-            checkCount++;
-			vind[node->divfeat] = checkID;
-		
-			result.addPoint(dataset[node->divfeat],node->divfeat);
-			//CheckNeighbor(result, node.divfeat, vec);
-			return;
+			node = bestChild;
 		}
-	
-		/* Which child branch should be taken first? */
-		val = vec[node->divfeat];
-		diff = val - node->divval;
-		bestChild = (diff < 0) ? node->child1 : node->child2;
-		otherChild = (diff < 0) ? node->child2 : node->child1;
-	
-		/* Create a branch record for the branch not taken.  Add distance
-			of this feature boundary (we don't attempt to correct for any
-			use of this feature in a parent node, which is unlikely to
-			happen and would have only a small effect).  Don't bother
-			adding more branches to heap after halfway point, as cost of
-			adding exceeds their value.
+
+		/* Do not check same node more than once when searching multiple trees.
+			Once a vector is checked, we set its location in vind to the
+			current checkID. The result set doesn't look for duplicates.
 		*/
-		if (2 * checkCount < maxCheck  ||  !result.full()) {
-			heap->insert( BranchSt::make_branch(otherChild, mindistsq + diff * diff) );
-		}
-	
-		/* Call recursively to search next level down. */
-		searchLevel(result, vec, bestChild, mindistsq, checkCount, maxCheck);
+		int index = -1-node;
+		if (c.vind[index] == c.checkID) return;
+		if (checkCount>=maxCheck && result.full()) return;
+		checkCount++;
+		c.vind[index] = c.checkID;
+
+		result.addPoint(dataset[index],index);
 	}
 	
 	/**
 	 * Performs an exact search in the tree starting from a node.
 	 */
-	void searchLevelExact(ResultSet& result, float* vec, Tree node, float mindistsq)
+	template <typename Result>
+	void searchLevelExact(KDTreeContext& c, Result& result, float* vec, int node, float mindistsq) const
 	{
-		float val, diff;
-		Tree bestChild, otherChild;
-	
-		/* If this is a leaf node, then do check and return. */
-		if (node->child1 == NULL  &&  node->child2 == NULL) {
+		/* If this is a leaf, then do check and return. */
+		if (node < 0) {
 		
 			/* Do not check same node more than once when searching multiple trees.
 				Once a vector is checked, we set its location in vind to the
 				current checkID.
 			*/
-			if (vind[node->divfeat] == checkID)
+			int index = -1-node;
+			if (c.vind[index] == c.checkID)
 				return;
-			vind[node->divfeat] = checkID;
+			c.vind[index] = c.checkID;
 		
-			result.addPoint(dataset[node->divfeat],node->divfeat);
-			//CheckNeighbor(result, node.divfeat, vec);
+			result.addPoint(dataset[index],index);
 			return;
 		}
 	
 		/* Which child branch should be taken first? */
-		val = vec[node->divfeat];
-		diff = val - node->divval;
-		bestChild = (diff < 0) ? node->child1 : node->child2;
-		otherChild = (diff < 0) ? node->child2 : node->child1;
-	
+		const Node& n = nodes[node];
+		float diff = vec[n.divfeat] - n.divval;
+		int bestChild = (diff < 0) ? n.child1 : n.child2;
+		int otherChild = (diff < 0) ? n.child2 : n.child1;
 	
 		/* Call recursively to search next level down. */
-		searchLevelExact(result, vec, bestChild, mindistsq);
-		searchLevelExact(result, vec, otherChild, mindistsq+diff * diff);
+		searchLevelExact(c, result, vec, bestChild, mindistsq);
+		searchLevelExact(c, result, vec, otherChild, mindistsq+diff * diff);
 	}
 	
 };   // class KDTree
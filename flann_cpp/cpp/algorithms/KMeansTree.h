@@ -23,12 +23,17 @@
 #include <cassert>
 #include <limits>
 #include <cmath>
+#include <mutex>
+#include <vector>
+#include "../constants.h"
 #include "../util/common.h"
 #include "../util/Heap.h"
 #include "../util/Allocator.h"
 #include "../util/Dataset.h"
 #include "../util/ResultSet.h"
 #include "../util/Random.h"
+#include "../util/ThreadPool.h"
+#include "../util/Serialization.h"
 #include "../algorithms/NNIndex.h"
 
 using namespace std;
@@ -226,6 +231,12 @@ namespace {
         Init() { centers_init(); }
     };
     Init __init;
+
+    /**
+    * Names of the algorithms used for assigning the points to the closest 
+    * center in the k-means iterations, indexed by the KMEANS_ASSIGN_* constants.
+    */
+    const char* assignAlgs[] = { "lloyd", "blocked", "hamerly" };
 }
 
 
@@ -304,6 +315,12 @@ class KMeansTree : public NNIndex
 		 * Child nodes (only for non-terminal nodes)
 		 */
 		KMeansNodeSt** childs;
+		/**
+		 * The cluster centers of the child nodes, stored as one aligned
+		 * branching x veclen block (only for non-terminal nodes). The
+		 * pivot of each child points inside this block.
+		 */
+		float* child_pivots;
 		/**
 		 * Node points (only for terminal nodes)
 		 */
@@ -314,6 +331,28 @@ class KMeansTree : public NNIndex
 		int level;
 	};
     typedef KMeansNodeSt* KMeansNode;
+
+	/**
+	 * A node as stored in an index file. The nodes are stored in 
+	 * breadth-first order, so the children of a node are consecutive.
+	 */
+	struct NodeRecord {
+		float radius;
+		float mean_radius;
+		float variance;
+		int size;
+		int level;
+		/**
+		 * Position of the first child in the node array, -1 for the 
+		 * terminal nodes.
+		 */
+		int children;
+		/**
+		 * Position of the node points in the indices array (only for 
+		 * terminal nodes).
+		 */
+		int indices;
+	};
 	
 
 
@@ -322,10 +361,32 @@ class KMeansTree : public NNIndex
      */
     typedef BranchStruct<KMeansNode> BranchSt;
 
-    /**
-     * Priority queue storing intermediate branches in the best-bin-first search
-     */
-    Heap<BranchSt>* heap;
+	/**
+	 * Search state of the k-means tree.
+	 */
+	class KMeansContext : public SearchContext
+	{
+	public:
+		/**
+		 * Priority queue storing intermediate branches in the best-bin-first search
+		 */
+		Heap<BranchSt> heap;
+
+		/**
+		 * Array with distances to the kmeans domains of a node.
+		 */
+		float* domain_distances;
+
+		KMeansContext(int size, int branching) : heap(size)
+		{
+			domain_distances = new float[branching];
+		}
+
+		~KMeansContext()
+		{
+			delete[] domain_distances;
+		}
+	};
 
 
 
@@ -340,6 +401,12 @@ class KMeansTree : public NNIndex
 	int* indices;
 
 
+	/**
+	 * The children centers of all the nodes when the tree was loaded from
+	 * a file (in one block instead of one block per node), NULL otherwise.
+	 */
+	float* loaded_pivots;
+
 	/**
 	 * Pooled memory allocator.
 	 * 
@@ -354,18 +421,52 @@ class KMeansTree : public NNIndex
 	 */
 	int memoryCounter;
 	
-	
-	/**
-	 * Array with distances to the kmeans domains of a node.
-	 * Used during search phase.
-	 */
-	float* domain_distances;
-	
     /**
     * The function used for choosing the cluster centers. 
     */
     centersAlgFunction chooseCenters;
 
+    /**
+    * Algorithm used for assigning the points to the closest center
+    * (one of the KMEANS_ASSIGN_* constants).
+    */
+    int assign_algorithm;
+
+    /**
+    * Number of points (and of centers) processed together by the 
+    * blocked assignment step.
+    */
+    static const int ASSIGN_TILE = 32;
+
+    /**
+    * Number of points assigned by one task of the blocked assignment
+    * step in the large nodes (a multiple of ASSIGN_TILE).
+    */
+    static const int ASSIGN_CHUNK = 16384;
+
+    /**
+    * Minimum number of points in a node for building its subtree 
+    * in a separate task.
+    */
+    static const int TASK_MIN_POINTS = 1000;
+
+    /**
+    * Number of threads used for building the tree (<=0 for one per
+    * hardware thread).
+    */
+    int cores;
+
+    /**
+    * Thread pool and task group running the build, only set during buildIndex.
+    */
+    ThreadPool* workers;
+    TaskGroup* build_tasks;
+
+    /**
+    * Protects pool and memoryCounter, which are used by the build tasks.
+    */
+    mutex build_lock;
+
 	
 	
 public:
@@ -383,7 +484,7 @@ public:
 	 * 		inputData = dataset with the input features
 	 * 		params = parameters passed to the hierarchical k-means algorithm
 	 */
-	KMeansTree(Dataset<float>& inputData, Params params) : dataset(inputData), root(NULL), indices(NULL)
+	KMeansTree(Dataset<float>& inputData, Params params) : dataset(inputData), root(NULL), indices(NULL), loaded_pivots(NULL), workers(NULL), build_tasks(NULL)
 	{
 		memoryCounter = 0;
 
@@ -408,10 +509,32 @@ public:
 		else {
 			throw FLANNException("Unknown algorithm for choosing initial centers.");
 		}
+
+		assign_algorithm = -1;
+		const char* assign = "lloyd";
+		if (params.find("kmeans-assign") != params.end()) {
+			assign = (const char*)params["kmeans-assign"];
+		}
+		for (size_t i=0;i<ARRAY_LEN(assignAlgs);++i) {
+			if (strcmp(assign, assignAlgs[i])==0) {
+				assign_algorithm = (int)i;
+			}
+		}
+		if (assign_algorithm<0) {
+			throw FLANNException("Unknown algorithm for assigning points to centers.");
+		}
+
+		cores = 1;
+		if (params.find("cores") != params.end()) {
+			cores = (int)params["cores"];
+		}
+		// the C callers that fill the parameters field by field can leave
+		// the cores uninitialized, no more threads than the hardware ones
+		if (cores<=0 || cores>ThreadPool::hardwareThreads()) {
+			cores = ThreadPool::hardwareThreads();
+		}
         cb_index = 0.4;
     
-		domain_distances = new float[branching];
- 		heap = new Heap<BranchSt>(dataset.rows);
 	}
 	
 
@@ -423,13 +546,17 @@ public:
 	virtual ~KMeansTree()
 	{
 		if (root != NULL) {
-			free_centers(root);
+			delete[] root->pivot;
+			if (loaded_pivots != NULL) {
+				free_aligned(loaded_pivots);
+			}
+			else {
+				free_centers(root);
+			}
 		}
-		delete heap;
         if (indices!=NULL) {
 		  delete[] indices;
         }
-		delete[] domain_distances;
 	}
 
     /**
@@ -479,11 +606,177 @@ public:
 		printf("allocated root\n");
 		computeNodeStatistics(root, indices, size_);
 		printf("computed node statistics\n");
+
+		// the subtrees are built by tasks spawned from computeClustering
+		ThreadPool threads(cores);
+		TaskGroup tasks;
+		workers = &threads;
+		build_tasks = &tasks;
 		computeClustering(root, indices, size_, branching,0);
+		threads.wait(tasks);
+		workers = NULL;
+		build_tasks = NULL;
 		printf("computed clustering\n");
 	}
 
 
+	/**
+	 * Saves the tree: the indices array, the nodes in breadth-first order,
+	 * the root center and the children centers of the non-terminal nodes
+	 * in the same order.
+	 */
+	void saveIndex(FILE* stream)
+	{
+		save_value(stream, branching);
+		save_value(stream, cb_index);
+		save_value(stream, size_);
+		save_value(stream, *indices, size_);
+
+		vector<KMeansNode> order;
+		vector<NodeRecord> nodes;
+		order.push_back(root);
+		for (size_t i=0;i<order.size();++i) {
+			KMeansNode node = order[i];
+			NodeRecord r;
+			r.radius = node->radius;
+			r.mean_radius = node->mean_radius;
+			r.variance = node->variance;
+			r.size = node->size;
+			r.level = node->level;
+			if (node->childs==NULL) {
+				r.children = -1;
+				r.indices = (int)(node->indices - indices);
+			}
+			else {
+				r.children = (int)order.size();
+				r.indices = 0;
+				for (int k=0;k<branching;++k) {
+					order.push_back(node->childs[k]);
+				}
+			}
+			nodes.push_back(r);
+		}
+
+		int count = (int)nodes.size();
+		save_value(stream, count);
+		save_value(stream, nodes[0], count);
+		save_value(stream, *root->pivot, veclen_);
+		for (size_t i=0;i<order.size();++i) {
+			if (order[i]->childs!=NULL) {
+				save_value(stream, *order[i]->child_pivots, branching*veclen_);
+			}
+		}
+	}
+
+
+	/**
+	 * Loads the tree saved by saveIndex, instead of building it. The 
+	 * nodes, the indices and the children centers are each read at once.
+	 */
+	void loadIndex(FILE* stream)
+	{
+		if (root!=NULL) {
+			throw FLANNException("The index is already built");
+		}
+
+		int size;
+		load_value(stream, branching);
+		load_value(stream, cb_index);
+		load_value(stream, size);
+		if (branching<2) {
+			throw FLANNException("Invalid branching factor in the index file");
+		}
+		if (size!=size_) {
+			throw FLANNException("The index file does not match the dataset");
+		}
+		// the parts loaded before an invalid one are freed, the destructor
+		// only frees a complete tree
+		float* root_pivot = NULL;
+		int memory = memoryCounter;
+		try {
+			indices = new int[size_];
+			load_value(stream, *indices, size_);
+			// the searches use them to index the dataset
+			for (int i=0;i<size_;++i) {
+				if (indices[i]<0 || indices[i]>=size_) {
+					throw FLANNException("The index file does not match the dataset");
+				}
+			}
+
+			int count;
+			load_value(stream, count);
+			if (count<1) {
+				throw FLANNException("Invalid tree in the index file");
+			}
+			vector<NodeRecord> nodes(count);
+			load_value(stream, nodes[0], count);
+
+			root_pivot = new float[veclen_];
+			memoryCounter += veclen_*sizeof(float);
+			load_value(stream, *root_pivot, veclen_);
+
+			int internal = 0;
+			for (int i=0;i<count;++i) {
+				if (nodes[i].children>=0) {
+					internal++;
+				}
+			}
+			size_t block = (size_t)branching*veclen_;
+			if (internal>0) {
+				loaded_pivots = allocate_aligned<float>(internal*block);
+				memoryCounter += internal*block*sizeof(float);
+				load_value(stream, *loaded_pivots, internal*block);
+			}
+
+			KMeansNode base = pool.allocate<KMeansNodeSt>(count);
+			float* pivots = loaded_pivots;
+			for (int i=0;i<count;++i) {
+				const NodeRecord& r = nodes[i];
+				KMeansNode node = base+i;
+				node->radius = r.radius;
+				node->mean_radius = r.mean_radius;
+				node->variance = r.variance;
+				node->size = r.size;
+				node->level = r.level;
+				if (r.children<0) {
+					if (r.size<0 || r.indices<0 || r.indices>size_-r.size) {
+						throw FLANNException("Invalid tree in the index file");
+					}
+					node->indices = indices+r.indices;
+					node->childs = NULL;
+					node->child_pivots = NULL;
+				}
+				else {
+					if (r.children<=i || r.children>count-branching) {
+						throw FLANNException("Invalid tree in the index file");
+					}
+					node->indices = NULL;
+					node->childs = pool.allocate<KMeansNode>(branching);
+					node->child_pivots = pivots;
+					for (int k=0;k<branching;++k) {
+						node->childs[k] = base+r.children+k;
+						node->childs[k]->pivot = pivots+k*veclen_;
+					}
+					pivots += block;
+				}
+			}
+			root = base;
+			root->pivot = root_pivot;
+		}
+		catch (...) {
+			delete[] indices;
+			indices = NULL;
+			delete[] root_pivot;
+			if (loaded_pivots!=NULL) {
+				free_aligned(loaded_pivots);
+				loaded_pivots = NULL;
+			}
+			memoryCounter = memory;
+			throw;
+		}
+	}
+
+
     /** 
      * Find set of nearest neighbors to vec. Their indices are stored inside
      * the result object. 
@@ -491,41 +784,32 @@ public:
      * Params:
      *     result = the result object in which the indices of the nearest-neighbors are stored 
      *     vec = the vector for which to search the nearest neighbors
-     *     searchParams = parameters that influence the search algorithm (checks, cb_index)
+     *     searchParams = parameters that influence the search algorithm (checks)
+     *     context = search context created by createSearchContext
      */
-    void findNeighbors(ResultSet& result, float* vec, Params searchParams)
+    void findNeighbors(ResultSet& result, float* vec, const SearchParams& searchParams, SearchContext& context) const
     {
-        int maxChecks;
-        float cb_index;
-        if (searchParams.find("checks") == searchParams.end()) {
-            maxChecks = -1;
-        }
-        else {            
-            maxChecks = (int)searchParams["checks"];
-        }
+        KMeansContext& c = static_cast<KMeansContext&>(context);
 
-        if (searchParams.find("cb_index") != searchParams.end()) {
-            cb_index = (float)searchParams["cb_index"];
-        }
+        search(c, result, vec, searchParams.checks);
+    }
 
-        
-        if (maxChecks<0) {
-            findExactNN(root, result, vec);
-        }
-        else {
-            heap->clear();           
-            int checks = 0;         
-            
-            findNN(root, result, vec, checks, maxChecks);
-            
-            BranchSt branch;
-            while (heap->popMin(branch) && (checks<maxChecks || !result.full())) {
-                KMeansNode node = branch.node;      
-                findNN(node, result, vec, checks, maxChecks);
-            }
-            assert(result.full());
-        }
-        
+
+    bool findNearest(float* vec, const SearchParams& searchParams, SearchContext& context, int& index, float& dist) const
+    {
+        KMeansContext& c = static_cast<KMeansContext&>(context);
+        SingleResultSet result(vec, veclen_);
+
+        search(c, result, vec, searchParams.checks);
+        index = result.getNeighbor();
+        dist = result.getDistance();
+        return true;
+    }
+
+
+    SearchContext* createSearchContext() const
+    {
+        return new KMeansContext(size_, branching);
     }
 
 
@@ -567,6 +851,58 @@ public:
         return clusterCount;
     }
 
+    /**
+     * Returns: the branching factor of the tree
+     */
+    int getBranching() const
+    {
+        return branching;
+    }
+
+
+    /**
+     * Flattens the tree, for descending it without the index (vocabulary
+     * trees). The nodes are numbered in breadth-first order, as in saveIndex,
+     * so the children of a node are consecutive.
+     * Params:
+     *     levels = the nodes at this depth (the root is at depth 0) are made
+     *         terminal, <=0 for the whole tree
+     *     children = output, the number of the first child of each node,
+     *         -1 for the terminal nodes
+     *     pivots = output, the branching x veclen block of children centers
+     *         of each non-terminal node, in the order of the nodes
+     * Returns: number of nodes
+     */
+    int getTree(int levels, vector<int>& children, vector<float>& pivots) const
+    {
+        if (root==NULL) {
+            throw FLANNException("The index is not built");
+        }
+        children.clear();
+        pivots.clear();
+
+        vector<KMeansNode> order;
+        vector<int> depth;
+        order.push_back(root);
+        depth.push_back(0);
+        for (size_t i=0;i<order.size();++i) {
+            KMeansNode node = order[i];
+            if (node->childs==NULL || (levels>0 && depth[i]==levels)) {
+                children.push_back(-1);
+            }
+            else {
+                children.push_back((int)order.size());
+                for (int k=0;k<branching;++k) {
+                    order.push_back(node->childs[k]);
+                    depth.push_back(depth[i]+1);
+                }
+                pivots.insert(pivots.end(), node->child_pivots, node->child_pivots+branching*veclen_);
+            }
+        }
+        return (int)order.size();
+    }
+
+
     Params estimateSearchParams(float precision, Dataset<float>* testset = NULL)
     {
         Params params;
@@ -580,15 +916,15 @@ private:
 
 
     /**
-    * Helper function
+    * Helper function. Releases the blocks with the children centers.
     */
     void free_centers(KMeansNode node) 
     {
-        delete[] node->pivot;
         if (node->childs!=NULL) {
             for (int k=0;k<branching;++k) {
                 free_centers(node->childs[k]);
             }
+            free_aligned(node->child_pivots);
         }
     }
 
@@ -660,6 +996,7 @@ private:
 			node->indices = indices;
             sort(node->indices,node->indices+indices_length);
             node->childs = NULL;
+            node->child_pivots = NULL;
 			return;
 		}
 		
@@ -671,6 +1008,7 @@ private:
             node->indices = indices;
             sort(node->indices,node->indices+indices_length);
             node->childs = NULL;
+            node->child_pivots = NULL;
 			return;
 		}
 		
@@ -685,13 +1023,154 @@ private:
 		
 	 	float* radiuses = new float[branching];
 		int* count = new int[branching];
+		int* belongs_to = new int[indices_length];
+
+		if (assign_algorithm==KMEANS_ASSIGN_BLOCKED) {
+			iterateBlocked(indices, indices_length, dcenters, belongs_to, count, radiuses);
+		}
+		else if (assign_algorithm==KMEANS_ASSIGN_HAMERLY) {
+			iterateHamerly(indices, indices_length, dcenters, belongs_to, count, radiuses);
+		}
+		else {
+			iterateLloyd(indices, indices_length, dcenters, belongs_to, count, radiuses);
+		}
+        
+        // the children centers are kept together so that they can be
+        // compared against a query in one pass
+        float* centers = allocate_aligned<float>(branching*veclen_);
+
+        for (int i=0; i<branching; ++i) {
+            for (int k=0; k<veclen_; ++k) {
+                centers[i*veclen_+k] = dcenters[i][k];
+            }
+ 		}	
+        node->child_pivots = centers;
+	
+
+		{
+			lock_guard<mutex> guard(build_lock);
+			memoryCounter += branching*veclen_*sizeof(float);
+			node->childs = pool.allocate<KMeansNode>(branching);
+			for (int c=0;c<branching;++c) {
+				node->childs[c] = pool.allocate<KMeansNodeSt>();
+			}
+		}
+
+		// seeds for the random state of the subtrees, drawn before any of them
+		// is built so that the tree doesn't depend on the number of threads
+		unsigned int* seeds = new unsigned int[branching];
+		for (int c=0;c<branching;++c) {
+			seeds[c] = (unsigned int)rand_double(4294967296.0);
+		}
+
+		// compute kmeans clustering for each of the resulting clusters
+		int start = 0;
+		int end = start;
+		for (int c=0;c<branching;++c) {
+			int s = count[c];
+
+			float variance = 0;
+			float mean_radius =0;
+			// the points before start belong to the previous clusters (and may
+			// already be reordered by their subtree)
+			for (int i=start;i<indices_length;++i) {
+				if (belongs_to[i]==c) {
+					float d = squared_dist(dataset[indices[i]], veclen_);
+					variance += d;
+					mean_radius += sqrt(d);
+					swap(indices[i],indices[end]);
+					swap(belongs_to[i],belongs_to[end]);
+					end++;
+				}
+			}
+			variance /= s;
+			mean_radius /= s;
+			variance -= squared_dist(centers+c*veclen_,veclen_);
+			
+			node->childs[c]->radius = radiuses[c];
+			node->childs[c]->pivot = centers+c*veclen_;
+			node->childs[c]->variance = variance;
+			node->childs[c]->mean_radius = mean_radius;
+			buildSubtree(node->childs[c],indices+start, end-start, level+1, seeds[c]);
+			start=end;
+		}
+
+		delete[] seeds;
+		delete[] radiuses;
+		delete[] count;
+		delete[] belongs_to;
+	}
+	
+	
+	
+	/**
+	 * Task building the subtree of a node.
+	 */
+	class ClusteringTask : public Task
+	{
+		KMeansTree& tree;
+		KMeansNode node;
+		int* indices;
+		int indices_length;
+		int level;
+		unsigned int seed;
+
+	public:
+		ClusteringTask(KMeansTree& tree_, KMeansNode node_, int* indices_, int indices_length_, int level_, unsigned int seed_) :
+			tree(tree_), node(node_), indices(indices_), indices_length(indices_length_), level(level_), seed(seed_)
+		{
+		}
+
+		void run()
+		{
+			seed_random(seed);
+			tree.computeClustering(node, indices, indices_length, tree.branching, level);
+		}
+	};
+
+
+	/**
+	 * Builds the subtree of a child node. Large subtrees are built by a 
+	 * separate task when the build uses several threads.
+	 * 
+	 * Params:
+	 *     node = the child node
+	 *     indices = indices of the points belonging to the child
+	 *     level = level of the child
+	 *     seed = seed for the random state used by the subtree
+	 */
+	void buildSubtree(KMeansNode node, int* indices, int indices_length, int level, unsigned int seed)
+	{
+		if (workers->size()>1 && indices_length>=TASK_MIN_POINTS) {
+			workers->spawn(new ClusteringTask(*this, node, indices, indices_length, level, seed), *build_tasks);
+		}
+		else {
+			seed_random(seed);
+			computeClustering(node, indices, indices_length, branching, level);
+		}
+	}
+
+
+	/**
+	 * Standard k-means (Lloyd) iterations: each point is compared against
+	 * every center and the centers are recomputed from the assignment.
+	 * 
+	 * Params:
+	 *     indices = indices of the points to cluster
+	 *     indices_length = number of points
+	 *     dcenters = the initial centers, on return the final centers
+	 *     belongs_to = output, the center each point is assigned to
+	 *     count = output, number of points assigned to each center
+	 *     radiuses = output, squared radius of each cluster
+	 */
+	void iterateLloyd(int* indices, int indices_length, Dataset<double>& dcenters, int* belongs_to, int* count, float* radiuses)
+	{
         for (int i=0;i<branching;++i) {
             radiuses[i] = 0;
             count[i] = 0;
         }
 		
         //	assign points to clusters
-		int* belongs_to = new int[indices_length];
 		for (int i=0;i<indices_length;++i) {
 
 			float sq_dist = squared_dist(dataset[indices[i]],dcenters[0], veclen_); 
@@ -757,80 +1236,502 @@ private:
 				}
 			}
 			
+			if (fillEmptyClusters(indices, indices_length, belongs_to, count, NULL)) {
+				converged = false;
+			}
+		}
+	}
+
+
+	/**
+	 * K-means iterations using a blocked assignment step. The distances are
+	 * expanded as ||x||^2 + ||c||^2 - 2x.c, with the point norms computed once
+	 * and the dot products obtained with a matrix multiply between a tile of
+	 * ASSIGN_TILE points and blocks of ASSIGN_TILE centers. The sums used for
+	 * the new centers are accumulated while the tile is in cache, so the
+	 * points are read only once per iteration.
+	 * 
+	 * Same parameters and results as iterateLloyd, up to the rounding of 
+	 * the distances.
+	 */
+	void iterateBlocked(int* indices, int indices_length, Dataset<double>& dcenters, int* belongs_to, int* count, float* radiuses)
+	{
+		double* point_norms = new double[indices_length];
+		for (int i=0;i<indices_length;++i) {
+			point_norms[i] = squared_dist(dataset[indices[i]], veclen_);
+		}
+		Dataset<double> sums(branching, veclen_);
+		
+		assignBlocked(indices, indices_length, point_norms, dcenters, sums, belongs_to, count, radiuses, true);
+
+		bool converged = false;
+		int iteration = 0;
+		while (!converged && iteration<max_iter) {
+			converged = true;
+			iteration++;
+
+			// compute the new cluster centers
 			for (int i=0;i<branching;++i) {
-				// if one cluster converges to an empty cluster,
-				// move an element into that cluster
-				if (count[i]==0) {
-					int j = (i+1)%branching;
-					while (count[j]<=1) {
-						j = (j+1)%branching;
-					}					
-					
-					for (int k=0;k<indices_length;++k) {
-						if (belongs_to[k]==j) {
-							belongs_to[k] = i;
-							count[j]--;
-							count[i]++;
-							break;
-						}
+				int cnt = count[i];
+				for (int k=0;k<veclen_;++k) {
+					dcenters[i][k] = sums[i][k] / cnt;
+				}
+			}
+
+			// reassign points to clusters
+			if (assignBlocked(indices, indices_length, point_norms, dcenters, sums, belongs_to, count, radiuses, false)) {
+				converged = false;
+			}
+			if (fillEmptyClusters(indices, indices_length, belongs_to, count, &sums)) {
+				converged = false;
+			}
+		}
+
+		delete[] point_norms;
+	}
+
+
+	/**
+	 * Data of a blocked assignment pass shared by all its chunks.
+	 */
+	struct AssignPass {
+		int* indices;
+		double* point_norms;
+		float* centers;
+		double* center_norms;
+		int* belongs_to;
+		bool first;
+	};
+
+	/**
+	 * A range of points assigned in a blocked assignment pass, with the
+	 * sums, counts and radiuses of the clusters computed from them.
+	 */
+	struct AssignChunk {
+		int start;
+		int end;
+		double* sums;
+		int* count;
+		float* radiuses;
+		bool changed;
+	};
+
+	/**
+	 * Task assigning one chunk of the points.
+	 */
+	class AssignTask : public Task
+	{
+		KMeansTree& tree;
+		const AssignPass& pass;
+		AssignChunk& chunk;
+
+	public:
+		AssignTask(KMeansTree& tree_, const AssignPass& pass_, AssignChunk& chunk_) :
+			tree(tree_), pass(pass_), chunk(chunk_)
+		{
+		}
+
+		void run()
+		{
+			tree.assignBlockedRange(pass, chunk);
+		}
+	};
+
+
+	/**
+	 * One blocked assignment pass, see iterateBlocked. In the large nodes
+	 * the points are split in chunks of ASSIGN_CHUNK points assigned by 
+	 * separate tasks, and the per chunk results are added in order.
+	 * 
+	 * Params:
+	 *     sums = output, sum of the points assigned to each center
+	 *     first = true if belongs_to doesn't contain an assignment yet
+	 * Returns: true if any point changed its cluster
+	 */
+	bool assignBlocked(int* indices, int indices_length, double* point_norms, Dataset<double>& dcenters, Dataset<double>& sums,
+						int* belongs_to, int* count, float* radiuses, bool first)
+	{
+		AssignPass pass;
+		pass.indices = indices;
+		pass.point_norms = point_norms;
+		pass.centers = allocate_aligned<float>(branching*veclen_);
+		pass.center_norms = new double[branching];
+		pass.belongs_to = belongs_to;
+		pass.first = first;
+
+		for (int i=0;i<branching;++i) {
+			for (int k=0;k<veclen_;++k) {
+				pass.centers[i*veclen_+k] = (float)dcenters[i][k];
+			}
+			pass.center_norms[i] = squared_dist(pass.centers+i*veclen_, veclen_);
+		}
+
+		bool changed = false;
+		if (indices_length<2*ASSIGN_CHUNK) {
+			AssignChunk chunk;
+			chunk.start = 0;
+			chunk.end = indices_length;
+			chunk.sums = sums.data;
+			chunk.count = count;
+			chunk.radiuses = radiuses;
+			assignBlockedRange(pass, chunk);
+			changed = chunk.changed;
+		}
+		else {
+			int chunks = (indices_length+ASSIGN_CHUNK-1)/ASSIGN_CHUNK;
+			AssignChunk* parts = new AssignChunk[chunks];
+			TaskGroup group;
+			for (int c=0;c<chunks;++c) {
+				parts[c].start = c*ASSIGN_CHUNK;
+				parts[c].end = min(indices_length, (c+1)*ASSIGN_CHUNK);
+				parts[c].sums = new double[branching*veclen_];
+				parts[c].count = new int[branching];
+				parts[c].radiuses = new float[branching];
+				workers->spawn(new AssignTask(*this, pass, parts[c]), group);
+			}
+			workers->wait(group);
+
+			for (int i=0;i<branching;++i) {
+				memset(sums[i],0,sizeof(double)*veclen_);
+				radiuses[i] = 0;
+				count[i] = 0;
+			}
+			for (int c=0;c<chunks;++c) {
+				for (int i=0;i<branching*veclen_;++i) {
+					sums.data[i] += parts[c].sums[i];
+				}
+				for (int i=0;i<branching;++i) {
+					count[i] += parts[c].count[i];
+					radiuses[i] = max(radiuses[i], parts[c].radiuses[i]);
+				}
+				changed = changed || parts[c].changed;
+
+				delete[] parts[c].sums;
+				delete[] parts[c].count;
+				delete[] parts[c].radiuses;
+			}
+			delete[] parts;
+		}
+
+		free_aligned(pass.centers);
+		delete[] pass.center_norms;
+
+		return changed;
+	}
+
+
+	/**
+	 * Assigns the points of one chunk to the closest center, see assignBlocked.
+	 */
+	void assignBlockedRange(const AssignPass& pass, AssignChunk& chunk)
+	{
+		float* points = allocate_aligned<float>(ASSIGN_TILE*veclen_);
+		float* dots = new float[ASSIGN_TILE*branching];
+		int* indices = pass.indices;
+		double* point_norms = pass.point_norms;
+		float* centers = pass.centers;
+		double* center_norms = pass.center_norms;
+		int* belongs_to = pass.belongs_to;
+		int* count = chunk.count;
+		float* radiuses = chunk.radiuses;
+
+		memset(chunk.sums,0,sizeof(double)*branching*veclen_);
+		for (int i=0;i<branching;++i) {
+			radiuses[i] = 0;
+			count[i] = 0;
+		}
+
+		bool changed = false;
+		for (int start=chunk.start; start<chunk.end; start+=ASSIGN_TILE) {
+			int n = min(ASSIGN_TILE, chunk.end-start);
+			for (int p=0;p<n;++p) {
+				memcpy(points+p*veclen_, dataset[indices[start+p]], veclen_*sizeof(float));
+			}
+			for (int c=0; c<branching; c+=ASSIGN_TILE) {
+				dot_block(points, n, centers+c*veclen_, min(ASSIGN_TILE, branching-c), veclen_, dots+c, branching);
+			}
+
+			for (int p=0;p<n;++p) {
+				int i = start+p;
+				float* d = dots+p*branching;
+				double best_dist = point_norms[i] + center_norms[0] - 2*d[0];
+				int best = 0;
+				for (int j=1;j<branching;++j) {
+					double dist = point_norms[i] + center_norms[j] - 2*d[j];
+					if (best_dist>dist) {
+						best = j;
+						best_dist = dist;
 					}
-					converged = false;
 				}
+				float sq_dist = best_dist>0 ? (float)best_dist : 0;
+				if (sq_dist>radiuses[best]) {
+					radiuses[best] = sq_dist;
+				}
+				if (!pass.first && best!=belongs_to[i]) {
+					changed = true;
+				}
+				belongs_to[i] = best;
+				count[best]++;
+
+				float* vec = points+p*veclen_;
+				double* sum = chunk.sums+best*veclen_;
+				for (int k=0;k<veclen_;++k) {
+					sum[k] += vec[k];
+				}
+			}
+		}
+		chunk.changed = changed;
+
+		free_aligned(points);
+		delete[] dots;
+	}
+
+
+	/**
+	 * K-means iterations accelerated with Hamerly's bounds:
+	 * Hamerly, Greg - Making k-means even faster (SDM 2010)
+	 * 
+	 * For each point an upper bound of the distance to its center and a lower
+	 * bound of the distance to all the other centers are kept and updated with
+	 * how much the centers moved. A point is only compared against all the
+	 * centers when the bounds can't prove that its assignment is unchanged,
+	 * which after the first iterations is the case for few points.
+	 * 
+	 * Same parameters and results as iterateLloyd, up to the rounding of 
+	 * the distances.
+	 */
+	void iterateHamerly(int* indices, int indices_length, Dataset<double>& dcenters, int* belongs_to, int* count, float* radiuses)
+	{
+		float* centers = allocate_aligned<float>(branching*veclen_);
+		float* dists = new float[branching];
+		double* upper = new double[indices_length];
+		double* lower = new double[indices_length];
+		double* drift = new double[branching];
+		double* half_gap = new double[branching];
+		Dataset<double> sums(branching, veclen_);
+
+		for (int j=0;j<branching;++j) {
+			for (int k=0;k<veclen_;++k) {
+				centers[j*veclen_+k] = (float)dcenters[j][k];
 			}
+			memset(sums[j],0,sizeof(double)*veclen_);
+			count[j] = 0;
+		}
 
+		//	assign points to clusters
+		for (int i=0;i<indices_length;++i) {
+			float* vec = dataset[indices[i]];
+			int best = closestTwoCenters(vec, centers, dists, upper[i], lower[i]);
+			belongs_to[i] = best;
+			count[best]++;
+			double* sum = sums[best];
+			for (int k=0;k<veclen_;++k) {
+				sum[k] += vec[k];
+			}
 		}
-        
-        float** centers = new float*[branching];
 
-        for (int i=0; i<branching; ++i) {
- 			centers[i] = new float[veclen_];
- 			memoryCounter += veclen_*sizeof(float);
-            for (int k=0; k<veclen_; ++k) {
-                centers[i][k] = dcenters[i][k];
-            }
- 		}	
-	
+		bool converged = false;
+		int iteration = 0;
+		while (!converged && iteration<max_iter) {
+			converged = true;
+			iteration++;
 
-		// compute kmeans clustering for each of the resulting clusters
-		node->childs = pool.allocate<KMeansNode>(branching);
-		int start = 0;
-		int end = start;
-		for (int c=0;c<branching;++c) {
-			int s = count[c];
+			// compute the new cluster centers and how much they moved
+			int max_drift = 0;
+			int second_drift = 1;
+			for (int j=0;j<branching;++j) {
+				int cnt = count[j];
+				double move = 0;
+				for (int k=0;k<veclen_;++k) {
+					double c = sums[j][k] / cnt;
+					double diff = c - dcenters[j][k];
+					move += diff*diff;
+					dcenters[j][k] = c;
+					centers[j*veclen_+k] = (float)c;
+				}
+				drift[j] = sqrt(move);
+				if (j>0) {
+					if (drift[j]>drift[max_drift]) {
+						second_drift = max_drift;
+						max_drift = j;
+					}
+					else if (j==1 || drift[j]>drift[second_drift]) {
+						second_drift = j;
+					}
+				}
+			}
 
-			float variance = 0;
-			float mean_radius =0;
+			// half of the distance from each center to the closest other center
+			for (int j=0;j<branching;++j) {
+				half_gap[j] = numeric_limits<double>::max();
+			}
+			for (int j=0;j<branching;++j) {
+				for (int l=j+1;l<branching;++l) {
+					double gap = sqrt(squared_dist(centers+j*veclen_, centers+l*veclen_, veclen_)) / 2;
+					half_gap[j] = min(half_gap[j], gap);
+					half_gap[l] = min(half_gap[l], gap);
+				}
+			}
+
+			// reassign points to clusters
 			for (int i=0;i<indices_length;++i) {
-				if (belongs_to[i]==c) {
-					float d = squared_dist(dataset[indices[i]], veclen_);
-					variance += d;
-					mean_radius += sqrt(d);
-					swap(indices[i],indices[end]);
-					swap(belongs_to[i],belongs_to[end]);
-					end++;
+				int a = belongs_to[i];
+				upper[i] += drift[a];
+				lower[i] -= (a==max_drift) ? drift[second_drift] : drift[max_drift];
+
+				double bound = max(half_gap[a], lower[i]);
+				if (upper[i]<=bound) continue;
+
+				float* vec = dataset[indices[i]];
+				upper[i] = sqrt(squared_dist(vec, centers+a*veclen_, veclen_));
+				if (upper[i]<=bound) continue;
+
+				int best = closestTwoCenters(vec, centers, dists, upper[i], lower[i]);
+				if (best!=a) {
+					count[a]--;
+					count[best]++;
+					double* from = sums[a];
+					double* to = sums[best];
+					for (int k=0;k<veclen_;++k) {
+						from[k] -= vec[k];
+						to[k] += vec[k];
+					}
+					belongs_to[i] = best;
+
+					converged = false;
 				}
 			}
-			variance /= s;
-			mean_radius /= s;
-			variance -= squared_dist(centers[c],veclen_);
-			
-			node->childs[c] = pool.allocate<KMeansNodeSt>();
-			node->childs[c]->radius = radiuses[c];
-			node->childs[c]->pivot = centers[c];
-			node->childs[c]->variance = variance;
-			node->childs[c]->mean_radius = mean_radius;
-			computeClustering(node->childs[c],indices+start, end-start, branching, level+1);
-			start=end;
+
+			if (fillEmptyClusters(indices, indices_length, belongs_to, count, &sums)) {
+				// the bounds of the moved points are no longer valid
+				for (int i=0;i<indices_length;++i) {
+					upper[i] = numeric_limits<double>::max();
+					lower[i] = 0;
+				}
+				converged = false;
+			}
 		}
 
-		delete[] centers;
-		delete[] radiuses;
-		delete[] count;
-		delete[] belongs_to;
+		// the bounds are not tight, compute the radiuses from the actual distances
+		for (int j=0;j<branching;++j) {
+			radiuses[j] = 0;
+		}
+		for (int i=0;i<indices_length;++i) {
+			int a = belongs_to[i];
+			float sq_dist = squared_dist(dataset[indices[i]], centers+a*veclen_, veclen_);
+			if (sq_dist>radiuses[a]) {
+				radiuses[a] = sq_dist;
+			}
+		}
+
+		free_aligned(centers);
+		delete[] dists;
+		delete[] upper;
+		delete[] lower;
+		delete[] drift;
+		delete[] half_gap;
+	}
+
+
+	/**
+	 * Helper function for iterateHamerly. Finds the closest center to a point.
+	 * 
+	 * Params:
+	 *     vec = the point
+	 *     centers = block with the centers
+	 *     dists = scratch array with branching elements
+	 *     closest = output, distance to the closest center
+	 *     second = output, distance to the second closest center
+	 * Returns: index of the closest center
+	 */
+	int closestTwoCenters(float* vec, float* centers, float* dists, double& closest, double& second)
+	{
+		squared_dist_many(vec, centers, branching, veclen_, dists);
+
+		int best = 0;
+		float best_dist = dists[0];
+		float second_dist = numeric_limits<float>::max();
+		for (int j=1;j<branching;++j) {
+			if (best_dist>dists[j]) {
+				second_dist = best_dist;
+				best_dist = dists[j];
+				best = j;
+			}
+			else if (second_dist>dists[j]) {
+				second_dist = dists[j];
+			}
+		}
+		closest = sqrt(best_dist);
+		second = sqrt(second_dist);
+		return best;
+	}
+
+
+	/**
+	 * If one cluster converges to an empty cluster, moves an element into 
+	 * that cluster.
+	 * 
+	 * Params:
+	 *     sums = if not NULL, the per cluster sums of the points are updated too
+	 * Returns: true if any point was moved
+	 */
+	bool fillEmptyClusters(int* indices, int indices_length, int* belongs_to, int* count, Dataset<double>* sums)
+	{
+		bool moved = false;
+		for (int i=0;i<branching;++i) {
+			if (count[i]==0) {
+				int j = (i+1)%branching;
+				while (count[j]<=1) {
+					j = (j+1)%branching;
+				}					
+				
+				for (int k=0;k<indices_length;++k) {
+					if (belongs_to[k]==j) {
+						belongs_to[k] = i;
+						count[j]--;
+						count[i]++;
+						if (sums!=NULL) {
+							float* vec = dataset[indices[k]];
+							for (int l=0;l<veclen_;++l) {
+								(*sums)[j][l] -= vec[l];
+								(*sums)[i][l] += vec[l];
+							}
+						}
+						break;
+					}
+				}
+				moved = true;
+			}
+		}
+		return moved;
 	}
 	
 	
-	
+	/**
+	 * Searches the tree for the neighbors of vec, exactly if maxChecks<0.
+	 */
+	template <typename Result>
+	void search(KMeansContext& c, Result& result, float* vec, int maxChecks) const
+	{
+		if (maxChecks<0) {
+			findExactNN(c, root, result, vec);
+		}
+		else {
+			c.heap.clear();
+			int checks = 0;
+
+			findNN(c, root, result, vec, checks, maxChecks);
+
+			BranchSt branch;
+			while (c.heap.popMin(branch) && (checks<maxChecks || !result.full())) {
+				KMeansNode node = branch.node;
+				findNN(c, node, result, vec, checks, maxChecks);
+			}
+			assert(result.full());
+		}
+	}
+
+
 	/**
 	 * Performs one descent in the hierarchical k-means tree. The branches not
 	 * visited are stored in a priority queue.
@@ -844,7 +1745,8 @@ private:
      */
 
 
-	void findNN(KMeansNode node, ResultSet& result, float* vec, int& checks, int maxChecks)
+	template <typename Result>
+	void findNN(KMeansContext& c, KMeansNode node, Result& result, float* vec, int& checks, int maxChecks) const
 	{
 		// Ignore those clusters that are too far away
 		{
@@ -871,8 +1773,8 @@ private:
 			}
 		} 
 		else {
-			int closest_center = exploreNodeBranches(node, vec);			
-			findNN(node->childs[closest_center],result,vec, checks, maxChecks);
+			int closest_center = exploreNodeBranches(c, node, vec);			
+			findNN(c, node->childs[closest_center],result,vec, checks, maxChecks);
 		}		
 	}
 	
@@ -884,13 +1786,14 @@ private:
 	 *     distances = array with the distances to each child node.
 	 * Returns:
 	 */	
-	int exploreNodeBranches(KMeansNode node, float* q)
+	int exploreNodeBranches(KMeansContext& c, KMeansNode node, float* q) const
 	{
-		
+		float* domain_distances = c.domain_distances;
+
+		squared_dist_many(q, node->child_pivots, branching, veclen_, domain_distances);
+
 		int best_index = 0;
-		domain_distances[best_index] = squared_dist(q,node->childs[best_index]->pivot, veclen_); 
 		for (int i=1;i<branching;++i) {
-			domain_distances[i] = squared_dist(q,node->childs[i]->pivot,veclen_);
 			if (domain_distances[i]<domain_distances[best_index]) {
 				best_index = i;
 			}
@@ -905,7 +1808,7 @@ private:
 //				if (domain_distances[i]<dist_to_border) {
 //					domain_distances[i] = dist_to_border;
 //				}
-				heap->insert(BranchSt::make_branch(node->childs[i],domain_distances[i]));
+				c.heap.insert(BranchSt::make_branch(node->childs[i],domain_distances[i]));
 			}
 		}
 		
@@ -916,7 +1819,8 @@ private:
 	/**
 	 * Function the performs exact nearest neighbor search by traversing the entire tree. 
 	 */
-	void findExactNN(KMeansNode node, ResultSet& result, float* vec)
+	template <typename Result>
+	void findExactNN(KMeansContext& c, KMeansNode node, Result& result, float* vec) const
 	{
 		// Ignore those clusters that are too far away
 		{
@@ -942,10 +1846,10 @@ private:
 		else {
 			int* sort_indices = new int[branching];
 			
-			getCenterOrdering(node, vec, sort_indices);
+			getCenterOrdering(c, node, vec, sort_indices);
 
 			for (int i=0; i<branching; ++i) {
- 				findExactNN(node->childs[sort_indices[i]],result,vec);
+ 				findExactNN(c, node->childs[sort_indices[i]],result,vec);
 			}
 
 			delete[] sort_indices;
@@ -958,18 +1862,19 @@ private:
 	 * 
 	 * I computes the order in which to traverse the child nodes of a particular node.
 	 */
-	void getCenterOrdering(KMeansNode node, float* q, int* sort_indices)
+	void getCenterOrdering(KMeansContext& c, KMeansNode node, float* q, int* sort_indices) const
 	{
+		float* domain_distances = c.domain_distances;
+		squared_dist_many(q, node->child_pivots, branching, veclen_, domain_distances);
+
 		for (int i=0;i<branching;++i) {
-			float dist = squared_dist(q,node->childs[i]->pivot,veclen_);
+			float dist = domain_distances[i];
 			
 			int j=0;
-			while (domain_distances[j]<dist && j<i) j++;
+			while (j<i && domain_distances[sort_indices[j]]<dist) j++;
 			for (int k=i;k>j;--k) {
-				domain_distances[k] = domain_distances[k-1];
 				sort_indices[k] = sort_indices[k-1];
 			}
-			domain_distances[j] = dist;
 			sort_indices[j] = i;
 		}		
 	}	
@@ -40,7 +40,21 @@ public:
 		/* nothing to do here for linear search */
 	}
 
-	void findNeighbors(ResultSet& resultSet, float* vec, Params searchParams) 
+	void saveIndex(FILE* stream)
+	{
+		/* the dataset is the whole index */
+	}
+
+	void loadIndex(FILE* stream)
+	{
+	}
+
+	SearchContext* createSearchContext() const
+	{
+		return new SearchContext();
+	}
+
+	void findNeighbors(ResultSet& resultSet, float* vec, const SearchParams& searchParams, SearchContext& context) const
 	{
 		for (int i=0;i<dataset.rows;++i) {
 			resultSet.addPoint(dataset[i],i);
@@ -18,6 +18,7 @@ IndexRegistryEntry* register_index_creator(const char* name, IndexCreator creato
         node->creator = creator;
         node->next  = root;
         root = node;
+        return node;
     }
 }
 
@@ -3,8 +3,11 @@
 
 #include "../util/common.h"
 #include "../util/Dataset.h"
+#include <stdio.h>
 #include <map>
 #include <string>
+#include <vector>
+#include <mutex>
 
 // #include <stdio.h>
 
@@ -25,14 +28,58 @@ namespace {\
 
 class ResultSet;
 
+
+/**
+ * The parameters of a search, given to the indices with each query. A
+ * plain struct passed by reference: the Params map is only used for the
+ * build of the indices and by the autotuning.
+ */
+struct SearchParams
+{
+    /**
+     * Number of points checked (the leaves of the trees, the codes of
+     * ivfpq) before the search stops, -1 for an exact search.
+     */
+    int checks;
+
+    explicit SearchParams(int checks_ = -1) : checks(checks_)
+    {
+    }
+};
+
+
+/**
+ * The mutable state of a search (priority queue, visited marks, scratch 
+ * buffers). The indices don't change once built, so several threads can 
+ * search the same index at once, each one with its own context.
+ */
+class SearchContext
+{
+public:
+    virtual ~SearchContext() {};
+};
+
+
 /**
  * Nearest-neighbor index base class 
  */
 class NNIndex 
 {
+    /**
+    * Search contexts released by the callers of acquireSearchContext, 
+    * kept for the next searches.
+    */
+    vector<SearchContext*> free_contexts;
+    mutex contexts_lock;
+
 public:
 
-    virtual ~NNIndex() {};
+    virtual ~NNIndex() 
+    {
+        for (size_t i=0;i<free_contexts.size();++i) {
+            delete free_contexts[i];
+        }
+    };
     
 	/**
 		Method responsible with building the index.
@@ -40,9 +87,75 @@ public:
 	virtual void buildIndex() = 0;
 
 	/**
-		Method that searches for nearest-neighbors
+		Saves the structure of a built index (not the dataset) to a stream.
 	*/
-	virtual void findNeighbors(ResultSet& result, float* vec, Params searchParams) = 0;
+	virtual void saveIndex(FILE* stream) = 0;
+
+	/**
+		Loads the structure saved by saveIndex, instead of building the 
+		index. The index must be created over the same dataset.
+	*/
+	virtual void loadIndex(FILE* stream) = 0;
+
+	/**
+		Method that searches for nearest-neighbors. It can be called
+		concurrently, with a different context in each thread.
+
+		Params:
+			context = a search context created by this index
+	*/
+	virtual void findNeighbors(ResultSet& result, float* vec, const SearchParams& searchParams, SearchContext& context) const = 0;
+
+	/**
+		Searches for the single nearest neighbor, without the ResultSet
+		of findNeighbors. It finds the same neighbor as findNeighbors with
+		k=1 and the same parameters.
+
+		Params:
+			vec = the query point
+			searchParams = the parameters of the search
+			context = a search context created by this index
+			index = output, the index of the neighbor
+			dist = output, its squared distance
+		Returns: false if the index has no such search, the caller must
+			use findNeighbors
+	*/
+	virtual bool findNearest(float* vec, const SearchParams& searchParams, SearchContext& context, int& index, float& dist) const
+	{
+		return false;
+	}
+
+	/**
+		Creates a search context for this index. The caller owns it.
+	*/
+	virtual SearchContext* createSearchContext() const = 0;
+
+	/**
+		Returns a search context from the ones released before, or a new
+		one. Avoids allocating the context for each search in the callers 
+		that don't keep their own.
+	*/
+	SearchContext* acquireSearchContext()
+	{
+		{
+			lock_guard<mutex> guard(contexts_lock);
+			if (!free_contexts.empty()) {
+				SearchContext* context = free_contexts.back();
+				free_contexts.pop_back();
+				return context;
+			}
+		}
+		return createSearchContext();
+	}
+
+	/**
+		Gives back a context obtained from acquireSearchContext.
+	*/
+	void releaseSearchContext(SearchContext* context)
+	{
+		lock_guard<mutex> guard(contexts_lock);
+		free_contexts.push_back(context);
+	}
 
 	/**
 		Number of features in this index.
@@ -74,6 +187,35 @@ public:
 
 
 
+/**
+ * Holds a search context acquired from an index until the end of the scope.
+ */
+class ScopedSearchContext
+{
+    NNIndex& index;
+    SearchContext* context;
+
+    ScopedSearchContext(const ScopedSearchContext&);
+    ScopedSearchContext& operator=(const ScopedSearchContext&);
+
+public:
+    ScopedSearchContext(NNIndex& index_) : index(index_), context(index_.acquireSearchContext())
+    {
+    }
+
+    ~ScopedSearchContext()
+    {
+        index.releaseSearchContext(context);
+    }
+
+    SearchContext& operator*()
+    {
+        return *context;
+    }
+};
+
+
+
 typedef NNIndex* (*IndexCreator)(Dataset<float>& dataset, Params indexParams);
 
 struct IndexRegistryEntry
@@ -0,0 +1,641 @@
+/************************************************************************
+ * Distance functions - vectorized kernels
+ *
+ * SSE2, AVX2 and AVX-512 versions of the squared euclidian distance
+ * between float vectors, of the distances from one vector to a 
+ * contiguous block of vectors and of the dot products between two blocks
+ * of vectors (used by the k-means assignment step). The kernel used is 
+ * chosen once at startup
+ * using CPUID, the scalar loop from dist.h is used on other architectures
+ * or if none of the instruction sets is available.
+ *
+ * Version: 1.0
+ *
+ * License: LGPL
+ *
+ *************************************************************************/
+
+#include "../algorithms/dist.h"
+#include <string.h>
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIST_X86
+#define DIST_HAVE_AVX512
+#define DIST_TARGET(isa) __attribute__((target(isa)))
+#include <cpuid.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define DIST_X86
+#if _MSC_VER >= 1910
+#define DIST_HAVE_AVX512
+#endif
+#define DIST_TARGET(isa)
+#include <intrin.h>
+#endif
+
+#ifdef DIST_X86
+#include <immintrin.h>
+#endif
+
+
+namespace {
+
+double squared_dist_scalar(const float* a, const float* b, int length)
+{
+    return squared_dist<const float, const float>(a, b, length);
+}
+
+void squared_dist_many_scalar(const float* q, const float* vecs, int count, int length, float* dists)
+{
+    for (int i=0;i<count;++i) {
+        dists[i] = (float)squared_dist_scalar(q, vecs+i*length, length);
+    }
+}
+
+void dot_block_scalar(const float* a, int rows_a, const float* b, int rows_b, int length, float* dots, int ld)
+{
+    for (int i=0;i<rows_a;++i) {
+        const float* ai = a+i*length;
+        for (int j=0;j<rows_b;++j) {
+            const float* bj = b+j*length;
+            double dot = 0;
+            for (int k=0;k<length;++k) {
+                dot += ai[k]*bj[k];
+            }
+            dots[i*ld+j] = (float)dot;
+        }
+    }
+}
+
+#ifdef DIST_X86
+
+/* Squares of float differences are exact in double, so accumulating
+   them in double lanes only changes the order of the summation. */
+
+DIST_TARGET("sse2")
+double squared_dist_sse2(const float* a, const float* b, int length)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd();
+    __m128d acc3 = _mm_setzero_pd();
+
+    int i = 0;
+    for (; i+8<=length; i+=8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4));
+        __m128d lo0 = _mm_cvtps_pd(d0);
+        __m128d hi0 = _mm_cvtps_pd(_mm_movehl_ps(d0,d0));
+        __m128d lo1 = _mm_cvtps_pd(d1);
+        __m128d hi1 = _mm_cvtps_pd(_mm_movehl_ps(d1,d1));
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(lo0,lo0));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(hi0,hi0));
+        acc2 = _mm_add_pd(acc2, _mm_mul_pd(lo1,lo1));
+        acc3 = _mm_add_pd(acc3, _mm_mul_pd(hi1,hi1));
+    }
+    acc0 = _mm_add_pd(_mm_add_pd(acc0,acc1), _mm_add_pd(acc2,acc3));
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc0);
+    double distsq = lanes[0] + lanes[1];
+
+    /* Process last 0-7 items. */
+    for (; i<length; ++i) {
+        double diff = a[i] - b[i];
+        distsq += diff * diff;
+    }
+    return distsq;
+}
+
+DIST_TARGET("sse2")
+void squared_dist_many_sse2(const float* q, const float* vecs, int count, int length, float* dists)
+{
+    for (int i=0;i<count;++i) {
+        dists[i] = (float)squared_dist_sse2(q, vecs+i*length, length);
+    }
+}
+
+
+/* Horizontal sum of the 4 lanes of each of 4 registers. */
+DIST_TARGET("sse2")
+__m128 hsum4_sse2(__m128 c0, __m128 c1, __m128 c2, __m128 c3)
+{
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    return _mm_add_ps(_mm_add_ps(c0,c1), _mm_add_ps(c2,c3));
+}
+
+/* Dot products of one row of a with 4 rows of b at a time. */
+DIST_TARGET("sse2")
+void dot_block_sse2(const float* a, int rows_a, const float* b, int rows_b, int length, float* dots, int ld)
+{
+    for (int i=0;i<rows_a;++i) {
+        const float* ai = a+i*length;
+        int j = 0;
+        for (; j+4<=rows_b; j+=4) {
+            const float* b0 = b+j*length;
+            const float* b1 = b0+length;
+            const float* b2 = b1+length;
+            const float* b3 = b2+length;
+            __m128 c0 = _mm_setzero_ps(), c1 = _mm_setzero_ps();
+            __m128 c2 = _mm_setzero_ps(), c3 = _mm_setzero_ps();
+            int k = 0;
+            for (; k+4<=length; k+=4) {
+                __m128 ak = _mm_loadu_ps(ai+k);
+                c0 = _mm_add_ps(c0, _mm_mul_ps(ak, _mm_loadu_ps(b0+k)));
+                c1 = _mm_add_ps(c1, _mm_mul_ps(ak, _mm_loadu_ps(b1+k)));
+                c2 = _mm_add_ps(c2, _mm_mul_ps(ak, _mm_loadu_ps(b2+k)));
+                c3 = _mm_add_ps(c3, _mm_mul_ps(ak, _mm_loadu_ps(b3+k)));
+            }
+            float out[4];
+            _mm_storeu_ps(out, hsum4_sse2(c0, c1, c2, c3));
+            for (; k<length; ++k) {
+                out[0] += ai[k]*b0[k];
+                out[1] += ai[k]*b1[k];
+                out[2] += ai[k]*b2[k];
+                out[3] += ai[k]*b3[k];
+            }
+            for (int jj=0;jj<4;++jj) {
+                dots[i*ld+j+jj] = out[jj];
+            }
+        }
+        if (j<rows_b) {
+            dot_block_scalar(ai, 1, b+j*length, rows_b-j, length, dots+i*ld+j, ld);
+        }
+    }
+}
+
+
+DIST_TARGET("avx2,fma")
+double squared_dist_avx2(const float* a, const float* b, int length)
+{
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd();
+    __m256d acc3 = _mm256_setzero_pd();
+
+    int i = 0;
+    for (; i+16<=length; i+=16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8));
+        __m256d lo0 = _mm256_cvtps_pd(_mm256_castps256_ps128(d0));
+        __m256d hi0 = _mm256_cvtps_pd(_mm256_extractf128_ps(d0,1));
+        __m256d lo1 = _mm256_cvtps_pd(_mm256_castps256_ps128(d1));
+        __m256d hi1 = _mm256_cvtps_pd(_mm256_extractf128_ps(d1,1));
+        acc0 = _mm256_fmadd_pd(lo0, lo0, acc0);
+        acc1 = _mm256_fmadd_pd(hi0, hi0, acc1);
+        acc2 = _mm256_fmadd_pd(lo1, lo1, acc2);
+        acc3 = _mm256_fmadd_pd(hi1, hi1, acc3);
+    }
+    for (; i+8<=length; i+=8) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        __m256d lo0 = _mm256_cvtps_pd(_mm256_castps256_ps128(d0));
+        __m256d hi0 = _mm256_cvtps_pd(_mm256_extractf128_ps(d0,1));
+        acc0 = _mm256_fmadd_pd(lo0, lo0, acc0);
+        acc1 = _mm256_fmadd_pd(hi0, hi0, acc1);
+    }
+    acc0 = _mm256_add_pd(_mm256_add_pd(acc0,acc1), _mm256_add_pd(acc2,acc3));
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(acc0), _mm256_extractf128_pd(acc0,1));
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, sum);
+    double distsq = lanes[0] + lanes[1];
+
+    /* Process last 0-7 items. */
+    for (; i<length; ++i) {
+        double diff = a[i] - b[i];
+        distsq += diff * diff;
+    }
+    return distsq;
+}
+
+
+/* Computes the distances from q to 4 vectors at a time, so that each 
+   chunk of the query is loaded once in a register and reused for all 4. */
+DIST_TARGET("avx2,fma")
+void squared_dist_many_avx2(const float* q, const float* vecs, int count, int length, float* dists)
+{
+    int i = 0;
+    for (; i+4<=count; i+=4) {
+        const float* v0 = vecs+i*length;
+        const float* v1 = v0+length;
+        const float* v2 = v1+length;
+        const float* v3 = v2+length;
+        __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+        __m256d acc2 = _mm256_setzero_pd(), acc3 = _mm256_setzero_pd();
+
+        int k = 0;
+        for (; k+8<=length; k+=8) {
+            __m256 qk = _mm256_loadu_ps(q+k);
+            __m256 d0 = _mm256_sub_ps(qk, _mm256_loadu_ps(v0+k));
+            __m256 d1 = _mm256_sub_ps(qk, _mm256_loadu_ps(v1+k));
+            __m256 d2 = _mm256_sub_ps(qk, _mm256_loadu_ps(v2+k));
+            __m256 d3 = _mm256_sub_ps(qk, _mm256_loadu_ps(v3+k));
+            __m256d t;
+            t = _mm256_cvtps_pd(_mm256_castps256_ps128(d0)); acc0 = _mm256_fmadd_pd(t, t, acc0);
+            t = _mm256_cvtps_pd(_mm256_extractf128_ps(d0,1)); acc0 = _mm256_fmadd_pd(t, t, acc0);
+            t = _mm256_cvtps_pd(_mm256_castps256_ps128(d1)); acc1 = _mm256_fmadd_pd(t, t, acc1);
+            t = _mm256_cvtps_pd(_mm256_extractf128_ps(d1,1)); acc1 = _mm256_fmadd_pd(t, t, acc1);
+            t = _mm256_cvtps_pd(_mm256_castps256_ps128(d2)); acc2 = _mm256_fmadd_pd(t, t, acc2);
+            t = _mm256_cvtps_pd(_mm256_extractf128_ps(d2,1)); acc2 = _mm256_fmadd_pd(t, t, acc2);
+            t = _mm256_cvtps_pd(_mm256_castps256_ps128(d3)); acc3 = _mm256_fmadd_pd(t, t, acc3);
+            t = _mm256_cvtps_pd(_mm256_extractf128_ps(d3,1)); acc3 = _mm256_fmadd_pd(t, t, acc3);
+        }
+
+        // horizontal sums of the 4 accumulators: (a0+a1, b0+b1, a2+a3, b2+b3), ...
+        __m256d s01 = _mm256_hadd_pd(acc0, acc1);
+        __m256d s23 = _mm256_hadd_pd(acc2, acc3);
+        __m256d sums = _mm256_add_pd(_mm256_permute2f128_pd(s01, s23, 0x20), _mm256_permute2f128_pd(s01, s23, 0x31));
+        double out[4];
+        _mm256_storeu_pd(out, sums);
+
+        /* Process last 0-7 items. */
+        for (; k<length; ++k) {
+            double diff;
+            diff = q[k] - v0[k]; out[0] += diff * diff;
+            diff = q[k] - v1[k]; out[1] += diff * diff;
+            diff = q[k] - v2[k]; out[2] += diff * diff;
+            diff = q[k] - v3[k]; out[3] += diff * diff;
+        }
+        for (int j=0;j<4;++j) {
+            dists[i+j] = (float)out[j];
+        }
+    }
+    for (; i<count; ++i) {
+        dists[i] = (float)squared_dist_avx2(q, vecs+i*length, length);
+    }
+}
+
+
+/* Horizontal sums of 4 registers, returned in the 4 lanes of the result. */
+DIST_TARGET("avx2,fma")
+__m128 hsum4_avx2(__m256 c0, __m256 c1, __m256 c2, __m256 c3)
+{
+    __m256 s = _mm256_hadd_ps(_mm256_hadd_ps(c0, c1), _mm256_hadd_ps(c2, c3));
+    return _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s,1));
+}
+
+/* GEMM style micro-kernel: a 2x4 tile of dot products is kept in 8
+   registers, so that every load of a is used 4 times and every load
+   of b twice. */
+DIST_TARGET("avx2,fma")
+void dot_block_avx2(const float* a, int rows_a, const float* b, int rows_b, int length, float* dots, int ld)
+{
+    int i = 0;
+    for (; i+2<=rows_a; i+=2) {
+        const float* a0 = a+i*length;
+        const float* a1 = a0+length;
+        int j = 0;
+        for (; j+4<=rows_b; j+=4) {
+            const float* b0 = b+j*length;
+            const float* b1 = b0+length;
+            const float* b2 = b1+length;
+            const float* b3 = b2+length;
+            __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+            __m256 c02 = _mm256_setzero_ps(), c03 = _mm256_setzero_ps();
+            __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+            __m256 c12 = _mm256_setzero_ps(), c13 = _mm256_setzero_ps();
+            int k = 0;
+            for (; k+8<=length; k+=8) {
+                __m256 x0 = _mm256_loadu_ps(a0+k);
+                __m256 x1 = _mm256_loadu_ps(a1+k);
+                __m256 y;
+                y = _mm256_loadu_ps(b0+k); c00 = _mm256_fmadd_ps(x0, y, c00); c10 = _mm256_fmadd_ps(x1, y, c10);
+                y = _mm256_loadu_ps(b1+k); c01 = _mm256_fmadd_ps(x0, y, c01); c11 = _mm256_fmadd_ps(x1, y, c11);
+                y = _mm256_loadu_ps(b2+k); c02 = _mm256_fmadd_ps(x0, y, c02); c12 = _mm256_fmadd_ps(x1, y, c12);
+                y = _mm256_loadu_ps(b3+k); c03 = _mm256_fmadd_ps(x0, y, c03); c13 = _mm256_fmadd_ps(x1, y, c13);
+            }
+            float out0[4], out1[4];
+            _mm_storeu_ps(out0, hsum4_avx2(c00, c01, c02, c03));
+            _mm_storeu_ps(out1, hsum4_avx2(c10, c11, c12, c13));
+
+            /* Process last 0-7 items. */
+            for (; k<length; ++k) {
+                out0[0] += a0[k]*b0[k]; out1[0] += a1[k]*b0[k];
+                out0[1] += a0[k]*b1[k]; out1[1] += a1[k]*b1[k];
+                out0[2] += a0[k]*b2[k]; out1[2] += a1[k]*b2[k];
+                out0[3] += a0[k]*b3[k]; out1[3] += a1[k]*b3[k];
+            }
+            for (int jj=0;jj<4;++jj) {
+                dots[i*ld+j+jj] = out0[jj];
+                dots[(i+1)*ld+j+jj] = out1[jj];
+            }
+        }
+        if (j<rows_b) {
+            dot_block_scalar(a0, 2, b+j*length, rows_b-j, length, dots+i*ld+j, ld);
+        }
+    }
+    if (i<rows_a) {
+        dot_block_sse2(a+i*length, rows_a-i, b, rows_b, length, dots+i*ld, ld);
+    }
+}
+
+
+#ifdef DIST_HAVE_AVX512
+
+DIST_TARGET("avx512f")
+double squared_dist_avx512(const float* a, const float* b, int length)
+{
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+
+    int i = 0;
+    for (; i+16<=length; i+=16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i));
+        __m512d lo = _mm512_cvtps_pd(_mm512_castps512_ps256(d));
+        __m512d hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(d),1)));
+        acc0 = _mm512_fmadd_pd(lo, lo, acc0);
+        acc1 = _mm512_fmadd_pd(hi, hi, acc1);
+    }
+    if (i<length) {
+        /* masked loads zero the lanes past the end of the vectors */
+        __mmask16 mask = (__mmask16)((1u << (length-i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a+i), _mm512_maskz_loadu_ps(mask, b+i));
+        __m512d lo = _mm512_cvtps_pd(_mm512_castps512_ps256(d));
+        __m512d hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(d),1)));
+        acc0 = _mm512_fmadd_pd(lo, lo, acc0);
+        acc1 = _mm512_fmadd_pd(hi, hi, acc1);
+    }
+    acc0 = _mm512_add_pd(acc0, acc1);
+    __m256d sum4 = _mm256_add_pd(_mm512_castpd512_pd256(acc0), _mm512_extractf64x4_pd(acc0,1));
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum4), _mm256_extractf128_pd(sum4,1));
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, sum2);
+    return lanes[0] + lanes[1];
+}
+
+DIST_TARGET("avx512f")
+void squared_dist_many_avx512(const float* q, const float* vecs, int count, int length, float* dists)
+{
+    int tail = length%16;
+    __mmask16 mask = (__mmask16)((1u << tail) - 1);
+
+    int i = 0;
+    for (; i+4<=count; i+=4) {
+        const float* v[4];
+        v[0] = vecs+i*length;
+        v[1] = v[0]+length;
+        v[2] = v[1]+length;
+        v[3] = v[2]+length;
+        __m512d acc[4];
+        for (int j=0;j<4;++j) {
+            acc[j] = _mm512_setzero_pd();
+        }
+
+        for (int k=0; k<length; k+=16) {
+            __m512 qk;
+            if (k+16<=length) {
+                qk = _mm512_loadu_ps(q+k);
+            }
+            else {
+                qk = _mm512_maskz_loadu_ps(mask, q+k);
+            }
+            for (int j=0;j<4;++j) {
+                __m512 vk = (k+16<=length) ? _mm512_loadu_ps(v[j]+k) : _mm512_maskz_loadu_ps(mask, v[j]+k);
+                __m512 d = _mm512_sub_ps(qk, vk);
+                __m512d lo = _mm512_cvtps_pd(_mm512_castps512_ps256(d));
+                __m512d hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(d),1)));
+                acc[j] = _mm512_fmadd_pd(lo, lo, acc[j]);
+                acc[j] = _mm512_fmadd_pd(hi, hi, acc[j]);
+            }
+        }
+
+        for (int j=0;j<4;++j) {
+            __m256d sum4 = _mm256_add_pd(_mm512_castpd512_pd256(acc[j]), _mm512_extractf64x4_pd(acc[j],1));
+            __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum4), _mm256_extractf128_pd(sum4,1));
+            double lanes[2];
+            _mm_storeu_pd(lanes, sum2);
+            dists[i+j] = (float)(lanes[0] + lanes[1]);
+        }
+    }
+    for (; i<count; ++i) {
+        dists[i] = (float)squared_dist_avx512(q, vecs+i*length, length);
+    }
+}
+
+
+DIST_TARGET("avx512f")
+void dot_block_avx512(const float* a, int rows_a, const float* b, int rows_b, int length, float* dots, int ld)
+{
+    int tail = length%16;
+    __mmask16 mask = (__mmask16)((1u << tail) - 1);
+
+    int i = 0;
+    for (; i+2<=rows_a; i+=2) {
+        const float* a0 = a+i*length;
+        const float* a1 = a0+length;
+        int j = 0;
+        for (; j+4<=rows_b; j+=4) {
+            const float* bj[4];
+            bj[0] = b+j*length;
+            bj[1] = bj[0]+length;
+            bj[2] = bj[1]+length;
+            bj[3] = bj[2]+length;
+            __m512 c0[4], c1[4];
+            for (int jj=0;jj<4;++jj) {
+                c0[jj] = _mm512_setzero_ps();
+                c1[jj] = _mm512_setzero_ps();
+            }
+            for (int k=0; k<length; k+=16) {
+                bool full = k+16<=length;
+                __m512 x0 = full ? _mm512_loadu_ps(a0+k) : _mm512_maskz_loadu_ps(mask, a0+k);
+                __m512 x1 = full ? _mm512_loadu_ps(a1+k) : _mm512_maskz_loadu_ps(mask, a1+k);
+                for (int jj=0;jj<4;++jj) {
+                    __m512 y = full ? _mm512_loadu_ps(bj[jj]+k) : _mm512_maskz_loadu_ps(mask, bj[jj]+k);
+                    c0[jj] = _mm512_fmadd_ps(x0, y, c0[jj]);
+                    c1[jj] = _mm512_fmadd_ps(x1, y, c1[jj]);
+                }
+            }
+            for (int jj=0;jj<4;++jj) {
+                dots[i*ld+j+jj] = _mm512_reduce_add_ps(c0[jj]);
+                dots[(i+1)*ld+j+jj] = _mm512_reduce_add_ps(c1[jj]);
+            }
+        }
+        if (j<rows_b) {
+            dot_block_scalar(a0, 2, b+j*length, rows_b-j, length, dots+i*ld+j, ld);
+        }
+    }
+    if (i<rows_a) {
+        dot_block_sse2(a+i*length, rows_a-i, b, rows_b, length, dots+i*ld, ld);
+    }
+}
+
+#endif // DIST_HAVE_AVX512
+
+
+/**
+ * CPU feature detection
+ */
+void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    for (int i=0;i<4;++i) {
+        regs[i] = (unsigned int)info[i];
+    }
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+unsigned long long xgetbv0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+struct CpuFeatures {
+    bool sse2;
+    bool avx2;
+    bool avx512;
+
+    CpuFeatures() : sse2(false), avx2(false), avx512(false)
+    {
+        unsigned int regs[4];
+        cpuid(0, 0, regs);
+        unsigned int max_leaf = regs[0];
+        if (max_leaf<1) return;
+
+        cpuid(1, 0, regs);
+        sse2 = (regs[3] & (1u<<26)) != 0;
+        bool osxsave = (regs[2] & (1u<<27)) != 0;
+        bool avx = (regs[2] & (1u<<28)) != 0;
+        bool fma = (regs[2] & (1u<<12)) != 0;
+        if (!osxsave || !avx || max_leaf<7) return;
+
+        // the OS must save the ymm (and zmm) registers on context switches
+        unsigned long long xcr0 = xgetbv0();
+        bool os_avx = (xcr0 & 0x6) == 0x6;
+        bool os_avx512 = (xcr0 & 0xe6) == 0xe6;
+
+        cpuid(7, 0, regs);
+        avx2 = os_avx && fma && (regs[1] & (1u<<5)) != 0;
+        avx512 = os_avx512 && (regs[1] & (1u<<16)) != 0;
+    }
+};
+
+#endif // DIST_X86
+
+
+struct DistKernel {
+    const char* name;
+    squared_dist_float_func func;
+    squared_dist_many_func many;
+    dot_block_func dot;
+};
+
+/**
+ * The kernels, in order of preference.
+ */
+const DistKernel kernels[] = {
+#ifdef DIST_X86
+#ifdef DIST_HAVE_AVX512
+    { "avx512", &squared_dist_avx512, &squared_dist_many_avx512, &dot_block_avx512 },
+#endif
+    { "avx2", &squared_dist_avx2, &squared_dist_many_avx2, &dot_block_avx2 },
+    { "sse2", &squared_dist_sse2, &squared_dist_many_sse2, &dot_block_sse2 },
+#endif
+    { "scalar", &squared_dist_scalar, &squared_dist_many_scalar, &dot_block_scalar }
+};
+
+bool kernel_supported(const DistKernel& kernel)
+{
+#ifdef DIST_X86
+    static CpuFeatures cpu;
+    if (strcmp(kernel.name,"avx512")==0) return cpu.avx512;
+    if (strcmp(kernel.name,"avx2")==0) return cpu.avx2;
+    if (strcmp(kernel.name,"sse2")==0) return cpu.sse2;
+#endif
+    return true;
+}
+
+const char* selected_kernel = NULL;
+
+void use_kernel(const DistKernel& kernel)
+{
+    squared_dist_float = kernel.func;
+    squared_dist_many_float = kernel.many;
+    dot_block_float = kernel.dot;
+    selected_kernel = kernel.name;
+}
+
+void select_best_kernel()
+{
+    for (size_t i=0;i<sizeof(kernels)/sizeof(kernels[0]);++i) {
+        if (kernel_supported(kernels[i])) {
+            use_kernel(kernels[i]);
+            return;
+        }
+    }
+}
+
+/**
+ * Initial value of squared_dist_float, in case a distance is needed by
+ * another static initializer before the one below had a chance to run.
+ */
+double squared_dist_resolve(const float* a, const float* b, int length)
+{
+    select_best_kernel();
+    return squared_dist_float(a, b, length);
+}
+
+void squared_dist_many_resolve(const float* q, const float* vecs, int count, int length, float* dists)
+{
+    select_best_kernel();
+    squared_dist_many_float(q, vecs, count, length, dists);
+}
+
+void dot_block_resolve(const float* a, int rows_a, const float* b, int rows_b, int length, float* dots, int ld)
+{
+    select_best_kernel();
+    dot_block_float(a, rows_a, b, rows_b, length, dots, ld);
+}
+
+/**
+ * Static initializer. Selects the kernel before the program starts.
+ */
+struct KernelInit {
+    KernelInit()
+    {
+        if (selected_kernel==NULL) {
+            select_best_kernel();
+        }
+    }
+};
+
+}
+
+
+squared_dist_float_func squared_dist_float = &squared_dist_resolve;
+squared_dist_many_func squared_dist_many_float = &squared_dist_many_resolve;
+dot_block_func dot_block_float = &dot_block_resolve;
+
+namespace {
+    KernelInit __kernel_init;
+}
+
+
+const char* squared_dist_kernel()
+{
+    if (selected_kernel==NULL) {
+        select_best_kernel();
+    }
+    return selected_kernel;
+}
+
+bool set_squared_dist_kernel(const char* name)
+{
+    for (size_t i=0;i<sizeof(kernels)/sizeof(kernels[0]);++i) {
+        if (strcmp(kernels[i].name,name)==0 && kernel_supported(kernels[i])) {
+            use_kernel(kernels[i]);
+            return true;
+        }
+    }
+    return false;
+}
@@ -87,4 +87,102 @@ double squared_dist(T* a, int length)
 	return distsq;
 }
 
+
+/**
+ * Signature of the kernels computing the squared distance between two
+ * float vectors.
+ */
+typedef double (*squared_dist_float_func)(const float* a, const float* b, int length);
+
+/**
+ * Kernel used for float vectors. It is selected once at startup, based on
+ * what the CPU supports (see dist.cpp), and falls back to the scalar loop 
+ * above. All the kernels compute the differences in float and accumulate 
+ * the squares in double, so they return the same value as the generic 
+ * squared_dist up to the order of the summation.
+ */
+extern squared_dist_float_func squared_dist_float;
+
+/**
+ * Signature of the kernels computing the squared distances between one 
+ * float vector and a block of count vectors stored contiguously (row i 
+ * starts at vecs+i*length).
+ */
+typedef void (*squared_dist_many_func)(const float* q, const float* vecs, int count, int length, float* dists);
+
+/**
+ * Batched kernel, selected together with squared_dist_float. It processes
+ * several vectors of the block in one pass over the query.
+ */
+extern squared_dist_many_func squared_dist_many_float;
+
+/**
+ * Signature of the kernels computing the dot products between every row of
+ * the block a (rows_a x length) and every row of the block b (rows_b x length).
+ * The product of row i of a and row j of b is stored in dots[i*ld+j].
+ */
+typedef void (*dot_block_func)(const float* a, int rows_a, const float* b, int rows_b, int length, float* dots, int ld);
+
+/**
+ * Matrix-multiply kernel, selected together with squared_dist_float. Unlike
+ * the distance kernels it accumulates in float.
+ */
+extern dot_block_func dot_block_float;
+
+/**
+ * Name of the kernel selected for squared_dist_float ("scalar", "sse2", 
+ * "avx2" or "avx512").
+ */
+const char* squared_dist_kernel();
+
+/**
+ * Selects the kernel to use for squared_dist_float by name. 
+ *
+ * Returns: false if the kernel is unknown or not supported by this CPU
+ */
+bool set_squared_dist_kernel(const char* name);
+
+/**
+ *  Compute the squared distance between two float vectors using the
+ *  fastest kernel supported by the CPU.
+ */
+inline double squared_dist(float* a, float* b, int length) 
+{
+	return squared_dist_float(a, b, length);
+}
+
+/**
+ *  Compute the squared distances between the vector q and the count vectors
+ *  stored contiguously in vecs. 
+ *
+ *  Params:
+ *      q = the query vector
+ *      vecs = block of count x length floats
+ *      count = number of vectors in the block
+ *      length = vector length
+ *      dists = output array with count distances
+ */
+inline void squared_dist_many(float* q, float* vecs, int count, int length, float* dists) 
+{
+	squared_dist_many_float(q, vecs, count, length, dists);
+}
+
+/**
+ *  Computes the dot products between the rows of two blocks of vectors
+ *  (a GEMM with the second matrix transposed).
+ *
+ *  Params:
+ *      a = block of rows_a x length floats
+ *      rows_a = number of vectors in a
+ *      b = block of rows_b x length floats
+ *      rows_b = number of vectors in b
+ *      length = vector length
+ *      dots = output matrix, the product of a[i] and b[j] goes in dots[i*ld+j]
+ *      ld = row stride of dots
+ */
+inline void dot_block(float* a, int rows_a, float* b, int rows_b, int length, float* dots, int ld) 
+{
+	dot_block_float(a, rows_a, b, rows_b, length, dots, ld);
+}
+
 #endif //DIST_H
@@ -8,11 +8,20 @@ const int LINEAR    = 0;
 const int KDTREE    = 1;
 const int KMEANS    = 2;
 const int COMPOSITE = 3;
+const int IVFPQ     = 4;
 
 const int CENTERS_RANDOM = 0;
 const int CENTERS_GONZALES = 1;
 const int CENTERS_KMEANSPP = 2;
 
+const int KMEANS_ASSIGN_LLOYD = 0;
+const int KMEANS_ASSIGN_BLOCKED = 1;
+const int KMEANS_ASSIGN_HAMERLY = 2;
+
+/* Scoring of the images by the visual words they share with a query */
+const int SCORING_TFIDF = 0;
+const int SCORING_BM25 = 1;
+
 
 const int LOG_NONE  = 0;
 const int LOG_FATAL = 1;
@@ -8,8 +8,16 @@
 #include "algorithms/KMeansTree.h"
 #include "algorithms/CompositeTree.h"
 #include "algorithms/LinearSearch.h"
+#include "algorithms/IVFPQIndex.h"
 #include "nn/Autotune.h"
 #include "nn/Testing.h"
+#include "nn/IndexIO.h"
+#include "util/MatrixFile.h"
+#include "util/TextMatrix.h"
+#include "nn/Vocabulary.h"
+#include "nn/Corpus.h"
+#include "nn/InvertedIndex.h"
+#include "nn/HammingEmbedding.h"
 #include <objbase.h>
 using namespace std;
 
@@ -30,18 +38,32 @@ namespace {
     typedef NNIndex* NNIndexPtr;
     typedef Dataset<float>* DatasetPtr;
     
-    const char* algos[] = { "linear","kdtree", "kmeans", "composite" };
+    const char* algos[] = { "linear","kdtree", "kmeans", "composite", "ivfpq" };
     const char* centers_algos[] = { "random", "gonzales", "kmeanspp" };
+    const char* assign_algos[] = { "lloyd", "blocked", "hamerly" };
+
+    /* datasets read from the index files, released with their index */
+    map<NNIndex*, DatasetPtr> loaded_datasets;
 		
 	const char SIZES_FILE[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\cse484project\\cse484project\\features\\esp.size";
-	FLANN_INDEX BUILT_INDEX = 0x0;
-	int SIZE_BUILT_INDEx = 0;
+	FLANN_VOCABULARY VOCABULARY = 0x0;
 	const char FEATURE_FILE[] ="C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\cse484project\\cse484project\\features\\esp.feature";
 	const char FEATURE_FILE_BINARY[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\cse484project\\cse484project\\features\\esp.feature.xb";
 	const char IMAGELIST_FILE[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\cse484project\\cse484project\\features\\imglist.txt";
 	const char CLUSTER_FILE[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\clusters.txt";
 	const char CLUSTER_FILE_BINARY[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\clusters_small.xb";
 	const char FLANN_INDEX_BINARY[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\flann_index.xb";
+	const char VOCABULARY_TREE_FILE[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\vocabulary_tree.vt";
+	const char HAMMING_EMBEDDING_FILE[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\hamming_embedding.he";
+	FLANN_HAMMING_EMBEDDING HAMMING_EMBEDDING = 0x0;
+	// largest Hamming distance of matching descriptors, of 64 bits
+	const int HAMMING_THRESHOLD = 24;
+	// number of features the Hamming embedding is trained on
+	const int HAMMING_TRAINING_FEATURES = 250000;
+	const char BAGOWORDS_FILE[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\bagofwords\\bagofwords.txt";
+	const char BAGOWORDS_FILE_BINARY[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\bagofwords\\bagofwords.bow";
+	const char INVERTED_INDEX_FILE[] = "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\index\\bagofwords.ivf";
+	FLANN_INVERTED_INDEX INVERTED_INDEX = 0x0;
 	Params parametersToParams(IndexParameters parameters)
 	{
 		Params p;
@@ -51,6 +73,10 @@ namespace {
 		p["max-iterations"] = parameters.iterations;
 		p["branching"] = parameters.branching;
 		p["target-precision"] = parameters.target_precision;
+		p["cores"] = parameters.cores;
+		p["lists"] = parameters.lists;
+		p["subquantizers"] = parameters.subquantizers;
+		p["rerank"] = parameters.rerank;
 		
 		if (parameters.centers_init >=0 && parameters.centers_init<ARRAY_LEN(centers_algos)) {
 			p["centers-init"] = centers_algos[parameters.centers_init];
@@ -58,6 +84,13 @@ namespace {
 		else {
 			p["centers-init"] = "random";
 		}
+
+		if (parameters.kmeans_assign >=0 && parameters.kmeans_assign<ARRAY_LEN(assign_algos)) {
+			p["kmeans-assign"] = assign_algos[parameters.kmeans_assign];
+		}
+		else {
+			p["kmeans-assign"] = "lloyd";
+		}
 		
 		if (parameters.algorithm >=0 && parameters.algorithm<ARRAY_LEN(algos)) {
 			p["algorithm"] = algos[parameters.algorithm];
@@ -103,6 +136,26 @@ namespace {
 		} catch (...) {
 			p.target_precision = -1;
 		}
+		try {
+			p.cores = (int)params["cores"];
+		} catch (...) {
+			p.cores = 1;
+		}
+		try {
+			p.lists = (int)params["lists"];
+		} catch (...) {
+			p.lists = 1024;
+		}
+		try {
+			p.subquantizers = (int)params["subquantizers"];
+		} catch (...) {
+			p.subquantizers = 16;
+		}
+		try {
+			p.rerank = (int)params["rerank"];
+		} catch (...) {
+			p.rerank = 64;
+		}
         p.centers_init = CENTERS_RANDOM;
         for (size_t algo_id =0; algo_id<ARRAY_LEN(centers_algos); ++algo_id) {
             const char* algo = centers_algos[algo_id];
@@ -113,6 +166,16 @@ namespace {
 				}
 			} catch (...) {}
 		}
+        p.kmeans_assign = KMEANS_ASSIGN_LLOYD;
+        for (size_t algo_id =0; algo_id<ARRAY_LEN(assign_algos); ++algo_id) {
+            const char* algo = assign_algos[algo_id];
+            try {
+				if (algo == params["kmeans-assign"] ) {
+					p.kmeans_assign = algo_id;
+					break;
+				}
+			} catch (...) {}
+		}
         p.algorithm = LINEAR;
         for (size_t algo_id =0; algo_id<ARRAY_LEN(algos); ++algo_id) {
             const char* algo = algos[algo_id];
@@ -237,71 +300,84 @@ void readSizes(vector<int>* outSizes)
 		return;
 	}
 }
-float* readFeatures(int total_keypoints, const int KEYPOINT_SIZE)
+MappedMatrix* mapMatrixFile(const char* filename, int min_rows, int cols)
 {
-	ifstream featureFileStream;
-	featureFileStream.open(FEATURE_FILE);
-	
-	FILE* file = fopen(FEATURE_FILE_BINARY, "rb");
-	float* data = new float[total_keypoints * KEYPOINT_SIZE];
-	if(!file)
+	try
 	{
-		cout << "Could not open for reading " << FEATURE_FILE_BINARY << endl;
+		MappedMatrix* matrix = new MappedMatrix(filename);
+		if(matrix->data().rows < min_rows || matrix->data().cols != cols)
+		{
+			cout << filename << " has " << matrix->data().rows << "x" << matrix->data().cols 
+				<< " values, expected " << min_rows << "x" << cols << endl;
+			delete matrix;
+			return 0x0;
+		}
+		return matrix;
 	}
-	else
+	catch(runtime_error& e)
 	{
-		cout << "Reading features from binary " << FEATURE_FILE_BINARY << endl;
-		fread(data, sizeof(float), total_keypoints * KEYPOINT_SIZE, file);
-		cout << "Finished read of features from binary." << endl;
-		return data;
+		cout << "Could not map " << filename << ": " << e.what() << endl;
+		return 0x0;
 	}
+}
 
-
-	if(featureFileStream.is_open())
+/*
+	Maps the binary feature file, converting it first if it is missing or
+	written by an older version (floats without a header).
+*/
+MappedMatrix* readFeatures(int total_keypoints, const int KEYPOINT_SIZE)
+{
+	if(is_matrix_file(FEATURE_FILE_BINARY))
 	{
-		cout << "Successfully opened " << FEATURE_FILE << endl;
+		cout << "Mapping features from binary " << FEATURE_FILE_BINARY << endl;
+		return mapMatrixFile(FEATURE_FILE_BINARY, total_keypoints, KEYPOINT_SIZE);
+	}
 
-		file = fopen(FEATURE_FILE_BINARY, "wb");
-		if(!file)
+	FILE* file = fopen(FEATURE_FILE_BINARY, "rb");
+	if(file)
+	{
+		cout << "Converting features from old binary " << FEATURE_FILE_BINARY << endl;
+		Dataset<float> data(total_keypoints, KEYPOINT_SIZE);
+		size_t values = fread(data.data, sizeof(float), (size_t)total_keypoints * KEYPOINT_SIZE, file);
+		fclose(file);
+		if(values != (size_t)total_keypoints * KEYPOINT_SIZE)
 		{
-			cout << "Could not open for writing " << FEATURE_FILE_BINARY << endl;
-			featureFileStream.close();
-			return new float[0];
+			cout << "There was a problem reading " << FEATURE_FILE_BINARY << endl;
+			return 0x0;
 		}
-
-		int current_keypoint = 0;
-		while(current_keypoint < total_keypoints)
+		try
 		{
-			int k = 0;
-			float n;
-			while(k < KEYPOINT_SIZE)
-			{
-				
-				featureFileStream >> n;
-				data[current_keypoint * KEYPOINT_SIZE + k] = n;
-				
-				++k;
-			}
-
-			if(current_keypoint % 10000 == 0)
-			{
-				cout << "Read (" << (double)(current_keypoint) / (double)(total_keypoints) * 100 
-					<< "%)" << current_keypoint << "/" << total_keypoints << " keypoints." << endl;
-			}
-
-			current_keypoint++;
+			save_matrix(FEATURE_FILE_BINARY, data);
+		}
+		catch(runtime_error& e)
+		{
+			cout << "Could not write " << FEATURE_FILE_BINARY << ": " << e.what() << endl;
+			return 0x0;
 		}
-		
-		cout << "Read in " << current_keypoint << " keypoints." << endl;
-		fwrite(data, sizeof(float), total_keypoints * KEYPOINT_SIZE, file);
-		cout << "Wrote " << current_keypoint << " keypoints to binary file." << endl;
-		featureFileStream.close();
 	}
 	else
 	{
-		cout << "There was a problem opening " << FEATURE_FILE << endl;
+		// the text is parsed on all the cores and written to the binary file as it goes
+		cout << "Converting features from text " << FEATURE_FILE << endl;
+		try
+		{
+			int rows = convert_text_matrix(FEATURE_FILE, FEATURE_FILE_BINARY, KEYPOINT_SIZE, total_keypoints, 0);
+			if(rows < total_keypoints)
+			{
+				cout << FEATURE_FILE << " has only " << rows << " keypoints." << endl;
+				remove(FEATURE_FILE_BINARY);
+				return 0x0;
+			}
+		}
+		catch(runtime_error& e)
+		{
+			cout << "There was a problem converting " << FEATURE_FILE << ": " << e.what() << endl;
+			return 0x0;
+		}
 	}
-	return data;
+
+	cout << "Wrote " << total_keypoints << " keypoints to binary file." << endl;
+	return mapMatrixFile(FEATURE_FILE_BINARY, total_keypoints, KEYPOINT_SIZE);
 }
 void readImageNames(vector<string>* outNames)
 {
@@ -331,168 +407,121 @@ void readImageNames(vector<string>* outNames)
 }
 void writeClusterData(float* cluster_centers, int clusters_returned, const int KEYPOINT_SIZE)
 {
-
-	FILE* file = fopen(CLUSTER_FILE_BINARY, "wb");
-	if(!file)
-	{
-		cout << "Could not open for writing " << CLUSTER_FILE_BINARY << endl;
-		return;
-	}
-	else
+	cout << "Writing clusters to binary file " << CLUSTER_FILE_BINARY << endl;
+	try
 	{
-		cout << "Writing clusters to binary file " << CLUSTER_FILE_BINARY << endl;
-		fwrite(&clusters_returned, sizeof(int), 1, file);
-		fwrite(&KEYPOINT_SIZE, sizeof(int), 1, file);
-		fwrite(cluster_centers, sizeof(float), clusters_returned * KEYPOINT_SIZE, file);
-		fclose(file);
+		save_matrix(CLUSTER_FILE_BINARY, Dataset<float>(clusters_returned, KEYPOINT_SIZE, cluster_centers));
 		cout << "Finished writing " << clusters_returned * KEYPOINT_SIZE << " dimensions to " << CLUSTER_FILE_BINARY << endl;
 	}
-
-
-}
-int buildIndex(float* cluster_centers, int num_clusters, int KEYPOINT_SIZE)
-{
-	if(BUILT_INDEX != 0x0)
-	{
-		cout << "Index already built! Ptr:" << BUILT_INDEX << endl;
-		return SIZE_BUILT_INDEx;
-	}
-	IndexParameters build_index_params;
-	build_index_params.algorithm = KDTREE;
-	build_index_params.checks = 2048;
-	build_index_params.trees = 8;
-	build_index_params.target_precision = -1;
-	build_index_params.build_weight = 0.01;
-	build_index_params.memory_weight = 1;
-
-	float speedup;
-	NNIndex* index = flann_build_nnindex(cluster_centers,num_clusters,KEYPOINT_SIZE,&speedup, &build_index_params,NULL);
-
-	cout << "address of built index: " << BUILT_INDEX << endl;
-	if(BUILT_INDEX == 0x0)
+	catch(runtime_error& e)
 	{
-		cout << "Saved index." << endl;
-		BUILT_INDEX = index;
-		SIZE_BUILT_INDEx = index->usedMemory();
+		cout << "Could not write " << CLUSTER_FILE_BINARY << ": " << e.what() << endl;
 	}
-	cout << "Build index. " << endl;
-	return index->usedMemory();
 }
 
-float* ReadClusterFile(int* numClusters)
+/*
+	Converts a cluster file written by an older version (the number of
+	clusters and of dimensions followed by the centers, without the matrix
+	header) to the matrix file format.
+*/
+bool convertClusterFile()
 {
-	//std::ifstream fileStream;
-	//fileStream.open(CLUSTER_FILE);
-	
+	if(is_matrix_file(CLUSTER_FILE_BINARY))
+	{
+		return true;
+	}
 	FILE* file = fopen(CLUSTER_FILE_BINARY, "rb");
 	if(!file)
 	{
 		cout << "Could not open for reading " << CLUSTER_FILE_BINARY << endl;
-		return 0x0;
-	}	
-	
-	
-	cout << "Reading in cluster file " << CLUSTER_FILE_BINARY << endl;
-	int length = 0;
-	// Each line has a size on it
-	int total_point_dims;
-	int num_dimensions;
-
-	
+		return false;
+	}
+	cout << "Converting old cluster file " << CLUSTER_FILE_BINARY << endl;
+	int total_point_dims = 0;
+	int num_dimensions = 0;
 	fread(&total_point_dims,sizeof(int),1,file);
 	fread(&num_dimensions,sizeof(int),1,file);
-
-	int i = 0;
-	length = total_point_dims * num_dimensions;
-	float* cluster_centers = new float[length];
-	fread(cluster_centers, sizeof(float), length, file);
-
-
-	*numClusters = total_point_dims; // set value of numClusters to length
-	std::cout << "Finished reading cluster file. Read " << length << " sizes." << std::endl;
-	//fileStream.close();
-	
-	fclose(file);
-
-	return cluster_centers;
-}
-
-void writeIndexFile(FLANN_INDEX index, int sizeBytes)
-{
-	/*
-	FILE* file = fopen(FLANN_INDEX_BINARY, "wb");
-	//NNIndex* nnIndex = (NNIndex*)(index);
-	if(!file)
+	if(total_point_dims <= 0 || num_dimensions <= 0)
 	{
-		cout << "Could not open " << FLANN_INDEX_BINARY << endl;
+		cout << "Invalid cluster file " << CLUSTER_FILE_BINARY << endl;
+		fclose(file);
+		return false;
 	}
-	else
+	Dataset<float> cluster_centers(total_point_dims, num_dimensions);
+	size_t length = fread(cluster_centers.data, sizeof(float), (size_t)total_point_dims * num_dimensions, file);
+	fclose(file);
+	if(length != (size_t)total_point_dims * num_dimensions)
 	{
-		KDTree* tree = (KDTree*)(&index);
-		Dataset<float> treeDataset = tree->dataset;
-		float* mean = tree->mean;
-		int numTrees = tree->numTrees;
-		//fwrite(&sizeBytes, sizeof(int), 1, file);
-		//fwrite(, sizeBytes, 1, file);
-		//fwrite(&KEYPOINT_SIZE, sizeof(int), 1, file);
-		//fwrite(cluster_centers, sizeof(float), clusters_returned * KEYPOINT_SIZE, file);
-		fclose(file);
-		cout << "Finished writing " << sizeBytes << " bytes to " << FLANN_INDEX_BINARY << endl;
-	}*/
+		cout << "There was a problem reading " << CLUSTER_FILE_BINARY << endl;
+		return false;
+	}
+	writeClusterData(cluster_centers.data, total_point_dims, num_dimensions);
+	return true;
 }
 
-FLANN_INDEX readIndexFile()
+/*
+	Returns the vocabulary used by the bag of words, opened the first time
+	and kept for the life of the process. It is the vocabulary tree when
+	UpdateVocabularyTree wrote one, the cluster centers otherwise.
+*/
+FLANN_VOCABULARY getVocabulary()
 {
-
-	/*
-	FILE* file = fopen(FLANN_INDEX_BINARY, "rb");
-	FLANN_INDEX outIndex;
-	if(!file)
+	if(VOCABULARY == 0x0)
 	{
-		cout << "Could not open " << FLANN_INDEX_BINARY << endl;
-		return outIndex;
-	}
-	else
-	{
-		cout << "Reading FLANN_INDEX from binary file " << FLANN_INDEX_BINARY << endl;
-		int memoryUsed =0;
-		fread(&memoryUsed, sizeof(int), 1, file);
-		outIndex = (FLANN_INDEX)malloc(memoryUsed);
-		fread(outIndex, memoryUsed, 1, file);
-		cout << "Finished reading " << memoryUsed << " bytes from " << FLANN_INDEX_BINARY << endl;
-		fclose(file);
-		return outIndex;
+		FILE* tree = fopen(VOCABULARY_TREE_FILE, "rb");
+		if(tree)
+		{
+			fclose(tree);
+			VOCABULARY = flann_open_vocabulary_tree(VOCABULARY_TREE_FILE, NULL);
+			if(VOCABULARY == 0x0)
+			{
+				cout << "Could not open the vocabulary tree " << VOCABULARY_TREE_FILE << endl;
+			}
+			else
+			{
+				cout << "Opened vocabulary tree of " << flann_vocabulary_size(VOCABULARY) << " nodes." << endl;
+			}
+			return VOCABULARY;
+		}
+
+		if(!convertClusterFile())
+		{
+			return 0x0;
+		}
 
+		IndexParameters build_index_params;
+		build_index_params.algorithm = KDTREE;
+		build_index_params.checks = 2048;
+		build_index_params.trees = 8;
+		build_index_params.cores = 0;
+		build_index_params.target_precision = -1;
+		build_index_params.build_weight = 0.01;
+		build_index_params.memory_weight = 1;
+
+		VOCABULARY = flann_open_vocabulary(CLUSTER_FILE_BINARY, FLANN_INDEX_BINARY, &build_index_params, NULL);
+		if(VOCABULARY == 0x0)
+		{
+			cout << "Could not open the vocabulary " << CLUSTER_FILE_BINARY << endl;
+		}
+		else
+		{
+			cout << "Opened vocabulary of " << flann_vocabulary_size(VOCABULARY) << " words." << endl;
+		}
 	}
-	*/
-	return 0x0;
+	return VOCABULARY;
 }
 
 EXPORTED void WarmUp()
 {
-	int num_clusters;
-	float* cluster_centers = ReadClusterFile(&num_clusters);
-	if(cluster_centers == 0x0) return; // no cluster file to report
-
-	int indexSizeBytes = buildIndex(cluster_centers, num_clusters, 128); // keep the index in memory.
-
+	getVocabulary(); // keep the vocabulary and its index in memory.
 }
 EXPORTED char* CreateBagOfWords(float* keypoint_data, int num_keypoints)
 {	
 
-	int num_clusters;
-	//float* cluster_centers = (float*)::CoTaskMemAlloc(4609 * 128 * sizeof(float));
 	const int KEYPOINT_SIZE = 128;
-	float* cluster_centers = ReadClusterFile(&num_clusters);
+	// the vocabulary is opened once, the calls after the first one don't read any file
+	FLANN_VOCABULARY vocabulary = getVocabulary();
 
-	cout << "BEANS" << endl;
-	int indexSizeBytes = buildIndex(cluster_centers, num_clusters, KEYPOINT_SIZE);
-
-	/*
-	writeIndexFile(index2, indexSizeBytes);
-	FLANN_INDEX index = (readIndexFile()); // works when both read and write are present probably because its pointing to the same place
-	// in memory where a valid FLANN index is...
-	*/
 	stringstream strStream;
 	
 	cout << "Writing bag of words. " << endl;
@@ -506,52 +535,238 @@ EXPORTED char* CreateBagOfWords(float* keypoint_data, int num_keypoints)
 	strStream << "<DOCNO>" << "Query" << "</DOCNO>" << endl;
 	strStream << "<TEXT>" << endl;
 
-	int keypoints_examined = 0;
+	int keypoints_examined = num_keypoints / KEYPOINT_SIZE; //(num_keypoints / KEYPOINT_SIZE)
 
-	for(int j = 0; j < num_keypoints / KEYPOINT_SIZE; ++j) //(num_keypoints / KEYPOINT_SIZE)
+	// quantize all the keypoints of the image in one call
+	vector<int> nearest_neighbors(keypoints_examined);
+	if(vocabulary == 0x0 || (keypoints_examined > 0 && 
+		flann_quantize(vocabulary,keypoint_data,keypoints_examined,&nearest_neighbors[0],1024,0,&flann_params) != 0))
 	{
-		float keypoint[KEYPOINT_SIZE];
-		for(int k = 0; k < KEYPOINT_SIZE; ++k)
-		{
-			keypoint[k] = keypoint_data[keypoints_examined * KEYPOINT_SIZE + k];
-		}
-		keypoints_examined++;
-		int nearest_neighbor[1];// = new int[1];
-		int _r = flann_find_nearest_neighbors_index(BUILT_INDEX,keypoint,1,nearest_neighbor,1,1024,&flann_params);
-		strStream << "w" << nearest_neighbor[0] << " ";
+		cout << "Could not quantize the keypoints." << endl;
+		keypoints_examined = 0;
+	}
+	for(int j = 0; j < keypoints_examined; ++j)
+	{
+		strStream << "w" << nearest_neighbors[j] << " ";
 	}
 	strStream << endl << "</TEXT>" << endl;
 	strStream << "</DOC>" << endl;
 
 	cout << "Wrote out " << keypoints_examined << " keypoints." << endl;
 	
-	const char* szSampleString = strStream.str().c_str();
-	//cout << strStream.str() << endl;
-	//cout << strStream.str().c_str() << endl;
-    ULONG ulSize = strlen(szSampleString) + sizeof(char);
-	//cout << strlen(szSampleString) << endl;
+	// a single copy of the document, c_str() of the temporary str() would dangle
+	const string document = strStream.str();
+    ULONG ulSize = document.size() + sizeof(char);
 	
     char* pszReturn = NULL;
 
     pszReturn = (char*)::CoTaskMemAlloc(ulSize);
-    // Copy the contents of szSampleString
+    // Copy the document (with its terminating null)
     // to the memory pointed to by pszReturn.
-    strcpy(pszReturn, strStream.str().c_str());
-	//cout << pszReturn << endl;
-    // Return pszReturn.
-
-	delete cluster_centers;
+    memcpy(pszReturn, document.c_str(), ulSize);
 
     return pszReturn;
 }
 
+EXPORTED int CreateBagOfWordsHistogram(float* keypoint_data, int num_keypoints, int* histogram, int capacity)
+{
+	const int KEYPOINT_SIZE = 128;
+	FLANN_VOCABULARY vocabulary = getVocabulary();
+	if(vocabulary == 0x0)
+	{
+		return -1;
+	}
+
+	FLANNParameters flann_params;
+	flann_params.log_level = LOG_NONE;
+	flann_params.log_destination = NULL;
+	flann_params.random_seed = CENTERS_RANDOM;
+
+	return flann_bag_of_words(vocabulary, keypoint_data, num_keypoints / KEYPOINT_SIZE, histogram, capacity, 1024, 0, &flann_params);
+}
+
+/*
+	Returns the inverted index used by QueryImages, opened the first time and
+	kept for the life of the process. It is built from the binary bag of words
+	if the inverted file is missing.
+*/
+FLANN_INVERTED_INDEX getInvertedIndex()
+{
+	if(INVERTED_INDEX == 0x0)
+	{
+		FLANNParameters flann_params;
+		flann_params.log_level = LOG_NONE;
+		flann_params.log_destination = NULL;
+		flann_params.random_seed = CENTERS_RANDOM;
+
+		INVERTED_INDEX = flann_open_inverted_index(INVERTED_INDEX_FILE, &flann_params);
+		if(INVERTED_INDEX == 0x0)
+		{
+			cout << "Building the inverted file from " << BAGOWORDS_FILE_BINARY << endl;
+			if(flann_build_inverted_index(BAGOWORDS_FILE_BINARY, INVERTED_INDEX_FILE, NULL) == 0)
+			{
+				INVERTED_INDEX = flann_open_inverted_index(INVERTED_INDEX_FILE, NULL);
+			}
+		}
+		if(INVERTED_INDEX == 0x0)
+		{
+			cout << "Could not open the inverted file " << INVERTED_INDEX_FILE << endl;
+		}
+	}
+	return INVERTED_INDEX;
+}
+
+/*
+	Returns the Hamming embedding of the vocabulary, opened the first time
+	and kept for the life of the process, or 0x0 if UpdateHammingEmbedding
+	didn't write one for the current vocabulary.
+*/
+FLANN_HAMMING_EMBEDDING getHammingEmbedding()
+{
+	if(HAMMING_EMBEDDING == 0x0)
+	{
+		FILE* file = fopen(HAMMING_EMBEDDING_FILE, "rb");
+		if(file)
+		{
+			fclose(file);
+			HAMMING_EMBEDDING = flann_open_hamming_embedding(HAMMING_EMBEDDING_FILE, NULL);
+		}
+	}
+	return HAMMING_EMBEDDING;
+}
+
+/*
+	Closes the Hamming embedding and deletes its file, it is only valid for
+	the vocabulary it was trained for.
+*/
+void removeHammingEmbedding()
+{
+	if(HAMMING_EMBEDDING != 0x0)
+	{
+		flann_close_hamming_embedding(HAMMING_EMBEDDING, NULL);
+		HAMMING_EMBEDDING = 0x0;
+	}
+	remove(HAMMING_EMBEDDING_FILE);
+}
+
+EXPORTED int QueryImages(float* keypoint_data, int num_keypoints, int k, int* images, float* scores)
+{
+	const int KEYPOINT_SIZE = 128;
+	FLANN_VOCABULARY vocabulary = getVocabulary();
+	FLANN_INVERTED_INDEX inverted_index = getInvertedIndex();
+	if(vocabulary == 0x0 || inverted_index == 0x0)
+	{
+		return -1;
+	}
+
+	FLANNParameters flann_params;
+	flann_params.log_level = LOG_NONE;
+	flann_params.log_destination = NULL;
+	flann_params.random_seed = CENTERS_RANDOM;
+
+	// the signatures discard most of the false matches of the words
+	FLANN_HAMMING_EMBEDDING embedding = getHammingEmbedding();
+	if(embedding != 0x0 && ((InvertedIndex*)inverted_index)->has_signatures())
+	{
+		return flann_search_images_hamming(vocabulary, embedding, inverted_index, keypoint_data, num_keypoints / KEYPOINT_SIZE, k, 
+			HAMMING_THRESHOLD, images, scores, 1024, 0, &flann_params);
+	}
+	return flann_search_images(vocabulary, inverted_index, keypoint_data, num_keypoints / KEYPOINT_SIZE, k, SCORING_TFIDF, 
+		images, scores, 1024, 0, &flann_params);
+}
+
+EXPORTED int GetImageName(int image, char* name, int capacity)
+{
+	const char* image_name = INVERTED_INDEX == 0x0 ? 0x0 : flann_inverted_index_image_name(INVERTED_INDEX, image);
+	if(image_name == 0x0 || name == 0x0 || capacity <= 0)
+	{
+		return -1;
+	}
+	int length = strlen(image_name);
+	strncpy(name, image_name, capacity - 1);
+	name[capacity - 1] = '\0';
+	return length;
+}
+
+/*
+	Quantizes the features of all the images and writes their bag of words
+	documents, the TREC ones to BAGOWORDS_FILE and the binary ones to 
+	BAGOWORDS_FILE_BINARY, with the signatures of the Hamming embedding if
+	there is one. The images are quantized on all the cores while the 
+	documents are written in order.
+*/
+void writeBagOfWords(FLANN_VOCABULARY vocabulary, MappedMatrix* features, const vector<int>& sizes, CorpusFormat format)
+{
+	const char* filename = format == CORPUS_TREC ? BAGOWORDS_FILE : BAGOWORDS_FILE_BINARY;
+
+	vector<string> imgNames;
+	readImageNames(&imgNames);
+
+	try
+	{
+		write_corpus(*(Vocabulary*)vocabulary, features->data(), sizes, imgNames, filename, format, 1024, 0, 
+			(HammingEmbedding*)getHammingEmbedding());
+		cout << "Wrote " << sizes.size() << " bag of words documents to " << filename << endl;
+	}
+	catch(runtime_error& e)
+	{
+		cout << "There was a problem writing " << filename << ": " << e.what() << endl;
+	}
+}
+
+/*
+	Builds the inverted file from the binary bag of words documents.
+*/
+void writeInvertedIndex()
+{
+	if(flann_build_inverted_index(BAGOWORDS_FILE_BINARY, INVERTED_INDEX_FILE, NULL) == 0)
+	{
+		cout << "Wrote the inverted file " << INVERTED_INDEX_FILE << endl;
+	}
+	else
+	{
+		cout << "There was a problem writing " << INVERTED_INDEX_FILE << endl;
+	}
+}
+
+EXPORTED void UpdateBagOfWords(int binary)
+{
+	const int KEYPOINT_SIZE = 128;
+
+	vector<int> sizes;
+	readSizes(&sizes);
+
+	int total_keypoints = 0;
+	for(int i = 0; i < sizes.size(); ++i)
+	{
+		total_keypoints += sizes[i];
+	}
+
+	FLANN_VOCABULARY vocabulary = getVocabulary();
+	if(vocabulary == 0x0) return;
+	MappedMatrix* features = readFeatures(total_keypoints, KEYPOINT_SIZE);
+	if(features == 0x0) return;
+
+	if(binary && INVERTED_INDEX != 0x0)
+	{
+		flann_close_inverted_index(INVERTED_INDEX, NULL);
+		INVERTED_INDEX = 0x0;
+	}
+	writeBagOfWords(vocabulary, features, sizes, binary ? CORPUS_BINARY : CORPUS_TREC);
+	delete features;
+
+	if(binary)
+	{
+		writeInvertedIndex();
+	}
+}
+
 EXPORTED void UpdateClusterCenters(char sizeFile[], char featureFile[], char clusterOutputFile[])
 {
 
 	/*
 		Read in keypoints
 	*/
-	const char BAGOWORDS_FILE[] = { "C:\\Users\\Raider\\Desktop\\MSU\\FS13\\CSE484\\project\\bagofwords\\bagofwords.txt" };
 	const int KEYPOINT_SIZE = 128;
 
 	vector<int> sizes;
@@ -565,7 +780,9 @@ EXPORTED void UpdateClusterCenters(char sizeFile[], char featureFile[], char clu
 
 	cout << "There are " << total_keypoints << " keypoints." << endl;
 
-	float* flann_data = readFeatures(total_keypoints, KEYPOINT_SIZE);
+	MappedMatrix* features = readFeatures(total_keypoints, KEYPOINT_SIZE);
+	if(features == 0x0) return;
+	float* flann_data = features->data().data;
 
 	/*
 		
@@ -581,6 +798,8 @@ EXPORTED void UpdateClusterCenters(char sizeFile[], char featureFile[], char clu
 	index_params.branching = 10;
 	index_params.iterations = 15;
 	index_params.centers_init = CENTERS_GONZALES;
+	index_params.kmeans_assign = KMEANS_ASSIGN_BLOCKED;
+	index_params.cores = 0;
 	index_params.target_precision = -1;
 	index_params.build_weight = 0.01;
 	index_params.memory_weight = 1;
@@ -590,80 +809,156 @@ EXPORTED void UpdateClusterCenters(char sizeFile[], char featureFile[], char clu
 	cout << "Flann result: " << flann_result << endl;
 	
 	int clusters_returned = flann_result;
+	// the open vocabulary maps the old cluster file, close it before overwriting it
+	if(VOCABULARY != 0x0)
+	{
+		flann_close_vocabulary(VOCABULARY, NULL);
+		VOCABULARY = 0x0;
+	}
+	if(INVERTED_INDEX != 0x0)
+	{
+		flann_close_inverted_index(INVERTED_INDEX, NULL);
+		INVERTED_INDEX = 0x0;
+	}
 	writeClusterData(cluster_centers, clusters_returned, KEYPOINT_SIZE);
+	// the flat vocabulary replaces the vocabulary tree, the binary documents
+	// and the inverted file have the words of the old vocabulary
+	remove(VOCABULARY_TREE_FILE);
+	removeHammingEmbedding();
+	remove(BAGOWORDS_FILE_BINARY);
+	remove(INVERTED_INDEX_FILE);
 	
-	//int clusters_returned;
-	//float* cluster_centers = ReadClusterFile(&clusters_returned);
-
-	IndexParameters build_index_params;
-	build_index_params.algorithm = KDTREE;
-	build_index_params.checks = 2048;
-	build_index_params.trees = 8;
-	build_index_params.target_precision = -1;
-	build_index_params.build_weight = 0.01;
-	build_index_params.memory_weight = 1;
-
-	float speedup;
-	FLANN_INDEX index = flann_build_index(cluster_centers,clusters_returned,KEYPOINT_SIZE,&speedup, &build_index_params,NULL);
-	cout << "Build index. " << endl;
-
-	ofstream bagOfWordsStream;
-	bagOfWordsStream.open(BAGOWORDS_FILE);
-	vector<string> imgNames;
-	readImageNames(&imgNames);
+	HeapFree(GetProcessHeap(), 0, cluster_centers);
 
-	if(bagOfWordsStream.is_open())
+	// builds the index over the new clusters and saves it
+	FLANN_VOCABULARY vocabulary = getVocabulary();
+	if(vocabulary == 0x0)
 	{
-		cout << "Successfully opened " << BAGOWORDS_FILE << endl;
-
-		FLANNParameters flann_params;
-		flann_params.log_level = LOG_NONE;
-		flann_params.log_destination = NULL;
-		flann_params.random_seed = CENTERS_RANDOM;
-		int keypoints_examined = 0;
-		for(int i = 0; i < sizes.size(); ++i)
-		{
-
-			//int* nearest =  &nearest_neighbors_result[i];
-			//int nearest_num = (int)(*(nearest + 4)); // the cluster center id is stored in the next 4 bytes
-			bagOfWordsStream << "<DOC>" << endl;
-			bagOfWordsStream << "<DOCNO>" << imgNames[i] << "</DOCNO>" << endl;
-			bagOfWordsStream << "<TEXT>" << endl;
-
-			int keypoints_i = sizes[i];
-
-			for(int j = 0; j < keypoints_i; ++j)
-			{
-				float keypoint[KEYPOINT_SIZE];
-				for(int k = 0; k < KEYPOINT_SIZE; ++k)
-				{
+		delete features;
+		return;
+	}
 
-					keypoint[k] = flann_data[keypoints_examined * KEYPOINT_SIZE + k];
-				}
-				keypoints_examined++;
-				int nearest_neighbor[1];
-				int _r = flann_find_nearest_neighbors_index(index,keypoint,1,nearest_neighbor,1,1024,&flann_params);
-				bagOfWordsStream << "w" << nearest_neighbor[0] << " ";
+	writeBagOfWords(vocabulary, features, sizes, CORPUS_TREC);
+	writeBagOfWords(vocabulary, features, sizes, CORPUS_BINARY);
 
-			}
-			bagOfWordsStream << endl << "</TEXT>" << endl;
-			bagOfWordsStream << "</DOC>" << endl;
+	delete features;
 
+	writeInvertedIndex();
+}
 
+EXPORTED void UpdateVocabularyTree(int levels)
+{
+	const int KEYPOINT_SIZE = 128;
 
+	vector<int> sizes;
+	readSizes(&sizes);
 
-			
-		}
-		cout << "Wrote " << sizes.size() << " bag of words documents." << endl;
-		bagOfWordsStream.close();
-	}
-	else
+	int total_keypoints = 0;
+	for(int i = 0; i < sizes.size(); ++i)
 	{
-		cout << "There was a problem opening " << BAGOWORDS_FILE << endl;
+		total_keypoints += sizes[i];
 	}
 
-	delete flann_data;
-	delete cluster_centers;
+	MappedMatrix* features = readFeatures(total_keypoints, KEYPOINT_SIZE);
+	if(features == 0x0) return;
+
+	IndexParameters index_params;
+	index_params.algorithm = KMEANS;
+	index_params.checks = 2048;
+	index_params.cb_index = 0.6;
+	index_params.branching = 10;
+	index_params.iterations = 15;
+	index_params.centers_init = CENTERS_GONZALES;
+	index_params.kmeans_assign = KMEANS_ASSIGN_BLOCKED;
+	index_params.cores = 0;
+	index_params.target_precision = -1;
+	index_params.build_weight = 0.01;
+	index_params.memory_weight = 1;
+
+	// the open vocabulary and inverted file map the files rewritten below
+	if(VOCABULARY != 0x0)
+	{
+		flann_close_vocabulary(VOCABULARY, NULL);
+		VOCABULARY = 0x0;
+	}
+	if(INVERTED_INDEX != 0x0)
+	{
+		flann_close_inverted_index(INVERTED_INDEX, NULL);
+		INVERTED_INDEX = 0x0;
+	}
+	removeHammingEmbedding();
+
+	int nodes = flann_build_vocabulary_tree(features->data().data, total_keypoints, KEYPOINT_SIZE, levels, 
+		VOCABULARY_TREE_FILE, &index_params, NULL);
+	if(nodes < 0)
+	{
+		cout << "There was a problem writing " << VOCABULARY_TREE_FILE << endl;
+		delete features;
+		return;
+	}
+	cout << "Wrote the vocabulary tree of " << nodes << " nodes to " << VOCABULARY_TREE_FILE << endl;
+
+	// the words are the nodes of the tree, the documents and the inverted file are written again.
+	// CreateBagOfWords gives the leaves of the tree from now on, so do the TREC documents.
+	FLANN_VOCABULARY vocabulary = getVocabulary();
+	if(vocabulary == 0x0)
+	{
+		delete features;
+		return;
+	}
+	writeBagOfWords(vocabulary, features, sizes, CORPUS_TREC);
+	writeBagOfWords(vocabulary, features, sizes, CORPUS_BINARY);
+	delete features;
+
+	writeInvertedIndex();
+}
+
+EXPORTED void UpdateHammingEmbedding()
+{
+	const int KEYPOINT_SIZE = 128;
+
+	vector<int> sizes;
+	readSizes(&sizes);
+
+	int total_keypoints = 0;
+	for(int i = 0; i < sizes.size(); ++i)
+	{
+		total_keypoints += sizes[i];
+	}
+
+	FLANN_VOCABULARY vocabulary = getVocabulary();
+	if(vocabulary == 0x0) return;
+	MappedMatrix* features = readFeatures(total_keypoints, KEYPOINT_SIZE);
+	if(features == 0x0) return;
+
+	if(INVERTED_INDEX != 0x0)
+	{
+		flann_close_inverted_index(INVERTED_INDEX, NULL);
+		INVERTED_INDEX = 0x0;
+	}
+	removeHammingEmbedding();
+
+	// the medians are learned on features spread over all the images
+	int step = max(1, total_keypoints / HAMMING_TRAINING_FEATURES);
+	int training_rows = total_keypoints / step;
+	Dataset<float> training(training_rows, KEYPOINT_SIZE);
+	for(int i = 0; i < training_rows; ++i)
+	{
+		memcpy(training[i], features->data()[i * step], KEYPOINT_SIZE * sizeof(float));
+	}
+	if(flann_train_hamming_embedding(vocabulary, training.data, training_rows, HAMMING_EMBEDDING_FILE, 1024, 0, NULL) != 0)
+	{
+		cout << "There was a problem writing " << HAMMING_EMBEDDING_FILE << endl;
+		delete features;
+		return;
+	}
+	cout << "Wrote the Hamming embedding " << HAMMING_EMBEDDING_FILE << endl;
+
+	// the binary documents and the inverted file are written again with the signatures
+	writeBagOfWords(vocabulary, features, sizes, CORPUS_BINARY);
+	delete features;
+
+	writeInvertedIndex();
 }
 
 EXPORTED void flann_log_verbosity(int level)
@@ -749,6 +1044,11 @@ EXPORTED FLANN_INDEX flann_build_index(float* dataset, int rows, int cols, float
 
 
 EXPORTED int flann_find_nearest_neighbors(float* dataset,  int rows, int cols, float* testset, int tcount, int* result, int nn, IndexParameters* index_params, FLANNParameters* flann_params)
+{
+	return flann_find_nearest_neighbors_dists(dataset, rows, cols, testset, tcount, result, NULL, nn, index_params, flann_params);
+}
+
+EXPORTED int flann_find_nearest_neighbors_dists(float* dataset,  int rows, int cols, float* testset, int tcount, int* result, float* dists, int nn, IndexParameters* index_params, FLANNParameters* flann_params)
 {
 	try {
 		init_flann_parameters(flann_params);
@@ -779,10 +1079,15 @@ EXPORTED int flann_find_nearest_neighbors(float* dataset,  int rows, int cols, f
 		logger.info("Finished creating the index.\n");
 		
 		logger.info("Searching for nearest neighbors.\n");
-        Params searchParams;
-        searchParams["checks"] = index_params->checks;
+        SearchParams searchParams(index_params->checks);
         Dataset<int> result_set(tcount, nn, result);
-        search_for_neighbors(*index, Dataset<float>(tcount, cols, testset), result_set, searchParams);
+        if (dists!=NULL) {
+            Dataset<float> dists_set(tcount, nn, dists);
+            search_for_neighbors(*index, Dataset<float>(tcount, cols, testset), result_set, dists_set, searchParams);
+        }
+        else {
+            search_for_neighbors(*index, Dataset<float>(tcount, cols, testset), result_set, searchParams);
+        }
 		
 		delete index;
 		delete inputData;
@@ -796,6 +1101,11 @@ EXPORTED int flann_find_nearest_neighbors(float* dataset,  int rows, int cols, f
 }
 
 EXPORTED int flann_find_nearest_neighbors_index(FLANN_INDEX index_ptr, float* testset, int tcount, int* result, int nn, int checks, FLANNParameters* flann_params)
+{
+	return flann_find_nearest_neighbors_index_dists(index_ptr, testset, tcount, result, NULL, nn, checks, flann_params);
+}
+
+EXPORTED int flann_find_nearest_neighbors_index_dists(FLANN_INDEX index_ptr, float* testset, int tcount, int* result, float* dists, int nn, int checks, FLANNParameters* flann_params)
 {
 	try {
 		init_flann_parameters(flann_params);
@@ -808,11 +1118,16 @@ EXPORTED int flann_find_nearest_neighbors_index(FLANN_INDEX index_ptr, float* te
         int length = index->veclen();        
         StartStopTimer t;
         t.start();
-        Params searchParams;
-        searchParams["checks"] = checks;
+        SearchParams searchParams(checks);
         Dataset<int> result_set(tcount, nn, result);
 		//printf("Setup result set\n");
-        search_for_neighbors(*index, Dataset<float>(tcount, length, testset), result_set, searchParams);
+        if (dists!=NULL) {
+            Dataset<float> dists_set(tcount, nn, dists);
+            search_for_neighbors(*index, Dataset<float>(tcount, length, testset), result_set, dists_set, searchParams);
+        }
+        else {
+            search_for_neighbors(*index, Dataset<float>(tcount, length, testset), result_set, searchParams);
+        }
 		//printf("nearest neighbor search complete!\n");
         t.stop();
         logger.info("Searching took %g seconds\n",t.value);
@@ -826,6 +1141,98 @@ EXPORTED int flann_find_nearest_neighbors_index(FLANN_INDEX index_ptr, float* te
 	
 }
 
+EXPORTED int flann_find_nearest_neighbors_batch(FLANN_INDEX index_ptr, float* testset, int tcount, int* result, float* dists, int nn, int checks, int cores, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (index_ptr==NULL) {
+            throw FLANNException("Invalid index");
+        }
+        NNIndexPtr index = NNIndexPtr(index_ptr);
+        int length = index->veclen();
+        StartStopTimer t;
+        t.start();
+        SearchParams searchParams(checks);
+        Dataset<int> result_set(tcount, nn, result);
+        if (dists!=NULL) {
+            Dataset<float> dists_set(tcount, nn, dists);
+            search_for_neighbors_batch(*index, Dataset<float>(tcount, length, testset), result_set, &dists_set, searchParams, cores);
+        }
+        else {
+            search_for_neighbors_batch(*index, Dataset<float>(tcount, length, testset), result_set, NULL, searchParams, cores);
+        }
+        t.stop();
+        logger.info("Searching %d queries took %g seconds\n", tcount, t.value);
+
+		return 0;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+		return -1;
+	}
+}
+
+EXPORTED int flann_save_index(FLANN_INDEX index_ptr, const char* filename, float* dataset, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (index_ptr==NULL) {
+            throw FLANNException("Invalid index");
+        }
+        NNIndexPtr index = NNIndexPtr(index_ptr);
+        if (dataset!=NULL) {
+            Dataset<float> data(index->size(), index->veclen(), dataset);
+            save_index(*index, filename, &data);
+        }
+        else {
+            save_index(*index, filename);
+        }
+
+        return 0;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED FLANN_INDEX flann_load_index(const char* filename, float* dataset, int rows, int cols, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        StartStopTimer t;
+        t.start();
+        DatasetPtr data = NULL;
+        NNIndexPtr index;
+        if (dataset!=NULL) {
+            data = new Dataset<float>(rows, cols, dataset);
+            try {
+                DatasetPtr loaded;
+                index = load_index(filename, data, loaded);
+            }
+            catch (...) {
+                delete data;
+                throw;
+            }
+        }
+        else {
+            index = load_index(filename, NULL, data);
+        }
+        loaded_datasets[index] = data;
+        t.stop();
+        logger.info("Loading index took: %g\n",t.value);
+
+        return index;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return NULL;
+	}
+}
+
 int flann_free_index(FLANN_INDEX index_ptr, FLANNParameters* flann_params)
 {
 	try {
@@ -836,6 +1243,12 @@ int flann_free_index(FLANN_INDEX index_ptr, FLANNParameters* flann_params)
         }
         NNIndexPtr index = NNIndexPtr(index_ptr);
         delete index;
+
+        map<NNIndex*, DatasetPtr>::iterator loaded = loaded_datasets.find(index);
+        if (loaded!=loaded_datasets.end()) {
+            delete loaded->second;
+            loaded_datasets.erase(loaded);
+        }
      
         return 0;   
 	}
@@ -845,6 +1258,337 @@ int flann_free_index(FLANN_INDEX index_ptr, FLANNParameters* flann_params)
 	}
 }
 
+EXPORTED FLANN_VOCABULARY flann_open_vocabulary(const char* cluster_file, const char* index_file, IndexParameters* index_params, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (cluster_file==NULL || index_params==NULL) {
+            throw FLANNException("The cluster_file and index_params arguments must be non-null");
+        }
+        if (index_params->algorithm<0 || index_params->algorithm>=(int)ARRAY_LEN(algos)) {
+            throw FLANNException("Unknown index algorithm");
+        }
+        StartStopTimer t;
+        t.start();
+        Vocabulary* vocabulary = new Vocabulary(cluster_file, index_file, parametersToParams(*index_params));
+        t.stop();
+        logger.info("Opening the vocabulary took: %g\n",t.value);
+
+        return vocabulary;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return NULL;
+	}
+}
+
+EXPORTED int flann_build_vocabulary_tree(float* dataset, int rows, int cols, int levels, const char* tree_file, 
+                IndexParameters* index_params, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (tree_file==NULL || index_params==NULL) {
+            throw FLANNException("The tree_file and index_params arguments must be non-null");
+        }
+        StartStopTimer t;
+        t.start();
+        Dataset<float> inputData(rows,cols,dataset);
+        KMeansTree kmeans(inputData, parametersToParams(*index_params));
+        kmeans.buildIndex();
+
+        vector<int> children;
+        vector<float> pivots;
+        int nodes = kmeans.getTree(levels, children, pivots);
+        save_vocabulary_tree(tree_file, kmeans.getBranching(), cols, children, pivots);
+        t.stop();
+        logger.info("Building the vocabulary tree of %d nodes took: %g\n", nodes, t.value);
+
+        return nodes;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED FLANN_VOCABULARY flann_open_vocabulary_tree(const char* tree_file, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (tree_file==NULL) {
+            throw FLANNException("The tree_file argument must be non-null");
+        }
+        return new Vocabulary(tree_file);
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return NULL;
+	}
+}
+
+EXPORTED int flann_quantize(FLANN_VOCABULARY vocabulary_ptr, float* descriptors, int rows, int* words, int checks, int cores, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (vocabulary_ptr==NULL) {
+            throw FLANNException("Invalid vocabulary");
+        }
+        Vocabulary* vocabulary = (Vocabulary*)vocabulary_ptr;
+        vocabulary->quantize(Dataset<float>(rows, vocabulary->veclen(), descriptors), words, checks, cores);
+
+        return 0;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED int flann_bag_of_words(FLANN_VOCABULARY vocabulary_ptr, float* descriptors, int rows, int* histogram, int capacity, int checks, int cores, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (vocabulary_ptr==NULL) {
+            throw FLANNException("Invalid vocabulary");
+        }
+        if (capacity>0 && histogram==NULL) {
+            throw FLANNException("The histogram argument must be non-null");
+        }
+        Vocabulary* vocabulary = (Vocabulary*)vocabulary_ptr;
+        return vocabulary->histogram(Dataset<float>(rows, vocabulary->veclen(), descriptors), histogram, capacity, checks, cores);
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED int flann_build_inverted_index(const char* corpus_file, const char* index_file, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (corpus_file==NULL || index_file==NULL) {
+            throw FLANNException("The corpus_file and index_file arguments must be non-null");
+        }
+        build_inverted_index(corpus_file, index_file);
+
+        return 0;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED FLANN_INVERTED_INDEX flann_open_inverted_index(const char* index_file, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (index_file==NULL) {
+            throw FLANNException("The index_file argument must be non-null");
+        }
+        return new InvertedIndex(index_file);
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return NULL;
+	}
+}
+
+EXPORTED int flann_query_inverted_index(FLANN_INVERTED_INDEX index_ptr, const int* histogram, int pairs, int k, int scoring, 
+                int* images, float* scores, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (index_ptr==NULL) {
+            throw FLANNException("Invalid inverted index");
+        }
+        if ((pairs>0 && histogram==NULL) || (k>0 && images==NULL)) {
+            throw FLANNException("The histogram and images arguments must be non-null");
+        }
+        return ((InvertedIndex*)index_ptr)->query(histogram, pairs, k, scoring, images, scores);
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED int flann_search_images(FLANN_VOCABULARY vocabulary_ptr, FLANN_INVERTED_INDEX index_ptr, float* descriptors, int rows, int k, 
+                int scoring, int* images, float* scores, int checks, int cores, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (vocabulary_ptr==NULL || index_ptr==NULL) {
+            throw FLANNException("Invalid vocabulary or inverted index");
+        }
+        if (k>0 && images==NULL) {
+            throw FLANNException("The images argument must be non-null");
+        }
+        Vocabulary* vocabulary = (Vocabulary*)vocabulary_ptr;
+        int capacity = rows*vocabulary->words_per_descriptor();
+        vector<int> histogram(2*capacity+2);
+        int pairs = vocabulary->histogram(Dataset<float>(rows, vocabulary->veclen(), descriptors), &histogram[0], capacity, checks, cores);
+        return ((InvertedIndex*)index_ptr)->query(&histogram[0], pairs, k, scoring, images, scores);
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED int flann_inverted_index_size(FLANN_INVERTED_INDEX index_ptr)
+{
+    if (index_ptr==NULL) {
+        return -1;
+    }
+    return ((InvertedIndex*)index_ptr)->size();
+}
+
+EXPORTED const char* flann_inverted_index_image_name(FLANN_INVERTED_INDEX index_ptr, int image)
+{
+    if (index_ptr==NULL || image<0 || image>=((InvertedIndex*)index_ptr)->size()) {
+        return NULL;
+    }
+    return ((InvertedIndex*)index_ptr)->name(image);
+}
+
+EXPORTED int flann_close_inverted_index(FLANN_INVERTED_INDEX index_ptr, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (index_ptr==NULL) {
+            throw FLANNException("Invalid inverted index");
+        }
+        delete (InvertedIndex*)index_ptr;
+
+        return 0;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED int flann_train_hamming_embedding(FLANN_VOCABULARY vocabulary_ptr, float* descriptors, int rows, const char* embedding_file, 
+                int checks, int cores, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (vocabulary_ptr==NULL || embedding_file==NULL) {
+            throw FLANNException("Invalid vocabulary or embedding file");
+        }
+        Vocabulary* vocabulary = (Vocabulary*)vocabulary_ptr;
+        train_hamming_embedding(*vocabulary, Dataset<float>(rows, vocabulary->veclen(), descriptors), embedding_file, checks, cores);
+
+        return 0;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED FLANN_HAMMING_EMBEDDING flann_open_hamming_embedding(const char* embedding_file, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (embedding_file==NULL) {
+            throw FLANNException("The embedding_file argument must be non-null");
+        }
+        return new HammingEmbedding(embedding_file);
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return NULL;
+	}
+}
+
+EXPORTED int flann_search_images_hamming(FLANN_VOCABULARY vocabulary_ptr, FLANN_HAMMING_EMBEDDING embedding_ptr, FLANN_INVERTED_INDEX index_ptr, 
+                float* descriptors, int rows, int k, int threshold, int* images, float* scores, int checks, int cores, 
+                FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (vocabulary_ptr==NULL || embedding_ptr==NULL || index_ptr==NULL) {
+            throw FLANNException("Invalid vocabulary, embedding or inverted index");
+        }
+        if (k>0 && images==NULL) {
+            throw FLANNException("The images argument must be non-null");
+        }
+        Vocabulary* vocabulary = (Vocabulary*)vocabulary_ptr;
+        Dataset<float> query(rows, vocabulary->veclen(), descriptors);
+        vector<int> words(rows+1);
+        vocabulary->quantize(query, &words[0], checks, cores);
+        vector<int> histogram;
+        vector<unsigned long long> signatures;
+        int pairs = embedded_bag_of_words(*vocabulary, *(HammingEmbedding*)embedding_ptr, query, &words[0], histogram, signatures);
+        return ((InvertedIndex*)index_ptr)->querySignatures(pairs>0 ? &histogram[0] : NULL, pairs, pairs>0 ? &signatures[0] : NULL, 
+            threshold, k, images, scores);
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED int flann_close_hamming_embedding(FLANN_HAMMING_EMBEDDING embedding_ptr, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (embedding_ptr==NULL) {
+            throw FLANNException("Invalid Hamming embedding");
+        }
+        delete (HammingEmbedding*)embedding_ptr;
+
+        return 0;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
+EXPORTED int flann_vocabulary_size(FLANN_VOCABULARY vocabulary_ptr)
+{
+    if (vocabulary_ptr==NULL) {
+        return -1;
+    }
+    return ((Vocabulary*)vocabulary_ptr)->size();
+}
+
+EXPORTED int flann_close_vocabulary(FLANN_VOCABULARY vocabulary_ptr, FLANNParameters* flann_params)
+{
+	try {
+		init_flann_parameters(flann_params);
+
+        if (vocabulary_ptr==NULL) {
+            throw FLANNException("Invalid vocabulary");
+        }
+        delete (Vocabulary*)vocabulary_ptr;
+
+        return 0;
+	}
+	catch(runtime_error& e) {
+		logger.error("Caught exception: %s\n",e.what());
+        return -1;
+	}
+}
+
 EXPORTED int flann_compute_cluster_centers(float* dataset, int rows, int cols, int clusters, float* result, IndexParameters* index_params, FLANNParameters* flann_params)
 {
 	printf("AAAAAAAAAAAAAAAAAAAAAAAAAAAAA\n");
@@ -30,6 +30,11 @@ struct IndexParameters {
 	float build_weight;        // build tree time weighting factor
 	float memory_weight;       // index memory weigthing factor
     float sample_fraction;     // what fraction of the dataset to use for autotuning
+	int kmeans_assign;         // algorithm used for assigning the points to the centers in the kmeans iterations
+	int cores;                 // number of threads used for building the index (0 for all the cores)
+	int lists;                 // number of inverted lists (for the IVF-PQ index)
+	int subquantizers;         // bytes per vector, must divide the vector length (for the IVF-PQ index)
+	int rerank;                // candidates ranked by their exact distances, 0 for none (for the IVF-PQ index)
 };
 
 
@@ -44,6 +49,9 @@ struct FLANNParameters {
 
 
 typedef void* FLANN_INDEX;
+typedef void* FLANN_VOCABULARY;
+typedef void* FLANN_INVERTED_INDEX;
+typedef void* FLANN_HAMMING_EMBEDDING;
 
 #ifdef __cplusplus
 extern "C" {
@@ -52,8 +60,78 @@ extern "C" {
 LIBSPEC void WarmUp();
 LIBSPEC char* CreateBagOfWords(float* keypoint_data, int num_keypoints);
 
+/**
+Computes the visual word histogram of the keypoints of a query image, without
+formatting a document.
+
+Params:
+    keypoint_data = the keypoints, 128 values each
+    num_keypoints = number of values in keypoint_data (128 per keypoint), as for CreateBagOfWords
+    histogram = array for the (word, count) pairs, sorted by word
+    capacity = number of pairs the histogram array can hold
+
+Returns: the number of distinct words (only capacity pairs are written if it's larger)
+or a number <0 for error
+*/
+LIBSPEC int CreateBagOfWordsHistogram(float* keypoint_data, int num_keypoints, int* histogram, int capacity);
+
+/**
+Finds the images of the collection most similar to a query image, scored from the visual 
+words they share with it.
+
+Params:
+    keypoint_data = the keypoints of the query image, 128 values each
+    num_keypoints = number of values in keypoint_data (128 per keypoint), as for CreateBagOfWords
+    k = number of images to return
+    images = array for the images (k elements), by decreasing score
+    scores = array for their scores (k elements) or NULL
+
+Returns: the number of images written or a number <0 for error
+*/
+LIBSPEC int QueryImages(float* keypoint_data, int num_keypoints, int k, int* images, float* scores);
+
+/**
+Copies the name of an image returned by QueryImages.
+
+Returns: the length of the name (the name is truncated if it's not shorter than 
+capacity) or a number <0 for error
+*/
+LIBSPEC int GetImageName(int image, char* name, int capacity);
+
 LIBSPEC void UpdateClusterCenters(char sizeFile[], char featureFile[], char clusterOutputFile[]);
 
+/**
+Builds a vocabulary tree over the features of all the images (a hierarchical k-means 
+tree of branching 10) and uses it as the vocabulary instead of the cluster centers, 
+until UpdateClusterCenters is called again. The binary bag of words documents and the 
+inverted file used by QueryImages are written again with the nodes of the tree as the 
+words, and the TREC documents with the leaves of the tree, the words given by 
+CreateBagOfWords (the text index built from them must be built again).
+
+Params:
+    levels = number of levels of the tree below the root (6 gives up to a million 
+            leaves), <=0 for the whole tree
+*/
+LIBSPEC void UpdateVocabularyTree(int levels);
+
+/**
+Learns a Hamming embedding of the current vocabulary on a sample of the features of the 
+images, then writes the binary bag of words documents and the inverted file again with 
+the signatures of the descriptors. QueryImages then only counts the descriptors of the 
+same word with close signatures, until the vocabulary is changed.
+*/
+LIBSPEC void UpdateHammingEmbedding();
+
+/**
+Quantizes the features of all the images with the current vocabulary and writes their 
+bag of words documents again, without computing new clusters.
+
+Params:
+    binary = non-zero for the binary documents (sorted word and count pairs) and the 
+            inverted file used by QueryImages, zero for the TREC text documents
+*/
+LIBSPEC void UpdateBagOfWords(int binary);
+
 /**
 Sets the log level used for all flann functions (unless 
 specified in FLANNParameters for each call
@@ -106,6 +184,15 @@ Returns: zero or NULL for error
 */
 LIBSPEC int flann_find_nearest_neighbors(float* dataset, int rows, int cols, float* testset, int trows, int* result, int nn, struct IndexParameters* index_params, struct FLANNParameters* flann_params);
 
+/**
+Same as flann_find_nearest_neighbors, also returning the distances to the neighbors.
+
+Params:
+    dists = pointer to matrix for the squared distances to the nearest neighbors
+            (same size as result)
+*/
+LIBSPEC int flann_find_nearest_neighbors_dists(float* dataset, int rows, int cols, float* testset, int trows, int* result, float* dists, int nn, struct IndexParameters* index_params, struct FLANNParameters* flann_params);
+
 /**
 Searches for nearest neighbors using the index provided 
 
@@ -123,6 +210,37 @@ Returns: zero or a number <0 for error
 */
 LIBSPEC int flann_find_nearest_neighbors_index(FLANN_INDEX index_id, float* testset, int trows, int* result, int nn, int checks, struct FLANNParameters* flann_params);
 
+/**
+Same as flann_find_nearest_neighbors_index, also returning the distances to the neighbors.
+
+Params:
+    dists = pointer to matrix for the squared distances to the nearest neighbors
+            (same size as result)
+*/
+LIBSPEC int flann_find_nearest_neighbors_index_dists(FLANN_INDEX index_id, float* testset, int trows, int* result, float* dists, int nn, int checks, struct FLANNParameters* flann_params);
+
+/**
+Searches for the nearest neighbors of a batch of queries using the index provided.
+The queries are split between several threads, each one searching with its own
+search context.
+
+Params:
+    index_id = the index (constructed previously using flann_build_index).
+    testset = pointer to a query set stored in row major order
+    trows = number of rows (features) in the query dataset (same dimensionality as features in the dataset)
+    result = pointer to matrix for the indices of the nearest neighbors of the testset features in the dataset
+            (must have trows number of rows and nn number of columns)
+    dists = pointer to matrix for the squared distances to the nearest neighbors (same size as result),
+            or NULL if they are not needed
+    nn = how many nearest neighbors to return
+    checks = number of checks to perform before the search is stopped
+    cores = number of threads to use (0 for all the cores)
+    flann_params = generic flann parameters
+
+Returns: zero or a number <0 for error
+*/
+LIBSPEC int flann_find_nearest_neighbors_batch(FLANN_INDEX index_id, float* testset, int trows, int* result, float* dists, int nn, int checks, int cores, struct FLANNParameters* flann_params);
+
 /**
 Deletes an index and releases the memory used by it.
 
@@ -134,6 +252,271 @@ Returns: zero or a number <0 for error
 */
 LIBSPEC int flann_free_index(FLANN_INDEX index_id, struct FLANNParameters* flann_params);
 
+/**
+Saves an index to a file, so that it can be loaded later without building it again.
+
+Params:
+    index_id = the index (constructed previously using flann_build_index).
+    filename = the index file
+    dataset = the dataset the index was built over (index size rows and index dimensionality
+            columns) to store it in the file, or NULL to store only the index
+    flann_params = generic flann parameters
+
+Returns: zero or a number <0 for error
+*/
+LIBSPEC int flann_save_index(FLANN_INDEX index_id, const char* filename, float* dataset, struct FLANNParameters* flann_params);
+
+/**
+Loads an index saved with flann_save_index.
+
+Params:
+    filename = the index file
+    dataset = pointer to the data set the index was built over, stored in row major order, 
+            or NULL to use the data set stored in the file
+    rows = number of rows (features) in the dataset (ignored if dataset is NULL)
+    cols = number of columns in the dataset (ignored if dataset is NULL)
+    flann_params = generic flann parameters
+
+Returns: the index or NULL for error
+*/
+LIBSPEC FLANN_INDEX flann_load_index(const char* filename, float* dataset, int rows, int cols, struct FLANNParameters* flann_params);
+
+/**
+Opens a visual vocabulary: maps the cluster centers and loads the index used for
+quantizing the descriptors, or builds it if it can't be loaded. Both are kept until 
+the vocabulary is closed, so quantizing doesn't read any file.
+
+Params:
+    cluster_file = matrix file with the cluster centers (the visual words)
+    index_file = index file built over the centers, loaded if it is newer than the
+            cluster file, otherwise built and saved there. Can be NULL.
+    index_params = parameters used to build the index when it can't be loaded
+    flann_params = generic flann parameters
+
+Returns: the vocabulary or NULL for error
+*/
+LIBSPEC FLANN_VOCABULARY flann_open_vocabulary(const char* cluster_file, const char* index_file, struct IndexParameters* index_params, struct FLANNParameters* flann_params);
+
+/**
+Builds a vocabulary tree: a hierarchical k-means tree over a set of descriptors, 
+cut at a number of levels and saved with the children centers of its nodes. The 
+words of a vocabulary tree are its nodes: a descriptor is quantized by going down 
+to the closest child at each level (branching distances per level) and its bag of 
+words has all the nodes of its path but the root, so that the upper levels weigh 
+in the scores with their own idf.
+
+Params:
+    dataset = pointer to the descriptors stored in row major order
+    rows = number of descriptors
+    cols = length of the descriptors
+    levels = number of levels below the root, <=0 for the whole tree
+    tree_file = the tree file written
+    index_params = parameters of the clustering (branching, iterations, centers_init,
+            kmeans_assign, cores)
+    flann_params = generic flann parameters
+
+Returns: the number of nodes of the tree or a number <0 for error
+*/
+LIBSPEC int flann_build_vocabulary_tree(float* dataset, int rows, int cols, int levels, const char* tree_file, 
+                struct IndexParameters* index_params, struct FLANNParameters* flann_params);
+
+/**
+Opens a vocabulary tree written by flann_build_vocabulary_tree, mapped in memory until 
+the vocabulary is closed. It is used as the vocabularies opened with flann_open_vocabulary.
+
+Returns: the vocabulary or NULL for error
+*/
+LIBSPEC FLANN_VOCABULARY flann_open_vocabulary_tree(const char* tree_file, struct FLANNParameters* flann_params);
+
+/**
+Finds the visual word (the closest cluster center) of each descriptor, the leaf of
+each descriptor for a vocabulary tree.
+
+Params:
+    vocabulary = the vocabulary (opened with flann_open_vocabulary)
+    descriptors = pointer to the descriptors stored in row major order
+    rows = number of descriptors
+    words = array for the word of each descriptor (rows elements)
+    checks = number of checks to perform before the search is stopped
+    cores = number of threads to use (0 for all the cores)
+    flann_params = generic flann parameters
+
+Returns: zero or a number <0 for error
+*/
+LIBSPEC int flann_quantize(FLANN_VOCABULARY vocabulary, float* descriptors, int rows, int* words, int checks, int cores, struct FLANNParameters* flann_params);
+
+/**
+Computes the visual word histogram (bag of words) of a set of descriptors.
+
+Params:
+    vocabulary = the vocabulary (opened with flann_open_vocabulary)
+    descriptors = pointer to the descriptors stored in row major order
+    rows = number of descriptors
+    histogram = array for the (word, count) pairs: the distinct words in increasing 
+            order, each one followed by its number of descriptors
+    capacity = number of pairs the histogram array can hold (2*capacity ints), 
+            rows pairs are always enough (rows times the depth for a vocabulary tree)
+    checks = number of checks to perform before the search is stopped
+    cores = number of threads to use (0 for all the cores)
+    flann_params = generic flann parameters
+
+Returns: the number of distinct words, of which only the first capacity are written,
+or a number <0 for error
+*/
+LIBSPEC int flann_bag_of_words(FLANN_VOCABULARY vocabulary, float* descriptors, int rows, int* histogram, int capacity, int checks, int cores, struct FLANNParameters* flann_params);
+
+/**
+Returns: the number of visual words of a vocabulary or a number <0 for error
+*/
+LIBSPEC int flann_vocabulary_size(FLANN_VOCABULARY vocabulary);
+
+/**
+Closes a vocabulary and releases the memory used by it.
+
+Returns: zero or a number <0 for error
+*/
+LIBSPEC int flann_close_vocabulary(FLANN_VOCABULARY vocabulary, struct FLANNParameters* flann_params);
+
+/**
+Builds the inverted file of a binary bag of words corpus (the documents written by 
+UpdateBagOfWords).
+
+Params:
+    corpus_file = the binary corpus
+    index_file = the inverted file written
+    flann_params = generic flann parameters
+
+Returns: zero or a number <0 for error
+*/
+LIBSPEC int flann_build_inverted_index(const char* corpus_file, const char* index_file, struct FLANNParameters* flann_params);
+
+/**
+Opens an inverted file, mapped in memory until it's closed.
+
+Returns: the inverted index or NULL for error
+*/
+LIBSPEC FLANN_INVERTED_INDEX flann_open_inverted_index(const char* index_file, struct FLANNParameters* flann_params);
+
+/**
+Finds the images with the highest scores for a bag of words query.
+
+Params:
+    index = the inverted index
+    histogram = the (word, count) pairs of the query
+    pairs = number of pairs
+    k = number of images to return
+    scoring = SCORING_TFIDF (0) or SCORING_BM25 (1)
+    images = array for the images (k elements), by decreasing score
+    scores = array for their scores (k elements) or NULL
+    flann_params = generic flann parameters
+
+Returns: the number of images written or a number <0 for error
+*/
+LIBSPEC int flann_query_inverted_index(FLANN_INVERTED_INDEX index, const int* histogram, int pairs, int k, int scoring, 
+                int* images, float* scores, struct FLANNParameters* flann_params);
+
+/**
+Quantizes the descriptors of a query image and finds the images with the highest scores,
+in one call.
+
+Params:
+    vocabulary = the vocabulary the corpus of the inverted index was quantized with
+    index = the inverted index
+    descriptors = pointer to the descriptors stored in row major order
+    rows = number of descriptors
+    k = number of images to return
+    scoring = SCORING_TFIDF (0) or SCORING_BM25 (1)
+    images = array for the images (k elements), by decreasing score
+    scores = array for their scores (k elements) or NULL
+    checks = number of checks of the quantization
+    cores = number of threads of the quantization (0 for all the cores)
+    flann_params = generic flann parameters
+
+Returns: the number of images written or a number <0 for error
+*/
+LIBSPEC int flann_search_images(FLANN_VOCABULARY vocabulary, FLANN_INVERTED_INDEX index, float* descriptors, int rows, int k, 
+                int scoring, int* images, float* scores, int checks, int cores, struct FLANNParameters* flann_params);
+
+/**
+Returns: the number of images of an inverted index or a number <0 for error
+*/
+LIBSPEC int flann_inverted_index_size(FLANN_INVERTED_INDEX index);
+
+/**
+Returns: the name of an image of an inverted index (valid until the index is closed)
+or NULL for error
+*/
+LIBSPEC const char* flann_inverted_index_image_name(FLANN_INVERTED_INDEX index, int image);
+
+/**
+Closes an inverted index.
+
+Returns: zero or a number <0 for error
+*/
+LIBSPEC int flann_close_inverted_index(FLANN_INVERTED_INDEX index, struct FLANNParameters* flann_params);
+
+/**
+Learns a Hamming embedding for a vocabulary: a 64 bit signature of the position of a
+descriptor in the cell of each of its words (a random orthogonal projection of the
+descriptor thresholded at the medians of the training descriptors of the word). When
+the binary documents are written with it (UpdateBagOfWords), the inverted file keeps
+the signatures and flann_search_images_hamming only matches the descriptors with close
+signatures.
+
+Params:
+    vocabulary = the vocabulary
+    descriptors = pointer to the training descriptors stored in row major order
+    rows = number of training descriptors
+    embedding_file = the embedding file written
+    checks = number of checks of the quantization
+    cores = number of threads of the quantization (0 for all the cores)
+    flann_params = generic flann parameters
+
+Returns: zero or a number <0 for error
+*/
+LIBSPEC int flann_train_hamming_embedding(FLANN_VOCABULARY vocabulary, float* descriptors, int rows, const char* embedding_file, 
+                int checks, int cores, struct FLANNParameters* flann_params);
+
+/**
+Opens a Hamming embedding file, mapped in memory until it's closed.
+
+Returns: the embedding or NULL for error
+*/
+LIBSPEC FLANN_HAMMING_EMBEDDING flann_open_hamming_embedding(const char* embedding_file, struct FLANNParameters* flann_params);
+
+/**
+Quantizes the descriptors of a query image, computes their signatures and finds the 
+images with the highest tf-idf scores, counting only the pairs of descriptors of the 
+same word whose signatures differ by at most threshold bits.
+
+Params:
+    vocabulary = the vocabulary the corpus of the inverted index was quantized with
+    embedding = the Hamming embedding of the corpus
+    index = the inverted index, built from a corpus with signatures
+    descriptors = pointer to the descriptors stored in row major order
+    rows = number of descriptors
+    k = number of images to return
+    threshold = largest Hamming distance of matching descriptors (0 to 64, 64 gives
+            the scores of SCORING_TFIDF)
+    images = array for the images (k elements), by decreasing score
+    scores = array for their scores (k elements) or NULL
+    checks = number of checks of the quantization
+    cores = number of threads of the quantization (0 for all the cores)
+    flann_params = generic flann parameters
+
+Returns: the number of images written or a number <0 for error
+*/
+LIBSPEC int flann_search_images_hamming(FLANN_VOCABULARY vocabulary, FLANN_HAMMING_EMBEDDING embedding, FLANN_INVERTED_INDEX index, 
+                float* descriptors, int rows, int k, int threshold, int* images, float* scores, int checks, int cores, 
+                struct FLANNParameters* flann_params);
+
+/**
+Closes a Hamming embedding.
+
+Returns: zero or a number <0 for error
+*/
+LIBSPEC int flann_close_hamming_embedding(FLANN_HAMMING_EMBEDDING embedding, struct FLANNParameters* flann_params);
+
 /**
 Clusters the features in the dataset using a hierarchical kmeans clustering approach.
 This is significantly faster than using a flat kmeans clustering for a large number
@@ -0,0 +1,335 @@
+#include "Corpus.h"
+
+#include "../util/ThreadPool.h"
+#include "../util/Logger.h"
+#include "../util/Timer.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+
+namespace {
+
+const char CORPUS_SIGNATURE[8] = { 'F','L','A','N','N','B','O','W' };
+
+/* Number of features a chunk is filled up to (it always holds whole images). */
+const int CHUNK_FEATURES = 16384;
+
+/* Number of chunks quantized ahead of the writer, per thread. */
+const int CHUNKS_PER_THREAD = 2;
+
+
+/**
+    A range of consecutive images and, once quantized, their documents.
+*/
+struct Chunk
+{
+    int first_image;
+    int end_image;
+    size_t first_feature;
+    std::string output;
+    TaskGroup group;
+};
+
+
+void append_int(std::string& output, int value)
+{
+    output.append((const char*)&value, sizeof(int));
+}
+
+
+/**
+    Quantizes the features of a chunk on one thread and formats its documents.
+*/
+class QuantizeChunkTask : public Task
+{
+    Vocabulary& vocabulary;
+    const Dataset<float>& features;
+    const std::vector<int>& sizes;
+    const std::vector<std::string>& names;
+    CorpusFormat format;
+    int checks;
+    const HammingEmbedding* embedding;
+    Chunk& chunk;
+
+public:
+    QuantizeChunkTask(Vocabulary& vocabulary_, const Dataset<float>& features_, const std::vector<int>& sizes_,
+            const std::vector<std::string>& names_, CorpusFormat format_, int checks_, const HammingEmbedding* embedding_,
+            Chunk& chunk_) :
+        vocabulary(vocabulary_), features(features_), sizes(sizes_), names(names_), format(format_),
+        checks(checks_), embedding(embedding_), chunk(chunk_)
+    {
+    }
+
+    void run()
+    {
+        size_t rows = 0;
+        for (int i=chunk.first_image;i<chunk.end_image;++i) {
+            rows += sizes[i];
+        }
+        std::vector<int> words(rows);
+        if (rows>0) {
+            Dataset<float> chunk_features((int)rows, features.cols, features[0]+chunk.first_feature*features.cols);
+            vocabulary.quantize(chunk_features, &words[0], checks, 1);
+        }
+
+        chunk.output.clear();
+        char word[16];
+        std::vector<int> histogram;
+        std::vector<unsigned long long> signatures;
+        int* image_words = rows>0 ? &words[0] : NULL;
+        const float* image_features = features[0]+chunk.first_feature*features.cols;
+        for (int i=chunk.first_image;i<chunk.end_image;++i) {
+            if (format==CORPUS_TREC) {
+                chunk.output += "<DOC>\n<DOCNO>";
+                chunk.output += names[i];
+                chunk.output += "</DOCNO>\n<TEXT>\n";
+                for (int j=0;j<sizes[i];++j) {
+                    int length = sprintf(word, "w%d ", image_words[j]);
+                    chunk.output.append(word, length);
+                }
+                chunk.output += "\n</TEXT>\n</DOC>\n";
+            }
+            else if (embedding!=NULL) {
+                Dataset<float> image(sizes[i], features.cols, (float*)image_features);
+                int distinct = embedded_bag_of_words(vocabulary, *embedding, image, image_words, histogram, signatures);
+                append_int(chunk.output, (int)names[i].size());
+                chunk.output += names[i];
+                append_int(chunk.output, distinct);
+                if (distinct>0) {
+                    chunk.output.append((const char*)&histogram[0], 2*distinct*sizeof(int));
+                    chunk.output.append((const char*)&signatures[0], signatures.size()*sizeof(unsigned long long));
+                }
+            }
+            else {
+                int capacity = sizes[i]*vocabulary.words_per_descriptor();
+                histogram.resize(2*capacity+2);
+                int distinct = vocabulary.bag_of_words(image_words, sizes[i], &histogram[0], capacity);
+                append_int(chunk.output, (int)names[i].size());
+                chunk.output += names[i];
+                append_int(chunk.output, distinct);
+                chunk.output.append((const char*)&histogram[0], 2*distinct*sizeof(int));
+            }
+            image_words += sizes[i];
+            image_features += (size_t)sizes[i]*features.cols;
+        }
+    }
+};
+
+}
+
+
+void write_corpus(Vocabulary& vocabulary, const Dataset<float>& features, const std::vector<int>& sizes,
+            const std::vector<std::string>& names, const char* filename, CorpusFormat format, int checks, int cores,
+            const HammingEmbedding* embedding)
+{
+    if (names.size()<sizes.size()) {
+        throw FLANNException("There are fewer image names than images");
+    }
+    if (features.cols!=vocabulary.veclen()) {
+        throw FLANNException("The features and the vocabulary have different lengths");
+    }
+    if (format!=CORPUS_BINARY) {
+        embedding = NULL;
+    }
+    if (embedding!=NULL && (embedding->words()!=vocabulary.size() || embedding->veclen()!=features.cols)) {
+        throw FLANNException("The Hamming embedding was trained for another vocabulary");
+    }
+    size_t total = 0;
+    for (size_t i=0;i<sizes.size();++i) {
+        if (sizes[i]<0) {
+            throw FLANNException("Negative number of features");
+        }
+        total += sizes[i];
+    }
+    if (total>(size_t)features.rows) {
+        throw FLANNException("The images have more features than the feature matrix");
+    }
+
+    // text mode for the TREC documents, so that the lines end as with an ofstream
+    FILE* stream = fopen(filename, format==CORPUS_TREC ? "w" : "wb");
+    if (stream==NULL) {
+        throw FLANNException("Cannot open the corpus file for writing");
+    }
+
+    StartStopTimer t;
+    t.start();
+
+    ThreadPool pool(cores);
+    const int window = CHUNKS_PER_THREAD*pool.size();
+    Chunk* chunks = new Chunk[window];
+    int images = (int)sizes.size();
+    int next_image = 0;
+    size_t next_feature = 0;
+    int spawned = 0;
+    int written = 0;
+
+    try {
+        if (format==CORPUS_BINARY) {
+            CorpusHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.signature, CORPUS_SIGNATURE, sizeof(header.signature));
+            header.version = CORPUS_FILE_VERSION;
+            header.documents = images;
+            header.signature_bits = embedding!=NULL ? HAMMING_BITS : 0;
+            if (fwrite(&header, sizeof(header), 1, stream)!=1) {
+                throw FLANNException("Cannot write the corpus file");
+            }
+        }
+
+        while (written<spawned || next_image<images) {
+            // the reader: cuts the next chunks and queues them for the quantizers
+            while (spawned-written<window && next_image<images) {
+                Chunk& chunk = chunks[spawned%window];
+                chunk.first_image = next_image;
+                chunk.first_feature = next_feature;
+                int count = 0;
+                do {
+                    count += sizes[next_image];
+                    next_feature += sizes[next_image];
+                    next_image++;
+                } while (next_image<images && count+sizes[next_image]<=CHUNK_FEATURES);
+                chunk.end_image = next_image;
+                pool.spawn(new QuantizeChunkTask(vocabulary, features, sizes, names, format, checks, embedding, chunk), chunk.group);
+                spawned++;
+            }
+
+            // the writer: appends the oldest chunk, helping with the queued ones until it's ready
+            Chunk& chunk = chunks[written%window];
+            pool.wait(chunk.group);
+            if (fwrite(chunk.output.data(), 1, chunk.output.size(), stream)!=chunk.output.size()) {
+                throw FLANNException("Cannot write the corpus file");
+            }
+            std::string().swap(chunk.output);
+            written++;
+        }
+    }
+    catch (...) {
+        // the queued chunks use the buffers and the pool
+        for (int i=written;i<spawned;++i) {
+            try {
+                pool.wait(chunks[i%window].group);
+            }
+            catch (...) {
+            }
+        }
+        delete[] chunks;
+        fclose(stream);
+        throw;
+    }
+    delete[] chunks;
+    if (fclose(stream)!=0) {
+        throw FLANNException("Cannot write the corpus file");
+    }
+
+    t.stop();
+    logger.info("Wrote %d documents (%d features) in %g seconds\n", images, (int)total, t.value);
+}
+
+
+CorpusReader::CorpusReader(const char* filename) : file(filename), documents_(0), signature_bits_(0), header_size(0), position(0)
+{
+    // the version 1 header ends before signature_bits
+    const size_t version1_size = offsetof(CorpusHeader, signature_bits);
+    if (file.size()<version1_size) {
+        throw FLANNException("Not a corpus file");
+    }
+    CorpusHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, file.data(), version1_size);
+    if (memcmp(header.signature, CORPUS_SIGNATURE, sizeof(header.signature))!=0) {
+        throw FLANNException("Not a corpus file");
+    }
+    if (header.version==1) {
+        header_size = version1_size;
+    }
+    else if (header.version==CORPUS_FILE_VERSION) {
+        if (file.size()<sizeof(CorpusHeader)) {
+            throw FLANNException("The corpus file is truncated");
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        header_size = sizeof(CorpusHeader);
+    }
+    else {
+        throw FLANNException("Unsupported version of the corpus file");
+    }
+    if (header.documents<0 || (header.signature_bits!=0 && header.signature_bits!=HAMMING_BITS)) {
+        throw FLANNException("Invalid corpus file");
+    }
+    documents_ = header.documents;
+    signature_bits_ = header.signature_bits;
+    rewind();
+}
+
+
+bool CorpusReader::next(std::string& name, std::vector<int>& histogram)
+{
+    return read(name, histogram, NULL);
+}
+
+
+bool CorpusReader::next(std::string& name, std::vector<int>& histogram, std::vector<unsigned long long>& signatures)
+{
+    return read(name, histogram, &signatures);
+}
+
+
+bool CorpusReader::read(std::string& name, std::vector<int>& histogram, std::vector<unsigned long long>* signatures)
+{
+    if (position==file.size()) {
+        return false;
+    }
+    // the ints are not aligned after the names
+    int length;
+    if (file.size()-position<sizeof(int)) {
+        throw FLANNException("The corpus file is truncated");
+    }
+    memcpy(&length, file.data()+position, sizeof(int));
+    position += sizeof(int);
+    if (length<0 || file.size()-position<length+sizeof(int)) {
+        throw FLANNException("The corpus file is truncated");
+    }
+    name.assign(file.data()+position, length);
+    position += length;
+
+    int distinct;
+    memcpy(&distinct, file.data()+position, sizeof(int));
+    position += sizeof(int);
+    if (distinct<0 || (file.size()-position)/(2*sizeof(int))<(size_t)distinct) {
+        throw FLANNException("The corpus file is truncated");
+    }
+    histogram.resize(2*distinct);
+    if (distinct>0) {
+        memcpy(&histogram[0], file.data()+position, 2*distinct*sizeof(int));
+    }
+    position += 2*distinct*sizeof(int);
+
+    if (signatures!=NULL) {
+        signatures->clear();
+    }
+    if (signature_bits_>0) {
+        size_t count = 0;
+        for (int i=0;i<distinct;++i) {
+            if (histogram[2*i+1]<0) {
+                throw FLANNException("Invalid document in the corpus file");
+            }
+            count += histogram[2*i+1];
+        }
+        if ((file.size()-position)/sizeof(unsigned long long)<count) {
+            throw FLANNException("The corpus file is truncated");
+        }
+        if (signatures!=NULL && count>0) {
+            signatures->resize(count);
+            memcpy(&(*signatures)[0], file.data()+position, count*sizeof(unsigned long long));
+        }
+        position += count*sizeof(unsigned long long);
+    }
+    return true;
+}
+
+
+void CorpusReader::rewind()
+{
+    position = header_size;
+}
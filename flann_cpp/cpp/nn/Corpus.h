@@ -0,0 +1,147 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+
+#include "Vocabulary.h"
+#include "HammingEmbedding.h"
+#include "../util/MappedFile.h"
+
+#include <string>
+#include <vector>
+
+
+/**
+    Format of the bag of words documents written by write_corpus.
+*/
+enum CorpusFormat {
+    /**
+        TREC text documents, the words of each image in the order of its
+        keypoints: <DOC> <DOCNO>name</DOCNO> <TEXT> w<id> w<id> ... </TEXT> </DOC>
+    */
+    CORPUS_TREC = 0,
+    /**
+        A CorpusHeader followed by, for each image, the length of its name,
+        the name, the number of distinct words and the (word, count) pairs
+        sorted by word, all ints in native byte order. With signatures, the
+        pairs are followed by the signatures of the descriptors of each
+        word (count of them), in the order of the pairs, as unsigned 64 bit
+        integers.
+    */
+    CORPUS_BINARY = 1
+};
+
+
+/**
+    Version of the binary corpus format.
+*/
+const int CORPUS_FILE_VERSION = 2;
+
+
+/**
+    Header of a binary corpus file.
+*/
+struct CorpusHeader
+{
+    char signature[8];
+    int version;
+    int documents;
+    /**
+        Bits of the signatures of the descriptors, 0 without signatures.
+    */
+    int signature_bits;
+    int reserved;
+};
+
+
+/**
+    Quantizes the features of a collection of images and writes one bag of
+    words document per image.
+
+    The images are split in chunks of consecutive images that are quantized
+    (and formatted) on a thread pool, a bounded number of chunks ahead of the
+    writer, which appends them to the file in order. The file doesn't depend
+    on the number of threads.
+
+    Params:
+        vocabulary = the vocabulary used to quantize the features
+        features = the features of all the images, one after the other
+        sizes = number of features of each image
+        names = name of each image (at least as many as sizes)
+        filename = the corpus file
+        format = CORPUS_TREC or CORPUS_BINARY
+        checks = number of checks of the searches (<0 for an exact search)
+        cores = number of threads, <=0 for one per hardware thread
+        embedding = Hamming embedding of the vocabulary, the binary documents
+            then have the signatures of the descriptors, or NULL
+*/
+void write_corpus(Vocabulary& vocabulary, const Dataset<float>& features, const std::vector<int>& sizes,
+            const std::vector<std::string>& names, const char* filename, CorpusFormat format, int checks, int cores,
+            const HammingEmbedding* embedding = NULL);
+
+
+
+/**
+    Reads the documents of a binary corpus file, mapped in memory.
+*/
+class CorpusReader
+{
+    MappedFile file;
+    int documents_;
+    int signature_bits_;
+    size_t header_size;
+    size_t position;
+
+    CorpusReader(const CorpusReader&);
+    CorpusReader& operator=(const CorpusReader&);
+
+    bool read(std::string& name, std::vector<int>& histogram, std::vector<unsigned long long>* signatures);
+
+public:
+    /**
+        Maps a binary corpus file. Throws a FLANNException if it cannot be
+        mapped or if its header is wrong.
+    */
+    CorpusReader(const char* filename);
+
+    /**
+        Number of documents in the file.
+    */
+    int documents() const
+    {
+        return documents_;
+    }
+
+    /**
+        Bits of the signatures of the descriptors, 0 if the documents have
+        no signatures.
+    */
+    int signature_bits() const
+    {
+        return signature_bits_;
+    }
+
+    /**
+        Reads the next document.
+
+        Params:
+            name = output, the name of the image
+            histogram = output, the (word, count) pairs sorted by word
+        Returns: false after the last document. Throws a FLANNException if
+            the file is truncated.
+    */
+    bool next(std::string& name, std::vector<int>& histogram);
+
+    /**
+        Reads the next document with its signatures (left empty if the
+        documents have none).
+    */
+    bool next(std::string& name, std::vector<int>& histogram, std::vector<unsigned long long>& signatures);
+
+    /**
+        Goes back to the first document.
+    */
+    void rewind();
+};
+
+
+#endif //CORPUS_H
@@ -0,0 +1,275 @@
+#include "HammingEmbedding.h"
+
+#include "../algorithms/dist.h"
+#include "../util/Serialization.h"
+#include "../util/Random.h"
+#include "../util/Logger.h"
+#include "../util/Timer.h"
+#include "../util/common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+
+namespace {
+
+const char HAMMING_SIGNATURE[8] = { 'F','L','A','N','N','H','E','M' };
+
+const double PI = 3.14159265358979323846;
+
+/* Number of descriptors projected at once. */
+const int PROJECT_BLOCK = 256;
+
+
+size_t file_size(const HammingFileHeader& header)
+{
+    return sizeof(HammingFileHeader) + ((size_t)header.bits*header.veclen + (size_t)header.words*header.bits)*sizeof(float);
+}
+
+
+/**
+    A random orthogonal projection: Gaussian rows orthonormalized with the
+    Gram-Schmidt process.
+*/
+void random_projection(int bits, int veclen, std::vector<float>& projection)
+{
+    std::vector<double> rows((size_t)bits*veclen);
+    for (int b=0;b<bits;++b) {
+        double* row = &rows[(size_t)b*veclen];
+        for (;;) {
+            for (int j=0;j<veclen;++j) {
+                // Box-Muller
+                double u = rand_double(1.0, 1e-12);
+                double v = rand_double(1.0);
+                row[j] = sqrt(-2*log(u))*cos(2*PI*v);
+            }
+            for (int c=0;c<b;++c) {
+                const double* other = &rows[(size_t)c*veclen];
+                double dot = 0;
+                for (int j=0;j<veclen;++j) dot += row[j]*other[j];
+                for (int j=0;j<veclen;++j) row[j] -= dot*other[j];
+            }
+            double norm = 0;
+            for (int j=0;j<veclen;++j) norm += row[j]*row[j];
+            if (norm>1e-6) {
+                norm = sqrt(norm);
+                for (int j=0;j<veclen;++j) row[j] /= norm;
+                break;
+            }
+        }
+    }
+    projection.assign(rows.begin(), rows.end());
+}
+
+
+/**
+    Projects descriptors on the rows of a projection.
+*/
+void project_descriptors(const float* projection, const Dataset<float>& descriptors, float* projected)
+{
+    for (int i=0;i<descriptors.rows;i+=PROJECT_BLOCK) {
+        int rows = std::min(PROJECT_BLOCK, descriptors.rows-i);
+        dot_block_float(descriptors[i], rows, projection, HAMMING_BITS, descriptors.cols, projected+(size_t)i*HAMMING_BITS, HAMMING_BITS);
+    }
+}
+
+
+/**
+    A word of a descriptor, ordered by word.
+*/
+struct DescriptorWord
+{
+    int word;
+    int descriptor;
+
+    bool operator<(const DescriptorWord& rhs) const
+    {
+        return word<rhs.word || (word==rhs.word && descriptor<rhs.descriptor);
+    }
+};
+
+
+/**
+    Lists the words of each descriptor (with their paths for the vocabulary
+    trees), sorted by word.
+*/
+void descriptor_words(const Vocabulary& vocabulary, const int* words, int count, std::vector<DescriptorWord>& entries)
+{
+    std::vector<int> path(vocabulary.words_per_descriptor());
+    entries.clear();
+    entries.reserve((size_t)count*path.size());
+    for (int i=0;i<count;++i) {
+        int length = vocabulary.path(words[i], &path[0]);
+        for (int j=0;j<length;++j) {
+            DescriptorWord entry;
+            entry.word = path[j];
+            entry.descriptor = i;
+            entries.push_back(entry);
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+}
+
+}
+
+
+void train_hamming_embedding(Vocabulary& vocabulary, const Dataset<float>& descriptors, const char* filename, int checks, int cores)
+{
+    int veclen = vocabulary.veclen();
+    int words = vocabulary.size();
+    if (descriptors.cols!=veclen) {
+        throw FLANNException("The descriptors and the vocabulary have different lengths");
+    }
+    if (veclen<HAMMING_BITS) {
+        throw FLANNException("The descriptors are shorter than the signatures");
+    }
+    StartStopTimer t;
+    t.start();
+
+    std::vector<float> projection;
+    random_projection(HAMMING_BITS, veclen, projection);
+
+    // the residuals are projected: the words start with the projections of their centers
+    std::vector<float> thresholds((size_t)words*HAMMING_BITS, 0);
+    for (int w=0;w<words;++w) {
+        const float* center = vocabulary.center(w);
+        if (center!=NULL) {
+            Dataset<float> row(1, veclen, (float*)center);
+            project_descriptors(&projection[0], row, &thresholds[(size_t)w*HAMMING_BITS]);
+        }
+    }
+
+    int count = descriptors.rows;
+    if (count>0) {
+        std::vector<int> descriptor_leaves(count);
+        vocabulary.quantize(descriptors, &descriptor_leaves[0], checks, cores);
+        std::vector<float> projected((size_t)count*HAMMING_BITS);
+        project_descriptors(&projection[0], descriptors, &projected[0]);
+
+        std::vector<DescriptorWord> entries;
+        descriptor_words(vocabulary, &descriptor_leaves[0], count, entries);
+        std::vector<float> values;
+        for (size_t i=0;i<entries.size();) {
+            size_t j = i;
+            while (j<entries.size() && entries[j].word==entries[i].word) ++j;
+            float* word_thresholds = &thresholds[(size_t)entries[i].word*HAMMING_BITS];
+            values.resize(j-i);
+            for (int b=0;b<HAMMING_BITS;++b) {
+                for (size_t e=i;e<j;++e) {
+                    values[e-i] = projected[(size_t)entries[e].descriptor*HAMMING_BITS+b];
+                }
+                std::nth_element(values.begin(), values.begin()+values.size()/2, values.end());
+                word_thresholds[b] = values[values.size()/2];
+            }
+            i = j;
+        }
+    }
+
+    HammingFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.signature, HAMMING_SIGNATURE, sizeof(header.signature));
+    header.version = HAMMING_FILE_VERSION;
+    header.bits = HAMMING_BITS;
+    header.veclen = veclen;
+    header.words = words;
+
+    FILE* stream = fopen(filename, "wb");
+    if (stream==NULL) {
+        throw FLANNException("Cannot open the Hamming embedding file for writing");
+    }
+    try {
+        save_value(stream, header);
+        save_value(stream, projection[0], projection.size());
+        save_value(stream, thresholds[0], thresholds.size());
+    }
+    catch (...) {
+        fclose(stream);
+        remove(filename);
+        throw;
+    }
+    if (fclose(stream)!=0) {
+        remove(filename);
+        throw FLANNException("Cannot write the Hamming embedding file");
+    }
+
+    t.stop();
+    logger.info("Trained the Hamming embedding of %d words on %d descriptors in %g seconds\n", words, count, t.value);
+}
+
+
+HammingEmbedding::HammingEmbedding(const char* filename) : file(filename)
+{
+    if (file.size()<sizeof(HammingFileHeader)) {
+        throw FLANNException("Not a Hamming embedding file");
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.signature, HAMMING_SIGNATURE, sizeof(header.signature))!=0) {
+        throw FLANNException("Not a Hamming embedding file");
+    }
+    if (header.version!=HAMMING_FILE_VERSION) {
+        throw FLANNException("Unsupported version of the Hamming embedding file");
+    }
+    if (header.bits!=HAMMING_BITS || header.veclen<1 || header.words<0) {
+        throw FLANNException("Invalid Hamming embedding file");
+    }
+    if (file.size()<file_size(header)) {
+        throw FLANNException("The Hamming embedding file is truncated");
+    }
+    projection = (const float*)(file.data()+sizeof(HammingFileHeader));
+    thresholds = projection+(size_t)header.bits*header.veclen;
+}
+
+
+void HammingEmbedding::project(const Dataset<float>& descriptors, float* projected) const
+{
+    if (descriptors.cols!=header.veclen) {
+        throw FLANNException("The descriptors and the Hamming embedding have different lengths");
+    }
+    project_descriptors(projection, descriptors, projected);
+}
+
+
+unsigned long long HammingEmbedding::signature(const float* projected, int word) const
+{
+    const float* word_thresholds = thresholds+(size_t)word*HAMMING_BITS;
+    unsigned long long signature = 0;
+    for (int b=0;b<HAMMING_BITS;++b) {
+        if (projected[b]>word_thresholds[b]) {
+            signature |= 1ULL<<b;
+        }
+    }
+    return signature;
+}
+
+
+int embedded_bag_of_words(const Vocabulary& vocabulary, const HammingEmbedding& embedding, const Dataset<float>& descriptors,
+            const int* words, std::vector<int>& histogram, std::vector<unsigned long long>& signatures)
+{
+    if (embedding.words()!=vocabulary.size()) {
+        throw FLANNException("The Hamming embedding was trained for another vocabulary");
+    }
+    histogram.clear();
+    signatures.clear();
+    if (descriptors.rows==0) {
+        return 0;
+    }
+    std::vector<float> projected((size_t)descriptors.rows*HAMMING_BITS);
+    embedding.project(descriptors, &projected[0]);
+
+    std::vector<DescriptorWord> entries;
+    descriptor_words(vocabulary, words, descriptors.rows, entries);
+    signatures.reserve(entries.size());
+    for (size_t i=0;i<entries.size();) {
+        size_t j = i;
+        while (j<entries.size() && entries[j].word==entries[i].word) ++j;
+        histogram.push_back(entries[i].word);
+        histogram.push_back((int)(j-i));
+        for (size_t e=i;e<j;++e) {
+            signatures.push_back(embedding.signature(&projected[(size_t)entries[e].descriptor*HAMMING_BITS], entries[e].word));
+        }
+        i = j;
+    }
+    return (int)histogram.size()/2;
+}
@@ -0,0 +1,154 @@
+#ifndef HAMMINGEMBEDDING_H
+#define HAMMINGEMBEDDING_H
+
+
+#include "Vocabulary.h"
+#include "../util/MappedFile.h"
+
+#include <vector>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+
+/**
+    Number of bits of the binary signatures.
+*/
+const int HAMMING_BITS = 64;
+
+
+/**
+    Version of the Hamming embedding file format.
+*/
+const int HAMMING_FILE_VERSION = 1;
+
+
+/**
+    Header of a Hamming embedding file, followed by:
+        float projection[bits*veclen]: the projection, one row per bit
+        float thresholds[words*bits]: the threshold of each bit for each word
+*/
+struct HammingFileHeader
+{
+    char signature[8];
+    int version;
+    int bits;
+    int veclen;
+    int words;
+};
+
+
+/**
+    Number of different bits of two signatures.
+*/
+inline int hamming_distance(unsigned long long a, unsigned long long b)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(a^b);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return (int)__popcnt64(a^b);
+#else
+    unsigned long long x = a^b;
+    x = x - ((x>>1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x>>2) & 0x3333333333333333ULL);
+    x = (x + (x>>4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((x*0x0101010101010101ULL)>>56);
+#endif
+}
+
+
+/**
+    Learns a Hamming embedding for a vocabulary and writes it to a file.
+
+    The projection is a random orthogonal HAMMING_BITS x veclen matrix. The
+    threshold of a bit for a word is the median of the projections of the
+    training descriptors of the word, so each bit splits the cell of the
+    word in two halves. The words without training descriptors keep the
+    projection of their center (the residuals are projected).
+
+    Params:
+        vocabulary = the vocabulary, its words are the words of the embedding
+        descriptors = the training descriptors
+        filename = the embedding file
+        checks = number of checks of the quantization (<0 for an exact search)
+        cores = number of threads, <=0 for one per hardware thread
+*/
+void train_hamming_embedding(Vocabulary& vocabulary, const Dataset<float>& descriptors, const char* filename, int checks, int cores);
+
+
+/**
+    A Hamming embedding (Jegou, Douze and Schmid, Hamming Embedding and
+    Weak Geometric Consistency for Large Scale Image Search): a binary
+    signature of the position of a descriptor inside the cell of its visual
+    word. Two descriptors of the same word only match if their signatures
+    are close, which recovers the precision lost by the coarse quantization.
+
+    The embedding is mapped from its file and used in place.
+*/
+class HammingEmbedding
+{
+    MappedFile file;
+    HammingFileHeader header;
+    const float* projection;
+    const float* thresholds;
+
+    HammingEmbedding(const HammingEmbedding&);
+    HammingEmbedding& operator=(const HammingEmbedding&);
+
+public:
+    /**
+        Maps a Hamming embedding file. Throws a FLANNException if it cannot
+        be mapped or if it is invalid.
+    */
+    HammingEmbedding(const char* filename);
+
+    /**
+        Number of words of the vocabulary of the embedding.
+    */
+    int words() const
+    {
+        return header.words;
+    }
+
+    int veclen() const
+    {
+        return header.veclen;
+    }
+
+    /**
+        Projects descriptors.
+
+        Params:
+            descriptors = the descriptors, veclen() columns
+            projected = output, HAMMING_BITS values per descriptor
+    */
+    void project(const Dataset<float>& descriptors, float* projected) const;
+
+    /**
+        Signature of a projected descriptor in the cell of a word.
+    */
+    unsigned long long signature(const float* projected, int word) const;
+};
+
+
+/**
+    Computes the bag of words of a set of descriptors along with their
+    signatures: each descriptor has a signature for each of its words (the
+    nodes of its path for a vocabulary tree).
+
+    Params:
+        vocabulary = the vocabulary of the embedding
+        embedding = the embedding
+        descriptors = the descriptors
+        words = the words of the descriptors, returned by vocabulary.quantize
+        histogram = output, the (word, count) pairs sorted by word
+        signatures = output, the signatures of the descriptors of each word
+            of the histogram, in the order of the histogram (count of them)
+    Returns: the number of distinct words
+*/
+int embedded_bag_of_words(const Vocabulary& vocabulary, const HammingEmbedding& embedding, const Dataset<float>& descriptors,
+            const int* words, std::vector<int>& histogram, std::vector<unsigned long long>& signatures);
+
+
+#endif //HAMMINGEMBEDDING_H
@@ -0,0 +1,146 @@
+#include "IndexIO.h"
+
+#include "../util/Serialization.h"
+
+#include <string.h>
+#include <limits.h>
+
+
+namespace {
+
+const char INDEX_SIGNATURE[] = "FLANN_INDEX";
+
+/**
+    Closes a file at the end of a scope.
+*/
+class FileCloser
+{
+    FILE* stream;
+
+public:
+    FileCloser(FILE* stream_) : stream(stream_) {}
+
+    ~FileCloser()
+    {
+        fclose(stream);
+    }
+};
+
+
+/**
+    Moves forward in a file, also past 2GB.
+*/
+void skip_bytes(FILE* stream, size_t count)
+{
+#ifdef _MSC_VER
+    int result = _fseeki64(stream, (__int64)count, SEEK_CUR);
+#else
+    int result = fseeko(stream, (off_t)count, SEEK_CUR);
+#endif
+    if (result!=0) {
+        throw FLANNException("Cannot read from the index file");
+    }
+}
+
+}
+
+
+void save_index(NNIndex& index, const char* filename, const Dataset<float>* dataset)
+{
+    if (dataset!=NULL && (dataset->rows!=index.size() || dataset->cols!=index.veclen())) {
+        throw FLANNException("The dataset does not match the index");
+    }
+    if (strlen(index.name())>=sizeof(((IndexHeader*)0)->algorithm)) {
+        throw FLANNException("Index name too long");
+    }
+
+    FILE* stream = fopen(filename, "wb");
+    if (stream==NULL) {
+        throw FLANNException("Cannot open the index file for writing");
+    }
+    FileCloser closer(stream);
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.signature, INDEX_SIGNATURE);
+    header.version = INDEX_FILE_VERSION;
+    strcpy(header.algorithm, index.name());
+    header.rows = index.size();
+    header.cols = index.veclen();
+    header.data_embedded = dataset!=NULL;
+    save_value(stream, header);
+
+    if (dataset!=NULL) {
+        save_value(stream, *dataset->data, (size_t)dataset->rows*dataset->cols);
+    }
+    index.saveIndex(stream);
+}
+
+
+NNIndex* load_index(const char* filename, Dataset<float>* dataset, Dataset<float>*& loaded_data)
+{
+    loaded_data = NULL;
+
+    FILE* stream = fopen(filename, "rb");
+    if (stream==NULL) {
+        throw FLANNException("Cannot open the index file");
+    }
+    FileCloser closer(stream);
+
+    IndexHeader header;
+    load_value(stream, header);
+    if (strncmp(header.signature, INDEX_SIGNATURE, sizeof(header.signature))!=0) {
+        throw FLANNException("Not an index file");
+    }
+    if (header.version!=INDEX_FILE_VERSION) {
+        throw FLANNException("Unsupported version of the index file");
+    }
+    header.algorithm[sizeof(header.algorithm)-1] = 0;
+    // the size of the dataset allocated for the embedded data
+    if (header.rows<0 || header.cols<=0 || (long long)header.rows*header.cols>INT_MAX) {
+        throw FLANNException("Invalid dataset size in the index file");
+    }
+
+    if (dataset==NULL) {
+        if (!header.data_embedded) {
+            throw FLANNException("The index file doesn't contain the dataset");
+        }
+        dataset = loaded_data = new Dataset<float>(header.rows, header.cols);
+        try {
+            load_value(stream, *dataset->data, (size_t)header.rows*header.cols);
+        }
+        catch (...) {
+            delete loaded_data;
+            loaded_data = NULL;
+            throw;
+        }
+    }
+    else {
+        if (dataset->rows!=header.rows || dataset->cols!=header.cols) {
+            throw FLANNException("The index file does not match the dataset");
+        }
+        if (header.data_embedded) {
+            skip_bytes(stream, (size_t)header.rows*header.cols*sizeof(float));
+        }
+    }
+
+    // the constructors check these, the actual values are read by loadIndex
+    Params params;
+    params["trees"] = 1;
+    params["branching"] = 2;
+    params["max-iterations"] = -1;
+    params["centers-init"] = "random";
+
+    NNIndex* index = NULL;
+    try {
+        index = create_index(header.algorithm, *dataset, params);
+        index->loadIndex(stream);
+    }
+    catch (...) {
+        delete index;
+        delete loaded_data;
+        loaded_data = NULL;
+        throw;
+    }
+    return index;
+}
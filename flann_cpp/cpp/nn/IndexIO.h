@@ -0,0 +1,57 @@
+#ifndef INDEXIO_H
+#define INDEXIO_H
+
+
+#include "../algorithms/NNIndex.h"
+#include "../util/Dataset.h"
+
+
+/**
+    Version of the index file format, changed whenever the layout of the
+    header or of the saved indices changes.
+*/
+const int INDEX_FILE_VERSION = 1;
+
+
+/**
+    Header at the beginning of an index file.
+*/
+struct IndexHeader
+{
+    char signature[16];
+    int version;
+    char algorithm[16];
+    int rows;
+    int cols;
+    /**
+        Non zero if the dataset is stored after the header, otherwise the
+        index must be loaded over the dataset it was built for.
+    */
+    int data_embedded;
+};
+
+
+/**
+    Saves a built index to a file. 
+
+    Params:
+        dataset = the dataset of the index, stored in the file so that the index 
+            can be loaded without it, or NULL
+*/
+void save_index(NNIndex& index, const char* filename, const Dataset<float>* dataset = NULL);
+
+/**
+    Loads an index saved by save_index, without building it.
+
+    Params:
+        dataset = the dataset the index was built for, or NULL to use the one
+            stored in the file
+        loaded_data = output, the dataset read from the file (or NULL if the
+            dataset argument was used), owned by the caller and used by the index
+
+    Returns: the index
+*/
+NNIndex* load_index(const char* filename, Dataset<float>* dataset, Dataset<float>*& loaded_data);
+
+
+#endif //INDEXIO_H
@@ -0,0 +1,861 @@
+#include "InvertedIndex.h"
+
+#include "Corpus.h"
+#include "Postings.h"
+#include "HammingEmbedding.h"
+#include "../util/Serialization.h"
+#include "../util/Logger.h"
+#include "../util/Timer.h"
+#include "../util/common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include <string>
+
+
+namespace {
+
+const char INVERTED_SIGNATURE[8] = { 'F','L','A','N','N','I','V','F' };
+
+/* The BM25 parameters. */
+const float BM25_K1 = 1.2f;
+const float BM25_B = 0.75f;
+
+
+/**
+    Offsets of the parts of an inverted file.
+*/
+struct Layout
+{
+    size_t word_offsets;
+    size_t df;
+    size_t max_tfidf;
+    size_t max_bm25;
+    size_t lengths;
+    size_t norms;
+    size_t name_offsets;
+    size_t names;
+    size_t signature_offsets;
+    size_t signatures;
+    size_t postings;
+    size_t end;
+};
+
+
+size_t align8(size_t offset)
+{
+    return (offset+7) & ~(size_t)7;
+}
+
+
+Layout file_layout(const InvertedFileHeader& header)
+{
+    Layout layout;
+    layout.word_offsets = align8(sizeof(InvertedFileHeader));
+    layout.df = align8(layout.word_offsets + ((size_t)header.words+1)*sizeof(long long));
+    layout.max_tfidf = align8(layout.df + (size_t)header.words*sizeof(int));
+    layout.max_bm25 = align8(layout.max_tfidf + (size_t)header.words*sizeof(float));
+    layout.lengths = align8(layout.max_bm25 + (size_t)header.words*sizeof(float));
+    layout.norms = align8(layout.lengths + (size_t)header.documents*sizeof(int));
+    layout.name_offsets = align8(layout.norms + (size_t)header.documents*sizeof(float));
+    layout.names = align8(layout.name_offsets + ((size_t)header.documents+1)*sizeof(long long));
+    layout.signature_offsets = align8(layout.names + (size_t)header.names_size);
+    size_t signature_words = header.signature_bits>0 ? (size_t)header.words+1 : 0;
+    layout.signatures = layout.signature_offsets + signature_words*sizeof(long long);
+    layout.postings = layout.signatures + (size_t)header.signatures_size*sizeof(unsigned long long);
+    layout.end = layout.postings + (size_t)header.postings_size;
+    return layout;
+}
+
+
+float tfidf_idf(int documents, int df)
+{
+    return (float)log((double)documents/df);
+}
+
+
+float bm25_idf(int documents, int df)
+{
+    return (float)log(1 + (documents-df+0.5)/(df+0.5));
+}
+
+
+float average_image_length(long long total_length, int documents)
+{
+    return documents>0 ? (float)((double)total_length/documents) : 0;
+}
+
+
+/**
+    The tf factor of the BM25 score of an image.
+*/
+inline float bm25_tf(int tf, int length, float average_length)
+{
+    float norm = BM25_K1*(1-BM25_B+BM25_B*length/average_length);
+    return tf*(BM25_K1+1)/(tf+norm);
+}
+
+
+void append_varint(std::vector<unsigned char>& bytes, unsigned int value)
+{
+    while (value>=0x80) {
+        bytes.push_back((unsigned char)(value|0x80));
+        value >>= 7;
+    }
+    bytes.push_back((unsigned char)value);
+}
+
+
+inline unsigned int read_varint(const unsigned char*& p)
+{
+    unsigned int value = *p & 0x7f;
+    int shift = 7;
+    while (*p++ & 0x80) {
+        value |= (unsigned int)(*p & 0x7f) << shift;
+        shift += 7;
+    }
+    return value;
+}
+
+
+/**
+    Writes a part of the file and the padding to the next multiple of 8 bytes.
+*/
+template <typename T>
+void save_part(FILE* stream, const T* values, size_t count, size_t& offset)
+{
+    if (count>0) {
+        save_value(stream, *values, count);
+    }
+    offset += count*sizeof(T);
+    static const char zeros[8] = { 0 };
+    size_t padding = align8(offset)-offset;
+    if (padding>0) {
+        save_value(stream, zeros[0], padding);
+    }
+    offset += padding;
+}
+
+
+/**
+    An image and its score, ordered from the best to the worst.
+*/
+struct ScoredImage
+{
+    float score;
+    int image;
+
+    bool operator<(const ScoredImage& rhs) const
+    {
+        return score>rhs.score || (score==rhs.score && image<rhs.image);
+    }
+};
+
+
+/**
+    Offers an image to a heap of the k best images, the worst of them at
+    the top of the heap.
+    Returns: true if the image was added
+*/
+bool offer(std::vector<ScoredImage>& heap, int k, const ScoredImage& candidate)
+{
+    if ((int)heap.size()<k) {
+        heap.push_back(candidate);
+        std::push_heap(heap.begin(), heap.end());
+        return true;
+    }
+    if (candidate<heap.front()) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = candidate;
+        std::push_heap(heap.begin(), heap.end());
+        return true;
+    }
+    return false;
+}
+
+
+/**
+    Writes the images of a heap from the best to the worst, with their
+    scores divided by the norm of the query.
+*/
+int output_ranking(std::vector<ScoredImage>& heap, double query_norm, int* images, float* scores)
+{
+    std::sort_heap(heap.begin(), heap.end());
+    float norm = (float)sqrt(query_norm);
+    for (size_t i=0;i<heap.size();++i) {
+        images[i] = heap[i].image;
+        if (scores!=NULL) {
+            scores[i] = heap[i].score/norm;
+        }
+    }
+    return (int)heap.size();
+}
+
+
+/**
+    A word of a query, ordered by increasing bound of its contributions.
+*/
+struct QueryWord
+{
+    int word;
+    float weight;
+    float bound;
+
+    bool operator<(const QueryWord& rhs) const
+    {
+        return bound<rhs.bound;
+    }
+};
+
+
+/* The bounds of the contributions are enlarged a bit, so that the rounding
+   of the scores never prunes an image of the top k. */
+const float BOUND_SLACK = 1.001f;
+
+/* Number of images scored together by query. */
+const int QUERY_WINDOW = 4096;
+
+/* The candidates of a window are looked up in the lists with at least
+   this many postings per candidate in the window, all the postings of the
+   other lists in the window are read. */
+const double MERGE_RATIO = 2;
+
+/* The queries asking for more than one image per this many images score all
+   the postings. */
+const int EXHAUSTIVE_RATIO = 128;
+
+}
+
+
+void build_inverted_index(const char* corpus_file, const char* index_file)
+{
+    StartStopTimer t;
+    t.start();
+
+    CorpusReader corpus(corpus_file);
+    int documents = corpus.documents();
+    std::string name;
+    std::vector<int> histogram;
+
+    // first pass: the document frequencies, lengths and names
+    std::vector<int> df;
+    std::vector<int> lengths;
+    std::vector<long long> name_offsets;
+    std::string names;
+    long long total_length = 0;
+    while (corpus.next(name, histogram)) {
+        if ((int)lengths.size()==documents) {
+            throw FLANNException("The corpus file has more documents than its header");
+        }
+        int length = 0;
+        for (size_t i=0;i<histogram.size();i+=2) {
+            int word = histogram[i];
+            if (word<0 || histogram[i+1]<=0 || (i>0 && word<=histogram[i-2])) {
+                throw FLANNException("Invalid document in the corpus file");
+            }
+            if (word>=(int)df.size()) {
+                df.resize(word+1, 0);
+            }
+            df[word]++;
+            length += histogram[i+1];
+        }
+        lengths.push_back(length);
+        total_length += length;
+        name_offsets.push_back(names.size());
+        names += name;
+        names += '\0';
+    }
+    if ((int)lengths.size()!=documents) {
+        throw FLANNException("The corpus file has fewer documents than its header");
+    }
+    name_offsets.push_back(names.size());
+    int words = (int)df.size();
+
+    // second pass: the postings and the norms of the tf-idf vectors
+    std::vector<float> idf(words);
+    for (int w=0;w<words;++w) {
+        idf[w] = df[w]>0 ? tfidf_idf(documents, df[w]) : 0;
+    }
+    std::vector<std::vector<unsigned char> > lists(words);
+    std::vector<int> last(words, -1);
+    std::vector<float> norms(documents);
+    bool with_signatures = corpus.signature_bits()>0;
+    std::vector<std::vector<unsigned long long> > word_signatures(with_signatures ? words : 0);
+    std::vector<unsigned long long> signatures;
+    corpus.rewind();
+    for (int d=0;corpus.next(name, histogram, signatures);++d) {
+        double norm = 0;
+        const unsigned long long* signature = signatures.empty() ? NULL : &signatures[0];
+        for (size_t i=0;i<histogram.size();i+=2) {
+            int word = histogram[i];
+            int tf = histogram[i+1];
+            append_varint(lists[word], d-last[word]);
+            append_varint(lists[word], tf);
+            last[word] = d;
+            norm += (double)(tf*idf[word])*(tf*idf[word]);
+            if (with_signatures) {
+                word_signatures[word].insert(word_signatures[word].end(), signature, signature+tf);
+                signature += tf;
+            }
+        }
+        // the images whose words are all in every image have no weight,
+        // a unit norm keeps their scores defined
+        norms[d] = norm>0 ? (float)sqrt(norm) : 1;
+    }
+
+    // the lists are built as variable length integers, which are compact,
+    // and packed in blocks one word at a time, with the bounds of the
+    // contributions of the words
+    float average_length = average_image_length(total_length, documents);
+    std::vector<float> max_tfidf(words, 0);
+    std::vector<float> max_bm25(words, 0);
+    std::vector<int> images;
+    std::vector<int> tfs;
+    for (int w=0;w<words;++w) {
+        images.resize(df[w]);
+        tfs.resize(df[w]);
+        const unsigned char* p = lists[w].empty() ? NULL : &lists[w][0];
+        int image = -1;
+        for (int i=0;i<df[w];++i) {
+            image += read_varint(p);
+            images[i] = image;
+            tfs[i] = read_varint(p);
+            if (norms[image]>0) {
+                max_tfidf[w] = std::max(max_tfidf[w], tfs[i]/norms[image]);
+            }
+            max_bm25[w] = std::max(max_bm25[w], bm25_tf(tfs[i], lengths[image], average_length));
+        }
+        std::vector<unsigned char> packed;
+        if (df[w]>0) {
+            encode_postings(&images[0], &tfs[0], df[w], packed);
+        }
+        lists[w].swap(packed);
+    }
+
+    std::vector<long long> word_offsets(words+1);
+    word_offsets[0] = 0;
+    for (int w=0;w<words;++w) {
+        word_offsets[w+1] = word_offsets[w]+lists[w].size();
+    }
+    std::vector<long long> signature_offsets(with_signatures ? words+1 : 0);
+    if (with_signatures) {
+        signature_offsets[0] = 0;
+        for (int w=0;w<words;++w) {
+            signature_offsets[w+1] = signature_offsets[w]+word_signatures[w].size();
+        }
+    }
+
+    InvertedFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.signature, INVERTED_SIGNATURE, sizeof(header.signature));
+    header.version = INVERTED_FILE_VERSION;
+    header.documents = documents;
+    header.words = words;
+    header.total_length = total_length;
+    header.postings_size = word_offsets[words];
+    header.names_size = names.size();
+    header.signature_bits = corpus.signature_bits();
+    header.signatures_size = with_signatures ? signature_offsets[words] : 0;
+
+    FILE* stream = fopen(index_file, "wb");
+    if (stream==NULL) {
+        throw FLANNException("Cannot open the inverted file for writing");
+    }
+    try {
+        size_t offset = 0;
+        save_part(stream, &header, 1, offset);
+        save_part(stream, &word_offsets[0], words+1, offset);
+        save_part(stream, words>0 ? &df[0] : NULL, words, offset);
+        save_part(stream, words>0 ? &max_tfidf[0] : NULL, words, offset);
+        save_part(stream, words>0 ? &max_bm25[0] : NULL, words, offset);
+        save_part(stream, documents>0 ? &lengths[0] : NULL, documents, offset);
+        save_part(stream, documents>0 ? &norms[0] : NULL, documents, offset);
+        save_part(stream, &name_offsets[0], documents+1, offset);
+        save_part(stream, names.data(), names.size(), offset);
+        if (with_signatures) {
+            save_part(stream, &signature_offsets[0], words+1, offset);
+            for (int w=0;w<words;++w) {
+                save_part(stream, word_signatures[w].empty() ? NULL : &word_signatures[w][0], word_signatures[w].size(), offset);
+            }
+        }
+        for (int w=0;w<words;++w) {
+            if (!lists[w].empty()) {
+                save_value(stream, lists[w][0], lists[w].size());
+            }
+        }
+    }
+    catch (...) {
+        fclose(stream);
+        remove(index_file);
+        throw;
+    }
+    if (fclose(stream)!=0) {
+        remove(index_file);
+        throw FLANNException("Cannot write the inverted file");
+    }
+
+    t.stop();
+    logger.info("Built the inverted file of %d images and %d words (%g MB of postings) in %g seconds\n",
+                documents, words, header.postings_size/1048576.0, t.value);
+}
+
+
+InvertedIndex::InvertedIndex(const char* filename) : file(filename)
+{
+    if (file.size()<sizeof(InvertedFileHeader)) {
+        throw FLANNException("Not an inverted file");
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.signature, INVERTED_SIGNATURE, sizeof(header.signature))!=0) {
+        throw FLANNException("Not an inverted file");
+    }
+    if (header.version!=INVERTED_FILE_VERSION) {
+        throw FLANNException("Unsupported version of the inverted file");
+    }
+    if (header.documents<0 || header.words<0 || header.names_size<0 || header.postings_size<0 ||
+            (header.signature_bits!=0 && header.signature_bits!=HAMMING_BITS) || header.signatures_size<0 ||
+            (header.signature_bits==0 && header.signatures_size!=0)) {
+        throw FLANNException("Invalid inverted file");
+    }
+    Layout layout = file_layout(header);
+    if (file.size()<layout.end) {
+        throw FLANNException("The inverted file is truncated");
+    }
+
+    const char* data = file.data();
+    word_offsets = (const long long*)(data+layout.word_offsets);
+    df = (const int*)(data+layout.df);
+    max_tfidf = (const float*)(data+layout.max_tfidf);
+    max_bm25 = (const float*)(data+layout.max_bm25);
+    lengths = (const int*)(data+layout.lengths);
+    norms = (const float*)(data+layout.norms);
+    name_offsets = (const long long*)(data+layout.name_offsets);
+    names = data+layout.names;
+    signature_offsets = header.signature_bits>0 ? (const long long*)(data+layout.signature_offsets) : NULL;
+    signatures = (const unsigned long long*)(data+layout.signatures);
+    postings = (const unsigned char*)(data+layout.postings);
+
+    // the decoding and the names trust the offsets
+    for (int w=0;w<header.words;++w) {
+        if (word_offsets[w]>word_offsets[w+1]) {
+            throw FLANNException("Invalid inverted file");
+        }
+    }
+    if (word_offsets[0]!=0 || word_offsets[header.words]!=header.postings_size) {
+        throw FLANNException("Invalid inverted file");
+    }
+    for (int d=0;d<header.documents;++d) {
+        if (name_offsets[d]>=name_offsets[d+1] || names[name_offsets[d+1]-1]!='\0') {
+            throw FLANNException("Invalid inverted file");
+        }
+    }
+    if (name_offsets[header.documents]!=header.names_size) {
+        throw FLANNException("Invalid inverted file");
+    }
+    if (signature_offsets!=NULL) {
+        for (int w=0;w<header.words;++w) {
+            if (signature_offsets[w]>signature_offsets[w+1]) {
+                throw FLANNException("Invalid inverted file");
+            }
+        }
+        if (signature_offsets[0]!=0 || signature_offsets[header.words]!=header.signatures_size) {
+            throw FLANNException("Invalid inverted file");
+        }
+    }
+
+    // the idf, the scores and the postings trust the frequencies and the
+    // lengths (the postings are also checked by their cursors)
+    for (int w=0;w<header.words;++w) {
+        if (df[w]<0 || df[w]>header.documents) {
+            throw FLANNException("Invalid inverted file");
+        }
+    }
+    long long total_length = 0;
+    for (int d=0;d<header.documents;++d) {
+        if (lengths[d]<0 || !(norms[d]>0)) {
+            throw FLANNException("Invalid inverted file");
+        }
+        total_length += lengths[d];
+    }
+    if (total_length!=header.total_length) {
+        throw FLANNException("Invalid inverted file");
+    }
+
+    average_length = average_image_length(header.total_length, header.documents);
+}
+
+
+InvertedIndex::~InvertedIndex()
+{
+    for (size_t i=0;i<contexts.size();++i) {
+        delete contexts[i];
+    }
+}
+
+
+InvertedIndex::QueryContext* InvertedIndex::acquireContext()
+{
+    {
+        std::lock_guard<std::mutex> guard(contexts_lock);
+        if (!contexts.empty()) {
+            QueryContext* context = contexts.back();
+            contexts.pop_back();
+            return context;
+        }
+    }
+    QueryContext* context = new QueryContext();
+    context->scores.resize(std::max(header.documents, QUERY_WINDOW), 0);
+    return context;
+}
+
+
+void InvertedIndex::releaseContext(QueryContext* context)
+{
+    // the accumulators are left cleared for the next query
+    for (size_t i=0;i<context->touched.size();++i) {
+        context->scores[context->touched[i]] = 0;
+    }
+    context->touched.clear();
+
+    std::lock_guard<std::mutex> guard(contexts_lock);
+    contexts.push_back(context);
+}
+
+
+float InvertedIndex::wordWeight(int word, int count, int scoring) const
+{
+    if (word<0 || word>=header.words || count<=0 || df[word]==0) {
+        return 0;
+    }
+    // a word in all the images doesn't change the ranking
+    if (scoring==SCORING_BM25) {
+        return std::max(count*bm25_idf(header.documents, df[word]), 0.0f);
+    }
+    else {
+        float idf = tfidf_idf(header.documents, df[word]);
+        return count*idf*idf;
+    }
+}
+
+
+inline float InvertedIndex::contribution(float weight, int image, int tf, int scoring) const
+{
+    if (scoring==SCORING_BM25) {
+        return weight*bm25_tf(tf, lengths[image], average_length);
+    }
+    else {
+        return weight*tf/norms[image];
+    }
+}
+
+
+int InvertedIndex::queryExhaustive(const int* histogram, int pairs, int k, int scoring, int* images, float* scores)
+{
+    if (scoring!=SCORING_TFIDF && scoring!=SCORING_BM25) {
+        throw FLANNException("Unknown scoring model");
+    }
+    if (k<=0) {
+        return 0;
+    }
+    QueryContext* context = acquireContext();
+    std::vector<float>& accumulators = context->scores;
+    std::vector<int>& touched = context->touched;
+    int block_images[POSTING_BLOCK];
+    int block_tfs[POSTING_BLOCK];
+
+    // term at a time: the contributions of each word are added to the accumulators
+    double query_norm = 0;
+    for (int i=0;i<pairs;++i) {
+        int word = histogram[2*i];
+        float weight = wordWeight(word, histogram[2*i+1], scoring);
+        if (weight<=0) {
+            continue;
+        }
+        if (scoring==SCORING_TFIDF) {
+            query_norm += (double)weight*histogram[2*i+1];
+        }
+
+        PostingCursor cursor(postings+word_offsets[word], postings+word_offsets[word+1], df[word], header.documents);
+        int decoded;
+        while ((decoded = cursor.next(block_images, block_tfs))>0) {
+            for (int j=0;j<decoded;++j) {
+                int image = block_images[j];
+                if (accumulators[image]==0) {
+                    touched.push_back(image);
+                }
+                accumulators[image] += contribution(weight, image, block_tfs[j], scoring);
+            }
+        }
+    }
+
+    std::vector<ScoredImage> heap;
+    heap.reserve(std::min(k, (int)touched.size()));
+    for (size_t i=0;i<touched.size();++i) {
+        ScoredImage candidate;
+        candidate.image = touched[i];
+        candidate.score = accumulators[candidate.image];
+        offer(heap, k, candidate);
+    }
+
+    releaseContext(context);
+    return output_ranking(heap, scoring==SCORING_TFIDF ? query_norm : 1, images, scores);
+}
+
+
+int InvertedIndex::querySignatures(const int* histogram, int pairs, const unsigned long long* query_signatures, int threshold,
+            int k, int* images, float* scores)
+{
+    if (!has_signatures()) {
+        throw FLANNException("The inverted file has no signatures");
+    }
+    if (k<=0) {
+        return 0;
+    }
+    QueryContext* context = acquireContext();
+    std::vector<float>& accumulators = context->scores;
+    std::vector<int>& touched = context->touched;
+    int block_images[POSTING_BLOCK];
+    int block_tfs[POSTING_BLOCK];
+
+    // term at a time, the descriptors of the query are matched with the ones of each posting
+    double query_norm = 0;
+    const unsigned long long* query_signature = query_signatures;
+    for (int i=0;i<pairs;++i) {
+        int word = histogram[2*i];
+        int count = std::max(histogram[2*i+1], 0);
+        const unsigned long long* word_query = query_signature;
+        query_signature += count;
+        float weight = wordWeight(word, 1, SCORING_TFIDF);
+        if (weight<=0 || count==0) {
+            continue;
+        }
+        query_norm += (double)weight*count*count;
+
+        const unsigned long long* image_signature = signatures+signature_offsets[word];
+        const unsigned long long* end = signatures+signature_offsets[word+1];
+        PostingCursor cursor(postings+word_offsets[word], postings+word_offsets[word+1], df[word], header.documents);
+        int decoded;
+        while ((decoded = cursor.next(block_images, block_tfs))>0) {
+            for (int j=0;j<decoded;++j) {
+                int tf = block_tfs[j];
+                if (end-image_signature<tf) {
+                    throw FLANNException("Invalid inverted file");
+                }
+                int matches = 0;
+                for (int q=0;q<count;++q) {
+                    for (int t=0;t<tf;++t) {
+                        matches += hamming_distance(word_query[q], image_signature[t])<=threshold;
+                    }
+                }
+                image_signature += tf;
+                if (matches==0) {
+                    continue;
+                }
+                int image = block_images[j];
+                if (accumulators[image]==0) {
+                    touched.push_back(image);
+                }
+                accumulators[image] += weight*matches/norms[image];
+            }
+        }
+    }
+
+    std::vector<ScoredImage> heap;
+    heap.reserve(std::min(k, (int)touched.size()));
+    for (size_t i=0;i<touched.size();++i) {
+        ScoredImage candidate;
+        candidate.image = touched[i];
+        candidate.score = accumulators[candidate.image];
+        offer(heap, k, candidate);
+    }
+
+    releaseContext(context);
+    return output_ranking(heap, query_norm, images, scores);
+}
+
+
+int InvertedIndex::query(const int* histogram, int pairs, int k, int scoring, int* images, float* scores)
+{
+    if (scoring!=SCORING_TFIDF && scoring!=SCORING_BM25) {
+        throw FLANNException("Unknown scoring model");
+    }
+    if (k<=0) {
+        return 0;
+    }
+    // the k-th score is too low to prune much
+    if ((long long)k*EXHAUSTIVE_RATIO>header.documents) {
+        return queryExhaustive(histogram, pairs, k, scoring, images, scores);
+    }
+    QueryContext* context = acquireContext();
+    std::vector<PostingIterator>& iterators = context->iterators;
+
+    // the words, by increasing bound of their contributions
+    std::vector<QueryWord> words;
+    double query_norm = 0;
+    for (int i=0;i<pairs;++i) {
+        QueryWord word;
+        word.word = histogram[2*i];
+        word.weight = wordWeight(word.word, histogram[2*i+1], scoring);
+        if (word.weight<=0) {
+            continue;
+        }
+        if (scoring==SCORING_TFIDF) {
+            query_norm += (double)word.weight*histogram[2*i+1];
+        }
+        float bound = scoring==SCORING_BM25 ? max_bm25[word.word] : max_tfidf[word.word];
+        word.bound = word.weight*bound*BOUND_SLACK;
+        words.push_back(word);
+    }
+    std::sort(words.begin(), words.end());
+    int n = (int)words.size();
+    if ((int)iterators.size()<n) {
+        iterators.resize(n);
+    }
+    // bounds[i]: bound of the sum of the contributions of the words 0..i
+    std::vector<float> bounds(n);
+    for (int i=0;i<n;++i) {
+        int word = words[i].word;
+        iterators[i].reset(postings+word_offsets[word], postings+word_offsets[word+1], df[word], header.documents);
+        bounds[i] = (i>0 ? bounds[i-1] : 0)+words[i].bound;
+    }
+
+    // The words before first_essential can't bring an image into the top k
+    // by themselves. The images are taken a window at a time: the lists of
+    // the other words are added to the scores of the window, then the first
+    // words complete the scores of the images found, from the largest
+    // bound down, dropping the images that can no longer enter the top k.
+    std::vector<float>& window = context->scores;
+    std::vector<ScoredImage> heap;
+    std::vector<int> candidates;
+    candidates.reserve(QUERY_WINDOW);
+    float threshold = 0;
+    int first_essential = 0;
+    for (int start=0; start<header.documents && first_essential<n; start+=QUERY_WINDOW) {
+        int end = std::min(start+QUERY_WINDOW, header.documents);
+        int essential = first_essential;
+        for (int i=essential;i<n;++i) {
+            PostingIterator& it = iterators[i];
+            float weight = words[i].weight;
+            int buffered;
+            while ((buffered = it.buffered())>0) {
+                const int* block_images = it.buffered_images();
+                const int* block_tfs = it.buffered_tfs();
+                int j = 0;
+                for (; j<buffered && block_images[j]<end; ++j) {
+                    window[block_images[j]-start] += contribution(weight, block_images[j], block_tfs[j], scoring);
+                }
+                it.skip_buffered(j);
+                if (j<buffered) {
+                    break;
+                }
+            }
+        }
+
+        // lowest: no candidate has a lower score, or the next pass
+        // dropping the candidates waits for this bound
+        candidates.clear();
+        float lowest = std::numeric_limits<float>::max();
+        for (int image=start;image<end;++image) {
+            if (window[image-start]!=0) {
+                candidates.push_back(image);
+                lowest = std::min(lowest, window[image-start]);
+            }
+        }
+        bool full = (int)heap.size()==k;
+        for (int i=essential-1; i>=0 && !candidates.empty(); --i) {
+            // drops the candidates that can no longer enter the top k. When
+            // few are dropped, the next pass waits for the bound to get
+            // halfway closer to the threshold.
+            if (full && threshold-bounds[i]>=lowest) {
+                float bound = threshold-bounds[i];
+                size_t count = candidates.size();
+                lowest = std::numeric_limits<float>::max();
+                size_t kept = 0;
+                for (size_t c=0;c<candidates.size();++c) {
+                    int image = candidates[c];
+                    float score = window[image-start];
+                    if (score<=bound) {
+                        window[image-start] = 0;
+                    }
+                    else {
+                        candidates[kept++] = image;
+                        lowest = std::min(lowest, score);
+                    }
+                }
+                candidates.resize(kept);
+                if (kept>count-count/8) {
+                    lowest = std::max(lowest, (bound+threshold)/2);
+                }
+            }
+
+            PostingIterator& it = iterators[i];
+            float weight = words[i].weight;
+            double postings = (double)df[words[i].word]*(end-start)/header.documents;
+            if (postings<MERGE_RATIO*candidates.size()) {
+                // few postings per candidate: they are all added
+                it.seek(start);
+                int buffered;
+                while ((buffered = it.buffered())>0) {
+                    const int* block_images = it.buffered_images();
+                    const int* block_tfs = it.buffered_tfs();
+                    int j = 0;
+                    for (; j<buffered && block_images[j]<end; ++j) {
+                        float& score = window[block_images[j]-start];
+                        if (score!=0) {
+                            score += contribution(weight, block_images[j], block_tfs[j], scoring);
+                        }
+                    }
+                    it.skip_buffered(j);
+                    if (j<buffered) {
+                        break;
+                    }
+                }
+            }
+            else {
+                // many postings per candidate: the candidates are looked up,
+                // skipping the blocks between them
+                int buffered = it.buffered();
+                const int* block_images = it.buffered_images();
+                const int* block_tfs = it.buffered_tfs();
+                int j = 0;
+                for (size_t c=0;c<candidates.size();++c) {
+                    int image = candidates[c];
+                    while (j<buffered && block_images[j]<image) {
+                        ++j;
+                    }
+                    if (j==buffered && buffered>0) {
+                        it.skip_buffered(j);
+                        it.seek(image);
+                        buffered = it.buffered();
+                        block_images = it.buffered_images();
+                        block_tfs = it.buffered_tfs();
+                        j = 0;
+                    }
+                    if (j<buffered && block_images[j]==image) {
+                        window[image-start] += contribution(weight, image, block_tfs[j], scoring);
+                    }
+                }
+                it.skip_buffered(j);
+            }
+        }
+
+        for (size_t c=0;c<candidates.size();++c) {
+            ScoredImage candidate;
+            candidate.image = candidates[c];
+            candidate.score = window[candidate.image-start];
+            window[candidate.image-start] = 0;
+            if (offer(heap, k, candidate) && (int)heap.size()==k) {
+                threshold = heap.front().score;
+            }
+        }
+        while (first_essential<n && bounds[first_essential]<=threshold) {
+            first_essential++;
+        }
+    }
+
+    releaseContext(context);
+    return output_ranking(heap, scoring==SCORING_TFIDF ? query_norm : 1, images, scores);
+}
@@ -0,0 +1,235 @@
+#ifndef INVERTEDINDEX_H
+#define INVERTEDINDEX_H
+
+
+#include "Postings.h"
+#include "../util/MappedFile.h"
+#include "../constants.h"
+
+#include <vector>
+#include <mutex>
+
+
+/**
+    Version of the inverted file format.
+*/
+const int INVERTED_FILE_VERSION = 4;
+
+
+/**
+    Header of an inverted file. It is followed, each part starting at a
+    multiple of 8 bytes, by:
+        long long word_offsets[words+1]: offset of the postings of each word
+        int df[words]: number of images containing each word
+        float max_tfidf[words]: largest tf/norm of the images of each word
+        float max_bm25[words]: largest BM25 tf factor of the images of each
+            word, tf*(k1+1)/(tf+k1*(1-b+b*length/average_length))
+        int lengths[documents]: number of visual words of each image
+        float norms[documents]: norm of the tf-idf vector of each image
+        long long name_offsets[documents+1]: offset of the name of each image
+        char names[names_size]: the names, null terminated
+        long long signature_offsets[words+1]: offset of the signatures of
+            each word, only with signatures
+        unsigned long long signatures[signatures_size]: the
+            signatures of the descriptors of each word, tf of them for each
+            posting in the order of the postings, only with signatures
+        unsigned char postings[postings_size]
+
+    The postings of a word are its df (image, tf) pairs in increasing image
+    order, encoded by encode_postings: delta coded and bit-packed in blocks
+    of POSTING_BLOCK postings, the last partial block as variable length
+    integers.
+*/
+struct InvertedFileHeader
+{
+    char signature[8];
+    int version;
+    int documents;
+    int words;
+    /**
+        Bits of the signatures of the descriptors, 0 without signatures.
+    */
+    int signature_bits;
+    long long total_length;
+    long long postings_size;
+    long long names_size;
+    long long signatures_size;
+};
+
+
+/**
+    Builds the inverted file of a binary corpus file (written by write_corpus
+    with CORPUS_BINARY), with the signatures of the corpus if it has them.
+
+    Params:
+        corpus_file = the corpus
+        index_file = the inverted file written
+*/
+void build_inverted_index(const char* corpus_file, const char* index_file);
+
+
+/**
+    An inverted file mapped in memory, used to rank the images by the visual
+    words they share with a query. The postings are decoded in place from
+    the mapped file. Queries can be run concurrently from several threads.
+*/
+class InvertedIndex
+{
+    /**
+        Per query state: the score accumulators of the images (of a window
+        of images with the pruning), the images with a non zero score and the
+        iterators over the lists of the query words.
+    */
+    struct QueryContext {
+        std::vector<float> scores;
+        std::vector<int> touched;
+        std::vector<PostingIterator> iterators;
+    };
+
+    MappedFile file;
+    InvertedFileHeader header;
+
+    const long long* word_offsets;
+    const int* df;
+    const float* max_tfidf;
+    const float* max_bm25;
+    const int* lengths;
+    const float* norms;
+    const long long* name_offsets;
+    const char* names;
+    const long long* signature_offsets;
+    const unsigned long long* signatures;
+    const unsigned char* postings;
+
+    float average_length;
+
+    /**
+        Unused query contexts, reused by the next queries.
+    */
+    std::vector<QueryContext*> contexts;
+    std::mutex contexts_lock;
+
+    InvertedIndex(const InvertedIndex&);
+    InvertedIndex& operator=(const InvertedIndex&);
+
+    QueryContext* acquireContext();
+
+    void releaseContext(QueryContext* context);
+
+    /**
+        Weight of a query word, its contributions to the scores are the
+        weight times the tf factor of each image (before dividing by the
+        norm of the query for tf-idf).
+        Returns: 0 for the words that don't change the ranking
+    */
+    float wordWeight(int word, int count, int scoring) const;
+
+    /**
+        Contribution of a word of the query to the score of an image.
+    */
+    float contribution(float weight, int image, int tf, int scoring) const;
+
+public:
+    /**
+        Maps an inverted file. Throws a FLANNException if it cannot be mapped
+        or if it is invalid.
+    */
+    InvertedIndex(const char* filename);
+
+    ~InvertedIndex();
+
+    /**
+        Number of images.
+    */
+    int size() const
+    {
+        return header.documents;
+    }
+
+    /**
+        Number of visual words (one more than the largest word of the corpus).
+    */
+    int words() const
+    {
+        return header.words;
+    }
+
+    /**
+        Returns: true if the postings have the signatures of the descriptors
+    */
+    bool has_signatures() const
+    {
+        return header.signature_bits>0;
+    }
+
+    /**
+        Name of an image.
+    */
+    const char* name(int image) const
+    {
+        return names+name_offsets[image];
+    }
+
+    /**
+        Finds the images with the highest scores for a query.
+
+        Params:
+            histogram = the (word, count) pairs of the query, the words
+                outside of the vocabulary are ignored
+            pairs = number of pairs
+            k = number of images returned
+            scoring = SCORING_TFIDF (cosine of the tf-idf vectors, with
+                idf = log(N/df)) or SCORING_BM25 (Okapi BM25 with k1 = 1.2
+                and b = 0.75, each word weighted by its count in the query)
+            images = output, the images by decreasing score (the lowest
+                image first for equal scores)
+            scores = output, their scores, or NULL
+        Returns: the number of images written, at most k, only the images
+            sharing at least one word with the query are returned
+
+        The posting lists are pruned with the largest contribution of each
+        word (MaxScore): the words whose contributions together cannot bring
+        an image into the current top k don't add images, they only complete
+        the scores of the images found in the lists of the other words,
+        while these can still enter the top k, and their lists are skipped
+        a block at a time. The fewer images are asked, the more postings
+        are skipped; above one image per 128 images, all the postings are
+        scored.
+    */
+    int query(const int* histogram, int pairs, int k, int scoring, int* images, float* scores);
+
+    /**
+        Same as query, but scores all the postings of the query words, one
+        word at a time. Used as a reference by the tests and benchmarks.
+    */
+    int queryExhaustive(const int* histogram, int pairs, int k, int scoring, int* images, float* scores);
+
+    /**
+        Finds the images with the highest scores for a query with the
+        signatures of its descriptors (Hamming embedding), with the tf-idf
+        scoring: a descriptor of the query and a descriptor of an image
+        only match if they have the same word and if their signatures
+        differ by at most threshold bits, and each match counts for one in
+        the product of the tf of the query and the tf of the image. With a
+        threshold of HAMMING_BITS, the scores are the ones of query with
+        SCORING_TFIDF. All the postings of the query words are scored.
+        Throws a FLANNException if the index has no signatures.
+
+        Params:
+            histogram = the (word, count) pairs of the query
+            pairs = number of pairs
+            signatures = the signatures of the descriptors of each word of
+                the histogram, count of them, in the order of the histogram
+            threshold = largest Hamming distance of two matching descriptors
+            k = number of images returned
+            images = output, the images by decreasing score
+            scores = output, their scores, or NULL
+        Returns: the number of images written, at most k, only the images
+            with at least one match are returned
+    */
+    int querySignatures(const int* histogram, int pairs, const unsigned long long* signatures, int threshold,
+                int k, int* images, float* scores);
+};
+
+
+#endif //INVERTEDINDEX_H
@@ -0,0 +1,394 @@
+#include "Postings.h"
+
+#include "../util/common.h"
+
+#include <string.h>
+
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define POSTINGS_SSE2
+#include <emmintrin.h>
+#endif
+
+
+namespace {
+
+/* Values per lane of a packed block. */
+const int LANE_VALUES = POSTING_BLOCK/4;
+
+
+int bits_needed(unsigned int value)
+{
+    int bits = 0;
+    while (value!=0) {
+        bits++;
+        value >>= 1;
+    }
+    return bits;
+}
+
+
+void append_varint(std::vector<unsigned char>& bytes, unsigned int value)
+{
+    while (value>=0x80) {
+        bytes.push_back((unsigned char)(value|0x80));
+        value >>= 7;
+    }
+    bytes.push_back((unsigned char)value);
+}
+
+
+inline bool read_varint(const unsigned char*& p, const unsigned char* end, unsigned int& value)
+{
+    value = 0;
+    for (int shift=0; p<end && shift<35; shift+=7) {
+        unsigned char byte = *p++;
+        value |= (unsigned int)(byte & 0x7f) << shift;
+        if ((byte & 0x80)==0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+    Packs POSTING_BLOCK values with the given number of bits each, in the
+    lane layout described in encode_postings: 32 bit word j of lane l is
+    the (4*j+l)-th word of the output.
+*/
+void pack(const unsigned int* values, int bits, std::vector<unsigned char>& bytes)
+{
+    if (bits==0) {
+        return;
+    }
+    std::vector<unsigned int> words(4*bits, 0);
+    for (int i=0;i<POSTING_BLOCK;++i) {
+        int lane = i%4;
+        int position = (i/4)*bits;
+        int word = position/32;
+        int shift = position%32;
+        words[4*word+lane] |= values[i] << shift;
+        if (shift+bits>32) {
+            words[4*(word+1)+lane] |= values[i] >> (32-shift);
+        }
+    }
+    size_t offset = bytes.size();
+    bytes.resize(offset+words.size()*sizeof(unsigned int));
+    memcpy(&bytes[offset], &words[0], words.size()*sizeof(unsigned int));
+}
+
+
+void unpack_scalar(const unsigned char* in, int bits, int* out)
+{
+    if (bits==0) {
+        memset(out, 0, POSTING_BLOCK*sizeof(int));
+        return;
+    }
+    unsigned int mask = bits==32 ? 0xffffffffu : (1u<<bits)-1;
+    for (int i=0;i<POSTING_BLOCK;++i) {
+        int lane = i%4;
+        int position = (i/4)*bits;
+        int word = position/32;
+        int shift = position%32;
+        unsigned int low, high;
+        memcpy(&low, in+(4*word+lane)*sizeof(unsigned int), sizeof(unsigned int));
+        unsigned int value = low >> shift;
+        if (shift+bits>32) {
+            memcpy(&high, in+(4*(word+1)+lane)*sizeof(unsigned int), sizeof(unsigned int));
+            value |= high << (32-shift);
+        }
+        out[i] = (int)(value & mask);
+    }
+}
+
+
+void decode_images_scalar(const unsigned char* in, int bits, int previous, int* images)
+{
+    unpack_scalar(in, bits, images);
+    for (int i=0;i<POSTING_BLOCK;++i) {
+        previous += images[i]+1;
+        images[i] = previous;
+    }
+}
+
+
+void decode_tfs_scalar(const unsigned char* in, int bits, int* tfs)
+{
+    unpack_scalar(in, bits, tfs);
+    for (int i=0;i<POSTING_BLOCK;++i) {
+        tfs[i] += 1;
+    }
+}
+
+
+#ifdef POSTINGS_SSE2
+
+/**
+    Unpacks the V-th value of the four lanes and the next ones. The bit
+    positions are template constants, so the shifts take immediate counts
+    and the whole block is unrolled.
+*/
+template <int BITS, int V>
+struct UnpackLanes
+{
+    static void run(const __m128i* in, __m128i* out, __m128i mask)
+    {
+        const int position = V*BITS;
+        const int word = position/32;
+        const int shift = position%32;
+        __m128i value = _mm_srli_epi32(_mm_loadu_si128(in+word), shift);
+        if (shift+BITS>32) {
+            value = _mm_or_si128(value, _mm_slli_epi32(_mm_loadu_si128(in+word+1), (32-shift)%32));
+        }
+        _mm_storeu_si128(out+V, _mm_and_si128(value, mask));
+        UnpackLanes<BITS,V+1>::run(in, out, mask);
+    }
+};
+
+template <int BITS>
+struct UnpackLanes<BITS,LANE_VALUES>
+{
+    static void run(const __m128i*, __m128i*, __m128i)
+    {
+    }
+};
+
+template <int BITS>
+void unpack_bits_sse2(const unsigned char* in, int* out)
+{
+    __m128i mask = _mm_set1_epi32(BITS==32 ? -1 : (int)((1u<<(BITS%32))-1));
+    UnpackLanes<BITS,0>::run((const __m128i*)in, (__m128i*)out, mask);
+}
+
+typedef void (*unpack_func)(const unsigned char* in, int* out);
+
+const unpack_func unpack_sse2_table[33] = {
+    NULL,
+    &unpack_bits_sse2<1>, &unpack_bits_sse2<2>, &unpack_bits_sse2<3>, &unpack_bits_sse2<4>,
+    &unpack_bits_sse2<5>, &unpack_bits_sse2<6>, &unpack_bits_sse2<7>, &unpack_bits_sse2<8>,
+    &unpack_bits_sse2<9>, &unpack_bits_sse2<10>, &unpack_bits_sse2<11>, &unpack_bits_sse2<12>,
+    &unpack_bits_sse2<13>, &unpack_bits_sse2<14>, &unpack_bits_sse2<15>, &unpack_bits_sse2<16>,
+    &unpack_bits_sse2<17>, &unpack_bits_sse2<18>, &unpack_bits_sse2<19>, &unpack_bits_sse2<20>,
+    &unpack_bits_sse2<21>, &unpack_bits_sse2<22>, &unpack_bits_sse2<23>, &unpack_bits_sse2<24>,
+    &unpack_bits_sse2<25>, &unpack_bits_sse2<26>, &unpack_bits_sse2<27>, &unpack_bits_sse2<28>,
+    &unpack_bits_sse2<29>, &unpack_bits_sse2<30>, &unpack_bits_sse2<31>, &unpack_bits_sse2<32>
+};
+
+void unpack_sse2(const unsigned char* in, int bits, int* out)
+{
+    if (bits==0) {
+        memset(out, 0, POSTING_BLOCK*sizeof(int));
+    }
+    else {
+        unpack_sse2_table[bits](in, out);
+    }
+}
+
+void decode_images_sse2(const unsigned char* in, int bits, int previous, int* images)
+{
+    unpack_sse2(in, bits, images);
+    // prefix sum of the gaps + 1, four at a time
+    __m128i ones = _mm_set1_epi32(1);
+    __m128i carry = _mm_set1_epi32(previous);
+    __m128i* p = (__m128i*)images;
+    for (int i=0;i<LANE_VALUES;++i) {
+        __m128i x = _mm_add_epi32(_mm_loadu_si128(p+i), ones);
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, carry);
+        _mm_storeu_si128(p+i, x);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3,3,3,3));
+    }
+}
+
+void decode_tfs_sse2(const unsigned char* in, int bits, int* tfs)
+{
+    unpack_sse2(in, bits, tfs);
+    __m128i ones = _mm_set1_epi32(1);
+    __m128i* p = (__m128i*)tfs;
+    for (int i=0;i<LANE_VALUES;++i) {
+        _mm_storeu_si128(p+i, _mm_add_epi32(_mm_loadu_si128(p+i), ones));
+    }
+}
+
+#endif
+
+
+struct PostingsKernel {
+    const char* name;
+    void (*images)(const unsigned char* in, int bits, int previous, int* images);
+    void (*tfs)(const unsigned char* in, int bits, int* tfs);
+};
+
+/* Ordered by preference. */
+const PostingsKernel kernels[] = {
+#ifdef POSTINGS_SSE2
+    { "sse2", &decode_images_sse2, &decode_tfs_sse2 },
+#endif
+    { "scalar", &decode_images_scalar, &decode_tfs_scalar }
+};
+
+const PostingsKernel* kernel = &kernels[0];
+
+}
+
+
+void encode_postings(const int* images, const int* tfs, int count, std::vector<unsigned char>& bytes)
+{
+    unsigned int gaps[POSTING_BLOCK];
+    unsigned int values[POSTING_BLOCK];
+    int previous = -1;
+    int i = 0;
+    for (; i+POSTING_BLOCK<=count; i+=POSTING_BLOCK) {
+        unsigned int max_gap = 0;
+        unsigned int max_tf = 0;
+        for (int j=0;j<POSTING_BLOCK;++j) {
+            gaps[j] = (unsigned int)(images[i+j]-previous-1);
+            values[j] = (unsigned int)(tfs[i+j]-1);
+            previous = images[i+j];
+            max_gap |= gaps[j];
+            max_tf |= values[j];
+        }
+        PostingBlockHeader header;
+        memset(&header, 0, sizeof(header));
+        header.last_image = previous;
+        header.image_bits = (unsigned char)bits_needed(max_gap);
+        header.tf_bits = (unsigned char)bits_needed(max_tf);
+        size_t offset = bytes.size();
+        bytes.resize(offset+POSTING_BLOCK_HEADER);
+        memcpy(&bytes[offset], &header, POSTING_BLOCK_HEADER);
+        pack(gaps, header.image_bits, bytes);
+        pack(values, header.tf_bits, bytes);
+    }
+    for (; i<count; ++i) {
+        append_varint(bytes, images[i]-previous);
+        append_varint(bytes, tfs[i]);
+        previous = images[i];
+    }
+}
+
+
+PostingCursor::PostingCursor(const unsigned char* begin, const unsigned char* end_, int count, int documents_) :
+    p(begin), end(end_), remaining(count), previous(-1), documents(documents_)
+{
+}
+
+
+void PostingCursor::readBlockHeader(PostingBlockHeader& header) const
+{
+    if (end-p<POSTING_BLOCK_HEADER) {
+        throw FLANNException("Invalid postings");
+    }
+    memcpy(&header, p, POSTING_BLOCK_HEADER);
+    if (header.image_bits>32 || header.tf_bits>32 ||
+            end-p<POSTING_BLOCK_HEADER+16*(header.image_bits+header.tf_bits)) {
+        throw FLANNException("Invalid postings");
+    }
+}
+
+
+int PostingCursor::next(int* images, int* tfs)
+{
+    if (remaining>=POSTING_BLOCK) {
+        PostingBlockHeader header;
+        readBlockHeader(header);
+        int image_bits = header.image_bits;
+        int tf_bits = header.tf_bits;
+        p += POSTING_BLOCK_HEADER;
+        kernel->images(p, image_bits, previous, images);
+        p += 16*image_bits;
+        kernel->tfs(p, tf_bits, tfs);
+        p += 16*tf_bits;
+        previous = header.last_image;
+        remaining -= POSTING_BLOCK;
+        // the callers index their arrays with the images
+        for (int i=0;i<POSTING_BLOCK;++i) {
+            if ((unsigned int)images[i]>=(unsigned int)documents) {
+                throw FLANNException("Invalid postings");
+            }
+        }
+        return POSTING_BLOCK;
+    }
+
+    int count = remaining;
+    for (int i=0;i<count;++i) {
+        unsigned int gap, tf;
+        if (!read_varint(p, end, gap) || !read_varint(p, end, tf)) {
+            throw FLANNException("Invalid postings");
+        }
+        previous += gap;
+        if ((unsigned int)previous>=(unsigned int)documents) {
+            throw FLANNException("Invalid postings");
+        }
+        images[i] = previous;
+        tfs[i] = tf;
+    }
+    remaining = 0;
+    return count;
+}
+
+
+bool PostingCursor::skip(int target)
+{
+    if (remaining<POSTING_BLOCK) {
+        return false;
+    }
+    PostingBlockHeader header;
+    readBlockHeader(header);
+    if (header.last_image>=target) {
+        return false;
+    }
+    p += POSTING_BLOCK_HEADER+16*(header.image_bits+header.tf_bits);
+    previous = header.last_image;
+    remaining -= POSTING_BLOCK;
+    return true;
+}
+
+
+void PostingIterator::decodeBlock()
+{
+    count = cursor.next(images, tfs);
+    position = 0;
+    if (count==0) {
+        images[0] = POSTINGS_END;
+    }
+}
+
+
+void PostingIterator::reset(const unsigned char* begin, const unsigned char* end, int count_, int documents)
+{
+    cursor = PostingCursor(begin, end, count_, documents);
+    decodeBlock();
+}
+
+
+void PostingIterator::seekForward(int target)
+{
+    if (images[count-1]<target) {
+        while (cursor.skip(target)) {
+        }
+        decodeBlock();
+    }
+    while (images[position]<target) {
+        next();
+    }
+}
+
+
+const char* postings_kernel()
+{
+    return kernel->name;
+}
+
+
+bool set_postings_kernel(const char* name)
+{
+    for (size_t i=0;i<sizeof(kernels)/sizeof(kernels[0]);++i) {
+        if (strcmp(kernels[i].name,name)==0) {
+            kernel = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
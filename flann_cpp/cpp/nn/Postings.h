@@ -0,0 +1,252 @@
+#ifndef POSTINGS_H
+#define POSTINGS_H
+
+
+#include <stddef.h>
+#include <vector>
+
+
+/**
+    Number of postings of a packed block.
+*/
+const int POSTING_BLOCK = 128;
+
+
+/**
+    Image of a posting iterator past the end of its list.
+*/
+const int POSTINGS_END = 0x7fffffff;
+
+
+/**
+    Size of the header of a packed block.
+*/
+const int POSTING_BLOCK_HEADER = 8;
+
+
+/**
+    Header of a packed block of postings.
+*/
+struct PostingBlockHeader
+{
+    /**
+        Image of the last posting of the block.
+    */
+    int last_image;
+    /**
+        Bits per image gap.
+    */
+    unsigned char image_bits;
+    /**
+        Bits per tf.
+    */
+    unsigned char tf_bits;
+    unsigned short reserved;
+};
+
+
+/**
+    Encodes a posting list.
+
+    The postings are cut in blocks of POSTING_BLOCK postings. Each full block
+    is a PostingBlockHeader followed by the image gaps (image - previous
+    image - 1) and then the tfs - 1, each bit-packed with the bits of their
+    largest value. The values are packed in 4 interleaved 32 bit lanes
+    (value i goes in lane i%4), so that four of them are unpacked at once
+    with SSE2. The previous image of the first posting is the last image of
+    the previous block, or -1. The remaining postings (less than a block)
+    are stored as (image gap, tf) pairs of variable length integers, the gap
+    from the previous image: 7 bits per byte, the high bit set on all the
+    bytes but the last.
+
+    Params:
+        images = the images, increasing
+        tfs = the tfs, positive
+        count = number of postings
+        bytes = output, the encoded postings are appended to it
+*/
+void encode_postings(const int* images, const int* tfs, int count, std::vector<unsigned char>& bytes);
+
+
+/**
+    Decodes a posting list written by encode_postings, one block at a time.
+    The postings are decoded from the encoded bytes in place, they can be
+    mapped from a file.
+*/
+class PostingCursor
+{
+    const unsigned char* p;
+    const unsigned char* end;
+    int remaining;
+    int previous;
+    int documents;
+
+    /**
+        Reads the header of the next packed block and checks that the block
+        is inside the list.
+    */
+    void readBlockHeader(PostingBlockHeader& header) const;
+
+public:
+    PostingCursor() : p(NULL), end(NULL), remaining(0), previous(-1), documents(0)
+    {
+    }
+
+    /**
+        Params:
+            begin = the encoded postings
+            end = end of the encoded postings
+            count = number of postings
+            documents = the images are lower than documents (they index
+                the arrays of the documents)
+    */
+    PostingCursor(const unsigned char* begin, const unsigned char* end, int count, int documents);
+
+    /**
+        Number of postings not decoded yet.
+    */
+    int remaining_postings() const
+    {
+        return remaining;
+    }
+
+    /**
+        Decodes the next block. Throws a FLANNException if the postings
+        are invalid or if an image is not lower than documents.
+
+        Params:
+            images = output, room for POSTING_BLOCK images
+            tfs = output, room for POSTING_BLOCK tfs
+        Returns: the number of postings decoded, 0 at the end of the list
+    */
+    int next(int* images, int* tfs);
+
+    /**
+        Skips the next block without decoding it if all its images are
+        lower than a target image. Only the packed blocks are skipped.
+
+        Returns: true if the block was skipped
+    */
+    bool skip(int target);
+};
+
+
+/**
+    Iterates over the postings of a list one at a time, decoding a block at
+    a time.
+*/
+class PostingIterator
+{
+    PostingCursor cursor;
+    int images[POSTING_BLOCK];
+    int tfs[POSTING_BLOCK];
+    int count;
+    int position;
+
+    void decodeBlock();
+
+    void seekForward(int target);
+
+public:
+    PostingIterator() : count(0), position(0)
+    {
+        images[0] = POSTINGS_END;
+    }
+
+    /**
+        Starts iterating over a list, at its first posting.
+
+        Params:
+            begin = the encoded postings
+            end = end of the encoded postings
+            count = number of postings
+            documents = the images are lower than documents
+    */
+    void reset(const unsigned char* begin, const unsigned char* end, int count, int documents);
+
+    /**
+        Image of the current posting, POSTINGS_END past the end of the list.
+    */
+    int image() const
+    {
+        return images[position];
+    }
+
+    /**
+        Tf of the current posting.
+    */
+    int tf() const
+    {
+        return tfs[position];
+    }
+
+    /**
+        Moves to the next posting.
+    */
+    void next()
+    {
+        if (++position==count) {
+            decodeBlock();
+        }
+    }
+
+    /**
+        Moves to the first posting with an image greater or equal to a
+        target image, skipping the blocks before it without decoding them.
+    */
+    void seek(int target)
+    {
+        if (images[position]<target) {
+            seekForward(target);
+        }
+    }
+
+    /**
+        Number of decoded postings from the current one to the end of the
+        current block, 0 past the end of the list. Along with
+        buffered_images, buffered_tfs and skip_buffered, lets the callers
+        go through the postings in tight loops.
+    */
+    int buffered() const
+    {
+        return count-position;
+    }
+
+    const int* buffered_images() const
+    {
+        return images+position;
+    }
+
+    const int* buffered_tfs() const
+    {
+        return tfs+position;
+    }
+
+    /**
+        Moves n postings forward, at most buffered() postings.
+    */
+    void skip_buffered(int n)
+    {
+        position += n;
+        if (position==count) {
+            decodeBlock();
+        }
+    }
+};
+
+
+/**
+    Name of the block unpacking code in use ("sse2" or "scalar"). SSE2 is
+    used when the library is compiled for it (always on x64).
+*/
+const char* postings_kernel();
+
+
+/**
+    Selects the block unpacking code by name, for tests and benchmarks.
+    Returns: false if it isn't available
+*/
+bool set_postings_kernel(const char* name);
+
+
+#endif //POSTINGS_H
@@ -5,6 +5,7 @@
 #include "../util/Logger.h"
 #include "../algorithms/dist.h"
 #include "../util/common.h"
+#include "../util/ThreadPool.h"
 
 #include <algorithm>
 #include <math.h>
@@ -13,6 +14,9 @@
 
 const float SEARCH_EPS = 0.001;
 
+/* Smallest number of queries searched by one task of a batch search. */
+const int BATCH_MIN_QUERIES = 64;
+
 int countCorrectMatches(int* neighbors, int* groundTruth, int n)
 {
     int count = 0;
@@ -56,8 +60,8 @@ float search_with_ground_truth(NNIndex& index, const Dataset<float>& inputData,
     }
     
     ResultSet resultSet(nn+skipMatches);
-    Params searchParams;
-    searchParams["checks"] = checks;
+    SearchParams searchParams(checks);
+    ScopedSearchContext context(index);
 
     int correct;
     float distR;
@@ -71,7 +75,7 @@ float search_with_ground_truth(NNIndex& index, const Dataset<float>& inputData,
         for (int i = 0; i < testData.rows; i++) {
             float* target = testData[i];
             resultSet.init(target, testData.cols);
-            index.findNeighbors(resultSet,target, searchParams);            
+            index.findNeighbors(resultSet,target, searchParams, *context);            
             int* neighbors = resultSet.getNeighbors();
             neighbors = neighbors+skipMatches;
                     
@@ -94,25 +98,118 @@ float search_with_ground_truth(NNIndex& index, const Dataset<float>& inputData,
 }
 
 
-void search_for_neighbors(NNIndex& index, const Dataset<float>& testset, Dataset<int>& result, Params searchParams, int skip)
+namespace {
+
+/**
+    Searches a range of rows of a query set, with a context of its own.
+*/
+class SearchRangeTask : public Task
+{
+    NNIndex& index;
+    const Dataset<float>& testset;
+    Dataset<int>& result;
+    Dataset<float>* dists;
+    const SearchParams& searchParams;
+    int skip;
+    int start;
+    int end;
+
+public:
+    SearchRangeTask(NNIndex& index_, const Dataset<float>& testset_, Dataset<int>& result_, Dataset<float>* dists_, 
+            const SearchParams& searchParams_, int skip_, int start_, int end_) :
+        index(index_), testset(testset_), result(result_), dists(dists_), searchParams(searchParams_),
+        skip(skip_), start(start_), end(end_)
+    {
+    }
+
+    void run()
+    {
+        int nn = result.cols;
+        ScopedSearchContext context(index);
+        if (nn+skip==1 && findNearest(*context)) {
+            return;
+        }
+        ResultSet resultSet(nn+skip);
+
+        for (int i=start;i<end;++i) {
+            float* target = testset[i];
+            resultSet.init(target, testset.cols);
+            index.findNeighbors(resultSet, target, searchParams, *context);
+            memcpy(result[i], resultSet.getNeighbors()+skip, nn*sizeof(int));
+            if (dists!=NULL) {
+                memcpy((*dists)[i], resultSet.getDistances()+skip, nn*sizeof(float));
+            }
+        }
+    }
+
+private:
+    /**
+        The searches for a single neighbor (quantization) go through
+        NNIndex::findNearest when the index has it.
+        Returns: false if it hasn't (it fails on the first query)
+    */
+    bool findNearest(SearchContext& context)
+    {
+        int neighbor;
+        float dist;
+        for (int i=start;i<end;++i) {
+            if (!index.findNearest(testset[i], searchParams, context, neighbor, dist)) {
+                return false;
+            }
+            result[i][0] = neighbor;
+            if (dists!=NULL) {
+                (*dists)[i][0] = dist;
+            }
+        }
+        return true;
+    }
+};
+
+}
+
+
+void search_for_neighbors(NNIndex& index, const Dataset<float>& testset, Dataset<int>& result, const SearchParams& searchParams, int skip)
 {
     assert(testset.rows == result.rows);
 
-    int nn = result.cols;
-    ResultSet resultSet(nn+skip);
+    SearchRangeTask(index, testset, result, NULL, searchParams, skip, 0, testset.rows).run();
+}
 
-    for (int i = 0; i < testset.rows; i++) {
-        float* target = testset[i];
-		//printf("Target found [%d]\n",i);
-        resultSet.init(target, testset.cols);
-                
-        index.findNeighbors(resultSet,target, searchParams);
-        
-        int* neighbors = resultSet.getNeighbors();
-        memcpy(result[i], neighbors+skip, nn*sizeof(int));        
-		//printf("Neighbor found: %d\n",*neighbors);
+
+void search_for_neighbors(NNIndex& index, const Dataset<float>& testset, Dataset<int>& result, Dataset<float>& dists, const SearchParams& searchParams, int skip)
+{
+    assert(testset.rows == result.rows);
+    assert(dists.rows==result.rows && dists.cols==result.cols);
+
+    SearchRangeTask(index, testset, result, &dists, searchParams, skip, 0, testset.rows).run();
+}
+
+
+void search_for_neighbors_batch(NNIndex& index, const Dataset<float>& testset, Dataset<int>& result, Dataset<float>* dists, 
+            const SearchParams& searchParams, int cores, int skip)
+{
+    assert(testset.rows == result.rows);
+    assert(dists==NULL || (dists->rows==result.rows && dists->cols==result.cols));
+
+    if (cores<=0) {
+        cores = ThreadPool::hardwareThreads();
+    }
+    // a few ranges per thread so that the threads finishing early can steal
+    int ranges = min(cores*4, (testset.rows+BATCH_MIN_QUERIES-1)/BATCH_MIN_QUERIES);
+    if (cores==1 || ranges<=1) {
+        SearchRangeTask(index, testset, result, dists, searchParams, skip, 0, testset.rows).run();
+        return;
     }
 
+    // no more threads than ranges, the others would only be started and joined
+    ThreadPool threads(min(cores, ranges));
+    TaskGroup group;
+    for (int r=0;r<ranges;++r) {
+        int start = (int)((long long)r*testset.rows/ranges);
+        int end = (int)((long long)(r+1)*testset.rows/ranges);
+        threads.spawn(new SearchRangeTask(index, testset, result, dists, searchParams, skip, start, end), group);
+    }
+    threads.wait(group);
 }
 
 float test_index_checks(NNIndex& index, const Dataset<float>& inputData, const Dataset<float>& testData, const Dataset<int>& matches, int checks, float& precision, int nn, int skipMatches)
@@ -9,7 +9,25 @@
 using namespace std;
 
 
-void search_for_neighbors(NNIndex& index, const Dataset<float>& testset, Dataset<int>& result, Params searchParams, int skip = 0);
+void search_for_neighbors(NNIndex& index, const Dataset<float>& testset, Dataset<int>& result, const SearchParams& searchParams, int skip = 0);
+
+/**
+    Same as above, also returning the squared distances to the neighbors
+    (dists must have the same size as result).
+*/
+void search_for_neighbors(NNIndex& index, const Dataset<float>& testset, Dataset<int>& result, Dataset<float>& dists, const SearchParams& searchParams, int skip = 0);
+
+/**
+    Searches the neighbors of all the rows of testset, splitting them in ranges
+    searched on a thread pool, each range with its own search context. The
+    results do not depend on the number of threads.
+
+    Params:
+        dists = squared distances to the neighbors (same size as result), or NULL
+        cores = number of threads, <=0 for one per hardware thread
+*/
+void search_for_neighbors_batch(NNIndex& index, const Dataset<float>& testset, Dataset<int>& result, Dataset<float>* dists, 
+            const SearchParams& searchParams, int cores, int skip = 0);
 
 float test_index_checks(NNIndex& index, const Dataset<float>& inputData, const Dataset<float>& testData, const Dataset<int>& matches, 
             int checks, float& precision, int nn = 1, int skipMatches = 0);
@@ -0,0 +1,135 @@
+#include "Vocabulary.h"
+
+#include "Testing.h"
+#include "IndexIO.h"
+#include "../util/Logger.h"
+
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+
+
+namespace {
+
+/**
+    Modification time of a file, or 0 if it doesn't exist.
+*/
+time_t modification_time(const char* filename)
+{
+    struct stat st;
+    if (stat(filename, &st)!=0) {
+        return 0;
+    }
+    return st.st_mtime;
+}
+
+}
+
+
+Vocabulary::Vocabulary(const char* cluster_file, const char* index_file, Params params) : 
+    centers(new MappedMatrix(cluster_file)), index(NULL), tree(NULL)
+{
+    Dataset<float>& words = centers->data();
+    if (words.rows<1) {
+        delete centers;
+        throw FLANNException("The vocabulary has no words");
+    }
+
+    if (index_file!=NULL && modification_time(index_file)>=modification_time(cluster_file)) {
+        try {
+            Dataset<float>* loaded_data;
+            index = load_index(index_file, &words, loaded_data);
+        }
+        catch (FLANNException& e) {
+            logger.info("Cannot load the vocabulary index: %s\n", e.what());
+        }
+    }
+
+    if (index==NULL) {
+        logger.info("Building the vocabulary index\n");
+        try {
+            index = create_index((const char*)params["algorithm"], words, params);
+            index->buildIndex();
+            if (index_file!=NULL) {
+                save_index(*index, index_file);
+            }
+        }
+        catch (...) {
+            delete index;
+            delete centers;
+            throw;
+        }
+    }
+}
+
+
+Vocabulary::Vocabulary(const char* tree_file) : centers(NULL), index(NULL), tree(new VocabularyTree(tree_file))
+{
+}
+
+
+Vocabulary::~Vocabulary()
+{
+    delete index;
+    delete centers;
+    delete tree;
+}
+
+
+void Vocabulary::quantize(const Dataset<float>& descriptors, int* words, int checks, int cores)
+{
+    if (descriptors.cols!=veclen()) {
+        throw FLANNException("The descriptors and the vocabulary have different lengths");
+    }
+    if (tree!=NULL) {
+        tree->quantize(descriptors, words, cores);
+        return;
+    }
+    SearchParams searchParams(checks);
+    Dataset<int> result(descriptors.rows, 1, words);
+    search_for_neighbors_batch(*index, descriptors, result, NULL, searchParams, cores);
+}
+
+
+int Vocabulary::histogram(const Dataset<float>& descriptors, int* histogram, int capacity, int checks, int cores)
+{
+    std::vector<int> words(descriptors.rows);
+    if (descriptors.rows==0) {
+        return 0;
+    }
+    quantize(descriptors, &words[0], checks, cores);
+    return bag_of_words(&words[0], descriptors.rows, histogram, capacity);
+}
+
+
+int Vocabulary::bag_of_words(int* words, int count, int* histogram, int capacity) const
+{
+    if (tree==NULL) {
+        return word_histogram(words, count, histogram, capacity);
+    }
+    std::vector<int> nodes((size_t)count*tree->depth()+1);
+    int length = 0;
+    for (int i=0;i<count;++i) {
+        length += path(words[i], &nodes[length]);
+    }
+    return word_histogram(&nodes[0], length, histogram, capacity);
+}
+
+
+int word_histogram(int* words, int count, int* histogram, int capacity)
+{
+    std::sort(words, words+count);
+
+    int distinct = 0;
+    for (int i=0;i<count;) {
+        int j = i+1;
+        while (j<count && words[j]==words[i]) ++j;
+        if (distinct<capacity) {
+            histogram[2*distinct] = words[i];
+            histogram[2*distinct+1] = j-i;
+        }
+        distinct++;
+        i = j;
+    }
+    return distinct;
+}
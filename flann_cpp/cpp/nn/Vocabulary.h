@@ -0,0 +1,172 @@
+#ifndef VOCABULARY_H
+#define VOCABULARY_H
+
+
+#include "VocabularyTree.h"
+#include "../algorithms/NNIndex.h"
+#include "../util/MatrixFile.h"
+
+
+/**
+    A visual vocabulary: the cluster centers (the visual words), mapped from
+    a matrix file, and the index used to find the closest word of a 
+    descriptor. Both are loaded once and kept until the vocabulary is 
+    deleted, so quantizing descriptors doesn't read any file.
+
+    A vocabulary can also be a vocabulary tree: the words are then the nodes
+    of the tree, a descriptor is quantized to a leaf and its bag of words
+    has all the nodes of the path of the leaf.
+*/
+class Vocabulary
+{
+    MappedMatrix* centers;
+    NNIndex* index;
+    VocabularyTree* tree;
+
+    Vocabulary(const Vocabulary&);
+    Vocabulary& operator=(const Vocabulary&);
+
+public:
+    /**
+        Opens a vocabulary. The index is loaded from index_file when the file
+        exists, matches the centers and is newer than the cluster file.
+        Otherwise it is built and, if index_file is given, saved there.
+
+        Params:
+            cluster_file = matrix file with the cluster centers
+            index_file = index file built over the centers, or NULL
+            params = parameters used to build the index (algorithm and
+                the parameters of the algorithm)
+    */
+    Vocabulary(const char* cluster_file, const char* index_file, Params params);
+
+    /**
+        Opens a vocabulary tree file (written by save_vocabulary_tree).
+    */
+    explicit Vocabulary(const char* tree_file);
+
+    ~Vocabulary();
+
+    /**
+        Number of visual words (the nodes of a vocabulary tree).
+    */
+    int size() const
+    {
+        return tree!=NULL ? tree->size() : index->size();
+    }
+
+    /**
+        Length of the descriptors.
+    */
+    int veclen() const
+    {
+        return tree!=NULL ? tree->veclen() : index->veclen();
+    }
+
+    /**
+        Number of words of the bag of words of a descriptor, at most: 1, or
+        the depth of a vocabulary tree.
+    */
+    int words_per_descriptor() const
+    {
+        return tree!=NULL ? tree->depth() : 1;
+    }
+
+    /**
+        Lists the words of the bag of words of a descriptor quantized to a
+        word: the word itself, or the nodes of its path for a vocabulary
+        tree.
+
+        Params:
+            word = a word returned by quantize
+            words = output, room for words_per_descriptor() words
+        Returns: the number of words written
+    */
+    int path(int word, int* words) const
+    {
+        if (tree!=NULL) {
+            return tree->path(word, words);
+        }
+        words[0] = word;
+        return 1;
+    }
+
+    /**
+        Center of a word, veclen() values, NULL for the root of a vocabulary
+        tree.
+    */
+    const float* center(int word) const
+    {
+        return tree!=NULL ? tree->center(word) : centers->data()[word];
+    }
+
+    /**
+        The index over the centers, NULL for a vocabulary tree.
+    */
+    NNIndex* getIndex()
+    {
+        return index;
+    }
+
+    /**
+        Finds the closest visual word of each descriptor, the leaf reached
+        by going down a vocabulary tree.
+
+        Params:
+            descriptors = the descriptors, veclen() columns
+            words = output, the word of each descriptor
+            checks = number of checks of the search (<0 for an exact search),
+                not used by the vocabulary trees
+            cores = number of threads, <=0 for one per hardware thread
+    */
+    void quantize(const Dataset<float>& descriptors, int* words, int checks, int cores);
+
+    /**
+        Computes the visual word histogram (bag of words) of a set of 
+        descriptors: the distinct words, in increasing order, each one 
+        followed by the number of descriptors quantized to it.
+
+        Params:
+            descriptors = the descriptors, veclen() columns
+            histogram = output, (word, count) pairs
+            capacity = number of pairs the histogram can hold, no more
+                than descriptors.rows*words_per_descriptor() pairs are ever
+                needed
+            checks = number of checks of the search (<0 for an exact search)
+            cores = number of threads, <=0 for one per hardware thread
+        Returns: the number of distinct words, only the first capacity
+            pairs are written when it's larger than capacity
+    */
+    int histogram(const Dataset<float>& descriptors, int* histogram, int capacity, int checks, int cores);
+
+    /**
+        Computes the histogram of quantized descriptors, with the nodes of
+        their paths for a vocabulary tree.
+
+        Params:
+            words = the words returned by quantize, reordered in place
+            count = number of words
+            histogram = output, (word, count) pairs sorted by word
+            capacity = number of pairs the histogram can hold
+        Returns: the number of distinct words, only the first capacity
+            pairs are written when it's larger than capacity
+    */
+    int bag_of_words(int* words, int count, int* histogram, int capacity) const;
+};
+
+
+/**
+    Counts the occurrences of each word.
+
+    Params:
+        words = the words, sorted in place
+        count = number of words
+        histogram = output, the (word, count) pairs sorted by word
+        capacity = number of pairs the histogram can hold
+    Returns: the number of distinct words, only the first capacity pairs
+        are written when it's larger than capacity
+*/
+int word_histogram(int* words, int count, int* histogram, int capacity);
+
+
+#endif //VOCABULARY_H
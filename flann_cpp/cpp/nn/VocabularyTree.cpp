@@ -0,0 +1,249 @@
+#include "VocabularyTree.h"
+
+#include "../algorithms/dist.h"
+#include "../util/Serialization.h"
+#include "../util/ThreadPool.h"
+#include "../util/common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+
+namespace {
+
+const char TREE_SIGNATURE[8] = { 'F','L','A','N','N','V','O','T' };
+
+/* Smallest number of descriptors quantized by one task. */
+const int QUANTIZE_MIN_DESCRIPTORS = 256;
+
+
+/**
+    Offsets of the parts of a tree file.
+*/
+struct Layout
+{
+    size_t children;
+    size_t pivots;
+    size_t end;
+};
+
+
+size_t align32(size_t offset)
+{
+    return (offset+31) & ~(size_t)31;
+}
+
+
+Layout file_layout(const VocabularyTreeHeader& header)
+{
+    Layout layout;
+    layout.children = align32(sizeof(VocabularyTreeHeader));
+    layout.pivots = align32(layout.children + (size_t)header.nodes*sizeof(int));
+    layout.end = layout.pivots + (size_t)header.internal*header.branching*header.veclen*sizeof(float);
+    return layout;
+}
+
+
+/**
+    Writes a part of the file and the padding to the next multiple of 32 bytes.
+*/
+template <typename T>
+void save_part(FILE* stream, const T* values, size_t count, size_t& offset)
+{
+    if (count>0) {
+        save_value(stream, *values, count);
+    }
+    offset += count*sizeof(T);
+    static const char zeros[32] = { 0 };
+    size_t padding = align32(offset)-offset;
+    if (padding>0) {
+        save_value(stream, zeros[0], padding);
+    }
+    offset += padding;
+}
+
+
+/**
+    Quantizes a range of descriptors on one thread.
+*/
+class QuantizeRangeTask : public Task
+{
+    const VocabularyTree& tree;
+    const Dataset<float>& descriptors;
+    int* leaves;
+    int start;
+    int end;
+
+public:
+    QuantizeRangeTask(const VocabularyTree& tree_, const Dataset<float>& descriptors_, int* leaves_, int start_, int end_) :
+        tree(tree_), descriptors(descriptors_), leaves(leaves_), start(start_), end(end_)
+    {
+    }
+
+    void run()
+    {
+        std::vector<float> dists(tree.branching());
+        for (int i=start;i<end;++i) {
+            leaves[i] = tree.descend(descriptors[i], &dists[0]);
+        }
+    }
+};
+
+}
+
+
+void save_vocabulary_tree(const char* filename, int branching, int veclen,
+            const std::vector<int>& children, const std::vector<float>& pivots)
+{
+    VocabularyTreeHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.signature, TREE_SIGNATURE, sizeof(header.signature));
+    header.version = VOCABULARY_TREE_VERSION;
+    header.branching = branching;
+    header.veclen = veclen;
+    header.nodes = (int)children.size();
+    header.internal = (int)(children.size()-std::count(children.begin(), children.end(), -1));
+    if (header.nodes<1 || pivots.size()!=(size_t)header.internal*branching*veclen) {
+        throw FLANNException("Invalid vocabulary tree");
+    }
+
+    FILE* stream = fopen(filename, "wb");
+    if (stream==NULL) {
+        throw FLANNException("Cannot open the vocabulary tree file for writing");
+    }
+    try {
+        size_t offset = 0;
+        save_part(stream, &header, 1, offset);
+        save_part(stream, &children[0], children.size(), offset);
+        save_part(stream, pivots.empty() ? NULL : &pivots[0], pivots.size(), offset);
+    }
+    catch (...) {
+        fclose(stream);
+        remove(filename);
+        throw;
+    }
+    if (fclose(stream)!=0) {
+        remove(filename);
+        throw FLANNException("Cannot write the vocabulary tree file");
+    }
+}
+
+
+VocabularyTree::VocabularyTree(const char* filename) : file(filename), depth_(0)
+{
+    if (file.size()<sizeof(VocabularyTreeHeader)) {
+        throw FLANNException("Not a vocabulary tree file");
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.signature, TREE_SIGNATURE, sizeof(header.signature))!=0) {
+        throw FLANNException("Not a vocabulary tree file");
+    }
+    if (header.version!=VOCABULARY_TREE_VERSION) {
+        throw FLANNException("Unsupported version of the vocabulary tree file");
+    }
+    if (header.branching<2 || header.veclen<1 || header.nodes<1 || header.internal<0 || header.internal>header.nodes) {
+        throw FLANNException("Invalid vocabulary tree file");
+    }
+    Layout layout = file_layout(header);
+    if (file.size()<layout.end) {
+        throw FLANNException("The vocabulary tree file is truncated");
+    }
+    children = (const int*)(file.data()+layout.children);
+    pivots = (const float*)(file.data()+layout.pivots);
+
+    // the descent trusts the children, each node has a single parent after it
+    int nodes = header.nodes;
+    parents.assign(nodes, -1);
+    pivot_offsets.assign(nodes, 0);
+    std::vector<int> depths(nodes, 0);
+    size_t block = (size_t)header.branching*header.veclen;
+    int internal = 0;
+    for (int i=0;i<nodes;++i) {
+        int first = children[i];
+        if (first==-1) {
+            depth_ = std::max(depth_, depths[i]);
+            continue;
+        }
+        if (first<=i || first>nodes-header.branching || internal==header.internal) {
+            throw FLANNException("Invalid vocabulary tree file");
+        }
+        for (int k=first;k<first+header.branching;++k) {
+            if (parents[k]!=-1) {
+                throw FLANNException("Invalid vocabulary tree file");
+            }
+            parents[k] = i;
+            depths[k] = depths[i]+1;
+        }
+        pivot_offsets[i] = internal*block;
+        internal++;
+    }
+    if (internal!=header.internal) {
+        throw FLANNException("Invalid vocabulary tree file");
+    }
+}
+
+
+int VocabularyTree::descend(const float* descriptor, float* dists) const
+{
+    int node = 0;
+    while (children[node]!=-1) {
+        squared_dist_many_float(descriptor, pivots+pivot_offsets[node], header.branching, header.veclen, dists);
+        int best = 0;
+        for (int k=1;k<header.branching;++k) {
+            if (dists[k]<dists[best]) {
+                best = k;
+            }
+        }
+        node = children[node]+best;
+    }
+    return node;
+}
+
+
+void VocabularyTree::quantize(const Dataset<float>& descriptors, int* leaves, int cores) const
+{
+    if (descriptors.cols!=veclen()) {
+        throw FLANNException("The descriptors and the vocabulary tree have different lengths");
+    }
+    if (cores<=0) {
+        cores = ThreadPool::hardwareThreads();
+    }
+    // a few ranges per thread so that the threads finishing early can steal
+    int ranges = std::min(cores*4, (descriptors.rows+QUANTIZE_MIN_DESCRIPTORS-1)/QUANTIZE_MIN_DESCRIPTORS);
+    if (cores==1 || ranges<=1) {
+        QuantizeRangeTask(*this, descriptors, leaves, 0, descriptors.rows).run();
+        return;
+    }
+
+    // no more threads than ranges, the others would only be started and joined
+    ThreadPool threads(std::min(cores, ranges));
+    TaskGroup group;
+    for (int r=0;r<ranges;++r) {
+        int start = (int)((long long)r*descriptors.rows/ranges);
+        int end = (int)((long long)(r+1)*descriptors.rows/ranges);
+        threads.spawn(new QuantizeRangeTask(*this, descriptors, leaves, start, end), group);
+    }
+    threads.wait(group);
+}
+
+
+const float* VocabularyTree::center(int node) const
+{
+    int parent = parents[node];
+    if (parent<0) {
+        return NULL;
+    }
+    return pivots+pivot_offsets[parent]+(size_t)(node-children[parent])*header.veclen;
+}
+
+
+int VocabularyTree::path(int node, int* path) const
+{
+    int length = 0;
+    while (node>0) {
+        path[length++] = node;
+        node = parents[node];
+    }
+    return length;
+}
@@ -0,0 +1,160 @@
+#ifndef VOCABULARYTREE_H
+#define VOCABULARYTREE_H
+
+
+#include "../util/Dataset.h"
+#include "../util/MappedFile.h"
+
+#include <vector>
+
+
+/**
+    Version of the vocabulary tree file format.
+*/
+const int VOCABULARY_TREE_VERSION = 1;
+
+
+/**
+    Header of a vocabulary tree file. It is followed, each part starting at
+    a multiple of 32 bytes, by:
+        int children[nodes]: first child of each node, -1 for the leaves
+        float pivots[internal*branching*veclen]: the branching x veclen
+            block of children centers of each internal node, in node order
+
+    The nodes are numbered in breadth-first order from the root (node 0),
+    so the branching children of a node are consecutive.
+*/
+struct VocabularyTreeHeader
+{
+    char signature[8];
+    int version;
+    int branching;
+    int veclen;
+    int nodes;
+    int internal;
+    int reserved;
+};
+
+
+/**
+    Writes a vocabulary tree file, from a tree flattened by
+    KMeansTree::getTree.
+
+    Params:
+        filename = the tree file
+        branching = branching factor of the tree
+        veclen = length of the centers
+        children = first child of each node, -1 for the leaves
+        pivots = children centers of each internal node
+*/
+void save_vocabulary_tree(const char* filename, int branching, int veclen,
+            const std::vector<int>& children, const std::vector<float>& pivots);
+
+
+/**
+    A hierarchical k-means tree used as a vocabulary (Nister and Stewenius,
+    Scalable Recognition with a Vocabulary Tree): a descriptor is quantized
+    by going down the tree to the closest child of each node, which takes
+    branching distances per level instead of a search among all the leaves.
+    Every node of the path of the descriptor, except the root, is a visual
+    word of its bag of words, so the images are also compared on the coarse
+    clusters of the upper levels.
+
+    The tree is mapped from its file and used in place.
+*/
+class VocabularyTree
+{
+    MappedFile file;
+    VocabularyTreeHeader header;
+
+    const int* children;
+    const float* pivots;
+
+    /**
+        Parent of each node, -1 for the root.
+    */
+    std::vector<int> parents;
+    /**
+        Offset in pivots of the children centers of each internal node.
+    */
+    std::vector<size_t> pivot_offsets;
+    int depth_;
+
+    VocabularyTree(const VocabularyTree&);
+    VocabularyTree& operator=(const VocabularyTree&);
+
+public:
+    /**
+        Maps a vocabulary tree file. Throws a FLANNException if it cannot be
+        mapped or if it is invalid.
+    */
+    VocabularyTree(const char* filename);
+
+    /**
+        Number of nodes.
+    */
+    int size() const
+    {
+        return header.nodes;
+    }
+
+    /**
+        Length of the descriptors.
+    */
+    int veclen() const
+    {
+        return header.veclen;
+    }
+
+    int branching() const
+    {
+        return header.branching;
+    }
+
+    /**
+        Largest number of nodes on the path from a leaf to the root, the
+        root excluded.
+    */
+    int depth() const
+    {
+        return depth_;
+    }
+
+    /**
+        Goes down the tree to the leaf of a descriptor.
+
+        Params:
+            descriptor = the descriptor, veclen() values
+            dists = room for branching() distances
+        Returns: the leaf
+    */
+    int descend(const float* descriptor, float* dists) const;
+
+    /**
+        Finds the leaf of each descriptor.
+
+        Params:
+            descriptors = the descriptors, veclen() columns
+            leaves = output, the leaf of each descriptor
+            cores = number of threads, <=0 for one per hardware thread
+    */
+    void quantize(const Dataset<float>& descriptors, int* leaves, int cores) const;
+
+    /**
+        Center of a node, veclen() values, NULL for the root.
+    */
+    const float* center(int node) const;
+
+    /**
+        Lists the nodes from a node up to the root, the root excluded.
+
+        Params:
+            node = the node
+            path = output, room for depth() nodes
+        Returns: the number of nodes written
+    */
+    int path(int node, int* path) const;
+};
+
+
+#endif //VOCABULARYTREE_H
@@ -0,0 +1,844 @@
+
+#include "../algorithms/dist.h"
+#include "../algorithms/KMeansTree.h"
+#include "../algorithms/KDTree.h"
+#include "../nn/Postings.h"
+#include "../nn/Corpus.h"
+#include "../nn/InvertedIndex.h"
+#include "../util/Timer.h"
+#include "../util/Random.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+
+/* keeps the compiler from optimizing away the timed loops */
+volatile double sink;
+
+
+float* random_data(int rows, int cols)
+{
+	float* data = new float[rows*cols];
+	for (int i=0;i<rows*cols;++i) {
+		data[i] = (float)rand_double(255.0);
+	}
+	return data;
+}
+
+
+/**
+	Measures the time per distance computation of the squared_dist_float
+	kernels for the usual descriptor lengths and checks that every kernel
+	gives the same (float rounded) distances as the scalar one.
+*/
+int bench_squared_dist()
+{
+	const char* kernels[] = { "scalar", "sse2", "avx2", "avx512" };
+	const int dims[] = { 64, 128, 256 };
+	const int rows = 4096;
+	const int repeats = 200;
+	int errors = 0;
+
+	const char* selected = squared_dist_kernel();
+	printf("squared_dist (selected kernel: %s)\n", selected);
+	printf("%8s %6s %12s %12s\n", "kernel", "dim", "ns/dist", "mismatches");
+
+	for (int d=0; d<3; ++d) {
+		int veclen = dims[d];
+		float* data = random_data(rows, veclen);
+		float* query = random_data(1, veclen);
+
+		float* reference = new float[rows];
+		set_squared_dist_kernel("scalar");
+		for (int i=0;i<rows;++i) {
+			reference[i] = (float)squared_dist_float(query, data+i*veclen, veclen);
+		}
+
+		for (int k=0; k<4; ++k) {
+			if (!set_squared_dist_kernel(kernels[k])) {
+				printf("%8s %6d %12s\n", kernels[k], veclen, "unsupported");
+				continue;
+			}
+			int mismatches = 0;
+			for (int i=0;i<rows;++i) {
+				if ((float)squared_dist_float(query, data+i*veclen, veclen) != reference[i]) {
+					mismatches++;
+				}
+			}
+			errors += mismatches;
+
+			double sum = 0;
+			StartStopTimer t;
+			t.start();
+			for (int r=0;r<repeats;++r) {
+				for (int i=0;i<rows;++i) {
+					sum += squared_dist_float(query, data+i*veclen, veclen);
+				}
+			}
+			t.stop();
+			double ns = t.value*1e9/(double(repeats)*rows);
+			sink = sum;
+			printf("%8s %6d %12.2f %12d\n", kernels[k], veclen, ns, mismatches);
+		}
+
+		delete[] reference;
+		delete[] query;
+		delete[] data;
+	}
+	set_squared_dist_kernel(selected);
+	printf("\n");
+
+	return errors;
+}
+
+
+/**
+	Compares scoring the children of a k-means tree node one at a time, with
+	each center allocated separately, against the batched kernel working
+	on one contiguous block of centers.
+*/
+int bench_squared_dist_many()
+{
+	const int branchings[] = { 10, 32, 128, 256 };
+	const int veclen = 128;
+	const int repeats = 20000;
+	int errors = 0;
+
+	printf("squared_dist_many (veclen=%d)\n", veclen);
+	printf("%10s %14s %14s %12s\n", "branching", "ns/node(1x1)", "ns/node(1xN)", "mismatches");
+
+	for (int b=0; b<4; ++b) {
+		int branching = branchings[b];
+		float* block = random_data(branching, veclen);
+		float** centers = new float*[branching];
+		for (int i=0;i<branching;++i) {
+			centers[i] = new float[veclen];
+			memcpy(centers[i], block+i*veclen, veclen*sizeof(float));
+		}
+		float* query = random_data(1, veclen);
+		float* single = new float[branching];
+		float* batched = new float[branching];
+
+		StartStopTimer t1;
+		t1.start();
+		for (int r=0;r<repeats;++r) {
+			for (int i=0;i<branching;++i) {
+				single[i] = squared_dist(query, centers[i], veclen);
+			}
+		}
+		t1.stop();
+
+		StartStopTimer t2;
+		t2.start();
+		for (int r=0;r<repeats;++r) {
+			squared_dist_many(query, block, branching, veclen, batched);
+		}
+		t2.stop();
+
+		int mismatches = 0;
+		for (int i=0;i<branching;++i) {
+			if (single[i]!=batched[i]) mismatches++;
+		}
+		errors += mismatches;
+		printf("%10d %14.1f %14.1f %12d\n", branching, t1.value*1e9/repeats, t2.value*1e9/repeats, mismatches);
+
+		for (int i=0;i<branching;++i) {
+			delete[] centers[i];
+		}
+		delete[] centers;
+		delete[] block;
+		delete[] query;
+		delete[] single;
+		delete[] batched;
+	}
+	printf("\n");
+
+	return errors;
+}
+
+
+/**
+	The result set as it was before the heap: a sorted array, with a linear
+	scan for duplicates and a bubble insertion.
+*/
+class SortedResultSet
+{
+	std::vector<int> indices;
+	std::vector<float> dists;
+	int capacity;
+	int count;
+
+public:
+	SortedResultSet(int capacity_) : indices(capacity_), dists(capacity_), capacity(capacity_), count(0)
+	{
+	}
+
+	const int* getNeighbors() const
+	{
+		return &indices[0];
+	}
+
+	bool addPointDist(int index, float dist)
+	{
+		for (int i=0;i<count;++i) {
+			if (indices[i]==index) return false;
+		}
+		if (count<capacity) {
+			indices[count] = index;
+			dists[count] = dist;
+			++count;
+		}
+		else if (dist < dists[count-1] || (dist == dists[count-1] && index < indices[count-1])) {
+			indices[count-1] = index;
+			dists[count-1] = dist;
+		}
+		else {
+			return false;
+		}
+		for (int i=count-1;i>=1 && (dists[i]<dists[i-1] || (dists[i]==dists[i-1] && indices[i]<indices[i-1]));--i) {
+			std::swap(indices[i],indices[i-1]);
+			std::swap(dists[i],dists[i-1]);
+		}
+		return true;
+	}
+};
+
+
+/**
+	Compares the sorted array result set with the heap one on a stream of
+	candidates as seen by a search: mostly rejected once the set is full,
+	with some points seen twice. The heap is timed on the stream without
+	the repeated points and on the whole stream with a VisitedSet.
+*/
+int bench_result_set()
+{
+	const int ks[] = { 1, 10, 100, 1000 };
+	const int points = 200000;
+	const int candidates = 20000;
+	const int queries = 50;
+	int errors = 0;
+
+	std::vector<int> stream_indices(candidates);
+	std::vector<float> stream_dists(candidates);
+	std::vector<float> point_dists(points);
+	printf("result set (%d candidates per query)\n", candidates);
+	printf("%6s %14s %14s %16s %12s\n", "k", "ns/point(old)", "ns/point(heap)", "ns/point(visited)", "mismatches");
+
+	for (int t=0; t<4; ++t) {
+		int k = ks[t];
+		ResultSet heap(k);
+		VisitedSet visited(points);
+		double times[3] = { 0, 0, 0 };
+		int mismatches = 0;
+		for (int q=0;q<queries;++q) {
+			// a point seen twice has the same distance
+			for (int i=0;i<points;++i) {
+				point_dists[i] = (float)rand_double(1000.0);
+			}
+			for (int i=0;i<candidates;++i) {
+				stream_indices[i] = rand_int(points);
+				stream_dists[i] = point_dists[stream_indices[i]];
+			}
+			SortedResultSet reference(k);
+			StartStopTimer t0;
+			t0.start();
+			for (int i=0;i<candidates;++i) {
+				reference.addPointDist(stream_indices[i], stream_dists[i]);
+			}
+			t0.stop();
+			times[0] += t0.value;
+
+			// the searches that can't see a point twice don't need the visited set
+			std::vector<int> unique_indices;
+			std::vector<float> unique_dists;
+			visited.clear();
+			for (int i=0;i<candidates;++i) {
+				if (visited.visit(stream_indices[i])) {
+					unique_indices.push_back(stream_indices[i]);
+					unique_dists.push_back(stream_dists[i]);
+				}
+			}
+			int unique = (int)unique_indices.size();
+			heap.init(NULL, 0);
+			StartStopTimer t1;
+			t1.start();
+			for (int i=0;i<unique;++i) {
+				heap.addPointDist(unique_indices[i], unique_dists[i]);
+			}
+			int* neighbors = heap.getNeighbors();
+			t1.stop();
+			times[1] += t1.value*candidates/unique;
+			if (memcmp(neighbors, reference.getNeighbors(), k*sizeof(int))!=0) {
+				mismatches++;
+			}
+
+			heap.init(NULL, 0);
+			visited.clear();
+			heap.setVisited(&visited);
+			StartStopTimer t2;
+			t2.start();
+			for (int i=0;i<candidates;++i) {
+				heap.addPointDist(stream_indices[i], stream_dists[i]);
+			}
+			neighbors = heap.getNeighbors();
+			t2.stop();
+			times[2] += t2.value;
+			if (memcmp(neighbors, reference.getNeighbors(), k*sizeof(int))!=0) {
+				mismatches++;
+			}
+		}
+		errors += mismatches;
+		double scale = 1e9/((double)queries*candidates);
+		printf("%6d %14.1f %14.1f %16.1f %12d\n", k, times[0]*scale, times[1]*scale, times[2]*scale, mismatches);
+	}
+	printf("\n");
+
+	return errors;
+}
+
+
+/**
+	Times the quantization of descriptors (k=1) by the k-means tree and
+	the kd-tree with findNeighbors and a ResultSet, and with the single
+	neighbor search.
+*/
+int bench_nearest()
+{
+	const int rows = 100000;
+	const int cols = 128;
+	const int queries = 2000;
+	const int checks[2] = { 32, 256 };
+	int errors = 0;
+
+	float* points = random_data(rows, cols);
+	float* queries_data = random_data(queries, cols);
+	Dataset<float> data(rows, cols, points);
+	Dataset<float> testset(queries, cols, queries_data);
+
+	Params kmeans_params;
+	kmeans_params["branching"] = 32;
+	kmeans_params["max-iterations"] = 5;
+	kmeans_params["centers-init"] = "random";
+	KMeansTree kmeans(data, kmeans_params);
+	kmeans.buildIndex();
+	Params kdtree_params;
+	kdtree_params["trees"] = 4;
+	KDTree kdtree(data, kdtree_params);
+	kdtree.buildIndex();
+
+	NNIndex* indexes[2] = { &kmeans, &kdtree };
+	const char* names[2] = { "kmeans", "kdtree" };
+	printf("single neighbor search (%d points, %d queries)\n", rows, queries);
+	printf("%8s %8s %18s %18s %12s\n", "index", "checks", "us/query(nn=1)", "us/query(nearest)", "mismatches");
+	for (int i=0;i<2;++i) {
+		SearchContext* context = indexes[i]->createSearchContext();
+		for (int c=0;c<2;++c) {
+			SearchParams search(checks[c]);
+			std::vector<int> neighbors(queries);
+			ResultSet resultSet(1);
+			StartStopTimer t0;
+			t0.start();
+			for (int q=0;q<queries;++q) {
+				resultSet.init(testset[q], cols);
+				indexes[i]->findNeighbors(resultSet, testset[q], search, *context);
+				neighbors[q] = resultSet.getNeighbors()[0];
+			}
+			t0.stop();
+
+			int mismatches = 0;
+			StartStopTimer t1;
+			t1.start();
+			for (int q=0;q<queries;++q) {
+				int index;
+				float dist;
+				indexes[i]->findNearest(testset[q], search, *context, index, dist);
+				mismatches += index!=neighbors[q];
+			}
+			t1.stop();
+			errors += mismatches;
+			printf("%8s %8d %18.2f %18.2f %12d\n", names[i], checks[c], t0.value*1e6/queries, t1.value*1e6/queries, mismatches);
+		}
+		delete context;
+	}
+	printf("\n");
+
+	delete[] queries_data;
+	delete[] points;
+
+	return errors;
+}
+
+
+/**
+	The k-d forest as it was searched before the flat node layout: the 
+	nodes of each tree allocated from a pool in depth-first order, with
+	child pointers, the leaves being nodes without children.
+*/
+class PointerForest
+{
+	typedef KDTree::TreeSt* Tree;
+	typedef BranchStruct<Tree> Branch;
+
+	Dataset<float>& dataset;
+	std::vector<Tree> trees;
+	PooledAllocator pool;
+	Heap<Branch> heap;
+	std::vector<int> vind;
+	int checkID;
+
+public:
+	int memory;
+
+	PointerForest(const KDTree& index, Dataset<float>& dataset_) :
+		dataset(dataset_), heap(dataset_.rows), vind(dataset_.rows, 0), checkID(0), memory(0)
+	{
+		std::vector<KDTree::NodeRecord> records;
+		for (int t=0;t<index.numTrees;++t) {
+			index.getTree(t, records);
+			int count = (int)records.size();
+			Tree base = pool.allocate<KDTree::TreeSt>(count);
+			for (int i=0;i<count;++i) {
+				base[i].divfeat = records[i].divfeat;
+				base[i].divval = records[i].divval;
+				base[i].child1 = records[i].leaf() ? NULL : base+records[i].child1;
+				base[i].child2 = records[i].leaf() ? NULL : base+records[i].child2;
+			}
+			trees.push_back(base);
+			memory += count*sizeof(KDTree::TreeSt);
+		}
+	}
+
+	void findNeighbors(ResultSet& result, float* vec, int maxCheck)
+	{
+		Branch branch;
+		int checkCount = 0;
+		heap.clear();
+		checkID++;
+		for (size_t i=0;i<trees.size();++i) {
+			searchLevel(result, vec, trees[i], 0.0, checkCount, maxCheck);
+		}
+		while (heap.popMin(branch) && (checkCount<maxCheck || !result.full())) {
+			searchLevel(result, vec, branch.node, branch.mindistsq, checkCount, maxCheck);
+		}
+	}
+
+private:
+	void searchLevel(ResultSet& result, float* vec, Tree node, float mindistsq, int& checkCount, int maxCheck)
+	{
+		if (node->child1==NULL && node->child2==NULL) {
+			if (vind[node->divfeat]==checkID) return;
+			if (checkCount>=maxCheck && result.full()) return;
+			checkCount++;
+			vind[node->divfeat] = checkID;
+			result.addPoint(dataset[node->divfeat], node->divfeat);
+			return;
+		}
+		float diff = vec[node->divfeat]-node->divval;
+		Tree bestChild = (diff<0) ? node->child1 : node->child2;
+		Tree otherChild = (diff<0) ? node->child2 : node->child1;
+		if (2*checkCount<maxCheck || !result.full()) {
+			heap.insert(Branch::make_branch(otherChild, mindistsq+diff*diff));
+		}
+		searchLevel(result, vec, bestChild, mindistsq, checkCount, maxCheck);
+	}
+};
+
+
+/**
+	Times the k-d forest searches with the flat node layout of KDTree and
+	with the pointer nodes it replaced, on a forest of 8 trees over 150000
+	points (the size of a vocabulary).
+*/
+int bench_kdtree_layout()
+{
+	const int rows = 150000;
+	const int cols = 128;
+	const int queries = 2000;
+	const int ks[2] = { 1, 10 };
+	const int checks[3] = { 32, 128, 512 };
+	int errors = 0;
+
+	float* points = random_data(rows, cols);
+	float* queries_data = random_data(queries, cols);
+	Dataset<float> data(rows, cols, points);
+	Dataset<float> testset(queries, cols, queries_data);
+
+	Params params;
+	params["trees"] = 8;
+	params["cores"] = 0;
+	KDTree forest(data, params);
+	forest.buildIndex();
+	PointerForest pointers(forest, data);
+
+	printf("k-d forest layout (8 trees, %d points, nodes: %d bytes with pointers, %d flat)\n", rows, pointers.memory, forest.usedMemory());
+	printf("%4s %8s %20s %18s %12s\n", "k", "checks", "us/query(pointers)", "us/query(flat)", "mismatches");
+	SearchContext* context = forest.createSearchContext();
+	for (int i=0;i<2;++i) {
+		int k = ks[i];
+		ResultSet r0(k), r1(k);
+		for (int c=0;c<3;++c) {
+			SearchParams search(checks[c]);
+			std::vector<int> neighbors(queries*k);
+			StartStopTimer t0;
+			t0.start();
+			for (int q=0;q<queries;++q) {
+				r0.init(testset[q], cols);
+				pointers.findNeighbors(r0, testset[q], checks[c]);
+				memcpy(&neighbors[q*k], r0.getNeighbors(), k*sizeof(int));
+			}
+			t0.stop();
+
+			int mismatches = 0;
+			StartStopTimer t1;
+			t1.start();
+			for (int q=0;q<queries;++q) {
+				r1.init(testset[q], cols);
+				forest.findNeighbors(r1, testset[q], search, *context);
+				mismatches += memcmp(&neighbors[q*k], r1.getNeighbors(), k*sizeof(int))!=0;
+			}
+			t1.stop();
+			errors += mismatches;
+			printf("%4d %8d %20.2f %18.2f %12d\n", k, checks[c], t0.value*1e6/queries, t1.value*1e6/queries, mismatches);
+		}
+	}
+	printf("\n");
+	delete context;
+
+	delete[] queries_data;
+	delete[] points;
+
+	return errors;
+}
+
+
+/**
+	Times the k-means tree build (the configuration used by 
+	UpdateClusterCenters) with each of the assignment algorithms, 
+	with one thread and with one thread per core.
+*/
+void bench_kmeans_build(int rows)
+{
+	const int veclen = 128;
+	const char* assign[] = { "lloyd", "blocked", "hamerly" };
+
+	printf("kmeans build (%dx%d, branching=10, max-iterations=15)\n", rows, veclen);
+	int cores[] = { 1, ThreadPool::hardwareThreads() };
+	printf("%10s %12s %12s\n", "assign", "1 thread", "threads");
+
+	float* data = random_data(rows, veclen);
+	Dataset<float> dataset(rows, veclen, data);
+
+	Params params;
+	params["branching"] = 10;
+	params["max-iterations"] = 15;
+	params["centers-init"] = "gonzales";
+
+	for (int a=0; a<3; ++a) {
+		params["kmeans-assign"] = assign[a];
+		double seconds[2];
+		for (int c=0; c<2; ++c) {
+			params["cores"] = cores[c];
+			seed_random(1);
+			KMeansTree tree(dataset, params);
+
+			StartStopTimer t;
+			t.start();
+			tree.buildIndex();
+			t.stop();
+			seconds[c] = t.value;
+		}
+		printf("%10s %12.2f %12.2f (%d)\n", assign[a], seconds[0], seconds[1], cores[1]);
+	}
+	printf("\n");
+
+	delete[] data;
+}
+
+
+void append_varint(std::vector<unsigned char>& bytes, unsigned int value)
+{
+	while (value>=0x80) {
+		bytes.push_back((unsigned char)(value|0x80));
+		value >>= 7;
+	}
+	bytes.push_back((unsigned char)value);
+}
+
+
+inline unsigned int read_varint(const unsigned char*& p)
+{
+	unsigned int value = *p & 0x7f;
+	int shift = 7;
+	while (*p++ & 0x80) {
+		value |= (unsigned int)(*p & 0x7f) << shift;
+		shift += 7;
+	}
+	return value;
+}
+
+
+/**
+	Compares the size and the decoding speed of posting lists of several
+	densities stored as plain int arrays, as (gap, tf) varints (the
+	previous inverted file format) and bit-packed in blocks with each
+	unpacking kernel. The decoded postings are summed, the sums must match.
+*/
+int bench_postings()
+{
+	const char* kernels[] = { "scalar", "sse2" };
+	const int gaps[] = { 1, 16, 1024 };
+	const int count = 1<<20;
+	const int repeats = 20;
+	int errors = 0;
+
+	const char* selected = postings_kernel();
+	printf("postings (%d postings, tf mostly 1)\n", count);
+	printf("%8s %10s %14s %14s\n", "gap", "format", "bytes/posting", "Mpostings/s");
+
+	for (int g=0; g<3; ++g) {
+		std::vector<int> images(count);
+		std::vector<int> tfs(count);
+		int image = -1;
+		for (int i=0;i<count;++i) {
+			image += 1+rand_int(2*gaps[g]-1);
+			images[i] = image;
+			int tf = 1;
+			while (tf<20 && rand_int(4)==0) tf++;
+			tfs[i] = tf;
+		}
+		long long reference = 0;
+		for (int i=0;i<count;++i) {
+			reference += images[i]+tfs[i];
+		}
+
+		// plain arrays
+		long long sum = 0;
+		StartStopTimer t;
+		t.start();
+		for (int r=0;r<repeats;++r) {
+			for (int i=0;i<count;++i) {
+				sum += images[i]+tfs[i];
+			}
+		}
+		t.stop();
+		if (sum!=reference*repeats) errors++;
+		printf("%8d %10s %14.2f %14.1f\n", gaps[g], "int", 8.0, count*(double)repeats/t.value/1e6);
+
+		// varints
+		std::vector<unsigned char> varints;
+		int previous = -1;
+		for (int i=0;i<count;++i) {
+			append_varint(varints, images[i]-previous);
+			append_varint(varints, tfs[i]);
+			previous = images[i];
+		}
+		sum = 0;
+		t.reset();
+		t.start();
+		for (int r=0;r<repeats;++r) {
+			const unsigned char* p = &varints[0];
+			const unsigned char* end = p+varints.size();
+			int image = -1;
+			while (p<end) {
+				image += read_varint(p);
+				sum += image+read_varint(p);
+			}
+		}
+		t.stop();
+		if (sum!=reference*repeats) errors++;
+		printf("%8d %10s %14.2f %14.1f\n", gaps[g], "varint", varints.size()/(double)count, count*(double)repeats/t.value/1e6);
+
+		// packed blocks
+		std::vector<unsigned char> packed;
+		encode_postings(&images[0], &tfs[0], count, packed);
+		int block_images[POSTING_BLOCK];
+		int block_tfs[POSTING_BLOCK];
+		for (int k=0; k<2; ++k) {
+			if (!set_postings_kernel(kernels[k])) {
+				printf("%8d %10s %14s\n", gaps[g], kernels[k], "unsupported");
+				continue;
+			}
+			sum = 0;
+			t.reset();
+			t.start();
+			for (int r=0;r<repeats;++r) {
+				PostingCursor cursor(&packed[0], &packed[0]+packed.size(), count, 0x7fffffff);
+				int n;
+				while ((n = cursor.next(block_images, block_tfs))>0) {
+					for (int i=0;i<n;++i) {
+						sum += block_images[i]+block_tfs[i];
+					}
+				}
+			}
+			t.stop();
+			if (sum!=reference*repeats) errors++;
+			printf("%8d %10s %14.2f %14.1f\n", gaps[g], kernels[k], packed.size()/(double)count, count*(double)repeats/t.value/1e6);
+		}
+	}
+	set_postings_kernel(selected);
+	printf("\n");
+
+	return errors;
+}
+
+
+/**
+	Writes a binary corpus of random images, with the words drawn from a
+	Zipf distribution (word w with a probability close to 1/(w+1)).
+*/
+void write_random_corpus(const char* filename, int documents, int words, int features)
+{
+	FILE* file = fopen(filename, "wb");
+	CorpusHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, "FLANNBOW", 8);
+	header.version = CORPUS_FILE_VERSION;
+	header.documents = documents;
+	fwrite(&header, sizeof(header), 1, file);
+	for (int d=0;d<documents;++d) {
+		std::map<int,int> histogram;
+		int count = features/2+rand_int(features);
+		for (int j=0;j<count;++j) {
+			histogram[(int)pow(words+1.0, rand_double(1.0))-1]++;
+		}
+		char name[32];
+		int length = sprintf(name, "image%06d.jpg", d);
+		fwrite(&length, sizeof(int), 1, file);
+		fwrite(name, 1, length, file);
+		int distinct = (int)histogram.size();
+		fwrite(&distinct, sizeof(int), 1, file);
+		for (std::map<int,int>::const_iterator it=histogram.begin();it!=histogram.end();++it) {
+			fwrite(&it->first, sizeof(int), 1, file);
+			fwrite(&it->second, sizeof(int), 1, file);
+		}
+	}
+	fclose(file);
+}
+
+
+/**
+	Measures the latency of image queries against k, scoring all the
+	postings of the query words and with MaxScore pruning, and checks that
+	both find images with the same scores. The queries are images of the
+	corpus with half of their words dropped and as many random words added.
+
+	Params:
+		corpus_file = a binary corpus (UpdateBagOfWords(1) writes it), or
+			NULL for a random corpus
+*/
+int bench_image_query(const char* corpus_file)
+{
+	const int ks[] = { 1, 10, 100, 1000 };
+	const int queries = 200;
+	const char* random_file = "flann_bench.bow";
+	const char* index_file = "flann_bench.ivf";
+	int errors = 0;
+
+	if (corpus_file==NULL) {
+		corpus_file = random_file;
+		write_random_corpus(corpus_file, 50000, 200000, 1000);
+	}
+	build_inverted_index(corpus_file, index_file);
+	InvertedIndex index(index_file);
+
+	// the queries
+	CorpusReader corpus(corpus_file);
+	std::vector<std::vector<int> > pairs(queries);
+	std::string name;
+	std::vector<int> histogram;
+	long long query_words = 0;
+	int step = std::max(1, corpus.documents()/queries);
+	int q = 0;
+	for (int d=0; q<queries && corpus.next(name, histogram); ++d) {
+		if (d%step!=0 || histogram.empty()) {
+			continue;
+		}
+		std::map<int,int> query;
+		for (size_t i=0;i<histogram.size();i+=2) {
+			if (rand_int(2)==0) {
+				query[histogram[i]] += histogram[i+1];
+				query[rand_int(index.words())] += histogram[i+1];
+			}
+		}
+		for (std::map<int,int>::const_iterator it=query.begin();it!=query.end();++it) {
+			pairs[q].push_back(it->first);
+			pairs[q].push_back(it->second);
+		}
+		query_words += query.size();
+		q++;
+	}
+	pairs.resize(q);
+
+	printf("image queries (%d images, %d words, %d queries of %d words on average)\n",
+		   index.size(), index.words(), (int)pairs.size(), (int)(query_words/std::max((size_t)1,pairs.size())));
+	printf("%8s %8s %14s %14s %12s\n", "scoring", "k", "ms(all)", "ms(maxscore)", "mismatches");
+	const char* scoring_names[] = { "tfidf", "bm25" };
+	const int scorings[] = { SCORING_TFIDF, SCORING_BM25 };
+	std::vector<int> images(1000);
+	std::vector<float> scores(1000);
+	std::vector<float> reference(1000);
+	for (int s=0; s<2; ++s) {
+		for (int i=0; i<4; ++i) {
+			int k = ks[i];
+			int mismatches = 0;
+			StartStopTimer t1;
+			StartStopTimer t2;
+			for (size_t q=0;q<pairs.size();++q) {
+				int pair_count = (int)pairs[q].size()/2;
+				t1.start();
+				int count = index.queryExhaustive(&pairs[q][0], pair_count, k, scorings[s], &images[0], &reference[0]);
+				t1.stop();
+				t2.start();
+				int pruned = index.query(&pairs[q][0], pair_count, k, scorings[s], &images[0], &scores[0]);
+				t2.stop();
+				if (pruned!=count) {
+					mismatches++;
+					continue;
+				}
+				for (int j=0;j<count;++j) {
+					if (fabs(scores[j]-reference[j])>1e-4*reference[0]) {
+						mismatches++;
+						break;
+					}
+				}
+			}
+			errors += mismatches;
+			printf("%8s %8d %14.3f %14.3f %12d\n", scoring_names[s], k,
+				   1000*t1.value/pairs.size(), 1000*t2.value/pairs.size(), mismatches);
+		}
+	}
+	printf("\n");
+
+	remove(index_file);
+	remove(random_file);
+
+	return errors;
+}
+
+
+int main(int argc, char** argv)
+{
+	seed_random(1);
+	int errors = 0;
+
+	errors += bench_squared_dist();
+	errors += bench_squared_dist_many();
+	errors += bench_result_set();
+	errors += bench_nearest();
+	errors += bench_kdtree_layout();
+	errors += bench_postings();
+	errors += bench_image_query(argc>2 ? argv[2] : NULL);
+
+	int kmeans_rows = argc>1 ? atoi(argv[1]) : 1000000;
+	if (kmeans_rows>0) {
+		bench_kmeans_build(kmeans_rows);
+	}
+
+	return errors==0 ? 0 : 1;
+}
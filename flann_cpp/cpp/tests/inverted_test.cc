@@ -0,0 +1,690 @@
+
+#include "../nn/InvertedIndex.h"
+#include "../nn/Corpus.h"
+#include "../nn/Postings.h"
+#include "../nn/HammingEmbedding.h"
+#include "../util/Random.h"
+#include "../util/Timer.h"
+#include "../util/ThreadPool.h"
+#include "../util/common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <string>
+#include <vector>
+
+
+typedef std::map<int,int> Histogram;
+
+
+/**
+	Draws a word with a skewed distribution, so that the lists of the first
+	words are much longer than the others.
+*/
+int random_word(int words)
+{
+	double r = rand_double(1.0);
+	return (int)(words*r*r*r);
+}
+
+
+Histogram random_histogram(int words, int features)
+{
+	Histogram histogram;
+	for (int j=0;j<features;++j) {
+		histogram[random_word(words)]++;
+	}
+	return histogram;
+}
+
+
+/**
+	Writes a binary corpus file, in the format of write_corpus, with the
+	signatures of the descriptors of each document if they are given.
+*/
+void write_test_corpus(const char* filename, const std::vector<Histogram>& documents,
+			const std::vector<std::vector<unsigned long long> >* signatures = NULL)
+{
+	FILE* file = fopen(filename, "wb");
+	CorpusHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, "FLANNBOW", 8);
+	header.version = CORPUS_FILE_VERSION;
+	header.documents = (int)documents.size();
+	header.signature_bits = signatures!=NULL ? HAMMING_BITS : 0;
+	fwrite(&header, sizeof(header), 1, file);
+	for (size_t i=0;i<documents.size();++i) {
+		char name[32];
+		int length = sprintf(name, "image%05d.jpg", (int)i);
+		fwrite(&length, sizeof(int), 1, file);
+		fwrite(name, 1, length, file);
+		int distinct = (int)documents[i].size();
+		fwrite(&distinct, sizeof(int), 1, file);
+		for (Histogram::const_iterator it=documents[i].begin();it!=documents[i].end();++it) {
+			fwrite(&it->first, sizeof(int), 1, file);
+			fwrite(&it->second, sizeof(int), 1, file);
+		}
+		if (signatures!=NULL && !(*signatures)[i].empty()) {
+			fwrite(&(*signatures)[i][0], sizeof(unsigned long long), (*signatures)[i].size(), file);
+		}
+	}
+	fclose(file);
+}
+
+
+unsigned long long random_signature()
+{
+	unsigned long long signature = 0;
+	for (int i=0;i<4;++i) {
+		signature = (signature<<16) | (unsigned long long)rand_int(1<<16);
+	}
+	return signature;
+}
+
+
+/**
+	Random signatures for the descriptors of a document, in the order of
+	its words.
+*/
+std::vector<unsigned long long> random_signatures(const Histogram& histogram)
+{
+	std::vector<unsigned long long> signatures;
+	for (Histogram::const_iterator it=histogram.begin();it!=histogram.end();++it) {
+		for (int i=0;i<it->second;++i) {
+			signatures.push_back(random_signature());
+		}
+	}
+	return signatures;
+}
+
+
+/**
+	Scores all the documents for a query, as described in InvertedIndex::query.
+*/
+std::vector<double> reference_scores(const std::vector<Histogram>& documents, const Histogram& query, int scoring)
+{
+	int n = (int)documents.size();
+	std::map<int,int> df;
+	double total_length = 0;
+	for (int d=0;d<n;++d) {
+		for (Histogram::const_iterator it=documents[d].begin();it!=documents[d].end();++it) {
+			df[it->first]++;
+			total_length += it->second;
+		}
+	}
+	double average_length = total_length/n;
+
+	std::vector<double> scores(n, 0);
+	double query_norm = 0;
+	for (Histogram::const_iterator q=query.begin();q!=query.end();++q) {
+		if (df.count(q->first)==0) continue;
+		double idf = log((double)n/df[q->first]);
+		query_norm += (q->second*idf)*(q->second*idf);
+	}
+	for (int d=0;d<n;++d) {
+		double norm = 0;
+		int length = 0;
+		for (Histogram::const_iterator it=documents[d].begin();it!=documents[d].end();++it) {
+			double idf = log((double)n/df[it->first]);
+			norm += (it->second*idf)*(it->second*idf);
+			length += it->second;
+		}
+		for (Histogram::const_iterator q=query.begin();q!=query.end();++q) {
+			Histogram::const_iterator it = documents[d].find(q->first);
+			if (it==documents[d].end()) continue;
+			int f = df[q->first];
+			int tf = it->second;
+			if (scoring==SCORING_BM25) {
+				double idf = log(1+(n-f+0.5)/(f+0.5));
+				scores[d] += q->second*idf*tf*2.2/(tf+1.2*(0.25+0.75*length/average_length));
+			}
+			else {
+				double idf = log((double)n/f);
+				scores[d] += (q->second*idf)*(tf*idf);
+			}
+		}
+		if (scoring==SCORING_TFIDF && scores[d]>0) {
+			scores[d] /= sqrt(norm)*sqrt(query_norm);
+		}
+	}
+	return scores;
+}
+
+
+/**
+	Checks the top k images of a query against the reference scores: the
+	same scores, by decreasing score, and no better image left out.
+*/
+bool check_ranking(const std::vector<double>& reference, int k, const int* images, const float* scores, int count)
+{
+	std::vector<double> sorted;
+	for (size_t d=0;d<reference.size();++d) {
+		if (reference[d]>0) sorted.push_back(reference[d]);
+	}
+	std::sort(sorted.begin(), sorted.end());
+	std::reverse(sorted.begin(), sorted.end());
+	if (count!=std::min(k, (int)sorted.size())) {
+		return false;
+	}
+	double eps = 1e-4*(sorted.empty() ? 1 : sorted[0]);
+	for (int i=0;i<count;++i) {
+		if (fabs(reference[images[i]]-scores[i])>eps || fabs(scores[i]-sorted[i])>eps) {
+			return false;
+		}
+		if (i>0 && scores[i]>scores[i-1]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+	Encodes random posting lists, with gaps and tfs of all the bit widths,
+	and checks that every kernel decodes them back.
+*/
+int test_postings()
+{
+	const char* kernels[] = { "scalar", "sse2" };
+	const char* selected = postings_kernel();
+	int errors = 0;
+
+	for (int bits=0;bits<=30;++bits) {
+		// the largest gap of the first block has the given number of bits,
+		// its largest tf 31 bits
+		int count = 5*POSTING_BLOCK+bits;
+		std::vector<int> images(count);
+		std::vector<int> tfs(count);
+		unsigned int max_gap = bits==0 ? 0 : (1u<<bits)-1;
+		int image = -1;
+		for (int i=0;i<count;++i) {
+			unsigned int gap = i==7 ? max_gap : (unsigned int)rand_int(max_gap/count+1);
+			image += gap+1;
+			images[i] = image;
+			tfs[i] = i==9 ? 0x7fffffff-bits : 1+rand_int(1<<(bits%16));
+		}
+		std::vector<unsigned char> bytes;
+		encode_postings(&images[0], &tfs[0], count, bytes);
+
+		for (int k=0;k<2;++k) {
+			if (!set_postings_kernel(kernels[k])) {
+				continue;
+			}
+			std::vector<int> decoded_images(count+POSTING_BLOCK);
+			std::vector<int> decoded_tfs(count+POSTING_BLOCK);
+			PostingCursor cursor(&bytes[0], &bytes[0]+bytes.size(), count, 0x7fffffff);
+			int decoded = 0;
+			int n;
+			while ((n = cursor.next(&decoded_images[decoded], &decoded_tfs[decoded]))>0) {
+				decoded += n;
+			}
+			decoded_images.resize(decoded);
+			decoded_tfs.resize(decoded);
+			if (decoded_images!=images || decoded_tfs!=tfs) {
+				printf("Wrong postings decoded by the %s kernel with %d bits\n", kernels[k], bits);
+				errors++;
+			}
+		}
+	}
+	set_postings_kernel(selected);
+
+	// a block running past the end of the list is rejected
+	std::vector<int> images(POSTING_BLOCK);
+	std::vector<int> tfs(POSTING_BLOCK, 1);
+	for (int i=0;i<POSTING_BLOCK;++i) {
+		images[i] = 3*i;
+	}
+	std::vector<unsigned char> bytes;
+	encode_postings(&images[0], &tfs[0], POSTING_BLOCK, bytes);
+	try {
+		PostingCursor cursor(&bytes[0], &bytes[0]+bytes.size()-1, POSTING_BLOCK, 3*POSTING_BLOCK);
+		cursor.next(&images[0], &tfs[0]);
+		printf("Truncated postings were decoded\n");
+		errors++;
+	}
+	catch (FLANNException&) {
+	}
+
+	// the images past the documents are rejected, in a packed block and in
+	// the postings after the blocks
+	images.push_back(3*POSTING_BLOCK);
+	tfs.push_back(1);
+	for (int count=POSTING_BLOCK;count<=POSTING_BLOCK+1;++count) {
+		bytes.clear();
+		encode_postings(&images[0], &tfs[0], count, bytes);
+		try {
+			PostingCursor cursor(&bytes[0], &bytes[0]+bytes.size(), count, images[count-1]);
+			std::vector<int> decoded_images(POSTING_BLOCK), decoded_tfs(POSTING_BLOCK);
+			while (cursor.next(&decoded_images[0], &decoded_tfs[0])>0) {
+			}
+			printf("Postings with %d images past the documents were decoded\n", count);
+			errors++;
+		}
+		catch (FLANNException&) {
+		}
+	}
+
+	return errors;
+}
+
+
+/**
+	Builds the inverted file of a random corpus and checks the rankings of
+	random queries with both scoring models and both evaluations against a
+	brute force scoring.
+*/
+int test_ranking()
+{
+	const int documents = 3000;
+	const int words = 5000;
+	const int queries = 50;
+	const char* corpus_file = "inverted_test.bow";
+	const char* index_file = "inverted_test.ivf";
+	int errors = 0;
+
+	std::vector<Histogram> corpus(documents);
+	for (int d=0;d<documents;++d) {
+		// a few empty images
+		corpus[d] = random_histogram(words, d%500==3 ? 0 : 50+rand_int(300));
+	}
+	write_test_corpus(corpus_file, corpus);
+	build_inverted_index(corpus_file, index_file);
+
+	InvertedIndex index(index_file);
+	if (index.size()!=documents || strcmp(index.name(1234), "image01234.jpg")!=0) {
+		printf("The inverted file has wrong images\n");
+		errors++;
+	}
+
+	const int ks[4] = { 1, 10, 20, 5000 };
+	const int scorings[2] = { SCORING_TFIDF, SCORING_BM25 };
+	std::vector<int> images(5000);
+	std::vector<float> scores(5000);
+	for (int q=0;q<queries;++q) {
+		Histogram query = random_histogram(words+10, 1+rand_int(400));
+		std::vector<int> pairs;
+		for (Histogram::const_iterator it=query.begin();it!=query.end();++it) {
+			pairs.push_back(it->first);
+			pairs.push_back(it->second);
+		}
+		for (int s=0;s<2;++s) {
+			std::vector<double> reference = reference_scores(corpus, query, scorings[s]);
+			for (int i=0;i<4;++i) {
+				int count = index.query(&pairs[0], (int)query.size(), ks[i], scorings[s], &images[0], &scores[0]);
+				if (!check_ranking(reference, ks[i], &images[0], &scores[0], count)) {
+					printf("Wrong ranking for query %d, scoring %d, k=%d\n", q, scorings[s], ks[i]);
+					errors++;
+				}
+				count = index.queryExhaustive(&pairs[0], (int)query.size(), ks[i], scorings[s], &images[0], &scores[0]);
+				if (!check_ranking(reference, ks[i], &images[0], &scores[0], count)) {
+					printf("Wrong exhaustive ranking for query %d, scoring %d, k=%d\n", q, scorings[s], ks[i]);
+					errors++;
+				}
+			}
+		}
+	}
+
+	remove(corpus_file);
+	remove(index_file);
+
+	return errors;
+}
+
+
+size_t align8(size_t offset)
+{
+	return (offset+7) & ~(size_t)7;
+}
+
+
+/**
+	Writes a copy of an inverted file with the bytes at offset replaced.
+*/
+void write_corrupted(const std::vector<char>& bytes, size_t offset, const void* value, size_t size, const char* filename)
+{
+	std::vector<char> corrupted = bytes;
+	memcpy(&corrupted[offset], value, size);
+	FILE* file = fopen(filename, "wb");
+	fwrite(&corrupted[0], 1, corrupted.size(), file);
+	fclose(file);
+}
+
+
+int test_invalid_file()
+{
+	const char* corpus_file = "inverted_test_invalid.bow";
+	const char* index_file = "inverted_test_invalid.ivf";
+	const char* corrupted_file = "inverted_test_corrupted.ivf";
+	int errors = 0;
+
+	// the word 0 is in all the images, the first and the last images have
+	// no other word and no tf-idf weight
+	std::vector<Histogram> corpus(3);
+	corpus[0][0] = 2;
+	corpus[1][0] = 1;
+	corpus[1][1] = 3;
+	corpus[2][0] = 1;
+	write_test_corpus(corpus_file, corpus);
+	build_inverted_index(corpus_file, index_file);
+
+	try {
+		InvertedIndex index(index_file);
+		int pairs[4] = { 0, 1, 1, 1 };
+		int images[3];
+		float scores[3];
+		int count = index.query(pairs, 2, 3, SCORING_TFIDF, images, scores);
+		if (count!=1 || images[0]!=1 || !(scores[0]>0)) {
+			printf("Wrong ranking of the images without weight\n");
+			errors++;
+		}
+	}
+	catch (FLANNException& e) {
+		printf("Cannot load an inverted file with images without weight: %s\n", e.what());
+		errors++;
+	}
+
+	std::vector<char> bytes;
+	FILE* file = fopen(index_file, "rb");
+	char buffer[4096];
+	size_t read;
+	while ((read=fread(buffer, 1, sizeof(buffer), file))>0) {
+		bytes.insert(bytes.end(), buffer, buffer+read);
+	}
+	fclose(file);
+	InvertedFileHeader header;
+	memcpy(&header, &bytes[0], sizeof(header));
+
+	// the layout of the file, as in InvertedIndex.cpp
+	size_t df = align8(align8(sizeof(InvertedFileHeader)) + ((size_t)header.words+1)*sizeof(long long));
+	size_t lengths = align8(df + 3*(size_t)header.words*sizeof(float));
+	size_t norms = align8(lengths + (size_t)header.documents*sizeof(int));
+
+	const int minus_one = -1;
+	const int too_many = header.documents+1;
+	const int zero = 0;
+	const float zero_norm = 0;
+	const float negative_norm = -1;
+	const float nan_norm = (float)sqrt(-1.0);
+	struct {
+		const char* what;
+		size_t offset;
+		const void* value;
+	} corruptions[] = {
+		{ "a negative document frequency", df, &minus_one },
+		{ "a document frequency over the images", df+sizeof(int), &too_many },
+		{ "a negative length", lengths+sizeof(int), &minus_one },
+		{ "lengths different from the total length", lengths+sizeof(int), &zero },
+		{ "a zero norm", norms+sizeof(float), &zero_norm },
+		{ "a negative norm", norms+sizeof(float), &negative_norm },
+		{ "an invalid norm", norms, &nan_norm },
+	};
+	for (size_t i=0;i<sizeof(corruptions)/sizeof(corruptions[0]);++i) {
+		write_corrupted(bytes, corruptions[i].offset, corruptions[i].value, 4, corrupted_file);
+		try {
+			InvertedIndex index(corrupted_file);
+			printf("An inverted file with %s was loaded\n", corruptions[i].what);
+			errors++;
+		}
+		catch (FLANNException&) {
+		}
+	}
+
+	remove(corpus_file);
+	remove(index_file);
+	remove(corrupted_file);
+
+	return errors;
+}
+
+
+/**
+	Scores all the documents for a query with signatures, as described in
+	InvertedIndex::querySignatures.
+*/
+std::vector<double> reference_signature_scores(const std::vector<Histogram>& documents, 
+			const std::vector<std::vector<unsigned long long> >& signatures, const Histogram& query,
+			const std::vector<unsigned long long>& query_signatures, int threshold)
+{
+	int n = (int)documents.size();
+	std::map<int,int> df;
+	for (int d=0;d<n;++d) {
+		for (Histogram::const_iterator it=documents[d].begin();it!=documents[d].end();++it) {
+			df[it->first]++;
+		}
+	}
+
+	std::vector<double> scores(n, 0);
+	double query_norm = 0;
+	for (Histogram::const_iterator q=query.begin();q!=query.end();++q) {
+		if (df.count(q->first)==0) continue;
+		double idf = log((double)n/df[q->first]);
+		query_norm += (q->second*idf)*(q->second*idf);
+	}
+	for (int d=0;d<n;++d) {
+		double norm = 0;
+		size_t first = 0;
+		for (Histogram::const_iterator it=documents[d].begin();it!=documents[d].end();++it) {
+			double idf = log((double)n/df[it->first]);
+			norm += (it->second*idf)*(it->second*idf);
+			size_t query_first = 0;
+			for (Histogram::const_iterator q=query.begin();q!=query.end();++q) {
+				if (q->first==it->first) {
+					int matches = 0;
+					for (int i=0;i<q->second;++i) {
+						for (int j=0;j<it->second;++j) {
+							unsigned long long x = query_signatures[query_first+i]^signatures[d][first+j];
+							int bits = 0;
+							for (;x!=0;x&=x-1) bits++;
+							matches += bits<=threshold;
+						}
+					}
+					scores[d] += idf*idf*matches;
+				}
+				query_first += q->second;
+			}
+			first += it->second;
+		}
+		if (scores[d]>0) {
+			scores[d] /= sqrt(norm)*sqrt(query_norm);
+		}
+	}
+	return scores;
+}
+
+
+/**
+	Builds an inverted file with the signatures of the descriptors and
+	checks the rankings of queries with signatures: the tf-idf ones when
+	all the descriptors match, and the ones of a brute force matching of the
+	signatures otherwise.
+*/
+int test_signatures()
+{
+	const int documents = 2000;
+	const int words = 3000;
+	const int queries = 20;
+	const char* corpus_file = "inverted_test.bow";
+	const char* index_file = "inverted_test.ivf";
+	int errors = 0;
+
+	std::vector<Histogram> corpus(documents);
+	std::vector<std::vector<unsigned long long> > signatures(documents);
+	for (int d=0;d<documents;++d) {
+		corpus[d] = random_histogram(words, d%500==3 ? 0 : 50+rand_int(200));
+		signatures[d] = random_signatures(corpus[d]);
+	}
+	write_test_corpus(corpus_file, corpus, &signatures);
+	build_inverted_index(corpus_file, index_file);
+
+	InvertedIndex index(index_file);
+	if (!index.has_signatures()) {
+		printf("The inverted file has no signatures\n");
+		errors++;
+	}
+
+	const int thresholds[3] = { HAMMING_BITS, 28, 20 };
+	const int k = 20;
+	std::vector<int> images(k);
+	std::vector<float> scores(k);
+	for (int q=0;q<queries;++q) {
+		Histogram query = random_histogram(words, 1+rand_int(300));
+		std::vector<unsigned long long> query_signatures = random_signatures(query);
+		std::vector<int> pairs;
+		for (Histogram::const_iterator it=query.begin();it!=query.end();++it) {
+			pairs.push_back(it->first);
+			pairs.push_back(it->second);
+		}
+		for (int t=0;t<3;++t) {
+			std::vector<double> reference = thresholds[t]==HAMMING_BITS ? reference_scores(corpus, query, SCORING_TFIDF) :
+				reference_signature_scores(corpus, signatures, query, query_signatures, thresholds[t]);
+			int count = index.querySignatures(&pairs[0], (int)query.size(), &query_signatures[0], thresholds[t], k, &images[0], &scores[0]);
+			if (!check_ranking(reference, k, &images[0], &scores[0], count)) {
+				printf("Wrong ranking with signatures for query %d, threshold %d\n", q, thresholds[t]);
+				errors++;
+			}
+		}
+	}
+
+	// an inverted file without signatures can't match them
+	write_test_corpus(corpus_file, corpus);
+	build_inverted_index(corpus_file, index_file);
+	{
+		InvertedIndex plain(index_file);
+		try {
+			int pairs[2] = { 1, 1 };
+			unsigned long long signature = 0;
+			plain.querySignatures(pairs, 1, &signature, HAMMING_BITS, k, &images[0], &scores[0]);
+			printf("An inverted file without signatures was queried with signatures\n");
+			errors++;
+		}
+		catch (FLANNException&) {
+		}
+	}
+
+	remove(corpus_file);
+	remove(index_file);
+
+	return errors;
+}
+
+
+/**
+	Runs a range of queries on an inverted index.
+*/
+class QueryTask : public Task
+{
+	InvertedIndex& index;
+	const std::vector<std::vector<int> >& queries;
+	std::vector<int>& result;
+	int k;
+	int start;
+	int end;
+
+public:
+	QueryTask(InvertedIndex& index_, const std::vector<std::vector<int> >& queries_, std::vector<int>& result_, int k_, int start_, int end_) :
+		index(index_), queries(queries_), result(result_), k(k_), start(start_), end(end_)
+	{
+	}
+
+	void run()
+	{
+		for (int q=start;q<end;++q) {
+			int count = index.query(&queries[q][0], (int)queries[q].size()/2, k, SCORING_BM25, &result[q*k], NULL);
+			for (int i=count;i<k;++i) {
+				result[q*k+i] = -1;
+			}
+		}
+	}
+};
+
+
+/**
+	Runs queries from several threads on one index and compares with the
+	results of a single thread.
+*/
+int test_concurrent_queries()
+{
+	const int documents = 20000;
+	const int words = 20000;
+	const int queries = 400;
+	const int k = 20;
+	const char* corpus_file = "inverted_test.bow";
+	const char* index_file = "inverted_test.ivf";
+	int errors = 0;
+
+	std::vector<Histogram> corpus(documents);
+	for (int d=0;d<documents;++d) {
+		corpus[d] = random_histogram(words, 300);
+	}
+	write_test_corpus(corpus_file, corpus);
+	build_inverted_index(corpus_file, index_file);
+	InvertedIndex index(index_file);
+
+	std::vector<std::vector<int> > pairs(queries);
+	for (int q=0;q<queries;++q) {
+		Histogram query = random_histogram(words, 500);
+		for (Histogram::const_iterator it=query.begin();it!=query.end();++it) {
+			pairs[q].push_back(it->first);
+			pairs[q].push_back(it->second);
+		}
+	}
+
+	std::vector<int> serial(queries*k);
+	std::vector<int> parallel(queries*k);
+	StartStopTimer t;
+	t.start();
+	QueryTask(index, pairs, serial, k, 0, queries).run();
+	t.stop();
+	printf("%d queries on %d images: %.3f ms per query\n", queries, documents, 1000*t.value/queries);
+
+	ThreadPool threads(4);
+	TaskGroup group;
+	for (int i=0;i<8;++i) {
+		threads.spawn(new QueryTask(index, pairs, parallel, k, i*queries/8, (i+1)*queries/8), group);
+	}
+	threads.wait(group);
+	if (serial!=parallel) {
+		printf("The concurrent queries give different images\n");
+		errors++;
+	}
+
+	// a truncated file is rejected
+	FILE* file = fopen(index_file, "rb");
+	std::vector<char> bytes(1<<20);
+	size_t length = fread(&bytes[0], 1, bytes.size(), file);
+	fclose(file);
+	file = fopen(index_file, "wb");
+	fwrite(&bytes[0], 1, length/2, file);
+	fclose(file);
+	try {
+		InvertedIndex truncated(index_file);
+		printf("A truncated inverted file was opened\n");
+		errors++;
+	}
+	catch (FLANNException&) {
+	}
+
+	remove(corpus_file);
+	remove(index_file);
+
+	return errors;
+}
+
+
+int main(int argc, char** argv)
+{
+	seed_random(1);
+	int errors = 0;
+
+	errors += test_postings();
+	errors += test_ranking();
+	errors += test_invalid_file();
+	errors += test_signatures();
+	errors += test_concurrent_queries();
+
+	printf(errors==0 ? "PASSED\n" : "FAILED\n");
+	return errors==0 ? 0 : 1;
+}
@@ -0,0 +1,585 @@
+
+#include "../algorithms/KDTree.h"
+#include "../util/MatrixFile.h"
+#include "../util/TextMatrix.h"
+#include "../nn/Vocabulary.h"
+#include "../nn/Corpus.h"
+#include "../nn/HammingEmbedding.h"
+#include "../util/Random.h"
+#include "../util/Timer.h"
+#include "../util/common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+/**
+	Writes a matrix file, maps it back and checks the header checks of
+	MappedMatrix on a truncated file and on a file without header.
+*/
+int test_matrix_file()
+{
+	const int rows = 1000;
+	const int cols = 128;
+	const char* filename = "io_test.xb";
+	int errors = 0;
+
+	Dataset<float> data(rows, cols);
+	for (int i=0;i<rows*cols;++i) {
+		data.data[i] = (float)rand_double(256.0);
+	}
+	save_matrix(filename, data);
+
+	if (!is_matrix_file(filename)) {
+		printf("The matrix file is not recognized\n");
+		errors++;
+	}
+	{
+		MappedMatrix mapped(filename);
+		if (mapped.data().rows!=rows || mapped.data().cols!=cols ||
+				memcmp(mapped.data().data, data.data, rows*cols*sizeof(float))!=0) {
+			printf("The mapped matrix is different\n");
+			errors++;
+		}
+	}
+
+	// same file without its last row
+	FILE* file = fopen(filename, "rb");
+	char* bytes = new char[sizeof(MatrixHeader)+rows*cols*sizeof(float)];
+	size_t length = fread(bytes, 1, sizeof(MatrixHeader)+rows*cols*sizeof(float), file);
+	fclose(file);
+	file = fopen(filename, "wb");
+	fwrite(bytes, 1, length-cols*sizeof(float), file);
+	fclose(file);
+	try {
+		MappedMatrix mapped(filename);
+		printf("A truncated matrix file was mapped\n");
+		errors++;
+	}
+	catch (FLANNException&) {
+	}
+
+	// the old cluster files: rows and cols followed by the data
+	file = fopen(filename, "wb");
+	fwrite(&rows, sizeof(int), 1, file);
+	fwrite(&cols, sizeof(int), 1, file);
+	fwrite(data.data, sizeof(float), rows*cols, file);
+	fclose(file);
+	if (is_matrix_file(filename)) {
+		printf("A file without header is recognized as a matrix file\n");
+		errors++;
+	}
+	try {
+		MappedMatrix mapped(filename);
+		printf("A file without header was mapped\n");
+		errors++;
+	}
+	catch (FLANNException&) {
+	}
+
+	delete[] bytes;
+	remove(filename);
+
+	return errors;
+}
+
+
+/**
+	Converts a text matrix with several number formats and line endings,
+	large enough to be split in chunks, with one and with several threads,
+	and checks the errors on an incomplete row and on an invalid number.
+*/
+int test_text_matrix()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const char* text_file = "io_test.txt";
+	const char* matrix_file = "io_test_text.xb";
+	int errors = 0;
+
+	Dataset<float> expected(rows, cols);
+	char number[64];
+	FILE* file = fopen(text_file, "wb");
+	for (int i=0;i<rows;++i) {
+		for (int j=0;j<cols;++j) {
+			int k = rand_int(100000)-20000;
+			switch ((i+j)%5) {
+			case 0:
+				fprintf(file, "%d", k);
+				expected[i][j] = (float)k;
+				break;
+			case 1:
+				fprintf(file, "%s%d.%02d", k<0 ? "-" : "", abs(k)/100, abs(k)%100);
+				expected[i][j] = (float)k/100.0f;
+				break;
+			case 2:
+				fprintf(file, "%de-3", k);
+				expected[i][j] = (float)k/1000.0f;
+				break;
+			case 3:
+				fprintf(file, "+%d.5E2", abs(k));
+				expected[i][j] = (float)abs(k)*100.0f+50.0f;
+				break;
+			default:
+				// more digits than the fast path handles
+				sprintf(number, "%d.1234567890123456789012", k);
+				fputs(number, file);
+				expected[i][j] = (float)strtod(number, NULL);
+			}
+			fputs(j%20==19 ? "\r\n" : (j%7==3 ? "\t" : " "), file);
+		}
+		fputs("\n", file);
+	}
+	fclose(file);
+
+	for (int cores=1;cores<=4;cores+=3) {
+		StartStopTimer t;
+		t.start();
+		int converted = convert_text_matrix(text_file, matrix_file, cols, -1, cores);
+		t.stop();
+		printf("text conversion on %d threads: %.3fs\n", cores, t.value);
+
+		MappedMatrix mapped(matrix_file);
+		if (converted!=rows || mapped.data().rows!=rows || mapped.data().cols!=cols ||
+				memcmp(mapped.data().data, expected.data, rows*cols*sizeof(float))!=0) {
+			printf("The converted text matrix is different\n");
+			errors++;
+		}
+	}
+
+	// only the first rows
+	if (convert_text_matrix(text_file, matrix_file, cols, 1000, 2)!=1000) {
+		printf("The conversion of the first rows gives a wrong number of rows\n");
+		errors++;
+	}
+	else {
+		MappedMatrix mapped(matrix_file);
+		if (mapped.data().rows!=1000 || memcmp(mapped.data().data, expected.data, 1000*cols*sizeof(float))!=0) {
+			printf("The first rows of the text matrix are different\n");
+			errors++;
+		}
+	}
+
+	// one value less than a whole row, and then an invalid number
+	const char* invalid[2] = { "1 2 3\n4 5 6\n7 8\n", "1 2 3\n4 5 x6\n" };
+	for (int i=0;i<2;++i) {
+		file = fopen(text_file, "wb");
+		fputs(invalid[i], file);
+		fclose(file);
+		try {
+			convert_text_matrix(text_file, matrix_file, 3, -1, 2);
+			printf("An invalid text matrix was converted\n");
+			errors++;
+		}
+		catch (FLANNException&) {
+		}
+		if (is_matrix_file(matrix_file)) {
+			printf("A failed conversion left a matrix file\n");
+			errors++;
+		}
+	}
+
+	remove(text_file);
+	remove(matrix_file);
+
+	return errors;
+}
+
+
+/**
+	Opens a vocabulary twice, the first time the index is built and saved,
+	the second time it is loaded, and checks the words and the histogram
+	of an exact quantization against a linear scan of the centers.
+*/
+int test_vocabulary()
+{
+	const int words = 2000;
+	const int cols = 128;
+	const int descriptors = 1000;
+	const char* cluster_file = "io_test_clusters.xb";
+	const char* index_file = "io_test_clusters.idx";
+	int errors = 0;
+
+	Dataset<float> centers(words, cols);
+	for (int i=0;i<words*cols;++i) {
+		centers.data[i] = (float)rand_int(256);
+	}
+	Dataset<float> testset(descriptors, cols);
+	for (int i=0;i<descriptors*cols;++i) {
+		testset.data[i] = (float)rand_int(256);
+	}
+	int* expected = new int[descriptors];
+	for (int i=0;i<descriptors;++i) {
+		expected[i] = 0;
+		for (int j=1;j<words;++j) {
+			if (squared_dist(testset[i], centers[j], cols) < squared_dist(testset[i], centers[expected[i]], cols)) {
+				expected[i] = j;
+			}
+		}
+	}
+	save_matrix(cluster_file, centers);
+	remove(index_file);
+
+	Params params;
+	params["algorithm"] = "kdtree";
+	params["trees"] = 1;
+	int* result = new int[descriptors];
+	for (int run=0;run<2;++run) {
+		FILE* file = fopen(index_file, "rb");
+		bool saved = file!=NULL;
+		if (file!=NULL) {
+			fclose(file);
+		}
+		if (saved!=(run==1)) {
+			printf("The vocabulary index was %s\n", saved ? "saved before the first open" : "not saved");
+			errors++;
+		}
+
+		Vocabulary vocabulary(cluster_file, index_file, params);
+		if (vocabulary.size()!=words || vocabulary.veclen()!=cols) {
+			printf("The vocabulary has a different size\n");
+			errors++;
+			continue;
+		}
+		memset(result, -1, descriptors*sizeof(int));
+		vocabulary.quantize(testset, result, -1, 4);
+		if (memcmp(result, expected, descriptors*sizeof(int))!=0) {
+			printf("The vocabulary gives different words\n");
+			errors++;
+		}
+
+		// the histogram of the words, and the same one truncated
+		int* histogram = new int[2*descriptors];
+		int count = vocabulary.histogram(testset, histogram, descriptors, -1, 4);
+		int total = 0;
+		for (int i=0;i<count;++i) {
+			int word = histogram[2*i];
+			int expected_count = 0;
+			for (int j=0;j<descriptors;++j) {
+				if (expected[j]==word) expected_count++;
+			}
+			if ((i>0 && word<=histogram[2*i-2]) || histogram[2*i+1]!=expected_count) {
+				break;
+			}
+			total += expected_count;
+		}
+		if (total!=descriptors) {
+			printf("The vocabulary gives a wrong histogram\n");
+			errors++;
+		}
+		int* truncated = new int[2*10];
+		if (vocabulary.histogram(testset, truncated, 10, -1, 1)!=count || memcmp(truncated, histogram, 2*10*sizeof(int))!=0) {
+			printf("The vocabulary gives a wrong truncated histogram\n");
+			errors++;
+		}
+		delete[] truncated;
+		delete[] histogram;
+	}
+
+	delete[] result;
+	delete[] expected;
+	remove(index_file);
+	remove(cluster_file);
+
+	return errors;
+}
+
+
+/**
+	Reads a whole file.
+*/
+std::string read_file(const char* filename)
+{
+	std::string content;
+	FILE* file = fopen(filename, "rb");
+	if (file!=NULL) {
+		char buffer[4096];
+		size_t length;
+		while ((length = fread(buffer, 1, sizeof(buffer), file))>0) {
+			content.append(buffer, length);
+		}
+		fclose(file);
+	}
+	return content;
+}
+
+
+/**
+	Writes the corpus of a collection with one and with several threads,
+	in both formats. The files must be identical, and the TREC one must be
+	the one written from a serial quantization of all the features.
+*/
+int test_corpus()
+{
+	const int words = 3000;
+	const int cols = 128;
+	const int images = 300;
+	const char* cluster_file = "io_test_corpus.xb";
+	const char* corpus_file = "io_test_corpus.txt";
+	int errors = 0;
+
+	Dataset<float> centers(words, cols);
+	for (int i=0;i<words*cols;++i) {
+		centers.data[i] = (float)rand_int(256);
+	}
+	save_matrix(cluster_file, centers);
+
+	std::vector<int> sizes(images);
+	std::vector<std::string> names(images);
+	int total = 0;
+	for (int i=0;i<images;++i) {
+		// a few images without features and some larger than a chunk
+		sizes[i] = i%50==7 ? 0 : (i%100==3 ? 20000 : rand_int(400));
+		char name[32];
+		sprintf(name, "image%04d.pgm", i);
+		names[i] = name;
+		total += sizes[i];
+	}
+	Dataset<float> features(total, cols);
+	for (size_t i=0;i<(size_t)total*cols;++i) {
+		features.data[i] = (float)rand_int(256);
+	}
+
+	Params params;
+	params["algorithm"] = "kdtree";
+	params["trees"] = 4;
+	Vocabulary vocabulary(cluster_file, NULL, params);
+
+	// the documents of the serial bag of words loop
+	int* quantized = new int[total];
+	vocabulary.quantize(features, quantized, 64, 1);
+	std::string expected;
+	int k = 0;
+	for (int i=0;i<images;++i) {
+		char word[16];
+		expected += "<DOC>\n<DOCNO>" + names[i] + "</DOCNO>\n<TEXT>\n";
+		for (int j=0;j<sizes[i];++j) {
+			sprintf(word, "w%d ", quantized[k++]);
+			expected += word;
+		}
+		expected += "\n</TEXT>\n</DOC>\n";
+	}
+
+	const CorpusFormat formats[2] = { CORPUS_TREC, CORPUS_BINARY };
+	for (int f=0;f<2;++f) {
+		std::string serial;
+		for (int cores=1;cores<=4;cores+=3) {
+			StartStopTimer t;
+			t.start();
+			write_corpus(vocabulary, features, sizes, names, corpus_file, formats[f], 64, cores);
+			t.stop();
+			printf("%s corpus on %d threads: %.3fs\n", formats[f]==CORPUS_TREC ? "TREC" : "binary", cores, t.value);
+
+			std::string content = read_file(corpus_file);
+			if (cores==1) {
+				serial = content;
+			}
+			else if (content!=serial) {
+				printf("The corpus written on %d threads is different\n", cores);
+				errors++;
+			}
+		}
+		if (formats[f]==CORPUS_TREC && serial!=expected) {
+			printf("The TREC corpus is different from the serial documents\n");
+			errors++;
+		}
+		if (formats[f]==CORPUS_BINARY) {
+			// checks the histograms against the serial words
+			const char* p = serial.data()+sizeof(CorpusHeader);
+			const char* end = serial.data()+serial.size();
+			const CorpusHeader* header = (const CorpusHeader*)serial.data();
+			int wrong = header->documents!=images ? 1 : 0;
+			k = 0;
+			for (int i=0;i<images && wrong==0;++i) {
+				int length = *(const int*)p;
+				p += sizeof(int);
+				if (std::string(p, length)!=names[i]) wrong++;
+				p += length;
+				int distinct = *(const int*)p;
+				p += sizeof(int);
+				int counted = 0;
+				for (int j=0;j<distinct;++j) {
+					const int* pair = (const int*)p+2*j;
+					int count = 0;
+					for (int l=k;l<k+sizes[i];++l) {
+						if (quantized[l]==pair[0]) count++;
+					}
+					if (count!=pair[1] || (j>0 && pair[0]<=pair[-2])) wrong++;
+					counted += count;
+				}
+				if (counted!=sizes[i]) wrong++;
+				p += 2*distinct*sizeof(int);
+				k += sizes[i];
+			}
+			if (wrong>0 || p!=end) {
+				printf("The binary corpus has wrong histograms\n");
+				errors++;
+			}
+		}
+	}
+
+	delete[] quantized;
+	remove(corpus_file);
+	remove(cluster_file);
+
+	return errors;
+}
+
+
+/**
+	Trains a Hamming embedding on a flat vocabulary. The bits must split the
+	training descriptors of each word in halves, the embedded bag of words
+	must have the words of the plain one, and the binary corpus written with
+	the embedding must read back with the same signatures.
+*/
+int test_hamming_embedding()
+{
+	const int words = 200;
+	const int cols = 128;
+	const int rows = 40000;
+	const int images = 100;
+	const char* cluster_file = "io_test_hamming.xb";
+	const char* embedding_file = "io_test_hamming.hem";
+	const char* corpus_file = "io_test_hamming.bow";
+	int errors = 0;
+
+	Dataset<float> centers(words, cols);
+	for (int i=0;i<words*cols;++i) {
+		centers.data[i] = (float)rand_int(256);
+	}
+	save_matrix(cluster_file, centers);
+	Dataset<float> features(rows, cols);
+	for (size_t i=0;i<(size_t)rows*cols;++i) {
+		features.data[i] = (float)rand_int(256);
+	}
+
+	Params params;
+	params["algorithm"] = "kdtree";
+	params["trees"] = 4;
+	Vocabulary vocabulary(cluster_file, NULL, params);
+	train_hamming_embedding(vocabulary, features, embedding_file, -1, 4);
+	HammingEmbedding embedding(embedding_file);
+	if (embedding.words()!=words || embedding.veclen()!=cols) {
+		printf("The Hamming embedding has a different size\n");
+		errors++;
+	}
+
+	std::vector<int> quantized(rows);
+	vocabulary.quantize(features, &quantized[0], -1, 4);
+	std::vector<int> histogram;
+	std::vector<unsigned long long> signatures;
+	int count = embedded_bag_of_words(vocabulary, embedding, features, &quantized[0], histogram, signatures);
+	// bag_of_words reorders the words
+	std::vector<int> sorted(quantized);
+	std::vector<int> expected(2*words);
+	if (count!=vocabulary.bag_of_words(&sorted[0], rows, &expected[0], words) || 
+			!std::equal(histogram.begin(), histogram.end(), expected.begin()) || signatures.size()!=(size_t)rows) {
+		printf("The embedded bag of words has different words\n");
+		errors++;
+	}
+	else {
+		// each bit is set for about half of the descriptors of each word
+		int unbalanced = 0;
+		size_t first = 0;
+		for (int i=0;i<count;++i) {
+			int size = histogram[2*i+1];
+			for (int b=0;b<HAMMING_BITS && size>=50;++b) {
+				int set = 0;
+				for (int j=0;j<size;++j) {
+					set += (signatures[first+j]>>b) & 1;
+				}
+				if (abs(2*set-size)>2) unbalanced++;
+			}
+			first += size;
+		}
+		if (unbalanced>0) {
+			printf("%d bits of the words don't split their descriptors in halves\n", unbalanced);
+			errors++;
+		}
+		int distance = hamming_distance(signatures[0], signatures[1]);
+		int bits = 0;
+		for (int b=0;b<HAMMING_BITS;++b) {
+			bits += ((signatures[0]^signatures[1])>>b) & 1;
+		}
+		if (distance!=bits) {
+			printf("Wrong Hamming distance\n");
+			errors++;
+		}
+	}
+
+	// the corpus has the signatures of each image
+	std::vector<int> sizes(images, rows/images);
+	sizes[7] = 0;
+	sizes[8] = 2*rows/images;
+	std::vector<std::string> names(images);
+	for (int i=0;i<images;++i) {
+		char name[32];
+		sprintf(name, "image%04d.pgm", i);
+		names[i] = name;
+	}
+	write_corpus(vocabulary, features, sizes, names, corpus_file, CORPUS_BINARY, -1, 4, &embedding);
+	{
+		CorpusReader reader(corpus_file);
+		if (reader.signature_bits()!=HAMMING_BITS) {
+			printf("The corpus has no signatures\n");
+			errors++;
+		}
+		std::string name;
+		std::vector<int> document;
+		std::vector<unsigned long long> document_signatures;
+		int wrong = 0;
+		int start = 0;
+		for (int i=0;i<images;++i) {
+			Dataset<float> image(sizes[i], cols, features[start]);
+			embedded_bag_of_words(vocabulary, embedding, image, &quantized[start], histogram, signatures);
+			if (!reader.next(name, document, document_signatures) || name!=names[i] || 
+					document!=histogram || document_signatures!=signatures) {
+				wrong++;
+			}
+			start += sizes[i];
+		}
+		if (wrong>0 || reader.next(name, document)) {
+			printf("The corpus has wrong signatures\n");
+			errors++;
+		}
+	}
+
+	// a truncated embedding is rejected
+	std::string content = read_file(embedding_file);
+	FILE* file = fopen(embedding_file, "wb");
+	fwrite(content.data(), 1, content.size()-4, file);
+	fclose(file);
+	try {
+		HammingEmbedding truncated(embedding_file);
+		printf("A truncated Hamming embedding was opened\n");
+		errors++;
+	}
+	catch (FLANNException&) {
+	}
+
+	remove(corpus_file);
+	remove(embedding_file);
+	remove(cluster_file);
+
+	return errors;
+}
+
+
+int main(int argc, char** argv)
+{
+	seed_random(1);
+	int errors = 0;
+
+	errors += test_matrix_file();
+	errors += test_text_matrix();
+	errors += test_vocabulary();
+	errors += test_corpus();
+	errors += test_hamming_embedding();
+
+	printf(errors==0 ? "PASSED\n" : "FAILED\n");
+	return errors==0 ? 0 : 1;
+}
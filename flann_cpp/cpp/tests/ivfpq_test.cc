@@ -0,0 +1,357 @@
+
+#include "../algorithms/IVFPQIndex.h"
+#include "../util/Timer.h"
+#include "../util/Random.h"
+#include "../nn/Testing.h"
+#include "../nn/IndexIO.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+
+/**
+	Generates rows x cols points in [0,255] spread around a number of random
+	centers along a few random directions per center, so that the nearest
+	neighbors are well separated as for real descriptors.
+*/
+Dataset<float>* structured_data(int rows, int cols, int groups, int directions)
+{
+	Dataset<float> centers(groups, cols);
+	Dataset<float> axes(groups*directions, cols);
+	for (int i=0;i<groups*cols;++i) {
+		centers.data[i] = (float)rand_int(192, 64);
+	}
+	for (int i=0;i<groups*directions*cols;++i) {
+		axes.data[i] = (float)rand_double(8.0, -8.0);
+	}
+	Dataset<float>* data = new Dataset<float>(rows, cols);
+	for (int i=0;i<rows;++i) {
+		int group = rand_int(groups);
+		float* point = (*data)[i];
+		for (int k=0;k<cols;++k) {
+			point[k] = centers[group][k] + (float)rand_double(2.0, -2.0);
+		}
+		for (int d=0;d<directions;++d) {
+			float weight = (float)rand_double(4.0, -4.0);
+			float* axis = axes[group*directions+d];
+			for (int k=0;k<cols;++k) {
+				point[k] += weight*axis[k];
+			}
+		}
+		for (int k=0;k<cols;++k) {
+			point[k] = point[k]<0 ? 0 : (point[k]>255 ? 255 : floor(point[k]));
+		}
+	}
+	return data;
+}
+
+
+/**
+	Finds the nearest neighbor of each query by a linear scan.
+*/
+void exact_neighbors(Dataset<float>& data, Dataset<float>& queries, int* neighbors)
+{
+	for (int q=0;q<queries.rows;++q) {
+		double best = -1;
+		for (int i=0;i<data.rows;++i) {
+			double d = squared_dist(queries[q], data[i], data.cols);
+			if (best<0 || d<best) {
+				best = d;
+				neighbors[q] = i;
+			}
+		}
+	}
+}
+
+
+Params index_params(int cores)
+{
+	Params params;
+	params["lists"] = 64;
+	params["subquantizers"] = 16;
+	params["rerank"] = 64;
+	params["branching"] = 16;
+	params["max-iterations"] = 10;
+	params["centers-init"] = "random";
+	params["cores"] = cores;
+	return params;
+}
+
+
+/**
+	Fraction of the queries whose first neighbor is the exact one.
+*/
+float recall(NNIndex& index, Dataset<float>& queries, const int* neighbors, const SearchParams& search, Dataset<float>* dists = NULL)
+{
+	Dataset<int> result(queries.rows, 1);
+	if (dists!=NULL) {
+		search_for_neighbors(index, queries, result, *dists, search);
+	}
+	else {
+		search_for_neighbors(index, queries, result, search);
+	}
+	int found = 0;
+	for (int q=0;q<queries.rows;++q) {
+		found += result[q][0]==neighbors[q];
+	}
+	return (float)found/queries.rows;
+}
+
+
+/**
+	Builds an index and checks the precision of the searches with and
+	without re-ranking, the distances of the re-ranked results and the
+	memory used by the codes.
+*/
+int test_search()
+{
+	const int rows = 50000;
+	const int cols = 128;
+	const int queries = 500;
+	int errors = 0;
+
+	Dataset<float>* data = structured_data(rows+queries, cols, 200, 8);
+	Dataset<float> points(rows, cols, data->data);
+	Dataset<float> testset(queries, cols, (*data)[rows]);
+	int* neighbors = new int[queries];
+	exact_neighbors(points, testset, neighbors);
+
+	StartStopTimer t;
+	t.start();
+	IVFPQIndex index(points, index_params(4));
+	index.buildIndex();
+	t.stop();
+	int memory = index.usedMemory();
+	printf("build: %.3fs, %d bytes (%.1fx smaller than the vectors)\n", t.value, memory, (float)rows*cols*sizeof(float)/memory);
+	if ((size_t)memory*16>(size_t)rows*cols*sizeof(float)) {
+		printf("The index takes more than a 16th of the vectors\n");
+		errors++;
+	}
+
+	SearchParams search(4000);
+	Dataset<float> dists(queries, 1);
+	t.reset();
+	t.start();
+	float reranked = recall(index, testset, neighbors, search, &dists);
+	t.stop();
+	printf("re-ranked: precision %.3f, %.3fms per query\n", reranked, t.value*1000/queries);
+	if (reranked<0.9) {
+		printf("Low precision of the re-ranked search\n");
+		errors++;
+	}
+	int wrong = 0;
+	Dataset<int> result(queries, 1);
+	search_for_neighbors(index, testset, result, search);
+	for (int q=0;q<queries;++q) {
+		if (dists[q][0]!=(float)squared_dist(testset[q], points[result[q][0]], cols)) {
+			wrong++;
+		}
+	}
+	if (wrong>0) {
+		printf("%d re-ranked distances are not the exact ones\n", wrong);
+		errors++;
+	}
+
+	// the estimated distances only
+	Params plain = index_params(4);
+	plain["rerank"] = 0;
+	IVFPQIndex estimated(points, plain);
+	estimated.buildIndex();
+	float precision = recall(estimated, testset, neighbors, search);
+	printf("estimated distances: precision %.3f\n", precision);
+	if (precision<0.3 || precision>reranked) {
+		printf("Unexpected precision of the search without re-ranking\n");
+		errors++;
+	}
+
+	// scanning all the lists finds at least as many neighbors
+	search.checks = -1;
+	float exhaustive = recall(index, testset, neighbors, search);
+	if (exhaustive<reranked) {
+		printf("The search of all the lists is less precise\n");
+		errors++;
+	}
+
+	delete[] neighbors;
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Searches for more neighbors than the re-ranked candidates and than
+	the checks: the lists are scanned until the result is full, so every
+	neighbor must be a distinct point of the dataset.
+*/
+int test_many_neighbors()
+{
+	const int rows = 5000;
+	const int cols = 32;
+	const int queries = 100;
+	const int nn = 100;
+	int errors = 0;
+
+	Dataset<float>* data = structured_data(rows, cols, 50, 4);
+	Dataset<float>* testset = structured_data(queries, cols, 50, 4);
+
+	const int reranks[2] = { 64, 0 };
+	const int checks[2] = { 50, 2000 };
+	for (int r=0;r<2;++r) {
+		Params params = index_params(4);
+		params["rerank"] = reranks[r];
+		IVFPQIndex index(*data, params);
+		index.buildIndex();
+		for (int c=0;c<2;++c) {
+			Dataset<int> result(queries, nn);
+			Dataset<float> dists(queries, nn);
+			search_for_neighbors(index, *testset, result, dists, SearchParams(checks[c]));
+			int wrong = 0;
+			for (int q=0;q<queries;++q) {
+				std::vector<int> sorted(result[q], result[q]+nn);
+				std::sort(sorted.begin(), sorted.end());
+				if (sorted[0]<0 || sorted[nn-1]>=rows || std::unique(sorted.begin(), sorted.end())!=sorted.end()) {
+					wrong++;
+					continue;
+				}
+				for (int j=0;j<nn && reranks[r]>0;++j) {
+					if (dists[q][j]!=(float)squared_dist((*testset)[q], (*data)[result[q][j]], cols)) {
+						wrong++;
+						break;
+					}
+				}
+			}
+			if (wrong>0) {
+				printf("rerank %d, checks %d: %d queries with invalid neighbors\n", reranks[r], checks[c], wrong);
+				errors++;
+			}
+		}
+	}
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Builds the same index with one and with several threads, from the same
+	seed. The codes must not depend on the number of threads.
+*/
+int test_parallel_build()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int queries = 300;
+	const int nn = 5;
+	int errors = 0;
+
+	Dataset<float>* data = structured_data(rows, cols, 100, 8);
+	Dataset<float>* testset = structured_data(queries, cols, 100, 8);
+
+	SearchParams search(2000);
+	Dataset<int> results[2] = { Dataset<int>(queries, nn), Dataset<int>(queries, nn) };
+	const int cores[2] = { 1, 4 };
+	for (int t=0;t<2;++t) {
+		seed_random(5);
+		IVFPQIndex index(*data, index_params(cores[t]));
+		index.buildIndex();
+		search_for_neighbors(index, *testset, results[t], search);
+	}
+	if (memcmp(results[0].data, results[1].data, queries*nn*sizeof(int))!=0) {
+		printf("The index built on several threads gives different neighbors\n");
+		errors++;
+	}
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Saves an index, loads it back through the index registry and checks that
+	the loaded index finds the same neighbors.
+*/
+int test_save_load()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int queries = 300;
+	const int nn = 5;
+	const char* filename = "ivfpq_test.idx";
+	int errors = 0;
+
+	Dataset<float>* data = structured_data(rows, cols, 100, 8);
+	Dataset<float>* testset = structured_data(queries, cols, 100, 8);
+
+	NNIndex* index = create_index("ivfpq", *data, index_params(4));
+	index->buildIndex();
+	SearchParams search(2000);
+	Dataset<int> built(queries, nn);
+	search_for_neighbors(*index, *testset, built, search);
+	save_index(*index, filename);
+
+	Dataset<float>* loaded_data;
+	NNIndex* loaded = load_index(filename, data, loaded_data);
+	if (strcmp(loaded->name(), "ivfpq")!=0 || loaded->usedMemory()!=index->usedMemory()) {
+		printf("The loaded index is different\n");
+		errors++;
+	}
+	Dataset<int> result(queries, nn);
+	search_for_neighbors(*loaded, *testset, result, search);
+	if (memcmp(result.data, built.data, queries*nn*sizeof(int))!=0) {
+		printf("The loaded index gives different neighbors\n");
+		errors++;
+	}
+	delete loaded;
+	delete index;
+
+	// a truncated file is rejected
+	FILE* file = fopen(filename, "rb");
+	vector<char> content;
+	char buffer[4096];
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof(buffer), file))>0) {
+		content.insert(content.end(), buffer, buffer+length);
+	}
+	fclose(file);
+	file = fopen(filename, "wb");
+	fwrite(&content[0], 1, content.size()-100, file);
+	fclose(file);
+	try {
+		loaded = load_index(filename, data, loaded_data);
+		printf("A truncated index was loaded\n");
+		delete loaded;
+		errors++;
+	}
+	catch (FLANNException&) {
+	}
+	remove(filename);
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+int main(int argc, char** argv)
+{
+	seed_random(1);
+	int errors = 0;
+
+	errors += test_search();
+	errors += test_many_neighbors();
+	errors += test_parallel_build();
+	errors += test_save_load();
+
+	printf(errors==0 ? "PASSED\n" : "FAILED\n");
+	return errors==0 ? 0 : 1;
+}
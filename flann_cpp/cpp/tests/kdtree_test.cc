@@ -0,0 +1,495 @@
+
+#include "../algorithms/KDTree.h"
+#include "../util/Timer.h"
+#include "../util/Random.h"
+#include "../nn/Testing.h"
+#include "../nn/IndexIO.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+
+/**
+	Generates rows x cols points with integer coordinates in [0,255]
+	like the SIFT descriptors.
+*/
+Dataset<float>* random_data(int rows, int cols)
+{
+	Dataset<float>* data = new Dataset<float>(rows, cols);
+	for (int i=0;i<rows*cols;++i) {
+		data->data[i] = (float)rand_int(256);
+	}
+	return data;
+}
+
+
+/**
+	Builds the same forest with one and with several threads, from the
+	same seed. Each tree has its own random state seeded by buildIndex,
+	so the approximate searches must return the same neighbors.
+*/
+int test_parallel_build()
+{
+	const int rows = 50000;
+	const int cols = 128;
+	const int nn = 5;
+	const int queries = 500;
+	int errors = 0;
+
+	Dataset<float>* data = random_data(rows, cols);
+
+	Params params;
+	params["trees"] = 8;
+
+	const int runs = 2;
+	const int cores[runs] = { 1, 4 };
+	KDTree* forests[runs];
+	for (int t=0;t<runs;++t) {
+		params["cores"] = cores[t];
+		seed_random(3);
+		forests[t] = new KDTree(*data, params);
+
+		StartStopTimer timer;
+		timer.start();
+		forests[t]->buildIndex();
+		timer.stop();
+		printf("%d threads: build %.3fs, %d bytes\n", cores[t], timer.value, forests[t]->usedMemory());
+	}
+
+	// the contexts must be released before the forests are deleted
+	{
+		ResultSet r0(nn), r1(nn);
+		SearchParams search(128);
+		ScopedSearchContext c0(*forests[0]), c1(*forests[1]);
+		int different = 0;
+		for (int q=0;q<queries;++q) {
+			float* query = (*data)[rand_int(rows)];
+			r0.init(query, cols);
+			r1.init(query, cols);
+			forests[0]->findNeighbors(r0, query, search, *c0);
+			forests[1]->findNeighbors(r1, query, search, *c1);
+			for (int j=0;j<nn;++j) {
+				if (r0.getNeighbors()[j]!=r1.getNeighbors()[j]) {
+					different++;
+					break;
+				}
+			}
+		}
+		if (different>0) {
+			printf("%d queries with different neighbors\n", different);
+			errors++;
+		}
+	}
+
+	for (int t=0;t<runs;++t) {
+		delete forests[t];
+	}
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Searches a range of queries with a context of its own.
+*/
+class SearchTask : public Task
+{
+	NNIndex& index;
+	Dataset<float>& queries;
+	int* result;
+	int start;
+	int end;
+
+public:
+	SearchTask(NNIndex& index_, Dataset<float>& queries_, int* result_, int start_, int end_) :
+		index(index_), queries(queries_), result(result_), start(start_), end(end_)
+	{
+	}
+
+	void run()
+	{
+		SearchContext* context = index.createSearchContext();
+		ResultSet r(1);
+		SearchParams search(64);
+		for (int q=start;q<end;++q) {
+			r.init(queries[q], queries.cols);
+			index.findNeighbors(r, queries[q], search, *context);
+			result[q] = r.getNeighbors()[0];
+		}
+		delete context;
+	}
+};
+
+
+/**
+	Searches one forest from several threads at once, each one with its
+	own search context, and compares with the results of a single thread.
+*/
+int test_concurrent_search()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int queries = 4000;
+	const int tasks = 16;
+	int errors = 0;
+
+	Dataset<float>* data = random_data(rows, cols);
+	Dataset<float>* testset = random_data(queries, cols);
+
+	Params params;
+	params["trees"] = 4;
+	KDTree forest(*data, params);
+	forest.buildIndex();
+
+	int* serial = new int[queries];
+	int* parallel = new int[queries];
+	SearchTask(forest, *testset, serial, 0, queries).run();
+
+	ThreadPool threads(4);
+	TaskGroup group;
+	for (int t=0;t<tasks;++t) {
+		threads.spawn(new SearchTask(forest, *testset, parallel, t*queries/tasks, (t+1)*queries/tasks), group);
+	}
+	threads.wait(group);
+
+	int different = 0;
+	for (int q=0;q<queries;++q) {
+		if (serial[q]!=parallel[q]) {
+			different++;
+		}
+	}
+	if (different>0) {
+		printf("%d queries with different neighbors in the concurrent search\n", different);
+		errors++;
+	}
+
+	delete[] serial;
+	delete[] parallel;
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Searches a query set with search_for_neighbors_batch on several threads
+	and checks the indices and distances against a serial search and the
+	distances against the ones computed from the returned neighbors.
+*/
+int test_batch_search()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int queries = 3000;
+	const int nn = 3;
+	int errors = 0;
+
+	Dataset<float>* data = random_data(rows, cols);
+	Dataset<float>* testset = random_data(queries, cols);
+
+	Params params;
+	params["trees"] = 4;
+	KDTree forest(*data, params);
+	forest.buildIndex();
+
+	SearchParams search(64);
+	Dataset<int> serial(queries, nn);
+	Dataset<int> batch(queries, nn);
+	Dataset<float> dists(queries, nn);
+
+	StartStopTimer t;
+	t.start();
+	search_for_neighbors(forest, *testset, serial, search);
+	t.stop();
+	printf("serial search: %.3fs\n", t.value);
+
+	t.reset();
+	t.start();
+	search_for_neighbors_batch(forest, *testset, batch, &dists, search, 4);
+	t.stop();
+	printf("batch search on 4 threads: %.3fs\n", t.value);
+
+	if (memcmp(serial.data, batch.data, queries*nn*sizeof(int))!=0) {
+		printf("The batch search gives different neighbors\n");
+		errors++;
+	}
+	int wrong = 0;
+	for (int q=0;q<queries;++q) {
+		for (int j=0;j<nn;++j) {
+			if (dists[q][j]!=(float)squared_dist((*testset)[q], (*data)[batch[q][j]], cols)) {
+				wrong++;
+			}
+		}
+	}
+	if (wrong>0) {
+		printf("%d wrong distances in the batch search\n", wrong);
+		errors++;
+	}
+
+	Dataset<float> serial_dists(queries, nn);
+	search_for_neighbors(forest, *testset, serial, serial_dists, search);
+	if (memcmp(serial_dists.data, dists.data, queries*nn*sizeof(float))!=0) {
+		printf("The serial search gives different distances\n");
+		errors++;
+	}
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Searches a forest whose trees reach the same points: the neighbors must
+	be distinct and sorted by distance, also when the search is stopped
+	before the result set is full.
+*/
+int test_distinct_neighbors()
+{
+	const int rows = 5000;
+	const int cols = 32;
+	const int queries = 200;
+	const int nn = 100;
+	int errors = 0;
+
+	Dataset<float>* data = random_data(rows, cols);
+	Dataset<float>* testset = random_data(queries, cols);
+
+	Params params;
+	params["trees"] = 8;
+	KDTree forest(*data, params);
+	forest.buildIndex();
+
+	int wrong = 0;
+	const int checks[3] = { 16, 256, -1 };
+	for (int c=0;c<3;++c) {
+		SearchParams search(checks[c]);
+		Dataset<int> result(queries, nn);
+		Dataset<float> dists(queries, nn);
+		search_for_neighbors(forest, *testset, result, dists, search);
+		for (int q=0;q<queries;++q) {
+			std::vector<int> sorted(result[q], result[q]+nn);
+			std::sort(sorted.begin(), sorted.end());
+			if (std::unique(sorted.begin(), sorted.end())!=sorted.end()) {
+				wrong++;
+			}
+			for (int j=1;j<nn;++j) {
+				if (dists[q][j]<dists[q][j-1] || (dists[q][j]==dists[q][j-1] && result[q][j]<result[q][j-1])) {
+					wrong++;
+					break;
+				}
+			}
+		}
+	}
+	if (wrong>0) {
+		printf("%d searches with repeated or unsorted neighbors\n", wrong);
+		errors++;
+	}
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	The single neighbor search (used by search_for_neighbors for k=1) must
+	find the neighbor and the distance of findNeighbors with k=1.
+*/
+int test_nearest()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int queries = 1000;
+	int errors = 0;
+
+	Dataset<float>* data = random_data(rows, cols);
+	Dataset<float>* testset = random_data(queries, cols);
+
+	Params params;
+	params["trees"] = 4;
+	KDTree forest(*data, params);
+	forest.buildIndex();
+
+	ScopedSearchContext context(forest);
+	ResultSet resultSet(1);
+	const int checks[3] = { 32, 256, -1 };
+	for (int c=0;c<3;++c) {
+		SearchParams search(checks[c]);
+		Dataset<int> result(queries, 1);
+		Dataset<float> dists(queries, 1);
+		StartStopTimer t;
+		t.start();
+		search_for_neighbors(forest, *testset, result, dists, search);
+		t.stop();
+
+		int wrong = 0;
+		for (int q=0;q<queries;++q) {
+			resultSet.init((*testset)[q], cols);
+			forest.findNeighbors(resultSet, (*testset)[q], search, *context);
+			int index;
+			float dist;
+			if (!forest.findNearest((*testset)[q], search, *context, index, dist)
+					|| index!=resultSet.getNeighbors()[0] || dist!=resultSet.getDistances()[0]
+					|| result[q][0]!=index || dists[q][0]!=dist) {
+				wrong++;
+			}
+		}
+		printf("checks %d: %.3fms per query\n", checks[c], t.value*1000/queries);
+		if (wrong>0) {
+			printf("%d single neighbor searches differ from findNeighbors\n", wrong);
+			errors++;
+		}
+	}
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	The trees got back from the flat node layout must hold each point in
+	one leaf, and a node array in which a node is reached twice must be
+	rejected by loadIndex.
+*/
+int test_node_layout()
+{
+	const int rows = 5000;
+	const int cols = 32;
+	int errors = 0;
+
+	Dataset<float>* data = random_data(rows, cols);
+
+	Params params;
+	params["trees"] = 4;
+	KDTree forest(*data, params);
+	forest.buildIndex();
+
+	std::vector<KDTree::NodeRecord> records;
+	for (int t=0;t<forest.numTrees;++t) {
+		forest.getTree(t, records);
+		std::vector<int> leaves(rows, 0);
+		int wrong = (int)records.size()!=2*rows-1;
+		for (size_t i=0;i<records.size();++i) {
+			if (records[i].leaf()) {
+				wrong += leaves[records[i].divfeat]++!=0;
+			}
+		}
+		if (wrong>0) {
+			printf("Tree %d doesn't hold each point in one leaf\n", t);
+			errors++;
+		}
+	}
+
+	// the second child of the root is the root
+	forest.getTree(0, records);
+	records[0].child2 = 0;
+	FILE* stream = tmpfile();
+	int trees = 1;
+	int count = (int)records.size();
+	fwrite(&trees, sizeof(int), 1, stream);
+	fwrite(&count, sizeof(int), 1, stream);
+	fwrite(&records[0], sizeof(KDTree::NodeRecord), count, stream);
+	rewind(stream);
+	try {
+		forest.loadIndex(stream);
+		printf("A tree with a cycle was loaded\n");
+		errors++;
+	}
+	catch (FLANNException&) {
+	}
+	fclose(stream);
+
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Saves an index, with and without the dataset, loads it back and
+	checks that the loaded index finds the same neighbors.
+*/
+int test_save_load()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int queries = 1000;
+	const int nn = 5;
+	const char* filename = "kdtree_test.idx";
+	int errors = 0;
+
+	Dataset<float>* data = random_data(rows, cols);
+	Dataset<float>* testset = random_data(queries, cols);
+
+	Params params;
+	params["trees"] = 4;
+	KDTree forest(*data, params);
+	forest.buildIndex();
+
+	SearchParams search(128);
+	Dataset<int> built(queries, nn);
+	search_for_neighbors(forest, *testset, built, search);
+
+	for (int embed=0;embed<2;++embed) {
+		save_index(forest, filename, embed ? data : NULL);
+
+		StartStopTimer t;
+		t.start();
+		Dataset<float>* loaded_data;
+		NNIndex* loaded = load_index(filename, embed ? NULL : data, loaded_data);
+		t.stop();
+		printf("load%s: %.3fs\n", embed ? " (embedded dataset)" : "", t.value);
+
+		if (loaded->size()!=forest.size() || loaded->veclen()!=forest.veclen()) {
+			printf("The loaded index has a different size\n");
+			errors++;
+		}
+		else if (embed && memcmp(loaded_data->data, data->data, rows*cols*sizeof(float))!=0) {
+			printf("The dataset stored in the index file is different\n");
+			errors++;
+		}
+		else {
+			Dataset<int> result(queries, nn);
+			search_for_neighbors(*loaded, *testset, result, search);
+			if (memcmp(result.data, built.data, queries*nn*sizeof(int))!=0) {
+				printf("The loaded index gives different neighbors\n");
+				errors++;
+			}
+		}
+		delete loaded;
+		delete loaded_data;
+	}
+	remove(filename);
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+int main(int argc, char** argv)
+{
+	seed_random(1);
+	int errors = 0;
+
+	errors += test_parallel_build();
+	errors += test_concurrent_search();
+	errors += test_batch_search();
+	errors += test_distinct_neighbors();
+	errors += test_nearest();
+	errors += test_node_layout();
+	errors += test_save_load();
+
+	printf(errors==0 ? "PASSED\n" : "FAILED\n");
+	return errors==0 ? 0 : 1;
+}
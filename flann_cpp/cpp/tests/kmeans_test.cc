@@ -0,0 +1,609 @@
+
+#include "../algorithms/KMeansTree.h"
+#include "../util/Timer.h"
+#include "../util/Random.h"
+#include "../nn/Testing.h"
+#include "../nn/IndexIO.h"
+#include "../nn/Vocabulary.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <vector>
+
+
+/**
+	Generates rows x cols points grouped around a number of random centers,
+	with integer coordinates in [0,255] like the SIFT descriptors.
+*/
+Dataset<float>* clustered_data(int rows, int cols, int groups)
+{
+	Dataset<float> centers(groups, cols);
+	for (int i=0;i<groups*cols;++i) {
+		centers.data[i] = (float)rand_int(256);
+	}
+	Dataset<float>* data = new Dataset<float>(rows, cols);
+	for (int i=0;i<rows;++i) {
+		float* center = centers[rand_int(groups)];
+		for (int k=0;k<cols;++k) {
+			float v = floor(center[k] + rand_double(60.0) - 30);
+			(*data)[i][k] = v<0 ? 0 : (v>255 ? 255 : v);
+		}
+	}
+	return data;
+}
+
+
+/**
+	Sum of the squared distances from each point to the closest center.
+*/
+double clustering_cost(Dataset<float>& data, float* centers, int count)
+{
+	double cost = 0;
+	for (int i=0;i<data.rows;++i) {
+		double best = squared_dist(data[i], centers, data.cols);
+		for (int j=1;j<count;++j) {
+			double d = squared_dist(data[i], centers+j*data.cols, data.cols);
+			if (d<best) best = d;
+		}
+		cost += best;
+	}
+	return cost;
+}
+
+
+/**
+	Checks the assignment computed from the ||x||^2 + ||c||^2 - 2x.c expansion
+	and dot_block against the one computed with squared_dist (the one used
+	by the lloyd iterations). The two can only disagree when the two closest
+	centers are at the same distance, up to the float rounding.
+*/
+int test_blocked_assignment()
+{
+	const int rows = 4000;
+	const int cols = 128;
+	const int branchings[] = { 2, 10, 33, 128 };
+	int errors = 0;
+
+	Dataset<float>* data = clustered_data(rows, cols, 50);
+
+	for (int b=0;b<4;++b) {
+		int branching = branchings[b];
+		float* centers = new float[branching*cols];
+		for (int j=0;j<branching;++j) {
+			memcpy(centers+j*cols, (*data)[rand_int(rows)], cols*sizeof(float));
+			centers[j*cols] += (float)rand_double(1.0);
+		}
+		float* dots = new float[rows*branching];
+		dot_block(data->data, rows, centers, branching, cols, dots, branching);
+
+		int differences = 0;
+		int ties = 0;
+		for (int i=0;i<rows;++i) {
+			double norm = squared_dist((*data)[i], cols);
+			int reference = 0;
+			int blocked = 0;
+			double reference_dist = squared_dist((*data)[i], centers, cols);
+			double blocked_dist = norm + squared_dist(centers, cols) - 2*dots[i*branching];
+			for (int j=1;j<branching;++j) {
+				double d = squared_dist((*data)[i], centers+j*cols, cols);
+				if (reference_dist>d) {
+					reference = j;
+					reference_dist = d;
+				}
+				d = norm + squared_dist(centers+j*cols, cols) - 2*dots[i*branching+j];
+				if (blocked_dist>d) {
+					blocked = j;
+					blocked_dist = d;
+				}
+			}
+			if (reference!=blocked) {
+				double d1 = squared_dist((*data)[i], centers+reference*cols, cols);
+				double d2 = squared_dist((*data)[i], centers+blocked*cols, cols);
+				if (fabs(d1-d2) <= 1e-5*norm) {
+					ties++;
+				}
+				else {
+					differences++;
+				}
+			}
+		}
+		printf("branching %4d: %d different assignments, %d ties\n", branching, differences, ties);
+		errors += differences;
+
+		delete[] centers;
+		delete[] dots;
+	}
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Builds the same k-means tree with the lloyd, blocked and hamerly 
+	assignment and compares the clusterings and the search results against
+	the lloyd ones.
+*/
+int test_assign_modes()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int clusters = 451;
+	int errors = 0;
+
+	Dataset<float>* data = clustered_data(rows, cols, 40);
+
+	Params params;
+	params["branching"] = 10;
+	params["max-iterations"] = 15;
+	params["centers-init"] = "gonzales";
+
+	const int modes = 3;
+	const char* assign[modes] = { "lloyd", "blocked", "hamerly" };
+	KMeansTree* trees[modes];
+	float* centers[modes];
+	int count[modes];
+	double cost[modes];
+	for (int t=0;t<modes;++t) {
+		params["kmeans-assign"] = assign[t];
+		seed_random(7);
+		trees[t] = new KMeansTree(*data, params);
+		StartStopTimer timer;
+		timer.start();
+		trees[t]->buildIndex();
+		timer.stop();
+
+		centers[t] = new float[clusters*cols];
+		count[t] = trees[t]->getClusterCenters(clusters, centers[t]);
+		cost[t] = clustering_cost(*data, centers[t], count[t]);
+		printf("%8s: build %.3fs, %d clusters, cost %g\n", assign[t], timer.value, count[t], cost[t]);
+	}
+
+	for (int t=1;t<modes;++t) {
+		if (count[0]!=count[t]) {
+			printf("%s: different number of clusters\n", assign[t]);
+			errors++;
+		}
+		else if (fabs(cost[0]-cost[t]) > 1e-3*cost[0]) {
+			printf("%s: clustering cost differs\n", assign[t]);
+			errors++;
+		}
+
+		// exact search must find the same neighbors whatever the tree
+		ResultSet r0(5), r1(5);
+		SearchParams exact;
+		ScopedSearchContext c0(*trees[0]), c1(*trees[t]);
+		int different = 0;
+		for (int q=0;q<200;++q) {
+			float* query = (*data)[rand_int(rows)];
+			r0.init(query, cols);
+			r1.init(query, cols);
+			trees[0]->findNeighbors(r0, query, exact, *c0);
+			trees[t]->findNeighbors(r1, query, exact, *c1);
+			for (int j=0;j<5;++j) {
+				if (r0.getNeighbors()[j]!=r1.getNeighbors()[j]) {
+					different++;
+					break;
+				}
+			}
+		}
+		if (different>0) {
+			printf("%s: %d queries with different exact neighbors\n", assign[t], different);
+			errors++;
+		}
+	}
+
+	for (int t=0;t<modes;++t) {
+		delete trees[t];
+		delete[] centers[t];
+	}
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Builds the same k-means tree with one and with several threads. The 
+	subtrees are seeded from their parent and the chunks of the parallel
+	assignment are added in order, so the trees must be identical.
+*/
+int test_parallel_build()
+{
+	const int rows = 40000;
+	const int cols = 128;
+	const int clusters = 1000;
+	int errors = 0;
+
+	Dataset<float>* data = clustered_data(rows, cols, 200);
+
+	Params params;
+	params["branching"] = 10;
+	params["max-iterations"] = 15;
+	params["centers-init"] = "gonzales";
+	params["kmeans-assign"] = "blocked";
+
+	const int runs = 2;
+	const int cores[runs] = { 1, 4 };
+	float* centers[runs];
+	int count[runs];
+	for (int t=0;t<runs;++t) {
+		params["cores"] = cores[t];
+		seed_random(11);
+		KMeansTree tree(*data, params);
+
+		StartStopTimer timer;
+		timer.start();
+		tree.buildIndex();
+		timer.stop();
+
+		centers[t] = new float[clusters*cols];
+		count[t] = tree.getClusterCenters(clusters, centers[t]);
+		printf("%d threads: build %.3fs, %d clusters\n", cores[t], timer.value, count[t]);
+	}
+
+	if (count[0]!=count[1] || memcmp(centers[0], centers[1], count[0]*cols*sizeof(float))!=0) {
+		printf("The parallel build gives a different tree\n");
+		errors++;
+	}
+
+	for (int t=0;t<runs;++t) {
+		delete[] centers[t];
+	}
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	The single neighbor search (used by search_for_neighbors for k=1) must
+	find the neighbor and the distance of findNeighbors with k=1.
+*/
+int test_nearest()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int queries = 1000;
+	int errors = 0;
+
+	Dataset<float>* data = clustered_data(rows, cols, 200);
+	Dataset<float>* testset = clustered_data(queries, cols, 200);
+
+	Params params;
+	params["branching"] = 16;
+	params["max-iterations"] = 10;
+	params["centers-init"] = "random";
+	KMeansTree tree(*data, params);
+	tree.buildIndex();
+
+	ScopedSearchContext context(tree);
+	ResultSet resultSet(1);
+	const int checks[3] = { 32, 256, -1 };
+	for (int c=0;c<3;++c) {
+		SearchParams search(checks[c]);
+		Dataset<int> result(queries, 1);
+		Dataset<float> dists(queries, 1);
+		StartStopTimer t;
+		t.start();
+		search_for_neighbors(tree, *testset, result, dists, search);
+		t.stop();
+
+		int wrong = 0;
+		for (int q=0;q<queries;++q) {
+			resultSet.init((*testset)[q], cols);
+			tree.findNeighbors(resultSet, (*testset)[q], search, *context);
+			int index;
+			float dist;
+			if (!tree.findNearest((*testset)[q], search, *context, index, dist)
+					|| index!=resultSet.getNeighbors()[0] || dist!=resultSet.getDistances()[0]
+					|| result[q][0]!=index || dists[q][0]!=dist) {
+				wrong++;
+			}
+		}
+		printf("checks %d: %.3fms per query\n", checks[c], t.value*1000/queries);
+		if (wrong>0) {
+			printf("%d single neighbor searches differ from findNeighbors\n", wrong);
+			errors++;
+		}
+	}
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Saves an index, with and without the dataset, loads it back and
+	checks that the loaded index finds the same neighbors.
+*/
+int test_save_load()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int queries = 1000;
+	const int nn = 5;
+	const char* filename = "kmeans_test.idx";
+	int errors = 0;
+
+	Dataset<float>* data = clustered_data(rows, cols, 50);
+	Dataset<float>* testset = clustered_data(queries, cols, 50);
+
+	Params params;
+	params["branching"] = 16;
+	params["max-iterations"] = 5;
+	params["centers-init"] = "random";
+	KMeansTree tree(*data, params);
+	tree.buildIndex();
+
+	SearchParams search(128);
+	Dataset<int> built(queries, nn);
+	search_for_neighbors(tree, *testset, built, search);
+
+	for (int embed=0;embed<2;++embed) {
+		save_index(tree, filename, embed ? data : NULL);
+
+		StartStopTimer t;
+		t.start();
+		Dataset<float>* loaded_data;
+		NNIndex* loaded = load_index(filename, embed ? NULL : data, loaded_data);
+		t.stop();
+		printf("load%s: %.3fs\n", embed ? " (embedded dataset)" : "", t.value);
+
+		if (loaded->size()!=tree.size() || loaded->veclen()!=tree.veclen()) {
+			printf("The loaded index has a different size\n");
+			errors++;
+		}
+		else if (embed && memcmp(loaded_data->data, data->data, rows*cols*sizeof(float))!=0) {
+			printf("The dataset stored in the index file is different\n");
+			errors++;
+		}
+		else {
+			Dataset<int> result(queries, nn);
+			search_for_neighbors(*loaded, *testset, result, search);
+			if (memcmp(result.data, built.data, queries*nn*sizeof(int))!=0) {
+				printf("The loaded index gives different neighbors\n");
+				errors++;
+			}
+		}
+		delete loaded;
+		delete loaded_data;
+	}
+	remove(filename);
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Writes a copy of an index file with the bytes at offset replaced and
+	checks that load_index rejects it.
+*/
+int check_invalid_index(const std::vector<char>& content, size_t offset, const void* value, size_t size,
+			Dataset<float>* data, const char* what)
+{
+	const char* filename = "kmeans_test_invalid.idx";
+	std::vector<char> corrupted = content;
+	memcpy(&corrupted[offset], value, size);
+	FILE* file = fopen(filename, "wb");
+	fwrite(&corrupted[0], 1, corrupted.size(), file);
+	fclose(file);
+
+	int errors = 0;
+	Dataset<float>* loaded_data = NULL;
+	try {
+		NNIndex* loaded = load_index(filename, data, loaded_data);
+		printf("An index file with %s was loaded\n", what);
+		delete loaded;
+		delete loaded_data;
+		errors++;
+	}
+	catch (FLANNException&) {
+	}
+	remove(filename);
+	return errors;
+}
+
+
+int test_invalid_index()
+{
+	const char* filename = "kmeans_test.idx";
+	int errors = 0;
+
+	Dataset<float>* data = clustered_data(1000, 16, 10);
+	Params params;
+	params["branching"] = 8;
+	params["max-iterations"] = 5;
+	params["centers-init"] = "random";
+	KMeansTree tree(*data, params);
+	tree.buildIndex();
+	save_index(tree, filename, data);
+
+	FILE* file = fopen(filename, "rb");
+	std::vector<char> content;
+	char buffer[4096];
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof(buffer), file))>0) {
+		content.insert(content.end(), buffer, buffer+length);
+	}
+	fclose(file);
+	remove(filename);
+
+	// the size of the embedded dataset
+	const int negative = -1;
+	const int zero = 0;
+	const int huge = 1<<20;
+	errors += check_invalid_index(content, offsetof(IndexHeader, rows), &negative, sizeof(int), NULL, "a negative number of rows");
+	errors += check_invalid_index(content, offsetof(IndexHeader, cols), &zero, sizeof(int), NULL, "no columns");
+	int size[2] = { huge, huge };
+	errors += check_invalid_index(content, offsetof(IndexHeader, rows), size, sizeof(size), NULL, "an overflowing dataset size");
+
+	// the indices of the points, and a file truncated in the centers after
+	// the first parts of the tree were loaded
+	size_t indices = sizeof(IndexHeader) + (size_t)data->rows*data->cols*sizeof(float) + 2*sizeof(int) + sizeof(float);
+	const int past_end = data->rows;
+	errors += check_invalid_index(content, indices, &negative, sizeof(int), data, "a negative point index");
+	errors += check_invalid_index(content, indices+sizeof(int), &past_end, sizeof(int), data, "a point index past the dataset");
+	std::vector<char> truncated(content.begin(), content.end()-100);
+	errors += check_invalid_index(truncated, 0, &truncated[0], 1, NULL, "truncated centers");
+
+	delete data;
+
+	return errors;
+}
+
+
+/**
+	Flattens a tree cut at a few levels into a vocabulary tree and checks
+	that quantizing with the vocabulary goes down to the same leaves as a
+	descent of the flattened tree with squared_dist, and that the bag of
+	words has every node of the paths but the root.
+*/
+int test_vocabulary_tree()
+{
+	const int rows = 20000;
+	const int cols = 128;
+	const int queries = 2000;
+	const int levels = 3;
+	const char* filename = "kmeans_test.vt";
+	int errors = 0;
+
+	Dataset<float>* data = clustered_data(rows, cols, 50);
+	Dataset<float>* testset = clustered_data(queries, cols, 50);
+
+	Params params;
+	params["branching"] = 8;
+	params["max-iterations"] = 5;
+	params["centers-init"] = "random";
+	KMeansTree tree(*data, params);
+	tree.buildIndex();
+
+	std::vector<int> children;
+	std::vector<float> pivots;
+	int nodes = tree.getTree(levels, children, pivots);
+	save_vocabulary_tree(filename, tree.getBranching(), cols, children, pivots);
+
+	// the reference descent, and the parents for the paths
+	const int branching = tree.getBranching();
+	std::vector<int> blocks(nodes, -1);
+	std::vector<int> parents(nodes, -1);
+	for (int i=0, internal=0;i<nodes;++i) {
+		if (children[i]>=0) {
+			blocks[i] = internal++;
+			for (int k=0;k<branching;++k) {
+				parents[children[i]+k] = i;
+			}
+		}
+	}
+	std::vector<int> expected(queries);
+	std::map<int,int> expected_counts;
+	for (int q=0;q<queries;++q) {
+		int node = 0;
+		int depth = 0;
+		while (children[node]>=0) {
+			const float* block = &pivots[(size_t)blocks[node]*branching*cols];
+			int best = 0;
+			for (int k=1;k<branching;++k) {
+				if (squared_dist((*testset)[q], (float*)block+k*cols, cols) < squared_dist((*testset)[q], (float*)block+best*cols, cols)) {
+					best = k;
+				}
+			}
+			node = children[node]+best;
+			depth++;
+		}
+		if (depth>levels) {
+			printf("The tree is not cut at %d levels\n", levels);
+			errors++;
+			break;
+		}
+		expected[q] = node;
+		for (;node>0;node=parents[node]) {
+			expected_counts[node]++;
+		}
+	}
+
+	{
+		Vocabulary vocabulary(filename);
+		if (vocabulary.size()!=nodes || vocabulary.veclen()!=cols || vocabulary.words_per_descriptor()>levels) {
+			printf("The vocabulary tree has a different size\n");
+			errors++;
+		}
+
+		std::vector<int> leaves(queries, -1);
+		StartStopTimer t;
+		t.start();
+		vocabulary.quantize(*testset, &leaves[0], -1, 4);
+		t.stop();
+		printf("vocabulary tree of %d nodes, depth %d: %.2fus per descriptor\n", nodes, vocabulary.words_per_descriptor(),
+			t.value*1e6/queries);
+		if (leaves!=expected) {
+			printf("The vocabulary tree gives different leaves\n");
+			errors++;
+		}
+
+		int capacity = queries*vocabulary.words_per_descriptor();
+		std::vector<int> histogram(2*capacity);
+		int count = vocabulary.histogram(*testset, &histogram[0], capacity, -1, 1);
+		bool same = count==(int)expected_counts.size();
+		std::map<int,int>::const_iterator it = expected_counts.begin();
+		for (int i=0;same && i<count;++i, ++it) {
+			same = histogram[2*i]==it->first && histogram[2*i+1]==it->second;
+		}
+		if (!same) {
+			printf("The vocabulary tree gives a wrong histogram\n");
+			errors++;
+		}
+	}
+
+	// a truncated tree is rejected
+	FILE* file = fopen(filename, "r+b");
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	std::vector<char> content(size);
+	fseek(file, 0, SEEK_SET);
+	fread(&content[0], 1, size, file);
+	fclose(file);
+	file = fopen(filename, "wb");
+	fwrite(&content[0], 1, size-4, file);
+	fclose(file);
+	try {
+		Vocabulary truncated(filename);
+		printf("The truncated vocabulary tree was opened\n");
+		errors++;
+	}
+	catch (FLANNException&) {
+	}
+	remove(filename);
+
+	delete testset;
+	delete data;
+
+	return errors;
+}
+
+
+int main(int argc, char** argv)
+{
+	seed_random(1);
+	int errors = 0;
+
+	errors += test_blocked_assignment();
+	errors += test_assign_modes();
+	errors += test_parallel_build();
+	errors += test_nearest();
+	errors += test_save_load();
+	errors += test_invalid_index();
+	errors += test_vocabulary_tree();
+
+	printf(errors==0 ? "PASSED\n" : "FAILED\n");
+	return errors==0 ? 0 : 1;
+}
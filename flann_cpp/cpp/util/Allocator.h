@@ -18,6 +18,9 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
 
 /**
  * Allocates (using C's malloc) a generic type T.
@@ -34,6 +37,47 @@ T* allocate(size_t count = 1)
 }
 
 
+/**
+ * Allocates a buffer of count instances of T aligned to the given 
+ * boundary (a power of 2), suitable for SIMD loads. The buffer must be
+ * released with free_aligned.
+ * 
+ * Params:
+ *     count = number of instances to allocate. 
+ *     alignment = alignment in bytes
+ * Returns: pointer (of type T*) to memory buffer
+ */
+template <typename T>
+T* allocate_aligned(size_t count, size_t alignment = 64) 
+{
+	void* mem;
+#ifdef _MSC_VER
+	mem = _aligned_malloc(sizeof(T)*count, alignment);
+#else
+	if (posix_memalign(&mem, alignment, sizeof(T)*count) != 0) {
+		mem = NULL;
+	}
+#endif
+	if (mem==NULL) {
+		fprintf(stderr,"Failed to allocate memory.");
+		exit(1);
+	}
+	return (T*) mem;
+}
+
+/**
+ * Releases a buffer obtained from allocate_aligned.
+ */
+inline void free_aligned(void* mem)
+{
+#ifdef _MSC_VER
+	_aligned_free(mem);
+#else
+	::free(mem);
+#endif
+}
+
+
 /**
  * Pooled storage allocator
  * 
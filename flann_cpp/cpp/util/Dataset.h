@@ -63,12 +63,12 @@ public:
     */
     T* operator[](int index) 
     {
-        return data+index*cols;
+        return data+(size_t)index*cols;
     }	
 
     T* operator[](int index) const
     {
-        return data+index*cols;
+        return data+(size_t)index*cols;
     }   
 
 
@@ -0,0 +1,92 @@
+#include "MappedFile.h"
+#include "common.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const char* filename) : data_(NULL), size_(0), file(INVALID_HANDLE_VALUE), mapping(NULL)
+{
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file==INVALID_HANDLE_VALUE) {
+        throw FLANNException("Cannot open the file to map");
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        throw FLANNException("Cannot get the size of the file to map");
+    }
+    size_ = (size_t)size.QuadPart;
+    if (size_==0) {
+        return;
+    }
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping!=NULL) {
+        data_ = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (data_==NULL) {
+        if (mapping!=NULL) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        throw FLANNException("Cannot map the file");
+    }
+}
+
+
+MappedFile::~MappedFile()
+{
+    if (data_!=NULL) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping!=NULL) {
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+}
+
+#else
+
+MappedFile::MappedFile(const char* filename) : data_(NULL), size_(0), fd(-1)
+{
+    fd = open(filename, O_RDONLY);
+    if (fd<0) {
+        throw FLANNException("Cannot open the file to map");
+    }
+    struct stat st;
+    if (fstat(fd, &st)!=0) {
+        close(fd);
+        throw FLANNException("Cannot get the size of the file to map");
+    }
+    size_ = (size_t)st.st_size;
+    if (size_==0) {
+        return;
+    }
+    void* m = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (m==MAP_FAILED) {
+        close(fd);
+        throw FLANNException("Cannot map the file");
+    }
+    data_ = (char*)m;
+}
+
+
+MappedFile::~MappedFile()
+{
+    if (data_!=NULL) {
+        munmap(data_, size_);
+    }
+    close(fd);
+}
+
+#endif
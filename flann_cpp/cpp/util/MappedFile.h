@@ -0,0 +1,62 @@
+/************************************************************************
+ * Read-only memory mapped files.
+ *
+ * Version: 1.0
+ *
+ * License: LGPL
+ *
+ *************************************************************************/
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+
+
+/**
+ * A whole file mapped read-only in memory. The pages are loaded on demand
+ * from the page cache and shared with the other processes mapping the
+ * same file.
+ */
+class MappedFile
+{
+    char* data_;
+    size_t size_;
+
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#else
+    int fd;
+#endif
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+public:
+    /**
+     * Maps a file, throws a FLANNException if the file cannot be opened.
+     */
+    MappedFile(const char* filename);
+
+    /**
+     * Unmaps the file, the pointers to its data are no longer valid.
+     */
+    ~MappedFile();
+
+    /**
+     * The file contents (NULL for an empty file). The memory is read-only.
+     */
+    const char* data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+};
+
+
+#endif //MAPPEDFILE_H
@@ -0,0 +1,88 @@
+#include "MatrixFile.h"
+#include "Serialization.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+namespace {
+
+const char MATRIX_SIGNATURE[8] = { 'F','L','A','N','N','M','A','T' };
+
+}
+
+
+void save_matrix_header(FILE* stream, int rows, int cols)
+{
+    MatrixHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.signature, MATRIX_SIGNATURE, sizeof(header.signature));
+    header.version = MATRIX_FILE_VERSION;
+    header.rows = rows;
+    header.cols = cols;
+    save_value(stream, header);
+}
+
+
+void save_matrix(const char* filename, const Dataset<float>& data)
+{
+    FILE* stream = fopen(filename, "wb");
+    if (stream==NULL) {
+        throw FLANNException("Cannot open the matrix file for writing");
+    }
+
+    try {
+        save_matrix_header(stream, data.rows, data.cols);
+        save_value(stream, *data.data, (size_t)data.rows*data.cols);
+    }
+    catch (...) {
+        fclose(stream);
+        throw;
+    }
+    if (fclose(stream)!=0) {
+        throw FLANNException("Cannot write the matrix file");
+    }
+}
+
+
+bool is_matrix_file(const char* filename)
+{
+    FILE* stream = fopen(filename, "rb");
+    if (stream==NULL) {
+        return false;
+    }
+    char signature[sizeof(MATRIX_SIGNATURE)];
+    bool result = fread(signature, 1, sizeof(signature), stream)==sizeof(signature) && 
+                    memcmp(signature, MATRIX_SIGNATURE, sizeof(signature))==0;
+    fclose(stream);
+    return result;
+}
+
+
+MappedMatrix::MappedMatrix(const char* filename) : file(filename), dataset(NULL)
+{
+    if (file.size()<sizeof(MatrixHeader)) {
+        throw FLANNException("Not a matrix file");
+    }
+    const MatrixHeader* header = (const MatrixHeader*)file.data();
+    if (memcmp(header->signature, MATRIX_SIGNATURE, sizeof(header->signature))!=0) {
+        throw FLANNException("Not a matrix file");
+    }
+    if (header->version!=MATRIX_FILE_VERSION) {
+        throw FLANNException("Unsupported version of the matrix file");
+    }
+    if (header->rows<0 || header->cols<=0 ||
+            file.size()-sizeof(MatrixHeader) < (size_t)header->rows*header->cols*sizeof(float)) {
+        throw FLANNException("The matrix file is truncated");
+    }
+
+    // the dataset doesn't own the data and never writes it
+    float* data = (float*)(file.data()+sizeof(MatrixHeader));
+    dataset = new Dataset<float>(header->rows, header->cols, data);
+}
+
+
+MappedMatrix::~MappedMatrix()
+{
+    delete dataset;
+}
@@ -0,0 +1,86 @@
+/************************************************************************
+ * Binary matrix files.
+ *
+ * Float matrices (features, cluster centers) stored after a small header,
+ * so that they can be memory mapped and used in place.
+ *
+ * Version: 1.0
+ *
+ * License: LGPL
+ *
+ *************************************************************************/
+
+#ifndef MATRIXFILE_H
+#define MATRIXFILE_H
+
+#include "Dataset.h"
+#include "MappedFile.h"
+
+#include <stdio.h>
+
+
+/**
+ * Version of the matrix file format.
+ */
+const int MATRIX_FILE_VERSION = 1;
+
+
+/**
+ * Header of a matrix file, followed by the rows*cols floats in row major
+ * order. Its size keeps the data 32 byte aligned in the mapped file.
+ */
+struct MatrixHeader
+{
+    char signature[8];
+    int version;
+    int rows;
+    int cols;
+    int reserved[3];
+};
+
+
+/**
+ * Writes a matrix header at the current position of a stream.
+ */
+void save_matrix_header(FILE* stream, int rows, int cols);
+
+/**
+ * Writes a matrix file.
+ */
+void save_matrix(const char* filename, const Dataset<float>& data);
+
+/**
+ * Returns: true if the file exists and starts with a matrix header
+ */
+bool is_matrix_file(const char* filename);
+
+
+/**
+ * A matrix file mapped in memory. The dataset points inside the mapped
+ * file: it is read-only and valid as long as the MappedMatrix exists.
+ */
+class MappedMatrix
+{
+    MappedFile file;
+    Dataset<float>* dataset;
+
+    MappedMatrix(const MappedMatrix&);
+    MappedMatrix& operator=(const MappedMatrix&);
+
+public:
+    /**
+     * Maps a matrix file. Throws a FLANNException if the file cannot be
+     * mapped or if the header or the file size is wrong.
+     */
+    MappedMatrix(const char* filename);
+
+    ~MappedMatrix();
+
+    Dataset<float>& data()
+    {
+        return *dataset;
+    }
+};
+
+
+#endif //MATRIXFILE_H
@@ -1,19 +1,46 @@
 
 #include "Random.h"
+#include "common.h"
+
+
+namespace {
+
+/* State of the generator. Each thread has its own, so threads can draw
+   numbers concurrently and, once seeded, get a reproducible sequence. */
+THREAD_LOCAL unsigned long long rand_state = 0x853c49e6748fea9bULL;
+
+/* xorshift64* generator */
+unsigned long long next_random()
+{
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * 2685821657736338717ULL;
+}
+
+/* uniform double in [0,1) */
+double next_unit()
+{
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+}
 
 
 void seed_random(unsigned int seed)
 {
-    srand(seed);    
+    // the state must not be 0
+    rand_state = (seed + 1ULL) * 0x9E3779B97F4A7C15ULL;
+    next_random();
 }
 
 double rand_double(double high, double low)
 {
-    return low + ((high-low) * (std::rand() / (RAND_MAX + 1.0)));
+    return low + ((high-low) * next_unit());
 }
 
 
 int rand_int(int high, int low)
 {
-    return low + (int) ( double(high-low) * (std::rand() / (RAND_MAX + 1.0)));    
+    return low + (int) ( double(high-low) * next_unit());    
 }
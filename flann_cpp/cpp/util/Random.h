@@ -23,6 +23,10 @@
 using namespace std;
 
 
+/**
+ * Seeds the random number generator of the calling thread. Every thread
+ * has its own generator, so the functions below can be used concurrently.
+ */
 void seed_random(unsigned int seed);
 
 double rand_double(double high = 1.0, double low=0);
@@ -4,6 +4,7 @@
 
 #include <algorithm>
 #include <limits>
+#include <vector>
 #include "../algorithms/dist.h"
 
 using namespace std;
@@ -38,8 +39,77 @@ struct BranchStruct {
 
 
 
+/**
+ * Set of the indices already given to a ResultSet during one search, for
+ * the searches that can reach the same point more than once (several
+ * trees over the same points). Cleared in constant time by moving to the
+ * next generation.
+ */
+class VisitedSet
+{
+	vector<unsigned int> marks;
+	unsigned int generation;
+
+public:
+	VisitedSet(int size) : marks(size, 0), generation(1)
+	{
+	}
+
+	void clear()
+	{
+		if (++generation==0) {
+			fill(marks.begin(), marks.end(), 0u);
+			generation = 1;
+		}
+	}
+
+	/**
+	 * Marks an index.
+	 * Returns: false if it was already marked
+	 */
+	bool visit(int index)
+	{
+		if (marks[index]==generation) {
+			return false;
+		}
+		marks[index] = generation;
+		return true;
+	}
+};
+
+
+
+/**
+ * The k nearest neighbors found so far. The neighbors are kept in a
+ * max-heap on (distance, index), so the worst one is known in constant 
+ * time and a point is added in O(log k); they are sorted when they are
+ * read. Ties are broken by the smaller index.
+ *
+ * The indices are not checked for duplicates, unless the search installs
+ * a VisitedSet with setVisited.
+ */
 class ResultSet 
 {
+	struct Neighbor {
+		float dist;
+		int index;
+
+		bool operator<(const Neighbor& rhs) const
+		{
+			return dist<rhs.dist || (dist==rhs.dist && index<rhs.index);
+		}
+	};
+
+	/**
+	 * The neighbors, a max-heap until they are sorted by getNeighbors
+	 * or getDistances.
+	 */
+	mutable Neighbor* heap;
+	mutable bool sorted;
+
+	/**
+	 * The sorted neighbors returned by getNeighbors and getDistances.
+	 */
 	int* indices;
 	float* dists;
     int capacity;
@@ -48,19 +118,25 @@ class ResultSet
     int veclen;
 	
 	int count;
-	
+
+	VisitedSet* visited;
+
+	ResultSet(const ResultSet&);
+	ResultSet& operator=(const ResultSet&);
 
 
 public:		
 	ResultSet(int capacity_, float* target_ = NULL, int veclen_ = 0 ) : 
-        capacity(capacity_), target(target_), veclen(veclen_), count(0)
+        sorted(true), capacity(capacity_), target(target_), veclen(veclen_), count(0), visited(NULL)
 	{
+        heap = new Neighbor[capacity_];
         indices = new int[capacity_];
         dists = new float[capacity_];            
 	}
 	
 	~ResultSet()
 	{
+		delete[] heap;
 		delete[] indices;
 		delete[] dists;
 	}
@@ -71,58 +147,209 @@ public:
         target = target_;
         veclen = veclen_;
         count = 0;
+        sorted = true;
+        visited = NULL;
+	}
+
+
+	/**
+	 * Installs the set used to skip the indices already added during this
+	 * search (NULL for none). init removes it.
+	 */
+	void setVisited(VisitedSet* visited_)
+	{
+		visited = visited_;
 	}
 	
 	
+	/**
+	 * The indices of the neighbors, closest first.
+	 */
 	int* getNeighbors() const
 	{	
+		sort();
 		return indices;
 	}
+
+	/**
+	 * The squared distances of the neighbors, in the order of getNeighbors.
+	 */
+	float* getDistances() const
+	{
+		sort();
+		return dists;
+	}
 	
 	bool full() const
 	{	
 		return count == capacity;
 	}
+
+	/**
+	 * The number of neighbors searched for.
+	 */
+	int getCapacity() const
+	{
+		return capacity;
+	}
 	
     
 	bool addPoint(float* point, int index) 
 	{
-		for (int i=0;i<count;++i) {
-			if (indices[i]==index) return false;
+		if (visited!=NULL && !visited->visit(index)) {
+			return false;
 		}
 		float dist = squared_dist(target,point,veclen);
-		
+		return insert(dist, index);
+	}
+
+	/**
+		Adds a point whose distance to the target is already known (an
+		estimate computed from compressed vectors).
+	*/
+	bool addPointDist(int index, float dist)
+	{
+		if (visited!=NULL && !visited->visit(index)) {
+			return false;
+		}
+		return insert(dist, index);
+	}
+	
+	float worstDist()
+	{
+		if (count<capacity) {
+			return numeric_limits<float>::max();
+		}
+		heapify();
+		return heap[0].dist;
+	}
+
+private:
+
+	bool insert(float dist, int index)
+	{
+		heapify();
+		Neighbor neighbor;
+		neighbor.dist = dist;
+		neighbor.index = index;
 		if (count<capacity) {
-			indices[count] = index;
-			dists[count] = dist;	
-			++count;
-		} 
-		else if (dist < dists[count-1] || (dist == dists[count-1] && index < indices[count-1])) {
-//         else if (dist < dists[count-1]) {
-			indices[count-1] = index;
-			dists[count-1] = dist;
+			// sift up
+			int i = count++;
+			while (i>0 && heap[(i-1)/2]<neighbor) {
+				heap[i] = heap[(i-1)/2];
+				i = (i-1)/2;
+			}
+			heap[i] = neighbor;
+			return true;
 		}
-		else { 
+		if (capacity==0 || !(neighbor<heap[0])) {
 			return false;
 		}
-		
-		int i = count-1;
-		// bubble up
-		while (i>=1 && (dists[i]<dists[i-1] || (dists[i]==dists[i-1] && indices[i]<indices[i-1]) ) ) {
-//         while (i>=1 && (dists[i]<dists[i-1]) ) {
-			swap(indices[i],indices[i-1]);
-			swap(dists[i],dists[i-1]);
-			i--;
+		// replaces the worst neighbor and sifts it down
+		int i = 0;
+		for (;;) {
+			int child = 2*i+1;
+			if (child>=count) break;
+			if (child+1<count && heap[child]<heap[child+1]) {
+				child++;
+			}
+			if (!(neighbor<heap[child])) break;
+			heap[i] = heap[child];
+			i = child;
 		}
-		
+		heap[i] = neighbor;
 		return true;
 	}
-	
-	float worstDist()
+
+	/**
+	 * Makes a heap again of neighbors sorted by getNeighbors (the search
+	 * can go on after reading them).
+	 */
+	void heapify() const
+	{
+		if (sorted && count>1) {
+			std::make_heap(heap, heap+count);
+		}
+		sorted = false;
+	}
+
+	void sort() const
 	{
-		return (count<capacity) ? numeric_limits<float>::max()  : dists[count-1];
+		if (!sorted) {
+			std::sort_heap(heap, heap+count);
+			sorted = true;
+		}
+		for (int i=0;i<count;++i) {
+			indices[i] = heap[i].index;
+			dists[i] = heap[i].dist;
+		}
 	}
 	
 };
 
+
+
+/**
+ * The single nearest neighbor found so far, for the searches with k=1
+ * (quantization to a vocabulary). It has the interface of ResultSet used 
+ * by the tree searches, which are templates on the result type, and 
+ * gives the same neighbor as a ResultSet of capacity 1 without its heap
+ * or allocations.
+ */
+class SingleResultSet
+{
+	float* target;
+	int veclen;
+
+	float dist;
+	int index;
+
+public:
+	SingleResultSet(float* target_, int veclen_) :
+		target(target_), veclen(veclen_), dist(numeric_limits<float>::max()), index(-1)
+	{
+	}
+
+	/**
+	 * The index of the neighbor, -1 if no point was added.
+	 */
+	int getNeighbor() const
+	{
+		return index;
+	}
+
+	/**
+	 * The squared distance of the neighbor.
+	 */
+	float getDistance() const
+	{
+		return dist;
+	}
+
+	bool full() const
+	{
+		return index>=0;
+	}
+
+	bool addPoint(float* point, int index_)
+	{
+		return addPointDist(index_, (float)squared_dist(target,point,veclen));
+	}
+
+	bool addPointDist(int index_, float dist_)
+	{
+		if (index>=0 && !(dist_<dist || (dist_==dist && index_<index))) {
+			return false;
+		}
+		dist = dist_;
+		index = index_;
+		return true;
+	}
+
+	float worstDist() const
+	{
+		return dist;
+	}
+};
+
 #endif //RESULTSET_H
@@ -0,0 +1,44 @@
+/************************************************************************
+ * Binary serialization helpers.
+ *
+ * Reading and writing of plain values and arrays, used by the indices
+ * to save and load their structure.
+ *
+ * Version: 1.0
+ *
+ * License: LGPL
+ *
+ *************************************************************************/
+
+#ifndef SERIALIZATION_H
+#define SERIALIZATION_H
+
+#include <stdio.h>
+#include "common.h"
+
+
+/**
+ * Writes count values to a stream.
+ */
+template <typename T>
+void save_value(FILE* stream, const T& value, size_t count = 1)
+{
+    if (count>0 && fwrite(&value, sizeof(T), count, stream)!=count) {
+        throw FLANNException("Cannot write to the index file");
+    }
+}
+
+
+/**
+ * Reads count values from a stream.
+ */
+template <typename T>
+void load_value(FILE* stream, T& value, size_t count = 1)
+{
+    if (count>0 && fread(&value, sizeof(T), count, stream)!=count) {
+        throw FLANNException("Cannot read from the index file, the file is truncated");
+    }
+}
+
+
+#endif //SERIALIZATION_H
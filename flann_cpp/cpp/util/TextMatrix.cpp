@@ -0,0 +1,282 @@
+#include "TextMatrix.h"
+#include "MatrixFile.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "Serialization.h"
+#include "Logger.h"
+#include "Timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+/* Number of bytes of text a chunk is filled up to (it always ends on a whitespace). */
+const size_t CHUNK_BYTES = 4<<20;
+
+/* Number of chunks parsed ahead of the writer, per thread. */
+const int CHUNKS_PER_THREAD = 2;
+
+/* The powers of ten exactly representable as floats and doubles. */
+const float FLOAT_POWERS[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+const double DOUBLE_POWERS[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+/* Largest number of significant digits accumulated in the mantissa. */
+const int MAX_DIGITS = 19;
+
+
+inline bool is_space(char c)
+{
+    return c==' ' || c=='\n' || c=='\r' || c=='\t' || c=='\f' || c=='\v';
+}
+
+inline bool is_digit(char c)
+{
+    return c>='0' && c<='9';
+}
+
+
+/**
+ * Parses the number starting at p with strtod, p is moved after it.
+ */
+float parse_slow(const char*& p, const char* end)
+{
+    const char* token_end = p;
+    while (token_end<end && !is_space(*token_end)) ++token_end;
+    std::string token(p, token_end);
+    char* parsed;
+    double value = strtod(token.c_str(), &parsed);
+    if (parsed==token.c_str() || *parsed!='\0') {
+        throw FLANNException("Invalid number in the text matrix");
+    }
+    p = token_end;
+    return (float)value;
+}
+
+
+/**
+ * Parses the number starting at p (not a whitespace), p is moved after it.
+ */
+float parse_float(const char*& p, const char* end)
+{
+    const char* start = p;
+    bool negative = false;
+    if (p<end && (*p=='-' || *p=='+')) {
+        negative = *p=='-';
+        ++p;
+    }
+
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any_digit = false;
+    bool exact = true;
+    while (p<end && is_digit(*p)) {
+        if (digits<MAX_DIGITS) {
+            mantissa = mantissa*10 + (*p-'0');
+            if (mantissa!=0) digits++;
+        }
+        else {
+            exact = false;
+        }
+        any_digit = true;
+        ++p;
+    }
+    if (p<end && *p=='.') {
+        ++p;
+        while (p<end && is_digit(*p)) {
+            if (digits<MAX_DIGITS) {
+                mantissa = mantissa*10 + (*p-'0');
+                exponent--;
+                if (mantissa!=0) digits++;
+            }
+            else {
+                exact = false;
+            }
+            any_digit = true;
+            ++p;
+        }
+    }
+    if (any_digit && p<end && (*p=='e' || *p=='E')) {
+        ++p;
+        bool negative_exponent = false;
+        if (p<end && (*p=='-' || *p=='+')) {
+            negative_exponent = *p=='-';
+            ++p;
+        }
+        if (p==end || !is_digit(*p)) {
+            exact = false;
+        }
+        int value = 0;
+        while (p<end && is_digit(*p)) {
+            if (value<10000) value = value*10 + (*p-'0');
+            ++p;
+        }
+        exponent += negative_exponent ? -value : value;
+    }
+
+    if (!any_digit || !exact || (p<end && !is_space(*p))) {
+        p = start;
+        return parse_slow(p, end);
+    }
+
+    float value;
+    if (mantissa<(1ull<<24) && exponent>=-10 && exponent<=10) {
+        // a single float operation on exact operands, rounded as by strtof
+        value = (float)mantissa;
+        value = exponent<0 ? value/FLOAT_POWERS[-exponent] : value*FLOAT_POWERS[exponent];
+    }
+    else if (mantissa<(1ull<<53) && exponent>=-22 && exponent<=22) {
+        double d = (double)mantissa;
+        value = (float)(exponent<0 ? d/DOUBLE_POWERS[-exponent] : d*DOUBLE_POWERS[exponent]);
+    }
+    else {
+        p = start;
+        return parse_slow(p, end);
+    }
+    return negative ? -value : value;
+}
+
+
+/**
+ * A range of the text and, once parsed, its values.
+ */
+struct Chunk
+{
+    const char* begin;
+    const char* end;
+    std::vector<float> values;
+    TaskGroup group;
+};
+
+
+/**
+ * Parses the numbers of a chunk.
+ */
+class ParseChunkTask : public Task
+{
+    Chunk& chunk;
+
+public:
+    ParseChunkTask(Chunk& chunk_) : chunk(chunk_)
+    {
+    }
+
+    void run()
+    {
+        chunk.values.clear();
+        // numbers of at least one digit and one separator
+        chunk.values.reserve((chunk.end-chunk.begin)/2);
+        const char* p = chunk.begin;
+        for (;;) {
+            while (p<chunk.end && is_space(*p)) ++p;
+            if (p==chunk.end) break;
+            chunk.values.push_back(parse_float(p, chunk.end));
+        }
+    }
+};
+
+}
+
+
+int convert_text_matrix(const char* text_file, const char* matrix_file, int cols, int max_rows, int cores)
+{
+    if (cols<=0) {
+        throw FLANNException("The number of columns must be positive");
+    }
+    MappedFile text(text_file);
+
+    FILE* stream = fopen(matrix_file, "wb");
+    if (stream==NULL) {
+        throw FLANNException("Cannot open the matrix file for writing");
+    }
+
+    StartStopTimer t;
+    t.start();
+
+    ThreadPool pool(cores);
+    const int window = CHUNKS_PER_THREAD*pool.size();
+    Chunk* chunks = new Chunk[window];
+    const char* next = text.data();
+    const char* text_end = text.data()+text.size();
+    size_t max_values = max_rows<0 ? (size_t)-1 : (size_t)max_rows*cols;
+    size_t values = 0;
+    int spawned = 0;
+    int written = 0;
+
+    try {
+        // the header is written when the number of rows is known, until then
+        // the file is not recognized as a matrix file
+        MatrixHeader placeholder;
+        memset(&placeholder, 0, sizeof(placeholder));
+        save_value(stream, placeholder);
+
+        while (written<spawned || (next<text_end && values<max_values)) {
+            // the reader: cuts the next chunks and queues them for the parsers
+            while (spawned-written<window && next<text_end && values<max_values) {
+                Chunk& chunk = chunks[spawned%window];
+                chunk.begin = next;
+                chunk.end = (size_t)(text_end-next)>CHUNK_BYTES ? next+CHUNK_BYTES : text_end;
+                while (chunk.end<text_end && !is_space(*chunk.end)) ++chunk.end;
+                next = chunk.end;
+                pool.spawn(new ParseChunkTask(chunk), chunk.group);
+                spawned++;
+            }
+
+            // the writer: appends the values of the oldest chunk
+            Chunk& chunk = chunks[written%window];
+            pool.wait(chunk.group);
+            size_t count = chunk.values.size();
+            if (count>max_values-values) {
+                count = max_values-values;
+                next = text_end;
+            }
+            if (count>0) {
+                save_value(stream, chunk.values[0], count);
+            }
+            values += count;
+            std::vector<float>().swap(chunk.values);
+            written++;
+        }
+
+        if (values%cols!=0) {
+            throw FLANNException("The last row of the text matrix is incomplete");
+        }
+        if (values/cols>(size_t)0x7fffffff) {
+            throw FLANNException("The text matrix has too many rows");
+        }
+        if (fseek(stream, 0, SEEK_SET)!=0) {
+            throw FLANNException("Cannot write the matrix file");
+        }
+        save_matrix_header(stream, (int)(values/cols), cols);
+    }
+    catch (...) {
+        // the queued chunks use the buffers and the pool
+        for (int i=written;i<spawned;++i) {
+            try {
+                pool.wait(chunks[i%window].group);
+            }
+            catch (...) {
+            }
+        }
+        delete[] chunks;
+        fclose(stream);
+        remove(matrix_file);
+        throw;
+    }
+    delete[] chunks;
+    if (fclose(stream)!=0) {
+        remove(matrix_file);
+        throw FLANNException("Cannot write the matrix file");
+    }
+
+    t.stop();
+    logger.info("Converted %d rows of text in %g seconds\n", (int)(values/cols), t.value);
+
+    return (int)(values/cols);
+}
@@ -0,0 +1,44 @@
+/************************************************************************
+ * Conversion of text matrices to matrix files.
+ *
+ * Float matrices dumped as text (whitespace separated numbers, the rows
+ * one after the other) are parsed in parallel and written as binary
+ * matrix files.
+ *
+ * Version: 1.0
+ *
+ * License: LGPL
+ *
+ *************************************************************************/
+
+#ifndef TEXTMATRIX_H
+#define TEXTMATRIX_H
+
+
+/**
+ * Converts a text matrix to a matrix file.
+ *
+ * The text file is mapped and split in chunks ending on a whitespace,
+ * parsed on a thread pool a bounded number of chunks ahead of the writer,
+ * which appends the values to the matrix file in order.
+ *
+ * The numbers are parsed as by strtod (decimal, with an optional sign,
+ * fraction and exponent). The ones with up to 7 significant digits and a
+ * small exponent are converted with a single correctly rounded float
+ * operation, the others fall back to strtod.
+ *
+ * Params:
+ *     text_file = the text matrix
+ *     matrix_file = the matrix file written
+ *     cols = number of values of a row
+ *     max_rows = the rows after the first max_rows ones are ignored,
+ *         <0 to convert all of them
+ *     cores = number of threads, <=0 for one per hardware thread
+ * Returns: the number of rows written. Throws a FLANNException if a number
+ *     cannot be parsed, if the last row is incomplete or if a file cannot
+ *     be read or written.
+ */
+int convert_text_matrix(const char* text_file, const char* matrix_file, int cols, int max_rows, int cores);
+
+
+#endif //TEXTMATRIX_H
@@ -0,0 +1,159 @@
+
+#include "ThreadPool.h"
+#include "common.h"
+
+
+namespace {
+
+/* Pool and index of the worker thread running this code, NULL and 0
+   for the threads not started by a pool. */
+THREAD_LOCAL const ThreadPool* current_pool = NULL;
+THREAD_LOCAL int current_index = 0;
+
+}
+
+
+ThreadPool::ThreadPool(int threads_) : queued(0), stopping(false)
+{
+    threads = threads_>0 ? threads_ : hardwareThreads();
+    queues = new Queue[threads];
+
+    for (int i=1;i<threads;++i) {
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        stopping = true;
+    }
+    idle.notify_all();
+
+    for (size_t i=0;i<workers.size();++i) {
+        workers[i].join();
+    }
+    delete[] queues;
+}
+
+
+int ThreadPool::workerIndex() const
+{
+    return current_pool==this ? current_index : 0;
+}
+
+
+void ThreadPool::spawn(Task* task, TaskGroup& group)
+{
+    Entry entry;
+    entry.task = task;
+    entry.group = &group;
+    group.pending++;
+
+    Queue& queue = queues[workerIndex()];
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(entry);
+    }
+    queued++;
+
+    if (threads>1) {
+        // taking the lock orders the notification after the check
+        // of a worker that is about to sleep
+        { std::lock_guard<std::mutex> guard(idle_lock); }
+        idle.notify_one();
+    }
+}
+
+
+void ThreadPool::wait(TaskGroup& group)
+{
+    int index = workerIndex();
+    while (group.pending>0) {
+        if (!runOne(index)) {
+            std::this_thread::yield();
+        }
+    }
+
+    if (group.error) {
+        std::exception_ptr error = group.error;
+        group.error = std::exception_ptr();
+        std::rethrow_exception(error);
+    }
+}
+
+
+int ThreadPool::hardwareThreads()
+{
+    int n = (int)std::thread::hardware_concurrency();
+    return n>0 ? n : 1;
+}
+
+
+void ThreadPool::workerLoop(int index)
+{
+    current_pool = this;
+    current_index = index;
+
+    for (;;) {
+        if (runOne(index)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(idle_lock);
+        if (stopping) {
+            break;
+        }
+        if (queued==0) {
+            idle.wait(guard);
+        }
+    }
+}
+
+
+/**
+ * Runs one task, taken from the back of the thread's own deque or
+ * stolen from the front of another one.
+ *
+ * Returns: false if there was no task to run
+ */
+bool ThreadPool::runOne(int index)
+{
+    Entry entry;
+    bool found = false;
+
+    for (int i=0;i<threads && !found;++i) {
+        Queue& queue = queues[(index+i)%threads];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (!queue.tasks.empty()) {
+            if (i==0) {
+                entry = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            else {
+                entry = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            found = true;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+    queued--;
+
+    try {
+        entry.task->run();
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> guard(entry.group->error_lock);
+        if (!entry.group->error) {
+            entry.group->error = std::current_exception();
+        }
+    }
+    delete entry.task;
+    entry.group->pending--;
+
+    return true;
+}
@@ -0,0 +1,165 @@
+/************************************************************************
+ * Work stealing thread pool.
+ *
+ * This module contains a small fork-join task scheduler used to run
+ * independent parts of the index construction concurrently.
+ *
+ * Version: 1.0
+ *
+ * License: LGPL
+ *
+ *************************************************************************/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+
+
+/**
+ * A unit of work executed by a ThreadPool. The pool deletes the task
+ * after running it.
+ */
+class Task
+{
+public:
+    virtual ~Task() {}
+
+    virtual void run() = 0;
+};
+
+
+/**
+ * A set of tasks that can be waited for together. A task belongs to
+ * the group it was spawned in; the tasks it spawns can use the same
+ * or another group.
+ */
+class TaskGroup
+{
+    friend class ThreadPool;
+
+    /**
+     * Number of tasks spawned in the group and not finished yet.
+     */
+    std::atomic<int> pending;
+
+    /**
+     * First exception thrown by a task of the group, rethrown by wait.
+     */
+    std::exception_ptr error;
+    std::mutex error_lock;
+
+    TaskGroup(const TaskGroup&);
+    TaskGroup& operator=(const TaskGroup&);
+
+public:
+    TaskGroup() : pending(0) {}
+};
+
+
+/**
+ * Work stealing thread pool.
+ *
+ * Each thread has its own deque of tasks. A thread pushes the tasks it
+ * spawns at the back of its deque and also takes work from the back, so it
+ * keeps working on the most recent (smallest and cache hot) tasks, while
+ * idle threads steal the oldest (largest) tasks from the front of the other
+ * deques. The thread that created the pool is counted in its size: it
+ * executes tasks while waiting for a group to finish.
+ */
+class ThreadPool
+{
+    struct Entry {
+        Task* task;
+        TaskGroup* group;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Entry> tasks;
+    };
+
+    /**
+     * Number of threads, including the owner thread.
+     */
+    int threads;
+
+    /**
+     * The task deques, the one of the owner thread first.
+     */
+    Queue* queues;
+
+    std::vector<std::thread> workers;
+
+    /**
+     * Number of tasks in the deques, used to put idle workers to sleep.
+     */
+    std::atomic<int> queued;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    bool stopping;
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    void workerLoop(int index);
+
+    bool runOne(int index);
+
+public:
+    /**
+     * Constructor. Starts threads-1 worker threads.
+     *
+     * Params:
+     *     threads = number of threads, <=0 for one per hardware thread
+     */
+    ThreadPool(int threads);
+
+    /**
+     * Destructor. Stops the worker threads, the pool must be idle.
+     */
+    ~ThreadPool();
+
+    /**
+     * Number of threads in the pool, including the owner thread.
+     */
+    int size() const
+    {
+        return threads;
+    }
+
+    /**
+     * Index of the calling thread in the pool: 1..size()-1 for the
+     * worker threads, 0 for any other thread.
+     */
+    int workerIndex() const;
+
+    /**
+     * Queues a task for execution. Can be called from the tasks.
+     *
+     * Params:
+     *     task = the task, deleted by the pool after it runs
+     *     group = the group the task belongs to
+     */
+    void spawn(Task* task, TaskGroup& group);
+
+    /**
+     * Executes queued tasks until all the tasks of the group are
+     * finished. Rethrows the first exception thrown by one of them.
+     */
+    void wait(TaskGroup& group);
+
+    /**
+     * Returns: the number of hardware threads (at least 1)
+     */
+    static int hardwareThreads();
+};
+
+
+#endif //THREADPOOL_H
@@ -2,15 +2,34 @@
 #define TIMER_H
 
 #include <time.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
 
 /**
  * A start-stop timer class.
  * 
- * Can be used to time portions of code.
+ * Can be used to time portions of code. It measures the elapsed (wall) 
+ * time, so that it also times correctly the multi-threaded code.
  */
 class StartStopTimer
 {
-    clock_t startTime;
+    double startTime;
+
+    /**
+     * Returns: the current time in seconds
+     */
+    static double now()
+    {
+#ifdef _WIN32
+        // clock() measures the elapsed time on Windows
+        return (double)clock() / CLOCKS_PER_SEC;
+#else
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec*1e-6;
+#endif
+    }
  
 public:
     /**
@@ -31,15 +50,14 @@ public:
      * Starts the timer.
      */
     void start() {
-        startTime = clock();
+        startTime = now();
     }
     
     /**
      * Stops the timer and updates timer value.
      */
     void stop() {
-        clock_t stopTime = clock();
-        value += ( (double)stopTime - startTime) / CLOCKS_PER_SEC;
+        value += now() - startTime;
     }
     
     /**
@@ -4,6 +4,12 @@
 
 #define ARRAY_LEN(a) (sizeof(a)/sizeof(a[0]))
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 
 #include "Variant.h"
 #include <map>